@@ -1,9 +1,91 @@
 #ifndef __DISK_H__
 #define __DISK_H__
 
+// How the image file is accessed: mapped into memory, pread/pwrite through the page cache,
+// O_DIRECT with aligned buffers (falls back to pread/pwrite where O_DIRECT is unsupported),
+// io_uring, which submits queued requests in batches (falls back to pread/pwrite without io_uring),
+// or a compressed image (see zimg.h), which is not compatible with the plain image the others use
+enum { DISK_MMAP = 0, DISK_PIO, DISK_DIRECT, DISK_URING, DISK_LZ };
+// Choose the backend ("mmap", "pio", "direct", "uring" or "lz") for the next init_disk; returns -1 for an unknown name
+int disk_set_backend(const char *name);
+// Name of the backend in use
+const char *disk_backend();
+// Deduplicate chunks with the same contents from the next init_disk on (lz backend only, see zimg.h);
+// the sharing is logged when the disk is opened and closed
+void disk_set_dedup(int on);
+// How the mmap backend maps the image from the next init_disk on. advice is the access hint for the whole
+// mapping: "normal", "random" (no readahead around faults), "sequential" (aggressive readahead), "willneed"
+// (start reading the whole image in now) or "auto", which watches the requests, switches between random and
+// sequential and prefetches ahead of sequential streams. hugepages maps the image 2 MB-aligned and asks for
+// transparent huge pages (used only where the file system supports them for shared mappings); populate
+// pre-faults every page in init_disk. Returns -1 for an unknown advice
+int disk_set_mapping(const char *advice, int hugepages, int populate);
+
+// When written data is forced to stable storage: never (F is ignored), every period ms from a background
+// thread, after every write (once per batch of queued writes), or only on an explicit flush (cmd_f)
+enum { SYNC_NONE = 0, SYNC_PERIODIC, SYNC_WRITE, SYNC_FLUSH };
+// Choose the policy ("none", "periodic", "write" or "flush") and the period for "periodic" for the next init_disk;
+// returns -1 for an unknown name
+int disk_set_sync(const char *policy, int period_ms);
+// Name of the policy in use
+const char *disk_sync_policy();
+// Number of times data has actually been forced to storage
+unsigned long disk_sync_count();
+
+// How request latency is modelled. With rpm == 0 a request costs ttd ms per cylinder the head moves, as before.
+// Otherwise it costs a seek (ttd ms between adjacent tracks, growing with the square root of the distance for
+// short seeks and linearly for long ones), the rotational wait for its first sector and the transfer time.
+// The disk serves one request at a time on a virtual clock.
+// block sleeps in the caller until the request would finish, async only advances the clock so the caller
+// can delay the reply (see disk_clock), and sim advances it without regard to real time, for benchmarks
+enum { TIMING_BLOCK = 0, TIMING_ASYNC, TIMING_SIM };
+// Choose the mode ("block", "async" or "sim") and the spindle speed for the next init_disk;
+// returns -1 for an unknown name
+int disk_set_timing(const char *mode, int rpm);
+int disk_timing();
+// Virtual time (us) at which the last request queued or performed finishes: on CLOCK_MONOTONIC,
+// except in sim mode where it starts from 0 at init_disk
+double disk_clock();
+// Virtual time (us) spent serving requests since init_disk
+double disk_busy();
+
 int init_disk(char* filename, int ncyl, int nsec, int ttd);
 int cmd_i(int *ncyl, int *nsec);
 int cmd_r(int cyl, int sec, char *buf);
 int cmd_w(int cyl, int sec, int len, char *data);
+// Read/write a run of n consecutive sectors starting at (cyl, sec), continuing on the next cylinder
+#define MAXRUN 64
+int cmd_rn(int cyl, int sec, int n, char *buf);
+int cmd_wn(int cyl, int sec, int n, char *data);
+
+// Discard n sectors starting at (cyl, sec) (n is not limited to MAXRUN): they read back as zeros and the
+// image gives their space back to the host file system where it can (hole punching, else zeros are written).
+// Reads of sectors never written or discarded return zeros without touching the image
+int cmd_d(int cyl, int sec, long n);
+// Sectors that may hold data in the image; the rest are holes
+long disk_allocated();
+
+// Keep a CRC32C per sector in <disk file>.crc from the next init_disk on (built from the image when missing).
+// Writes update it and every read is checked against it: a read with a mismatching sector fails.
+// Opening an image with checksums off removes a stale table
+void disk_set_checksum(int on);
+// Whether the disk in use keeps checksums
+int disk_checksum();
+// Number of reads that failed their checksum since the program started
+unsigned long disk_checksum_errors();
+
+// Called when a queued request has finished, with status 0 on success and 1 on failure
+typedef void (*disk_done)(void *arg, int status);
+// Queue a run like cmd_rn/cmd_wn and return at once; returns 1 (and never calls done) if the run is invalid.
+// done is called at the latest by disk_complete, and buf/data must stay untouched until then.
+// With the uring backend the requests are submitted together by disk_complete and finish in any
+// order; the other backends finish the request before returning
+int cmd_rn_async(int cyl, int sec, int n, char *buf, disk_done done, void *arg);
+int cmd_wn_async(int cyl, int sec, int n, char *data, disk_done done, void *arg);
+// Submit everything queued and wait until all of it has finished
+void disk_complete();
+// Barrier: finish the queued requests and return once everything written so far is durable.
+// Consecutive barriers with no write in between cost one sync. Returns 1 if the sync failed
+int cmd_f();
 void close_disk();
 #endif
@@ -0,0 +1,15 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+// A small LZ77 codec in the LZ4 block format: greedy matching through a hash table of 4-byte sequences,
+// literal runs and matches coded as a token byte, optional length bytes and a 2-byte offset.
+// Fast to decompress, meant for blocks of at most 64 KB
+
+// Compress n bytes of src into dst, which has room for cap bytes. Returns the compressed size,
+// or 0 if it would not fit in cap (store the block uncompressed then)
+int lz_compress(const char *src, int n, char *dst, int cap);
+// Decompress n bytes of src into dst, which has room for cap bytes. Returns the decompressed size,
+// or -1 if src is not a valid block or does not fit
+int lz_decompress(const char *src, int n, char *dst, int cap);
+
+#endif
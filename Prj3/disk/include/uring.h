@@ -0,0 +1,17 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+// A minimal io_uring wrapper on the raw system calls, for the uring disk backend
+
+// Set up a ring for up to entries requests in flight; returns -1 if io_uring is unavailable
+int uring_init(unsigned entries);
+// Queue a read or write of len bytes at offset off of fd; tag is handed back on completion.
+// Nothing is submitted until uring_wait. Returns -1 if the ring is full
+int uring_queue(int write, int fd, char *buf, unsigned len, long off, unsigned long tag);
+// Submit everything queued with one system call and wait until all of it has completed, calling
+// done(tag, res) for each request in completion order (res is the byte count or -errno).
+// Returns -1 if the kernel refused the submission; requests not reported to done did not run
+int uring_wait(void (*done)(unsigned long tag, int res));
+void uring_exit();
+
+#endif
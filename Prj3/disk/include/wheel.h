@@ -0,0 +1,16 @@
+#ifndef __WHEEL_H__
+#define __WHEEL_H__
+
+// A timer wheel that holds replies back until the modelled disk would have finished the request
+
+// Start the timer thread; send(id, msg, len) delivers a due reply and returns -1 if it must be retried later
+void wheel_start(int (*send)(int id, const char *msg, int len));
+// Hold msg (len bytes, malloc'ed; freed once sent) for connection id until due (us, CLOCK_MONOTONIC).
+// Replies for one connection leave in the order they were added, so due is raised to the last one's if needed
+void wheel_add(int id, char *msg, int len, double due);
+// Number of replies held for connection id
+int wheel_held(int id);
+// Drop everything held for connection id, which has gone
+void wheel_drop(int id);
+
+#endif
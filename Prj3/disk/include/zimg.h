@@ -0,0 +1,34 @@
+#ifndef __ZIMG_H__
+#define __ZIMG_H__
+
+// A compressed disk image for the lz backend: the image is cut into 4 KB chunks, each stored LZ-compressed
+// (or as is, when that does not save space) somewhere in the file, found through a chunk index kept at the front.
+// All-zero chunks take no space. Rewritten chunks go to a new place and the old one is reused only after the
+// index pointing to the new place is durable, so a crash leaves every chunk either old or new.
+// Recently used chunks stay decompressed in a memory cache.
+// With deduplication, a chunk whose contents are already stored points at the stored copy instead of
+// writing another one; copies are never changed in place, so rewriting a shared chunk copies on write
+
+#define ZCHUNK 4096
+
+// Open the compressed image in fd (an empty file becomes a new image) for nsect sectors, deduplicating
+// new writes if dedup is set (reads every stored copy once to index it). Images written with and without
+// deduplication are the same format. Returns -1 if fd holds something else or an image of another size
+int zimg_open(int fd, long nsect, int dedup);
+// Read or write n sectors from sector s
+int zimg_io(int write, long s, int n, char *buf);
+// Make n sectors from s read back as zeros; whole chunks give their space back
+int zimg_discard(long s, long n);
+// Whether chunk c holds data
+int zimg_stored(long c);
+// Write the index and make everything written so far durable; returns -1 if that failed
+int zimg_sync();
+// Bytes of chunk data stored (shared copies counted once), and the size of the file
+void zimg_usage(long *stored, long *file);
+// Chunks holding data, the distinct stored copies they point at, and writes since opening that found
+// their data already stored
+void zimg_dedup_stats(long *chunks, long *copies, unsigned long *hits);
+// Write the index and forget the image (fd is left open)
+void zimg_close();
+
+#endif
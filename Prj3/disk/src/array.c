@@ -0,0 +1,559 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "log.h"
+#include "tcp_utils.h"
+
+/*------------------------------------------------------------
+ *  磁盘阵列服务器 BDA
+ *    对外说和 BDS 一样的协议（I/R/W/RN/WN/F/D/E），背后把请求分到 N 个 BDS 上：
+ *    RAID-0 按 chunk 个扇区条带化，RAID-1 镜像，RAID-5 条带化并在每行放一块
+ *    轮转的校验块（left-symmetric）。一个请求拆出的成员请求先全部发出、再依次
+ *    收回复，各个 BDS 同时寻道和读写。
+ *    成员断开或回复失败后当作坏盘：RAID-1/5 降级运行，坏盘上的数据由其余成员
+ *    （和校验）重建，写入时跳过坏盘；RAID-0 或坏盘超过冗余时相关请求失败。
+ *    做到一半坏掉的请求在降级状态下整个重做一遍，RAID-5 的校验重新算过，
+ *    不会和数据不一致。不做坏盘替换后的重建，也不处理崩溃时的 write hole。
+ *-----------------------------------------------------------*/
+
+static const int BLOCKSIZE = 512;
+
+#define MAXMEMBER 16
+#define MAXIO (MAXRUN * MAXMEMBER)  // 一个阶段最多发出的成员请求数
+#define POOL_SECTS (3 * MAXRUN * MAXMEMBER)  // 一个请求用到的临时缓冲区（扇区数）
+
+enum { IO_READ, IO_WRITE, IO_FLUSH, IO_DISCARD };
+
+static struct member {
+    char *host;
+    int port;
+    tcp_client c;
+    int nsec;         // 成员的每柱面扇区数
+    long size;        // 成员的扇区数
+    int failed;
+    int out[MAXIO];   // 已发出、还没收到回复的请求（ios 的下标），按发出的顺序
+    int nout;
+} members[MAXMEMBER];
+
+static struct io {
+    int kind;
+    int m;
+    long s;     // 成员上的起始扇区
+    long n;
+    char *buf;  // 读到这里，或者要写的数据
+    int status; // 0 成功，1 失败
+} ios[MAXIO];
+static int nio;
+
+static int nmember, nfailed, level, chunk = 16;
+static int ndata;      // 每行的数据块数
+static long msize;     // 每个成员用于阵列的扇区数，chunk 的整数倍
+static int ncyl, nsec; // 对外的几何
+static char pool[POOL_SECTS * 512];
+static int pool_used;  // pool 中已分出去的扇区数
+
+// 从临时缓冲区分出n个扇区；每个请求开始时清空
+static char *take(int n) {
+    char *p = pool + (long)pool_used * BLOCKSIZE;
+    pool_used += n;
+    return p;
+}
+
+static void xor_into(char *dst, const char *src, long len) {
+    for (long i = 0; i < len; i++) dst[i] ^= src[i];
+}
+
+static void member_failed(int m) {
+    if (members[m].failed) return;
+    members[m].failed = 1;
+    nfailed++;
+    Warn("Member %d (%s:%d) failed, %d of %d member(s) left", m, members[m].host, members[m].port,
+         nmember - nfailed, nmember);
+}
+
+// 坏盘的数目还在冗余能承受的范围内
+static int tolerable() {
+    if (level == 1) return nfailed < nmember;
+    if (level == 5) return nfailed <= 1;
+    return nfailed == 0;
+}
+
+/*--------------- 成员请求 ---------------------*/
+// 向成员m发出一个请求，回复在 wait_all 里收；坏盘上的请求直接失败
+static void submit(int kind, int m, long s, long n, char *buf) {
+    static char msg[64 + MAXRUN * 512];
+    struct member *mb = &members[m];
+    struct io *io = &ios[nio];
+    *io = (struct io){kind, m, s, n, buf, 0};
+    if (mb->failed) {
+        io->status = 1;
+        nio++;
+        return;
+    }
+    int len;
+    switch (kind) {
+        case IO_READ: len = sprintf(msg, "RN %ld %ld %ld", s / mb->nsec, s % mb->nsec, n) + 1; break;
+        case IO_WRITE:
+            len = sprintf(msg, "WN %ld %ld %ld ", s / mb->nsec, s % mb->nsec, n);
+            memcpy(msg + len, buf, n * BLOCKSIZE);
+            len += n * BLOCKSIZE;
+            break;
+        case IO_FLUSH: len = sprintf(msg, "F") + 1; break;
+        default: len = sprintf(msg, "D %ld %ld %ld", s / mb->nsec, s % mb->nsec, n) + 1; break;
+    }
+    client_send(mb->c, msg, len);
+    mb->out[mb->nout++] = nio++;
+}
+
+// 收齐所有已发出请求的回复。连接断开的成员当作坏盘；有冗余时回复失败的成员也当作坏盘，
+// 它的内容已经和其他成员对不上了。返回1表示有请求失败
+static int wait_all() {
+    static char reply[8 + MAXRUN * 512];
+    int failed = 0;
+    for (int m = 0; m < nmember; m++) {
+        struct member *mb = &members[m];
+        for (int i = 0; i < mb->nout; i++) {
+            struct io *io = &ios[mb->out[i]];
+            int len = mb->failed ? 0 : client_recv(mb->c, reply, sizeof(reply));
+            if (len <= 0) {
+                member_failed(m);
+                io->status = 1;
+            } else if (len < 3 || strncmp(reply, "Yes", 3) != 0 ||
+                       (io->kind == IO_READ && len != 4 + io->n * BLOCKSIZE)) {
+                Warn("Member %d refused a request at sector %ld", m, io->s);
+                if (level) member_failed(m);
+                io->status = 1;
+            } else if (io->kind == IO_READ) {
+                memcpy(io->buf, reply + 4, io->n * BLOCKSIZE);
+            }
+        }
+        mb->nout = 0;
+    }
+    for (int i = 0; i < nio; i++) failed |= ios[i].status;
+    nio = 0;
+    return failed;
+}
+
+/*--------------- 地址映射 ---------------------*/
+// RAID-0/5 第r行的校验成员，RAID-0 没有校验，返回-1
+static int parity_of(long r) { return level == 5 ? nmember - 1 - r % nmember : -1; }
+
+// 第r行的第d个数据块所在的成员
+static int member_of(long r, int d) { return level == 5 ? (parity_of(r) + 1 + d) % nmember : d; }
+
+// RAID-1 读哪个成员：按 chunk 轮流，跳过坏盘
+static int mirror_for(long L) {
+    for (int i = 0; i < nmember; i++) {
+        int m = (L / chunk + i) % nmember;
+        if (!members[m].failed) return m;
+    }
+    return 0;
+}
+
+/*--------------- 读 ---------------------*/
+// 读从第L个逻辑扇区开始的n个扇区
+static int array_read(long L, int n, char *buf) {
+    if (level == 1) {
+        submit(IO_READ, mirror_for(L), L, n, buf);
+        return wait_all();
+    }
+    struct {
+        char *dst, *src;
+        long len;
+        int cnt;
+    } rebuild[MAXRUN];
+    int nrebuild = 0;
+    long rowlen = (long)ndata * chunk;
+    for (long l = L; l < L + n;) {
+        long r = l / rowlen;
+        int d = l % rowlen / chunk, off = l % chunk;
+        int k = chunk - off < L + n - l ? chunk - off : L + n - l;
+        int m = member_of(r, d);
+        char *b = buf + (l - L) * BLOCKSIZE;
+        if (!members[m].failed || level == 0) {
+            submit(IO_READ, m, r * chunk + off, k, b);
+        } else {
+            // 降级读：同一行其余成员（含校验）的同一段异或起来
+            char *src = take((nmember - 1) * k);
+            for (int j = 0, i = 0; j < nmember; j++)
+                if (j != m) submit(IO_READ, j, r * chunk + off, k, src + (long)i++ * k * BLOCKSIZE);
+            rebuild[nrebuild++] = (typeof(rebuild[0])){b, src, (long)k * BLOCKSIZE, nmember - 1};
+        }
+        l += k;
+    }
+    if (wait_all()) return 1;
+    for (int i = 0; i < nrebuild; i++) {
+        memset(rebuild[i].dst, 0, rebuild[i].len);
+        for (int j = 0; j < rebuild[i].cnt; j++) xor_into(rebuild[i].dst, rebuild[i].src + j * rebuild[i].len, rebuild[i].len);
+    }
+    return 0;
+}
+
+/*--------------- 写 ---------------------*/
+// RAID-5 一行里要写的一段
+struct piece {
+    int m, off, k;
+    char *data;  // 新数据
+    char *old;   // 读改写时读出的旧数据
+};
+
+// RAID-5 写一行中的[lo, hi)（逻辑扇区），有三种做法：
+//   整行：校验直接由新数据算出，不用读；
+//   读改写：读出要写的各段和对应的校验，新校验 = 旧校验 ^ 旧数据 ^ 新数据；
+//   重建写：要写的成员坏了，读出这一段上所有好的成员，先重建坏盘的旧内容，
+//           覆盖上新数据后重算校验。
+// 第一阶段只发读请求，plan 记下第二阶段要做的事
+struct row {
+    long r;
+    int pm;          // 校验成员
+    int mode;        // 0 整行，1 读改写，2 重建写
+    int plo, phi;    // 这一行里受影响的块内偏移范围
+    struct piece pieces[MAXMEMBER];
+    int npiece;
+    char *parity;    // 校验（读改写时先读出旧的）
+    char *mbuf[MAXMEMBER];  // 重建写时各成员在[plo, phi)的内容
+};
+
+static void plan_row(struct row *w, long r, long lo, long hi, long L, char *buf) {
+    long rowlen = (long)ndata * chunk, rowstart = r * rowlen;
+    w->r = r;
+    w->pm = parity_of(r);
+    w->npiece = 0;
+    w->plo = chunk;
+    w->phi = 0;
+    int dead = -1;
+    for (long l = lo; l < hi;) {
+        int d = (l - rowstart) / chunk, off = l % chunk;
+        int k = chunk - off < hi - l ? chunk - off : hi - l;
+        struct piece *p = &w->pieces[w->npiece++];
+        *p = (struct piece){member_of(r, d), off, k, buf + (l - L) * BLOCKSIZE, NULL};
+        if (members[p->m].failed) dead = p->m;
+        if (off < w->plo) w->plo = off;
+        if (off + k > w->phi) w->phi = off + k;
+        l += k;
+    }
+    int span = w->phi - w->plo;
+    long ms = r * chunk + w->plo;
+    w->parity = take(span);
+    if (lo == rowstart && hi == rowstart + rowlen) {
+        w->mode = 0;
+    } else if (dead < 0 || members[w->pm].failed) {
+        w->mode = 1;
+        if (members[w->pm].failed) return;  // 没有校验要维护，直接写数据
+        submit(IO_READ, w->pm, ms, span, w->parity);
+        for (int i = 0; i < w->npiece; i++) {
+            struct piece *p = &w->pieces[i];
+            p->old = take(p->k);
+            submit(IO_READ, p->m, r * chunk + p->off, p->k, p->old);
+        }
+    } else {
+        w->mode = 2;
+        for (int j = 0; j < nmember; j++) {
+            w->mbuf[j] = j == w->pm ? w->parity : take(span);
+            if (!members[j].failed) submit(IO_READ, j, ms, span, w->mbuf[j]);
+        }
+    }
+}
+
+// 第二阶段：算出新校验，发出数据和校验的写请求
+static void write_row(struct row *w) {
+    int span = w->phi - w->plo;
+    long len = (long)span * BLOCKSIZE, ms = w->r * chunk + w->plo;
+    if (w->mode == 0) {
+        memset(w->parity, 0, len);
+        for (int i = 0; i < w->npiece; i++) xor_into(w->parity, w->pieces[i].data, len);
+    } else if (w->mode == 1) {
+        for (int i = 0; i < w->npiece; i++) {
+            struct piece *p = &w->pieces[i];
+            if (!p->old) continue;
+            char *dst = w->parity + (long)(p->off - w->plo) * BLOCKSIZE;
+            xor_into(dst, p->old, (long)p->k * BLOCKSIZE);
+            xor_into(dst, p->data, (long)p->k * BLOCKSIZE);
+        }
+    } else {
+        // 坏盘的旧内容 = 其余各成员（含校验）的异或
+        int dead = -1;
+        for (int j = 0; j < nmember; j++)
+            if (members[j].failed) dead = j;
+        memset(w->mbuf[dead], 0, len);
+        for (int j = 0; j < nmember; j++)
+            if (j != dead) xor_into(w->mbuf[dead], w->mbuf[j], len);
+        for (int i = 0; i < w->npiece; i++) {
+            struct piece *p = &w->pieces[i];
+            memcpy(w->mbuf[p->m] + (long)(p->off - w->plo) * BLOCKSIZE, p->data, (long)p->k * BLOCKSIZE);
+        }
+        memset(w->parity, 0, len);
+        for (int j = 0; j < nmember; j++)
+            if (j != w->pm) xor_into(w->parity, w->mbuf[j], len);
+    }
+    for (int i = 0; i < w->npiece; i++) {
+        struct piece *p = &w->pieces[i];
+        if (!members[p->m].failed) submit(IO_WRITE, p->m, w->r * chunk + p->off, p->k, p->data);
+    }
+    if (!members[w->pm].failed) submit(IO_WRITE, w->pm, ms, span, w->parity);
+}
+
+// 写从第L个逻辑扇区开始的n个扇区
+static int array_write(long L, int n, char *buf) {
+    if (level == 1) {
+        // 写所有好的镜像，写成功的那些仍然一致就算成功
+        for (int m = 0; m < nmember; m++) submit(IO_WRITE, m, L, n, buf);
+        wait_all();
+        return !tolerable();
+    }
+    long rowlen = (long)ndata * chunk;
+    if (level == 0) {
+        for (long l = L; l < L + n;) {
+            int k = chunk - l % chunk < L + n - l ? chunk - l % chunk : L + n - l;
+            submit(IO_WRITE, (l % rowlen) / chunk, l / rowlen * chunk + l % chunk, k, buf + (l - L) * BLOCKSIZE);
+            l += k;
+        }
+        return wait_all();
+    }
+    static struct row rows[MAXRUN + 1];
+    int nrow = 0;
+    for (long r = L / rowlen; r * rowlen < L + n; r++) {
+        long lo = r * rowlen > L ? r * rowlen : L;
+        long hi = (r + 1) * rowlen < L + n ? (r + 1) * rowlen : L + n;
+        plan_row(&rows[nrow++], r, lo, hi, L, buf);
+    }
+    if (wait_all()) return 1;
+    for (int i = 0; i < nrow; i++) write_row(&rows[i]);
+    return wait_all();
+}
+
+// 读写一段逻辑扇区；做到一半有成员坏掉、而阵列还能承受时，在降级状态下整个重做
+static int array_io(int write, long L, int n, char *buf) {
+    while (1) {
+        int before = nfailed;
+        pool_used = 0;
+        int ret = write ? array_write(L, n, buf) : array_read(L, n, buf);
+        if (ret == 0 || nfailed == before || !tolerable()) return ret;
+        Log("Retrying %s at sector %ld with %d failed member(s)", write ? "write" : "read", L, nfailed);
+    }
+}
+
+// 丢弃：整行的部分在每个成员上打洞（全零的行校验也是零），两头不满一行的部分写零
+static int array_discard(long L, long n) {
+    static char zero[MAXRUN * 512];
+    long rowlen = level == 1 ? chunk : (long)ndata * chunk;
+    long r0 = (L + rowlen - 1) / rowlen, r1 = (L + n) / rowlen;
+    if (r0 >= r1) r0 = r1 = L / rowlen;  // 不足一行
+    long head_end = r0 < r1 ? r0 * rowlen : L + n, tail_start = r0 < r1 ? r1 * rowlen : L + n;
+    for (long l = L; l < head_end; l += MAXRUN)
+        if (array_io(1, l, head_end - l < MAXRUN ? head_end - l : MAXRUN, zero)) return 1;
+    if (r0 < r1) {
+        for (int m = 0; m < nmember; m++) submit(IO_DISCARD, m, r0 * chunk, (r1 - r0) * chunk, NULL);
+        if (wait_all() && !(level && tolerable())) return 1;
+    }
+    for (long l = tail_start; l < L + n; l += MAXRUN)
+        if (array_io(1, l, L + n - l < MAXRUN ? L + n - l : MAXRUN, zero)) return 1;
+    return 0;
+}
+
+/*--------------- 命令 ---------------------*/
+// 检查从(cyl, sec)开始的n个扇区是否都在阵列内，返回第一个扇区的逻辑编号，非法时返回-1
+static long run_start(int cyl, int sec, long n, long limit) {
+    if (cyl >= ncyl || sec >= nsec || cyl < 0 || sec < 0 || n <= 0 || n > limit ||
+        (long)cyl * nsec + sec + n > (long)ncyl * nsec) {
+        Log("Invalid sector run: cyl=%d, sec=%d, n=%ld", cyl, sec, n);
+        return -1;
+    }
+    return (long)cyl * nsec + sec;
+}
+
+static void reply_status(tcp_buffer *wb, int failed) {
+    if (failed) reply(wb, "No ", 3);
+    else reply(wb, "Yes", 4);
+}
+
+int handle_i(tcp_buffer *wb, char *args, int len) {
+    static char buf[64];
+    sprintf(buf, "Yes %d %d", ncyl, nsec);
+    reply(wb, buf, strlen(buf) + 1);
+    return 0;
+}
+
+// R cyl sec 和 RN cyl sec n
+static int read_run(tcp_buffer *wb, char *args, int run) {
+    static char buf[4 + MAXRUN * 512];
+    int cyl, sec, n = 1;
+    if (sscanf(args, "%d %d %d", &cyl, &sec, &n) != 2 + run) {
+        Log("Invalid command format for READ: %s", args);
+        reply_status(wb, 1);
+        return 0;
+    }
+    long L = run_start(cyl, sec, n, MAXRUN);
+    if (L < 0 || array_io(0, L, n, buf + 4)) {
+        reply_status(wb, 1);
+        return 0;
+    }
+    memcpy(buf, "Yes ", 4);
+    reply(wb, buf, 4 + n * BLOCKSIZE);
+    return 0;
+}
+
+int handle_r(tcp_buffer *wb, char *args, int len) { return read_run(wb, args, 0); }
+
+int handle_rn(tcp_buffer *wb, char *args, int len) { return read_run(wb, args, 1); }
+
+int handle_w(tcp_buffer *wb, char *args, int len) {
+    char sector[512] = {0};
+    int cyl, sec, datalen;
+    if (sscanf(args, "%d %d %d", &cyl, &sec, &datalen) != 3 || datalen <= 0 || datalen > BLOCKSIZE) {
+        Log("Invalid command format for WRITE: %s", args);
+        reply_status(wb, 1);
+        return 0;
+    }
+    char *data = args;
+    for (int i = 0; i < 3; i++) data = strchr(data, ' ') + 1;
+    memcpy(sector, data, datalen);
+    long L = run_start(cyl, sec, 1, 1);
+    reply_status(wb, L < 0 || array_io(1, L, 1, sector));
+    return 0;
+}
+
+int handle_wn(tcp_buffer *wb, char *args, int len) {
+    int cyl, sec, n;
+    if (sscanf(args, "%d %d %d", &cyl, &sec, &n) != 3) {
+        Log("Invalid command format for WRITE RUN: %s", args);
+        reply_status(wb, 1);
+        return 0;
+    }
+    char *data = args;
+    for (int i = 0; i < 3; i++) data = strchr(data, ' ') + 1;
+    long L = run_start(cyl, sec, n, MAXRUN);
+    if (L >= 0 && args + len - data < (long)n * BLOCKSIZE) L = -1;
+    reply_status(wb, L < 0 || array_io(1, L, n, data));
+    return 0;
+}
+
+// F：所有好的成员都落盘后回复
+int handle_f(tcp_buffer *wb, char *args, int len) {
+    for (int m = 0; m < nmember; m++) submit(IO_FLUSH, m, 0, 0, NULL);
+    int failed = wait_all();
+    reply_status(wb, level ? !tolerable() : failed);
+    return 0;
+}
+
+int handle_d(tcp_buffer *wb, char *args, int len) {
+    int cyl, sec;
+    long n;
+    if (sscanf(args, "%d %d %ld", &cyl, &sec, &n) != 3) {
+        Log("Invalid command format for DISCARD: %s", args);
+        reply_status(wb, 1);
+        return 0;
+    }
+    long L = run_start(cyl, sec, n, (long)ncyl * nsec);
+    reply_status(wb, L < 0 || array_discard(L, n));
+    return 0;
+}
+
+int handle_e(tcp_buffer *wb, char *args, int len) {
+    const char *msg = "Bye!";
+    reply(wb, msg, strlen(msg) + 1);
+    return -1;
+}
+
+static struct {
+    const char *name;
+    int (*handler)(tcp_buffer *wb, char *, int);
+} cmd_table[] = {
+    {"I", handle_i},
+    {"R", handle_r},
+    {"W", handle_w},
+    {"RN", handle_rn},
+    {"WN", handle_wn},
+    {"F", handle_f},
+    {"D", handle_d},
+    {"E", handle_e},
+};
+
+#define NCMD (sizeof(cmd_table) / sizeof(cmd_table[0]))
+
+int on_recv(int id, tcp_buffer *wb, char *msg, int len) {
+    char *p = strtok(msg, " \r\n");
+    int ret = 1;
+    for (int i = 0; i < NCMD; i++)
+        if (p && strcmp(p, cmd_table[i].name) == 0) {
+            ret = cmd_table[i].handler(wb, p + strlen(p) + 1, len - strlen(p) - 1);
+            break;
+        }
+    if (ret == 1) {
+        static char unk[] = "Unknown command";
+        buffer_append(wb, unk, sizeof(unk));
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+FILE *log_file;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-l 0|1|5] [-c <chunk sectors>] <port> <host:port> <host:port> ...\n", prog);
+    fprintf(stderr, "  Serves the disk servers at the given addresses as one RAID-0, RAID-1 or RAID-5 array\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "l:c:")) != -1) {
+        switch (opt) {
+            case 'l': level = atoi(optarg); break;
+            case 'c': chunk = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    nmember = argc - optind - 1;
+    if (nmember < 1 || nmember > MAXMEMBER || chunk <= 0 || chunk > MAXRUN) usage(argv[0]);
+    if ((level != 0 && level != 1 && level != 5) || (level == 1 && nmember < 2) || (level == 5 && nmember < 3)) {
+        fprintf(stderr, "RAID-1 needs at least 2 members, RAID-5 at least 3\n");
+        usage(argv[0]);
+    }
+    int port = atoi(argv[optind]);
+    signal(SIGPIPE, SIG_IGN);  // 成员断开后的写只当作失败
+    log_init("array.log");
+
+    // 连上各个成员，阵列按最小的成员算容量
+    msize = -1;
+    for (int m = 0; m < nmember; m++) {
+        struct member *mb = &members[m];
+        char *colon = strrchr(argv[optind + 1 + m], ':');
+        if (!colon) usage(argv[0]);
+        *colon = 0;
+        mb->host = argv[optind + 1 + m];
+        mb->port = atoi(colon + 1);
+        mb->c = client_init(mb->host, mb->port);
+        char buf[64];
+        int mcyl = 0;
+        client_send(mb->c, "I", 2);
+        int n = client_recv(mb->c, buf, sizeof(buf) - 1);
+        buf[n > 0 ? n : 0] = 0;
+        if (sscanf(buf, "Yes %d %d", &mcyl, &mb->nsec) != 2 || mcyl <= 0 || mb->nsec <= 0) {
+            fprintf(stderr, "Member %s:%d did not report its geometry\n", mb->host, mb->port);
+            exit(EXIT_FAILURE);
+        }
+        mb->size = (long)mcyl * mb->nsec;
+        if (msize < 0 || mb->size < msize) msize = mb->size;
+    }
+    msize -= msize % chunk;
+    ndata = level == 0 ? nmember : level == 1 ? 1 : nmember - 1;
+    nsec = members[0].nsec;
+    long capacity = ndata * msize;
+    if (capacity / nsec > 0x7fffffff || capacity < nsec) {
+        fprintf(stderr, "Unsupported array size: %ld sectors\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+    ncyl = capacity / nsec;
+    Log("RAID-%d over %d member(s), chunk %d sector(s): %d cylinders, %d sectors per cylinder", level, nmember, chunk,
+        ncyl, nsec);
+
+    tcp_server server = server_init(port, 1, NULL, on_recv, NULL);
+    server_run(server);
+
+    // never reached
+    log_close();
+}
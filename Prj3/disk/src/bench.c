@@ -0,0 +1,244 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "log.h"
+#include "zimg.h"
+
+/*------------------------------------------------------------
+ *  各 I/O 后端的延迟与吞吐量基准测试
+ *    对同一个镜像依次用 mmap、pread/pwrite、O_DIRECT、io_uring 后端，以及在
+ *    <镜像>.lz 上用压缩镜像（lz 后端）做
+ *    随机单扇区读写（统计平均和 p99 延迟）、连续的 MAXRUN 扇区读写
+ *    （统计吞吐量），以及每批排队 depth 个的随机读（统计每秒操作数），
+ *    寻道时间 ttd 取 0，只测后端本身的开销。
+ *    给了 -r 时，再在模拟时钟上按该转速和 -t 的寻道时间跑一遍随机读和连续读，
+ *    报告模型给出的服务时间，不真的等待。
+ *    压缩镜像写入的内容是可压缩的文本，跑完报告压缩后的大小。
+ *    给了 -c 时，每个后端再开着扇区校验和跑一遍，和不开时对比开销。
+ *    给了 -d 时，再在新的压缩镜像上开着去重跑一遍：连续写反复写同一段数据，
+ *    是去重最有利的情形，随机写只改一个扇区，每次都要写新的一份；跑完报告共用的情况。
+ *    给了 -m 时，再用 mmap 后端比较几种映射的调优（访问提示、预先缺页、大页）：
+ *    每次先把镜像从页缓存里清掉，报告 init_disk 的时间、冷缓存下随机读的延迟和连续读的吞吐量。
+ *    镜像的内容会被覆盖。
+ *-----------------------------------------------------------*/
+
+FILE *log_file;
+
+static int nops = 20000;  // 随机读写的次数
+static int depth = 64;    // 排队读时每批的请求数
+static int rpm = 0;       // 模拟阶段的转速，0 表示跳过
+static int ttd = 10;      // 模拟阶段相邻磁道的寻道时间（毫秒）
+static int checksum = 0;  // 是否再开着校验和跑一遍
+static int dedup = 0;     // 是否再开着去重跑一遍 lz
+static int mapping = 0;   // 是否比较 mmap 的调优
+static int ncyl, nsec;
+static double *lat;
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// 写入的数据：一段重复的文本，各后端写的都一样，压缩镜像也能压缩
+static void fill(char *buf, int len) {
+    static const char text[] = "The quick brown fox jumps over the lazy dog. inode 2303, block ";
+    for (int i = 0; i < len; i++) buf[i] = text[i % (sizeof(text) - 1)] + (i / 512 % 7);
+}
+
+// 随机单扇区读或写nops次，打印平均延迟和 p99
+static void random_io(int write) {
+    char buf[512];
+    fill(buf, sizeof(buf));
+    srand(2303);
+    for (int i = 0; i < nops; i++) {
+        int cyl = rand() % ncyl, sec = rand() % nsec;
+        double t0 = now_us();
+        if (write) cmd_w(cyl, sec, sizeof(buf), buf);
+        else cmd_r(cyl, sec, buf);
+        lat[i] = now_us() - t0;
+    }
+    double sum = 0;
+    for (int i = 0; i < nops; i++) sum += lat[i];
+    qsort(lat, nops, sizeof(double), cmp_double);
+    printf("  random %-5s %9.2f us avg %9.2f us p99\n", write ? "write" : "read", sum / nops, lat[nops * 99 / 100]);
+}
+
+static void ignore_done(void *arg, int status) {}
+
+// 随机单扇区读nops次，每depth个排队后一起完成，打印每秒完成的请求数
+static void queued_read() {
+    static char buf[256][512];
+    srand(2303);
+    double t0 = now_us();
+    for (int i = 0; i < nops; i++) {
+        cmd_rn_async(rand() % ncyl, rand() % nsec, 1, buf[i % depth], ignore_done, NULL);
+        if ((i + 1) % depth == 0) disk_complete();
+    }
+    disk_complete();
+    printf("  queued read  %9.0f ops/s (depth %d)\n", nops / ((now_us() - t0) / 1e6), depth);
+}
+
+// 从头到尾连续读或写整个镜像，每次 MAXRUN 个扇区，打印吞吐量
+static void sequential_io(int write) {
+    static char buf[MAXRUN * 512];
+    fill(buf, sizeof(buf));
+    long total = (long)ncyl * nsec, done = 0;
+    double t0 = now_us();
+    while (done < total) {
+        int n = total - done < MAXRUN ? total - done : MAXRUN;
+        int cyl = done / nsec, sec = done % nsec;
+        if (write) cmd_wn(cyl, sec, n, buf);
+        else cmd_rn(cyl, sec, n, buf);
+        done += n;
+    }
+    double sec_used = (now_us() - t0) / 1e6;
+    printf("  seq    %-5s %9.1f MB/s\n", write ? "write" : "read", total * 512 / 1e6 / sec_used);
+}
+
+// 把镜像写回并从页缓存里清掉，之后的读都要真的读文件
+static void drop_cache(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// 本进程里用 PMD 映射的文件页（kB），看大页是否真的用上
+static long pmd_mapped_kb() {
+    char line[256];
+    long kb = 0;
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f) return -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "FilePmdMapped: %ld", &kb) == 1) break;
+    fclose(f);
+    return kb;
+}
+
+// 冷缓存下比较 mmap 后端的几种映射调优，镜像已经写满
+static void mapping_io(char *filename) {
+    struct { const char *name, *advice; int huge, populate; } t[] = {
+        {"default", "normal", 0, 0},    {"random", "random", 0, 0},     {"sequential", "sequential", 0, 0},
+        {"willneed", "willneed", 0, 0}, {"auto", "auto", 0, 0},         {"populate", "normal", 0, 1},
+        {"hugepages", "normal", 1, 0},
+    };
+    disk_set_backend("mmap");
+    for (int i = 0; i < (int)(sizeof(t) / sizeof(t[0])); i++) {
+        disk_set_mapping(t[i].advice, t[i].huge, t[i].populate);
+        drop_cache(filename);
+        double t0 = now_us();
+        if (init_disk(filename, ncyl, nsec, 0) != 0) return;
+        printf("mmap, %s (cold cache):\n  init         %9.2f ms\n", t[i].name, (now_us() - t0) / 1e3);
+        random_io(0);
+        if (t[i].huge) printf("  huge pages   %9ld kB mapped\n", pmd_mapped_kb());
+        close_disk();
+        drop_cache(filename);
+        if (init_disk(filename, ncyl, nsec, 0) != 0) return;
+        sequential_io(0);
+        close_disk();
+    }
+    disk_set_mapping("normal", 0, 0);
+}
+
+// 在模拟时钟上测随机单扇区读和连续读，打印模型给出的时间
+static void simulated_io(char *filename) {
+    static char buf[MAXRUN * 512];
+    disk_set_timing("sim", rpm);
+    if (init_disk(filename, ncyl, nsec, ttd) != 0) return;
+    printf("simulated %d rpm, %d ms track-to-track:\n", rpm, ttd);
+    srand(2303);
+    for (int i = 0; i < nops; i++) cmd_r(rand() % ncyl, rand() % nsec, buf);
+    printf("  random read  %9.2f ms avg\n", disk_clock() / 1e3 / nops);
+    long total = (long)ncyl * nsec, done = 0;
+    double t0 = disk_clock();
+    for (; done < total; done += MAXRUN) {
+        int n = total - done < MAXRUN ? total - done : MAXRUN;
+        cmd_rn(done / nsec, done % nsec, n, buf);
+    }
+    printf("  seq    read  %9.1f MB/s\n", total * 512 / 1e6 / ((disk_clock() - t0) / 1e6));
+    close_disk();
+    disk_set_timing("block", 0);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n <random ops>] [-q <queue depth>] [-r <rpm> [-t <ttd>]] [-c] [-d] [-m] <disk file name> <cylinders> <sector per cylinder>\n", prog);
+    fprintf(stderr, "  Overwrites the disk file\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:q:r:t:cdm")) != -1) {
+        switch (opt) {
+            case 'n': nops = atoi(optarg); break;
+            case 'q': depth = atoi(optarg); break;
+            case 'r': rpm = atoi(optarg); break;
+            case 't': ttd = atoi(optarg); break;
+            case 'c': checksum = 1; break;
+            case 'd': dedup = 1; break;
+            case 'm': mapping = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3 || nops <= 0 || depth <= 0 || depth > 256 || rpm < 0 || ttd < 0) usage(argv[0]);
+    char *filename = argv[optind];
+    ncyl = atoi(argv[optind + 1]);
+    nsec = atoi(argv[optind + 2]);
+    if (ncyl <= 0 || nsec <= 0) usage(argv[0]);
+    log_init("/dev/null");  // 每次读写都记日志会淹没后端本身的开销
+    lat = malloc(nops * sizeof(double));
+
+    const char *backends[] = {"mmap", "pio", "direct", "uring", "lz"};
+    const int nb = sizeof(backends) / sizeof(backends[0]);
+    char lzname[4096];
+    snprintf(lzname, sizeof(lzname), "%s.lz", filename);
+    unlink(lzname);  // 压缩镜像和普通镜像不通用
+    printf("%d x %d disk (%.1f MB), %d random ops\n", ncyl, nsec, (double)ncyl * nsec * 512 / 1e6, nops);
+    int nrun = nb * (checksum + 1);
+    for (int i = 0; i < nrun + dedup; i++) {
+        int lz = i == nrun || i % nb == nb - 1;
+        disk_set_backend(i == nrun ? "lz" : backends[i % nb]);
+        disk_set_checksum(i >= nb && i < nrun);
+        disk_set_dedup(i == nrun);
+        if (i == nrun) unlink(lzname);  // 去重从空镜像开始
+        if (init_disk(lz ? lzname : filename, ncyl, nsec, 0) != 0) return EXIT_FAILURE;
+        printf("%s%s%s:\n", disk_backend(), disk_checksum() ? ", checksums" : "", i == nrun ? ", dedup" : "");
+        sequential_io(1);
+        sequential_io(0);
+        random_io(1);
+        random_io(0);
+        queued_read();
+        if (lz) {
+            long stored, file;
+            zimg_usage(&stored, &file);
+            printf("  compressed   %9.1f MB stored, %.1f MB file (%.2fx)\n", stored / 1e6, file / 1e6,
+                   (double)ncyl * nsec * 512 / file);
+        }
+        if (i == nrun) {
+            long chunks, copies;
+            unsigned long hits;
+            zimg_dedup_stats(&chunks, &copies, &hits);
+            printf("  dedup        %9ld chunks, %ld copies (%.2fx), %lu writes saved\n", chunks, copies,
+                   copies ? (double)chunks / copies : 1.0, hits);
+        }
+        close_disk();
+    }
+    disk_set_checksum(0);
+    disk_set_dedup(0);
+    if (mapping) mapping_io(filename);
+    if (rpm > 0) simulated_io(filename);
+    free(lat);
+    return 0;
+}
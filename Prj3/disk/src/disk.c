@@ -1,15 +1,24 @@
+#define _GNU_SOURCE  // O_DIRECT
 #include "disk.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <linux/falloc.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
-#include<math.h>
+#include <math.h>
 
+#include "crc32c.h"
 #include "log.h"
+#include "uring.h"
+#include "zimg.h"
 
 // global variables
 static struct Disk {
@@ -18,18 +27,424 @@ static struct Disk {
     int _nsec;      // 每个柱面的扇区数
     int ttd;        // 相邻磁道间的寻道时间
     int fd;         // 文件描述符
-    char *diskfile; // 内存映射
-
-} disk;
+    char *diskfile; // 内存映射（mmap 后端）
+    int backend;    // 读写镜像的方式
+    char *bounce;   // O_DIRECT 用的对齐缓冲区
+} disk = {.fd = -1, .diskfile = MAP_FAILED};
 
 static const int BLOCKSIZE = 512; // 数据块大小
 static int cur_cyl = 0;
 
+#define DIRECT_ALIGN 4096  // O_DIRECT 的对齐要求，取常见的最大逻辑块大小
+#define DIRECT_BUFSIZE (MAXRUN * 512 + 2 * DIRECT_ALIGN)  // 一次请求对齐后最多涉及的字节数
+#define URING_DEPTH 256  // uring 后端一批最多提交的请求数
+static int next_backend = DISK_MMAP;  // 下一次 init_disk 使用的后端
+static int next_dedup;                // 下一次 init_disk 是否去重（只对 lz 后端）
+
+static const char *backend_names[] = {"mmap", "pio", "direct", "uring", "lz"};
+
+// 持久化策略
+static const char *sync_names[] = {"none", "periodic", "write", "flush"};
+static int sync_policy = SYNC_FLUSH;
+static int sync_period = 1000;     // periodic 策略的同步间隔（毫秒）
+static int dirty;                  // 上次同步之后有没有写过，后台同步线程也会访问
+static unsigned long nsync;        // 真正做了同步的次数
+static pthread_t sync_thread;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static int sync_running;           // 后台同步线程是否在运行
+
+int disk_set_backend(const char *name) {
+    for (int i = 0; i < (int)(sizeof(backend_names) / sizeof(backend_names[0])); i++)
+        if (strcmp(name, backend_names[i]) == 0) {
+            next_backend = i;
+            return 0;
+        }
+    return -1;
+}
+
+const char *disk_backend() { return backend_names[disk.backend]; }
+
+void disk_set_dedup(int on) { next_dedup = on; }
+
+int disk_set_sync(const char *policy, int period_ms) {
+    if (period_ms <= 0) return -1;
+    for (int i = 0; i < (int)(sizeof(sync_names) / sizeof(sync_names[0])); i++)
+        if (strcmp(policy, sync_names[i]) == 0) {
+            sync_policy = i;
+            sync_period = period_ms;
+            return 0;
+        }
+    return -1;
+}
+
+const char *disk_sync_policy() { return sync_names[sync_policy]; }
+
+unsigned long disk_sync_count() { return __atomic_load_n(&nsync, __ATOMIC_RELAXED); }
+
+/*--------------- 持久化 ---------------------*/
+// 把上次同步以来写入的数据刷到存储上；没有写过就什么也不做，连续的几次屏障因此只同步一次。
+// 先清标志再同步：同步期间的写会重新置位，留给下一次
+static uint32_t *crc_table;  // 扇区校验和表（见“扇区校验和”），和镜像一起同步
+static long crc_size;
+
+static int sync_disk() {
+    if (!__atomic_exchange_n(&dirty, 0, __ATOMIC_ACQ_REL)) return 0;
+    int ret = disk.backend == DISK_MMAP ? msync(disk.diskfile, disk.FILESIZE, MS_SYNC)
+              : disk.backend == DISK_LZ ? zimg_sync()
+                                        : fdatasync(disk.fd);
+    if (ret == 0 && crc_table) ret = msync(crc_table, crc_size, MS_SYNC);
+    if (ret < 0) {
+        Error("Could not sync the disk file: %s", strerror(errno));
+        __atomic_store_n(&dirty, 1, __ATOMIC_RELEASE);
+        return 1;
+    }
+    __atomic_add_fetch(&nsync, 1, __ATOMIC_RELAXED);
+    Log("Disk synced");
+    return 0;
+}
+
+// 一次写完成之后调用
+static void written() {
+    __atomic_store_n(&dirty, 1, __ATOMIC_RELEASE);
+}
+
+// periodic 策略的后台线程：每隔 sync_period 毫秒同步一次，直到 close_disk
+static void *sync_loop(void *arg) {
+    pthread_mutex_lock(&sync_lock);
+    while (sync_running) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += sync_period / 1000;
+        ts.tv_nsec += (sync_period % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&sync_cond, &sync_lock, &ts);
+        if (!sync_running) break;
+        pthread_mutex_unlock(&sync_lock);
+        sync_disk();
+        pthread_mutex_lock(&sync_lock);
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return NULL;
+}
+
+/*--------------- 稀疏镜像 ---------------------*/
+// 镜像按 CHUNK 字节分块，alloc_map 的一位表示这块在文件里是否可能有数据。位为 0 的块一定读出全零：
+// 要么是文件里的空洞（init_disk 时用 SEEK_DATA/SEEK_HOLE 扫出），要么被 cmd_d 整块丢弃过。
+// 读全是空洞的扇区时直接填零，不碰文件；写过的块置位，只有整块被丢弃才清零
+#define CHUNK 4096
+#define CHUNK_SECS (CHUNK / 512)
+
+static unsigned char *alloc_map;
+static long nchunk;
+
+static int chunk_used(long c) { return alloc_map[c / 8] & (1 << (c % 8)); }
+
+// 标记从第s个扇区开始的n个扇区所在的块已分配
+static void mark_used(long s, long n) {
+    for (long c = s / CHUNK_SECS; c <= (s + n - 1) / CHUNK_SECS; c++) alloc_map[c / 8] |= 1 << (c % 8);
+}
+
+// 标记整个落在这n个扇区里的块为空；镜像最后不满一块的部分到了镜像末尾也算整块
+static void mark_free(long s, long n) {
+    long end = s + n == disk.FILESIZE / 512 ? nchunk : (s + n) / CHUNK_SECS;
+    for (long c = (s + CHUNK_SECS - 1) / CHUNK_SECS; c < end; c++) alloc_map[c / 8] &= ~(1 << (c % 8));
+}
+
+// 从第s个扇区开始的n个扇区是否都在空的块里
+static int run_empty(long s, long n) {
+    for (long c = s / CHUNK_SECS; c <= (s + n - 1) / CHUNK_SECS; c++)
+        if (chunk_used(c)) return 0;
+    return 1;
+}
+
+// 按文件实际的数据区建 alloc_map；不支持 SEEK_DATA 的文件系统上全部当作已分配。
+// 压缩镜像的块和文件位置无关，看块索引
+static void scan_holes() {
+    nchunk = (disk.FILESIZE + CHUNK - 1) / CHUNK;
+    alloc_map = calloc((nchunk + 7) / 8, 1);
+    if (disk.backend == DISK_LZ) {
+        for (long c = 0; c < nchunk; c++)
+            if (zimg_stored(c)) alloc_map[c / 8] |= 1 << (c % 8);
+        return;
+    }
+    off_t data = 0, hole;
+    while ((data = lseek(disk.fd, data, SEEK_DATA)) >= 0 && data < disk.FILESIZE) {
+        hole = lseek(disk.fd, data, SEEK_HOLE);
+        if (hole < 0) hole = disk.FILESIZE;
+        mark_used(data / 512, (hole - data + 511) / 512);
+        data = hole;
+    }
+    if (data < 0 && errno != ENXIO) {
+        Warn("SEEK_DATA is not supported (%s), treating the whole image as allocated", strerror(errno));
+        memset(alloc_map, 0xff, (nchunk + 7) / 8);
+    }
+}
+
+long disk_allocated() {
+    long n = 0;
+    for (long c = 0; c < nchunk; c++) n += chunk_used(c) != 0;
+    return n * CHUNK_SECS;
+}
+
+/*--------------- 扇区校验和 ---------------------*/
+// 每个扇区的 CRC32C 存在镜像旁边的 <镜像>.crc 里，映射进内存，每个扇区 4 字节，和镜像一起同步。
+// 表项是扇区的 CRC 异或上全零扇区的 CRC，全零的表项正好对应全零的扇区：新建的表、空洞和
+// 丢弃过的扇区都不用另外填。写成功后更新表项，读出后逐个扇区核对，对不上的读失败。
+// 不开校验和时镜像可能被改写，旧的表就删掉，下次打开时按镜像的内容重建
+static int next_checksum;  // 下一次 init_disk 是否打开校验和
+static uint32_t zero_crc;
+static unsigned long nmismatch;
+
+void disk_set_checksum(int on) { next_checksum = on; }
+
+int disk_checksum() { return crc_table != NULL; }
+
+unsigned long disk_checksum_errors() { return nmismatch; }
+
+static uint32_t sector_crc(const char *p) { return crc32c(0, p, BLOCKSIZE) ^ zero_crc; }
+
+// 记下从第s个扇区开始的n个扇区新写入的内容
+static void crc_update(long s, long n, const char *buf) {
+    if (!crc_table) return;
+    for (long i = 0; i < n; i++) crc_table[s + i] = sector_crc(buf + i * BLOCKSIZE);
+}
+
+// 核对读出的n个扇区，有对不上的返回-1
+static int crc_verify(long s, long n, const char *buf) {
+    if (!crc_table) return 0;
+    for (long i = 0; i < n; i++)
+        if (sector_crc(buf + i * BLOCKSIZE) != crc_table[s + i]) {
+            __atomic_add_fetch(&nmismatch, 1, __ATOMIC_RELAXED);
+            Error("Checksum mismatch in sector %ld (cyl=%ld, sec=%ld)", s + i, (s + i) / disk._nsec,
+                  (s + i) % disk._nsec);
+            return -1;
+        }
+    return 0;
+}
+
+static int sparse_read(long s, int n, char *buf);
+
+// 打开（或删掉）filename.crc；新建或大小不对的表按镜像现有的内容算一遍，只读有数据的块
+static int open_checksums(const char *filename) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.crc", filename);
+    if (!next_checksum) {
+        if (unlink(path) == 0) Log("Removed %s: checksums are off and the image may change", path);
+        return 0;
+    }
+    static char zero[512];
+    zero_crc = crc32c(0, zero, BLOCKSIZE);
+    long nsect = disk.FILESIZE / BLOCKSIZE;
+    crc_size = nsect * sizeof(uint32_t);
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        Error("Could not open %s: %s", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    int fresh = st.st_size != crc_size;
+    if ((fresh && ftruncate(fd, 0) < 0) || ftruncate(fd, crc_size) < 0) {
+        Error("Could not resize %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    crc_table = mmap(NULL, crc_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  // 映射不依赖描述符
+    if (crc_table == MAP_FAILED) {
+        Error("Could not map %s: %s", path, strerror(errno));
+        crc_table = NULL;
+        return -1;
+    }
+    if (fresh) {
+        static char buf[MAXRUN * 512];
+        for (long s = 0; s < nsect; s += MAXRUN) {
+            int n = nsect - s < MAXRUN ? nsect - s : MAXRUN;
+            if (run_empty(s, n)) continue;
+            if (sparse_read(s, n, buf) < 0) return -1;
+            crc_update(s, n, buf);
+        }
+        msync(crc_table, crc_size, MS_SYNC);
+        Log("Built checksums for %s (%s)", filename, crc32c_hw() ? "SSE4.2" : "table-driven CRC32C");
+    }
+    return 0;
+}
+
+/*--------------- 时间模型 ---------------------*/
+// 每个请求的耗时 = 寻道 + 等目标扇区转到磁头下 + 传输，记在虚拟时钟上：磁盘一次只服务一个
+// 请求，请求从 max(到达时间, 上一个请求完成的时间) 开始。block 模式在调用线程里睡到完成
+// 时间（原来的做法），async 模式只算出完成时间、由调用者推迟回复，sim 模式不看真实时间，
+// 只推进虚拟时钟。
+#define SEEK_KNEE 400  // 短寻道以加速为主，耗时按距离的平方根增长；更远的按匀速线性增长
+
+static const char *timing_names[] = {"block", "async", "sim"};
+static int timing = TIMING_BLOCK;
+static int rpm;        // 转速，0 表示不模拟旋转等待和传输时间
+static double vclock;  // 上一个请求完成的虚拟时间（微秒）
+static double busy;    // 累计的服务时间（微秒）
+
+int disk_set_timing(const char *mode, int r) {
+    if (r < 0) return -1;
+    for (int i = 0; i < (int)(sizeof(timing_names) / sizeof(timing_names[0])); i++)
+        if (strcmp(mode, timing_names[i]) == 0) {
+            timing = i;
+            rpm = r;
+            return 0;
+        }
+    return -1;
+}
+
+int disk_timing() { return timing; }
+
+double disk_clock() { return vclock; }
+
+double disk_busy() { return busy; }
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// 磁头移动d个柱面的时间（微秒），相邻磁道之间是 ttd 毫秒；两段曲线在 SEEK_KNEE 处相切。
+// rpm 为 0 时不模拟盘片，保持原来每个柱面 ttd 毫秒的线性寻道
+static double seek_time(int d) {
+    double t2t = 1000.0 * disk.ttd;
+    if (!rpm) return t2t * d;
+    if (d <= SEEK_KNEE) return t2t * sqrt(d);
+    return t2t * (sqrt(SEEK_KNEE) + (d - SEEK_KNEE) / (2 * sqrt(SEEK_KNEE)));
+}
+
+// 服务从第s个扇区开始的n个扇区，推进虚拟时钟；跨过柱面边界时再寻道一次
+static void service(long s, int n) {
+    double t = timing == TIMING_SIM ? vclock : fmax(vclock, now_us()), start = t;
+    double rev = rpm ? 60e6 / rpm : 0, per = rev / disk._nsec;  // 转一圈、转过一个扇区的时间
+    while (n > 0) {
+        int cyl = s / disk._nsec, sec = s % disk._nsec;
+        int k = n < disk._nsec - sec ? n : disk._nsec - sec;
+        t += seek_time(abs(cyl - cur_cyl));
+        cur_cyl = cyl;
+        if (rpm) {
+            // 盘片匀速转动，t 时刻转到磁头下的是第 fmod(t, rev) / per 个扇区
+            t += fmod(sec * per - fmod(t, rev) + rev, rev) + k * per;
+        }
+        s += k;
+        n -= k;
+    }
+    vclock = t;
+    busy += t - start;
+    // 不到 1 微秒时不睡，usleep(0) 本身也要几十微秒
+    if (timing == TIMING_BLOCK && t - now_us() >= 1) usleep(t - now_us());
+}
+
+/*--------------- 映射的调优 ---------------------*/
+// mmap 后端的映射：可以按 2 MB 对齐后请求透明大页（PMD 映射要求虚拟地址对齐），可以用 MAP_POPULATE
+// 在 init_disk 里预先缺页，建好之后按 map_advice 给内核访问提示。auto 时每 ADVICE_WINDOW 个请求
+// 看一次其中多少个紧接着上一个：大多是就提示 SEQUENTIAL，并在连续流前面 PREFETCH 字节的范围内
+// 提前 WILLNEED；大多不是就提示 RANDOM，缺页时不再顺带预读用不上的页；其余情况恢复 NORMAL
+enum { ADVICE_NORMAL = 0, ADVICE_RANDOM, ADVICE_SEQUENTIAL, ADVICE_WILLNEED, ADVICE_AUTO };
+#define HUGE_SIZE (2L << 20)
+#define ADVICE_WINDOW 64
+#define PREFETCH (4L << 20)
+
+static const char *advice_names[] = {"normal", "random", "sequential", "willneed", "auto"};
+static const int advice_flags[] = {MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL, MADV_WILLNEED};
+static int map_advice = ADVICE_NORMAL;
+static int map_huge, map_populate;
+static struct pattern {
+    int current;     // 现在给内核的提示
+    long next;       // 紧接着上一个请求的扇区
+    int nreq, nseq;  // 本窗口的请求数，其中紧接着上一个的个数
+    long ahead;      // 已经提示 WILLNEED 到的字节偏移
+} pattern;
+
+int disk_set_mapping(const char *advice, int hugepages, int populate) {
+    for (int i = 0; i < (int)(sizeof(advice_names) / sizeof(advice_names[0])); i++)
+        if (strcmp(advice, advice_names[i]) == 0) {
+            map_advice = i;
+            map_huge = hugepages;
+            map_populate = populate;
+            return 0;
+        }
+    return -1;
+}
+
+// 对镜像的[off, off + len)给出提示，起点向下对齐到页
+static void advise(long off, long len, int advice) {
+    long lo = off & ~(sysconf(_SC_PAGESIZE) - 1);
+    if (madvise(disk.diskfile + lo, len + off - lo, advice_flags[advice]) < 0)
+        Warn("madvise(%s) failed: %s", advice_names[advice], strerror(errno));
+}
+
+// 映射整个镜像。要大页时先保留多出 HUGE_SIZE 的地址空间，在其中对齐的位置映射文件，再把两头还回去
+static char *map_image() {
+    int flags = MAP_SHARED | (map_populate ? MAP_POPULATE : 0);
+    if (!map_huge) return mmap(NULL, disk.FILESIZE, PROT_READ | PROT_WRITE, flags, disk.fd, 0);
+    long pg = sysconf(_SC_PAGESIZE), len = (disk.FILESIZE + pg - 1) & ~(pg - 1);
+    char *r = mmap(NULL, len + HUGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (r == MAP_FAILED) return r;
+    char *a = (char *)(((uintptr_t)r + HUGE_SIZE - 1) & ~(uintptr_t)(HUGE_SIZE - 1));
+    char *p = mmap(a, disk.FILESIZE, PROT_READ | PROT_WRITE, flags | MAP_FIXED, disk.fd, 0);
+    if (p == MAP_FAILED) {
+        munmap(r, len + HUGE_SIZE);
+        return p;
+    }
+    if (a > r) munmap(r, a - r);
+    if (r + len + HUGE_SIZE > a + len) munmap(a + len, r + len + HUGE_SIZE - (a + len));
+    // 只有支持共享文件映射大页的文件系统（如 tmpfs）才会真的用上
+    if (madvise(p, disk.FILESIZE, MADV_HUGEPAGE) < 0) Warn("Transparent huge pages are not available: %s", strerror(errno));
+    return p;
+}
+
+// auto 时记下一次请求，每满一个窗口重新判断访问模式；连续时保持前面 PREFETCH 字节已经提示过 WILLNEED
+static void observe(long s, int n) {
+    if (map_advice != ADVICE_AUTO) return;
+    pattern.nseq += s == pattern.next;
+    pattern.next = s + n;
+    if (++pattern.nreq == ADVICE_WINDOW) {
+        int a = pattern.nseq >= ADVICE_WINDOW * 3 / 4 ? ADVICE_SEQUENTIAL
+                : pattern.nseq <= ADVICE_WINDOW / 4   ? ADVICE_RANDOM
+                                                      : ADVICE_NORMAL;
+        if (a != pattern.current) {
+            advise(0, disk.FILESIZE, a);
+            Log("Access pattern looks %s (%d of %d requests continued the previous one)", advice_names[a],
+                pattern.nseq, ADVICE_WINDOW);
+            pattern.current = a;
+        }
+        pattern.nreq = pattern.nseq = 0;
+    }
+    if (pattern.current != ADVICE_SEQUENTIAL) return;
+    long end = (s + n) * BLOCKSIZE;
+    if (end > pattern.ahead || pattern.ahead - end > PREFETCH) pattern.ahead = end;  // 新的一段连续流
+    if (pattern.ahead - end < PREFETCH / 2 && pattern.ahead < disk.FILESIZE) {
+        long to = end + PREFETCH < disk.FILESIZE ? end + PREFETCH : disk.FILESIZE;
+        advise(pattern.ahead, to - pattern.ahead, ADVICE_WILLNEED);
+        pattern.ahead = to;
+    }
+}
+
+// 共用数据的情况：有数据的块数 / 实际存的份数
+static void log_dedup() {
+    long chunks, copies;
+    unsigned long hits;
+    zimg_dedup_stats(&chunks, &copies, &hits);
+    Log("Deduplication: %ld chunk(s) share %ld stored cop%s (%.2fx), %lu write(s) found their data already stored",
+        chunks, copies, copies == 1 ? "y" : "ies", copies ? (double)chunks / copies : 1.0, hits);
+}
+
 // 磁盘初始化
 int init_disk(char *filename, int ncyl, int nsec, int ttd) {
     disk._ncyl = ncyl;
     disk._nsec = nsec;
     disk.ttd = ttd;
+    disk.backend = next_backend;
+    cur_cyl = 0;
+    vclock = timing == TIMING_SIM ? 0 : now_us();
+    busy = 0;
     // do some initialization...
 
     // open file
@@ -39,25 +454,184 @@ int init_disk(char *filename, int ncyl, int nsec, int ttd) {
         exit(EXIT_FAILURE);
     }
     // stretch the file
-    disk.FILESIZE = BLOCKSIZE * disk._ncyl * disk._nsec;
+    disk.FILESIZE = (long)BLOCKSIZE * disk._ncyl * disk._nsec;
     // 原先的lseek方法操作会报错
-    if (ftruncate(disk.fd, disk.FILESIZE) < 0) {
+    if (disk.backend == DISK_LZ) {
+        // 压缩镜像的大小和磁盘大小无关，只在文件里记下扇区数
+        if (zimg_open(disk.fd, disk.FILESIZE / BLOCKSIZE, next_dedup) < 0) {
+            close(disk.fd);
+            disk.fd = -1;
+            return -1;
+        }
+    } else if (ftruncate(disk.fd, disk.FILESIZE) < 0) {
         Log("Error calling ftruncate() to stretch the file: %s", strerror(errno));
         close(disk.fd);
         return -1;
     }
-    // mmap
-    disk.diskfile = (char *) mmap(NULL, disk.FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, disk.fd, 0);
-    if (disk.diskfile == MAP_FAILED) {
-        close(disk.fd);
-        Log("Could not map file: %s", strerror(errno));
-        exit(EXIT_FAILURE);
+    if (next_dedup && disk.backend != DISK_LZ) Warn("Deduplication needs the lz backend, writing every copy");
+    scan_holes();
+
+    if (disk.backend == DISK_DIRECT) {
+        // 绕过页缓存：重新以 O_DIRECT 打开，文件系统不支持时退回 pread/pwrite
+        int fd = open(filename, O_RDWR | O_DIRECT);
+        if (fd < 0 || posix_memalign((void **)&disk.bounce, DIRECT_ALIGN, DIRECT_BUFSIZE) != 0) {
+            Warn("O_DIRECT is not available for %s (%s), using pread/pwrite", filename, strerror(errno));
+            if (fd >= 0) close(fd);
+            disk.backend = DISK_PIO;
+        } else {
+            close(disk.fd);
+            disk.fd = fd;
+            // 文件补齐到 DIRECT_ALIGN，最后一个不完整的对齐块也能整块读写；多出的部分不属于磁盘
+            long aligned = (disk.FILESIZE + DIRECT_ALIGN - 1) & ~(long)(DIRECT_ALIGN - 1);
+            if (aligned != disk.FILESIZE && ftruncate(disk.fd, aligned) < 0)
+                Warn("Could not pad the image to %d bytes: %s", DIRECT_ALIGN, strerror(errno));
+        }
+    }
+    if (disk.backend == DISK_URING && uring_init(URING_DEPTH) < 0) {
+        Warn("io_uring is not available, using pread/pwrite");
+        disk.backend = DISK_PIO;
+    }
+    if (disk.backend == DISK_MMAP) {
+        double t0 = now_us();
+        disk.diskfile = map_image();
+        if (disk.diskfile == MAP_FAILED) {
+            close(disk.fd);
+            Log("Could not map file: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        pattern = (struct pattern){ADVICE_NORMAL, -1, 0, 0, 0};
+        if (map_advice != ADVICE_NORMAL && map_advice != ADVICE_AUTO) {
+            advise(0, disk.FILESIZE, map_advice);
+            pattern.current = map_advice;
+        }
+        Log("Mapped the image in %.1f ms: advice %s%s%s", (now_us() - t0) / 1000, advice_names[map_advice],
+            map_huge ? ", huge pages" : "", map_populate ? ", populated" : "");
+    } else if (map_advice != ADVICE_NORMAL || map_huge || map_populate) {
+        Warn("Mapping options only apply to the mmap backend");
+    }
+
+    if (open_checksums(filename) < 0) {
+        close_disk();
+        return -1;
     }
 
-    Log("Disk initialized: %s, %d Cylinders, %d Sectors per cylinder", filename, ncyl, nsec);
+    dirty = 0;
+    if (sync_policy == SYNC_PERIODIC) {
+        sync_running = 1;
+        pthread_create(&sync_thread, NULL, sync_loop, NULL);
+    }
+    Log("Disk initialized: %s, %d Cylinders, %d Sectors per cylinder, %s backend, sync %s, %.1f of %.1f MB allocated, "
+        "checksums %s",
+        filename, ncyl, nsec, disk_backend(), disk_sync_policy(), disk_allocated() * 512 / 1e6, disk.FILESIZE / 1e6,
+        crc_table ? "on" : "off");
+    if (disk.backend == DISK_LZ) {
+        long stored, file;
+        zimg_usage(&stored, &file);
+        Log("Compressed image: %.1f MB of chunks stored in %.1f MB, file is %.1f MB, deduplication %s",
+            disk_allocated() * 512 / 1e6, stored / 1e6, file / 1e6, next_dedup ? "on" : "off");
+        log_dedup();
+    }
     return 0;
 }
 
+/*--------------- 各后端的扇区读写 ---------------------*/
+// 读写[off, off + len)的全部内容，被信号打断或只完成一部分时继续
+static int pio(int write, long off, size_t len, char *buf) {
+    while (len > 0) {
+        ssize_t n = write ? pwrite(disk.fd, buf, len, off) : pread(disk.fd, buf, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            Error("%s at offset %ld failed: %s", write ? "pwrite" : "pread", off, n < 0 ? strerror(errno) : "end of file");
+            return -1;
+        }
+        off += n;
+        len -= n;
+        buf += n;
+    }
+    return 0;
+}
+
+// 读对齐的区域，读到文件末尾时剩下的部分填零：镜像不是 DIRECT_ALIGN 的整数倍时最后一块只有一部分
+static int direct_read(long off, size_t len, char *buf) {
+    while (len > 0) {
+        ssize_t n = pread(disk.fd, buf, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            Error("pread at offset %ld failed: %s", off, strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            memset(buf, 0, len);
+            return 0;
+        }
+        off += n;
+        len -= n;
+        buf += n;
+    }
+    return 0;
+}
+
+// O_DIRECT 要求偏移、长度和缓冲区都按 DIRECT_ALIGN 对齐：
+// 读出覆盖这段扇区的对齐区域，写入时先改缓冲区里的那一段再整体写回
+static int direct(int write, long off, size_t len, char *buf) {
+    long lo = off & ~(long)(DIRECT_ALIGN - 1);
+    long hi = (off + len + DIRECT_ALIGN - 1) & ~(long)(DIRECT_ALIGN - 1);
+    int whole = write && lo == off && hi == off + (long)len;  // 整块覆盖时不用先读
+    if (!whole && direct_read(lo, hi - lo, disk.bounce) < 0) return -1;
+    if (!write) {
+        memcpy(buf, disk.bounce + (off - lo), len);
+        return 0;
+    }
+    memcpy(disk.bounce + (off - lo), buf, len);
+    return pio(1, lo, hi - lo, disk.bounce);
+}
+
+// 用当前的后端读写从第s个扇区开始的n个扇区
+static int backend_io(int write, long s, int n, char *buf) {
+    long off = (long)BLOCKSIZE * s;
+    size_t len = (size_t)BLOCKSIZE * n;
+    switch (disk.backend) {
+        case DISK_URING:
+            // 同步请求要排在已经排队的请求之后；单个请求走 io_uring 也是一次系统调用，直接 pread/pwrite
+            disk_complete();
+            return pio(write, off, len, buf);
+        case DISK_PIO: return pio(write, off, len, buf);
+        case DISK_DIRECT: return direct(write, off, len, buf);
+        case DISK_LZ: return zimg_io(write, s, n, buf);
+        default:
+            observe(s, n);
+            if (write) memcpy(&disk.diskfile[off], buf, len);
+            else memcpy(buf, &disk.diskfile[off], len);
+            return 0;
+    }
+}
+
+// 读从第s个扇区开始的n个扇区，空的块直接填零，其余的连成段交给后端
+static int sparse_read(long s, int n, char *buf) {
+    long end = s + n;
+    while (s < end) {
+        int used = chunk_used(s / CHUNK_SECS) != 0;
+        long e = s;
+        while (e < end && (chunk_used(e / CHUNK_SECS) != 0) == used) e = (e / CHUNK_SECS + 1) * CHUNK_SECS;
+        if (e > end) e = end;
+        if (!used) memset(buf, 0, (e - s) * BLOCKSIZE);
+        else if (backend_io(0, s, e - s, buf) < 0) return -1;
+        buf += (e - s) * BLOCKSIZE;
+        s = e;
+    }
+    return 0;
+}
+
+// 读写从第s个扇区开始的n个扇区，读出的扇区要和校验和对得上；write 策略下写完就同步
+static int sect_io(int write, long s, int n, char *buf) {
+    if (!write) return sparse_read(s, n, buf) < 0 ? -1 : crc_verify(s, n, buf);
+    if (backend_io(write, s, n, buf) < 0) return -1;
+    mark_used(s, n);
+    crc_update(s, n, buf);
+    written();
+    return sync_policy == SYNC_WRITE ? -sync_disk() : 0;
+}
+
 // 获取磁盘信息
 int cmd_i(int *ncyl, int *nsec) {
     // 获取磁盘信息
@@ -74,12 +648,11 @@ int cmd_r(int cyl, int sec, char *buf) {
         return 1;
     }
 
-    // 寻道
-    usleep(1000 * abs(cyl-cur_cyl) * disk.ttd); // 寻道时间
-    cur_cyl = cyl; // 更新柱面
+    // 寻道、旋转和传输的时间
+    service((long)cyl * disk._nsec + sec, 1);
 
     // 读数据并更新日志
-    memcpy(buf, &disk.diskfile[BLOCKSIZE * (cyl * disk._nsec + sec)], BLOCKSIZE);
+    if (sect_io(0, (long)cyl * disk._nsec + sec, 1, buf) < 0) return 1;
     Log("Read sector: cyl=%d, sec=%d", cyl, sec);
     return 0;
 }
@@ -97,29 +670,202 @@ int cmd_w(int cyl, int sec, int len, char *data) {
     }
 
     // 寻道
-    off_t offset = BLOCKSIZE * (cyl * disk._nsec + sec);
-    usleep(1000 * abs(cyl-cur_cyl) * disk.ttd); // 寻道时间
-    cur_cyl = cyl; // 更新柱面
+    off_t offset = (off_t)BLOCKSIZE * ((long)cyl * disk._nsec + sec);
+    service(offset / BLOCKSIZE, 1);  // 寻道、旋转和传输的时间
 
     if (offset + BLOCKSIZE > disk.FILESIZE) {
         Log("Offset out of bound: offset=%ld, file size=%ld", offset, disk.FILESIZE);
         return 1;
     }
 
-    // 写数据并更新日志
-    memcpy(&disk.diskfile[offset], data, len);
-    if (len < BLOCKSIZE) {
-        memset(&disk.diskfile[offset + len], 0, BLOCKSIZE - len);
-    }
+    // 写数据并更新日志，不足一个扇区的部分补零
+    char sector[BLOCKSIZE];
+    memcpy(sector, data, len);
+    memset(sector + len, 0, BLOCKSIZE - len);
+    if (sect_io(1, offset / BLOCKSIZE, 1, sector) < 0) return 1;
     Log("Wrote sector: cyl:%d, sec=%d, len=%d", cyl, sec, len);
     return 0;
 }
 
+// 检查从(cyl, sec)开始的n个连续扇区是否都在磁盘内，返回第一个扇区的线性编号，非法时返回-1
+static long run_start(int cyl, int sec, int n) {
+    if (cyl >= disk._ncyl || sec >= disk._nsec || cyl < 0 || sec < 0 || n <= 0 || n > MAXRUN) {
+        Log("Invalid sector run: cyl=%d, sec=%d, n=%d", cyl, sec, n);
+        return -1;
+    }
+    long s = (long)cyl * disk._nsec + sec;
+    if (s + n > (long)disk._ncyl * disk._nsec) {
+        Log("Sector run out of bound: cyl=%d, sec=%d, n=%d", cyl, sec, n);
+        return -1;
+    }
+    return s;
+}
+
+// 连续读n个扇区
+int cmd_rn(int cyl, int sec, int n, char *buf) {
+    long s = run_start(cyl, sec, n);
+    if (s < 0) return 1;
+    service(s, n);
+    if (sect_io(0, s, n, buf) < 0) return 1;
+    Log("Read %d sector(s): cyl=%d, sec=%d", n, cyl, sec);
+    return 0;
+}
+
+// 连续写n个扇区
+int cmd_wn(int cyl, int sec, int n, char *data) {
+    long s = run_start(cyl, sec, n);
+    if (s < 0) return 1;
+    service(s, n);
+    if (sect_io(1, s, n, data) < 0) return 1;
+    Log("Wrote %d sector(s): cyl=%d, sec=%d", n, cyl, sec);
+    return 0;
+}
+
+// 丢弃：让从(cyl, sec)开始的n个扇区读出全零，并尽量把它们占的空间还给文件系统。
+// 在镜像里打洞，文件系统不支持时写零
+int cmd_d(int cyl, int sec, long n) {
+    if (cyl >= disk._ncyl || sec >= disk._nsec || cyl < 0 || sec < 0 || n <= 0 ||
+        (long)cyl * disk._nsec + sec + n > (long)disk._ncyl * disk._nsec) {
+        Log("Invalid discard: cyl=%d, sec=%d, n=%ld", cyl, sec, n);
+        return 1;
+    }
+    disk_complete();  // 排队的写不能落在洞里
+    long s = (long)cyl * disk._nsec + sec;
+    if (disk.backend == DISK_LZ) {
+        if (zimg_discard(s, n) < 0) return 1;
+    } else if (fallocate(disk.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, s * BLOCKSIZE, n * BLOCKSIZE) < 0) {
+        Warn("Could not punch a hole (%s), writing zeros", strerror(errno));
+        static char zero[MAXRUN * 512];
+        for (long i = 0; i < n; i += MAXRUN)
+            if (backend_io(1, s + i, n - i < MAXRUN ? n - i : MAXRUN, zero) < 0) return 1;
+    }
+    mark_free(s, n);
+    if (crc_table) memset(&crc_table[s], 0, n * sizeof(uint32_t));
+    written();
+    Log("Discarded %ld sector(s): cyl=%d, sec=%d", n, cyl, sec);
+    return 0;
+}
+
+/*--------------- 排队的异步请求 ---------------------*/
+// uring 后端下排队、还没完成的请求，下标就是交给 io_uring 的 tag
+static struct aio {
+    int write;
+    long off;
+    size_t len;
+    char *buf;
+    disk_done done;
+    void *arg;
+    int finished;
+} aios[URING_DEPTH];
+static int naio;
+
+// 一个请求完成：没读写完整（或内核不支持这种操作）时用 pread/pwrite 把剩下的补上
+static void aio_done(unsigned long tag, int res) {
+    struct aio *a = &aios[tag];
+    size_t done = res > 0 ? res : 0;
+    int status = 0;
+    if (done < a->len) {
+        if (res < 0) Warn("io_uring %s at offset %ld failed: %s, retrying", a->write ? "write" : "read", a->off,
+                          strerror(-res));
+        status = pio(a->write, a->off + done, a->len - done, a->buf + done) < 0;
+    }
+    if (status == 0 && a->write) {
+        crc_update(a->off / BLOCKSIZE, a->len / BLOCKSIZE, a->buf);
+        written();
+    }
+    if (status == 0 && !a->write) status = crc_verify(a->off / BLOCKSIZE, a->len / BLOCKSIZE, a->buf) < 0;
+    a->finished = 1;
+    a->done(a->arg, status);
+}
+
+void disk_complete() {
+    if (disk.backend != DISK_URING || naio == 0) return;
+    if (uring_wait(aio_done) < 0) {
+        // 环已经不可用：没有完成的请求同步做完，之后都用 pread/pwrite
+        for (int i = 0; i < naio; i++)
+            if (!aios[i].finished) aio_done(i, 0);
+        Warn("Switching to pread/pwrite");
+        uring_exit();
+        disk.backend = DISK_PIO;
+    }
+    naio = 0;
+    // write 策略下一批写只同步一次，disk_complete 返回时都已落盘
+    if (sync_policy == SYNC_WRITE) sync_disk();
+}
+
+// 屏障：之前写入的数据都已落盘后才返回；none 策略下不做任何事
+int cmd_f() {
+    disk_complete();
+    if (sync_policy == SYNC_NONE) return 0;
+    return sync_disk();
+}
+
+// 排队读写从第s个扇区开始的n个扇区，耗时在入队时按请求的顺序计算
+static int queue_run(int write, int cyl, int sec, int n, char *buf, disk_done done, void *arg) {
+    long s = run_start(cyl, sec, n);
+    if (s < 0) return 1;
+    service(s, n);
+    if (disk.backend != DISK_URING || (!write && run_empty(s, n))) {
+        done(arg, sect_io(write, s, n, buf) < 0);
+        return 0;
+    }
+    // 同一批里的请求可能同时进行：和排队的写（或这是写时和排队的读）重叠时先把前面的做完
+    long off = (long)BLOCKSIZE * s;
+    size_t len = (size_t)BLOCKSIZE * n;
+    for (int i = 0; i < naio; i++)
+        if ((write || aios[i].write) && off < aios[i].off + (long)aios[i].len && aios[i].off < off + (long)len) {
+            disk_complete();
+            break;
+        }
+    if (naio == URING_DEPTH) disk_complete();
+    struct aio *a = &aios[naio];
+    *a = (struct aio){write, off, len, buf, done, arg, 0};
+    if (write) mark_used(s, n);  // 之后排队的读要真的去读这些块
+    uring_queue(write, disk.fd, buf, a->len, a->off, naio);
+    naio++;
+    return 0;
+}
+
+int cmd_rn_async(int cyl, int sec, int n, char *buf, disk_done done, void *arg) {
+    if (queue_run(0, cyl, sec, n, buf, done, arg)) return 1;
+    Log("Queued read of %d sector(s): cyl=%d, sec=%d", n, cyl, sec);
+    return 0;
+}
+
+int cmd_wn_async(int cyl, int sec, int n, char *data, disk_done done, void *arg) {
+    if (queue_run(1, cyl, sec, n, data, done, arg)) return 1;
+    Log("Queued write of %d sector(s): cyl=%d, sec=%d", n, cyl, sec);
+    return 0;
+}
+
 // 关闭磁盘
 void close_disk() {
+    disk_complete();
+    if (sync_running) {
+        pthread_mutex_lock(&sync_lock);
+        sync_running = 0;
+        pthread_cond_signal(&sync_cond);
+        pthread_mutex_unlock(&sync_lock);
+        pthread_join(sync_thread, NULL);
+    }
+    if (sync_policy != SYNC_NONE) sync_disk();
+    if (disk.backend == DISK_URING) uring_exit();
+    if (disk.backend == DISK_LZ) {
+        log_dedup();
+        zimg_close();
+    }
     // close the file
     if (disk.diskfile != MAP_FAILED)
         munmap(disk.diskfile, disk.FILESIZE);
+    disk.diskfile = MAP_FAILED;
+    free(disk.bounce);
+    disk.bounce = NULL;
     if (disk.fd >= 0)
         close(disk.fd);
-}
\ No newline at end of file
+    disk.fd = -1;
+    free(alloc_map);
+    alloc_map = NULL;
+    nchunk = 0;
+    if (crc_table) munmap(crc_table, crc_size);
+    crc_table = NULL;
+}
@@ -0,0 +1,92 @@
+#define _GNU_SOURCE  // SEEK_DATA / SEEK_HOLE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*------------------------------------------------------------
+ *  稀疏感知的镜像复制
+ *    用 SEEK_DATA / SEEK_HOLE 跳过源镜像里的空洞，只读有数据的区段；
+ *    数据区段里整块（4KB）为零的部分也不写，目标镜像里留成空洞。
+ *    目标文件最后 ftruncate 成源文件的大小，没写过的地方都是空洞。
+ *-----------------------------------------------------------*/
+
+#define CHUNK 4096
+#define COPYBUF (1 << 20)
+
+static int is_zero(const char *p, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        if (p[i]) return 0;
+    return 1;
+}
+
+// 复制[off, end)这一段有数据的区段，返回实际写入的字节数，出错时返回-1
+static long copy_extent(int in, int out, off_t off, off_t end, char *buf) {
+    long written = 0;
+    while (off < end) {
+        size_t want = end - off < COPYBUF ? end - off : COPYBUF;
+        ssize_t n = pread(in, buf, want, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        for (ssize_t i = 0; i < n; i += CHUNK) {
+            size_t len = n - i < CHUNK ? n - i : CHUNK;
+            if (is_zero(buf + i, len)) continue;
+            if (pwrite(out, buf + i, len, off + i) != (ssize_t)len) return -1;
+            written += len;
+        }
+        off += n;
+    }
+    return written;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <source image> <destination image>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    int in = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", argv[1], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    // 先截成 0 再扩展：目标里原有的数据不能留下来
+    int out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0 || ftruncate(out, st.st_size) < 0) {
+        fprintf(stderr, "Could not create %s: %s\n", argv[2], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    char *buf = malloc(COPYBUF);
+    long total = 0;
+    off_t data = 0, hole;
+    while ((data = lseek(in, data, SEEK_DATA)) >= 0 && data < st.st_size) {
+        hole = lseek(in, data, SEEK_HOLE);
+        if (hole < 0) hole = st.st_size;
+        long n = copy_extent(in, out, data, hole, buf);
+        if (n < 0) {
+            fprintf(stderr, "Copy failed at offset %ld: %s\n", (long)data, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        total += n;
+        data = hole;
+    }
+    // 不支持 SEEK_DATA 时整个文件当作一个数据区段
+    if (data < 0 && errno != ENXIO) {
+        long n = copy_extent(in, out, 0, st.st_size, buf);
+        if (n < 0) {
+            fprintf(stderr, "Copy failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        total = n;
+    }
+    if (fsync(out) < 0) fprintf(stderr, "fsync %s: %s\n", argv[2], strerror(errno));
+    printf("Copied %.1f of %.1f MB\n", total / 1e6, st.st_size / 1e6);
+    free(buf);
+    close(in);
+    close(out);
+    return 0;
+}
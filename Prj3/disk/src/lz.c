@@ -0,0 +1,125 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*------------------------------------------------------------
+ *  LZ4 块格式的压缩和解压
+ *    每个序列是：token（高 4 位字面量长度，低 4 位匹配长度 - 4，等于 15 时后面
+ *    跟延伸字节，每个 255 表示还有下一个）、字面量、2 字节小端的匹配距离、
+ *    匹配长度的延伸字节。最后一个序列只有字面量。
+ *    压缩时用哈希表记下每个 4 字节序列最近出现的位置，贪心地取第一个匹配；
+ *    和 LZ4 一样，最后 5 个字节总是字面量，最后 12 个字节里不开始新的匹配。
+ *    解压时检查所有长度和距离，损坏的数据只会返回 -1。
+ *-----------------------------------------------------------*/
+
+#define HASH_BITS 12
+#define MINMATCH 4
+#define LAST_LITERALS 5
+#define MFLIMIT 12
+#define MAXDIST 65535
+
+static uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static int hash(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+
+// token 里放不下的长度：每个 255 表示还有下一个字节
+static char *put_len(char *op, int len) {
+    for (; len >= 255; len -= 255) *op++ = (char)255;
+    *op++ = len;
+    return op;
+}
+
+// 写出一个序列：anchor 开始的 lit 个字面量，之后（len > 0 时）距离 off、长度 len 的匹配。放不下时返回 NULL
+static char *put_seq(char *op, char *oend, const char *anchor, int lit, int off, int len) {
+    if (oend - op < 1 + lit / 255 + 1 + lit + (len ? 2 + len / 255 + 1 : 0)) return NULL;
+    char *token = op++;
+    int t = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) op = put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    if (len) {
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        len -= MINMATCH;
+        t |= len >= 15 ? 15 : len;
+        if (len >= 15) op = put_len(op, len - 15);
+    }
+    *token = t;
+    return op;
+}
+
+int lz_compress(const char *src, int n, char *dst, int cap) {
+    int table[1 << HASH_BITS];
+    memset(table, -1, sizeof(table));
+    const char *ip = src, *anchor = src, *end = src + n;
+    char *op = dst, *oend = dst + cap;
+    if (n > MFLIMIT) {
+        const char *mflimit = end - MFLIMIT, *matchlimit = end - LAST_LITERALS;
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            int h = hash(seq), ref = table[h];
+            table[h] = ip - src;
+            if (ref < 0 || ip - src - ref > MAXDIST || read32(src + ref) != seq) {
+                ip++;
+                continue;
+            }
+            const char *m = src + ref;
+            int len = MINMATCH;
+            while (ip + len < matchlimit && ip[len] == m[len]) len++;
+            op = put_seq(op, oend, anchor, ip - anchor, ip - m, len);
+            if (!op) return 0;
+            ip += len;
+            anchor = ip;
+        }
+    }
+    op = put_seq(op, oend, anchor, end - anchor, 0, 0);
+    return op ? op - dst : 0;
+}
+
+// token 后面的延伸字节加到 len 上，数据不够时返回 -1
+static int get_len(const unsigned char **ip, const unsigned char *iend, int len) {
+    int b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int lz_decompress(const char *src, int n, char *dst, int cap) {
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + n;
+    char *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        int t = *ip++;
+        int lit = t >> 4;
+        if (lit == 15 && (lit = get_len(&ip, iend, lit)) < 0) return -1;
+        if (lit > iend - ip || lit > oend - op) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;  // 最后一个序列只有字面量
+
+        if (iend - ip < 2) return -1;
+        int off = ip[0] | ip[1] << 8;
+        ip += 2;
+        int len = t & 15;
+        if (len == 15 && (len = get_len(&ip, iend, len)) < 0) return -1;
+        len += MINMATCH;
+        if (off == 0 || off > op - dst || len > oend - op) return -1;
+        const char *m = op - off;
+        if (off >= len) {
+            memcpy(op, m, len);
+        } else {
+            // 和要写的部分重叠（重复的短模式），只能逐字节复制
+            for (int i = 0; i < len; i++) op[i] = m[i];
+        }
+        op += len;
+    }
+    return op - dst;
+}
@@ -64,6 +64,23 @@ int handle_w(char *args) {
     return 0;
 }
 
+int handle_f(char *args) {
+    printf(cmd_f() == 0 ? "Yes\n" : "No\n");
+    return 0;
+}
+
+int handle_d(char *args) {
+    int cyl, sec;
+    long n;
+    if (sscanf(args, "%d %d %ld", &cyl, &sec, &n) != 3) {
+        Log("Invalid command format for DISCARD: %s", args);
+        printf("No\n");
+        return 0;
+    }
+    printf(cmd_d(cyl, sec, n) == 0 ? "Yes\n" : "No\n");
+    return 0;
+}
+
 int handle_e(char *args) {
     printf("Bye!\n");
     return -1;
@@ -76,6 +93,8 @@ static struct {
     {"I", handle_i},
     {"R", handle_r},
     {"W", handle_w},
+    {"F", handle_f},
+    {"D", handle_d},
     {"E", handle_e},
 };
 
@@ -83,20 +102,46 @@ static struct {
 
 FILE *log_file;
 
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-b mmap|pio|direct|uring|lz] [-s none|periodic|write|flush] [-p <sync period ms>] "
+            "[-t block|async|sim] [-r <rpm>] [-c] [-d] [-a normal|random|sequential|willneed|auto] [-H] [-P] <disk file name> <cylinders> <sector per cylinder> "
+            "<track-to-track delay>\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 4) {
-        fprintf(stderr,
-                "Usage: %s <disk file name> <cylinders> <sector per cylinder> "
-                "<track-to-track delay>\n",
-                argv[0]);
-        exit(EXIT_FAILURE);
+    int opt;
+    char *policy = NULL, *timing = "block", *advice = "normal";
+    int period = 1000, rpm = 0, huge = 0, populate = 0;
+    while ((opt = getopt(argc, argv, "b:s:p:t:r:cda:HP")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (disk_set_backend(optarg) < 0) usage(argv[0]);
+                break;
+            case 's': policy = optarg; break;
+            case 'p': period = atoi(optarg); break;
+            case 't': timing = optarg; break;
+            case 'r': rpm = atoi(optarg); break;
+            case 'c': disk_set_checksum(1); break;
+            case 'd': disk_set_dedup(1); break;
+            case 'a': advice = optarg; break;
+            case 'H': huge = 1; break;
+            case 'P': populate = 1; break;
+            default: usage(argv[0]);
+        }
     }
+    if (argc - optind < 4) usage(argv[0]);
+    if ((policy || period != 1000) && disk_set_sync(policy ? policy : disk_sync_policy(), period) < 0) usage(argv[0]);
+    if (disk_set_timing(timing, rpm) < 0) usage(argv[0]);
+    if (disk_set_mapping(advice, huge, populate) < 0) usage(argv[0]);
 
     // args
-    char *filename = argv[1];
-    int ncyl = atoi(argv[2]);
-    int nsec = atoi(argv[3]);
-    int ttd = atoi(argv[4]);  // ms
+    char *filename = argv[optind];
+    int ncyl = atoi(argv[optind + 1]);
+    int nsec = atoi(argv[optind + 2]);
+    int ttd = atoi(argv[optind + 3]);  // ms
 
     log_init("disk.log");
 
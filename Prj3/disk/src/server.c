@@ -1,11 +1,15 @@
+#include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "crc32c.h"
 #include "disk.h"
 #include "log.h"
 #include "tcp_utils.h"
+#include "wheel.h"
 
 static const int BLOCKSIZE = 512;
 
@@ -20,23 +24,132 @@ int handle_i(tcp_buffer *wb, char *args, int len) {
     return 0;
 }
 
+/*------------------------------------------------------------
+ *  读写请求先排队，再按请求的顺序回复
+ *    R/X/W/RN/RC/WN 交给 disk 的异步接口，每个请求的回复放在它自己的缓冲区里，
+ *    读到的数据直接落在回复的 "Yes " 后面。一批消息处理完（on_batch）、
+ *    排队的请求太多或回复快装不下写缓冲区时，disk_complete 一次提交并等待
+ *    全部完成，再把回复依次写进写缓冲区。uring 后端下请求可以乱序完成，
+ *    其余后端在入队时就已经完成。
+ *    F（屏障）也排队：同一批里的几个屏障在完成排队的请求之后只同步一次。
+ *    async 时间模式下，还没到模拟的完成时间的回复交给时间轮推迟发出，
+ *    服务线程不睡，其他客户端的请求照常处理。
+ *    排队状态是全局的：BDS 只有一个工作线程，而且每批结束时都会清空。
+ *-----------------------------------------------------------*/
+#define MAXPENDING 256
+#define SYNC_ROOM 64  // 给 I、E 等不排队的命令留的写缓冲区空间
+
+static struct pending {
+    char *buf;  // 回复，"Yes " 之后是读写的数据
+    int len;    // 回复的字节数
+    int hex;    // X：读完后把数据转成十六进制
+    int crc;    // RC：数据后面跟着这么多个扇区的 CRC32C
+    int barrier;  // F：要等数据落盘
+    double due;   // 模拟的完成时间
+} pending[MAXPENDING];
+static int npending, pending_bytes, nbarrier;
+static int pending_id;  // 排队的请求来自哪个连接
+
+static tcp_server server;
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// 时间轮发送回复的方式
+static int try_send(int id, const char *msg, int len) { return server_try_send(server, id, msg, len); }
+
+// 把回复写进写缓冲区；async 模式下没到完成时间、或者这个连接还有推迟的回复时交给时间轮（接管buf）
+static void deliver(tcp_buffer *wb, char *buf, int len, double due) {
+    if (disk_timing() == TIMING_ASYNC && (due > now_us() || wheel_held(pending_id))) {
+        wheel_add(pending_id, buf, len, due);
+        return;
+    }
+    buffer_append(wb, buf, len);
+    free(buf);
+}
+
+static void fail(struct pending *p) {
+    memcpy(p->buf, "No ", 3);
+    p->len = 3;
+}
+
+// 完成所有排队的请求，有屏障时再同步一次，然后按顺序写回复
+static void flush_pending(tcp_buffer *wb) {
+    disk_complete();
+    int failed = 0;
+    if (nbarrier) {
+        failed = cmd_f();
+        Log("Flush: %d barrier(s) in one sync", nbarrier);
+    }
+    for (int i = 0; i < npending; i++) {
+        if (pending[i].barrier && failed) fail(&pending[i]);
+        deliver(wb, pending[i].buf, pending[i].len, pending[i].due);
+    }
+    npending = pending_bytes = nbarrier = 0;
+}
+
+// 排队一个有size字节数据区（从 buf + 4 开始）、成功时回复len字节的请求
+static struct pending *new_pending(tcp_buffer *wb, int size, int len) {
+    if (npending == MAXPENDING || pending_bytes + len + 4 > TCP_BUF_SIZE - SYNC_ROOM) flush_pending(wb);
+    struct pending *p = &pending[npending++];
+    p->buf = malloc(4 + size);
+    memcpy(p->buf, "Yes ", 4);
+    p->len = len;
+    p->hex = 0;
+    p->crc = 0;
+    p->barrier = 0;
+    p->due = 0;
+    pending_bytes += len + 4;
+    return p;
+}
+
+// 格式错误的请求也要排队，它的回复才不会跑到前面的请求之前
+static int reject(tcp_buffer *wb) {
+    fail(new_pending(wb, 0, 3));
+    return 0;
+}
+
+static void io_done(void *arg, int status) {
+    struct pending *p = arg;
+    if (status) {
+        fail(p);
+        return;
+    }
+    if (p->hex) {
+        // 扇区读在数据区的后半部分，从前往后转换时写入的位置不会超过还没读的字节
+        static const char digits[] = "0123456789abcdef";
+        char *out = p->buf + 4;
+        unsigned char *in = (unsigned char *)out + BLOCKSIZE;
+        for (int i = 0; i < BLOCKSIZE; i++) {
+            unsigned char c = in[i];
+            out[2 * i] = digits[c >> 4];
+            out[2 * i + 1] = digits[c & 15];
+        }
+    }
+    // 开了校验和时数据已经和表核对过，这里算出的就是写入时的 CRC
+    for (int i = 0; i < p->crc; i++) {
+        uint32_t crc = htonl(crc32c(0, p->buf + 4 + i * BLOCKSIZE, BLOCKSIZE));
+        memcpy(p->buf + 4 + p->crc * BLOCKSIZE + i * 4, &crc, 4);
+    }
+}
+
 int handle_r(tcp_buffer *wb, char *args, int len) {
     int cyl;
     int sec;
-    char buf[512];
 
     // 解析参数
     if (sscanf(args, "%d %d", &cyl, &sec) != 2) {
         Log("Invalid command format for READ: %s", args);
-        reply_with_no(wb, NULL, 0);
-        return 0;
-    }
-    
-    // 调用读取，回复消息
-    if (cmd_r(cyl, sec, buf) == 0)
-        reply_with_yes(wb, buf, 512);
-    else
-        reply_with_no(wb, "No", 3);
+        return reject(wb);
+    }
+
+    // 排队读取，数据直接读进回复
+    struct pending *p = new_pending(wb, BLOCKSIZE, 4 + BLOCKSIZE);
+    if (cmd_rn_async(cyl, sec, 1, p->buf + 4, io_done, p) != 0) fail(p);
+    p->due = disk_clock();
     return 0;
 }
 
@@ -44,31 +157,18 @@ int handle_r(tcp_buffer *wb, char *args, int len) {
 int handle_rx(tcp_buffer *wb, char *args, int len) {
     int cyl;
     int sec;
-    char buf[512];
 
     // 解析参数
     if (sscanf(args, "%d %d", &cyl, &sec) != 2) {
         Log("Invalid command format for READ: %s", args);
-        reply_with_no(wb, NULL, 0);
-        return 0;
-    }
-
-    // 调用读取，回复消息
-    if (cmd_r(cyl, sec, buf) == 0) {
-        // 构造回复消息：将字节数组转换为十六进制字符串
-        char response[512 * 2 + 1];  // 加1留给null terminator
-        char *ptr = response;
-
-        for (int i = 0; i < 512; i++) {
-            ptr += sprintf(ptr, "%02x", (unsigned char)buf[i]);
-        }
-
-        // 安全地返回字符串，长度为实际字符长度（1024）
-        reply_with_yes(wb, response, strlen(response));
-    } else {
-        reply_with_no(wb, NULL, 0);
+        return reject(wb);
     }
 
+    // 回复是 1024 个十六进制字符（不含结尾的 null）
+    struct pending *p = new_pending(wb, 2 * BLOCKSIZE, 4 + 2 * BLOCKSIZE);
+    p->hex = 1;
+    if (cmd_rn_async(cyl, sec, 1, p->buf + 4 + BLOCKSIZE, io_done, p) != 0) fail(p);
+    p->due = disk_clock();
     return 0;
 }
 
@@ -82,23 +182,110 @@ int handle_w(tcp_buffer *wb, char *args, int len) {
     // 解析参数，检验合法性
     if(sscanf(args, "%d %d %d", &cyl, &sec, &datalen) != 3) {
         Log("Invalid command format for WRITE: %s", args);
-        reply(wb, "No", 3);
-        return 0;
+        return reject(wb);
     }
-    if (datalen < 0 || datalen > BLOCKSIZE) {
+    if (datalen <= 0 || datalen > BLOCKSIZE) {
         Log("Invalid data length: %d (must be 1-512)", datalen);
-        reply_with_no(wb, NULL, 0);
-        return 0;
+        return reject(wb);
     }
     data = args;
     for (int i = 0; i < 3; i++)
         data = strchr(data, ' ') + 1;
 
-    // 调用写入，回复消息
-    if (cmd_w(cyl, sec, datalen, data) == 0)
-        reply(wb, "Yes", 4);
-    else
-        reply_with_no(wb, NULL, 0);
+    // 数据拷进请求自己的缓冲区，不足一个扇区的部分补零
+    struct pending *p = new_pending(wb, BLOCKSIZE, 4);
+    memcpy(p->buf, "Yes", 4);
+    memcpy(p->buf + 4, data, datalen);
+    memset(p->buf + 4 + datalen, 0, BLOCKSIZE - datalen);
+    if (cmd_wn_async(cyl, sec, 1, p->buf + 4, io_done, p) != 0) fail(p);
+    p->due = disk_clock();
+    return 0;
+}
+
+// RN cyl sec n：连续读n个扇区，一次回复
+int handle_rn(tcp_buffer *wb, char *args, int len) {
+    int cyl, sec, n;
+
+    if (sscanf(args, "%d %d %d", &cyl, &sec, &n) != 3) {
+        Log("Invalid command format for READ RUN: %s", args);
+        return reject(wb);
+    }
+    if (n <= 0 || n > MAXRUN) {
+        Log("Invalid sector count for READ RUN: %d", n);
+        return reject(wb);
+    }
+    struct pending *p = new_pending(wb, n * BLOCKSIZE, 4 + n * BLOCKSIZE);
+    if (cmd_rn_async(cyl, sec, n, p->buf + 4, io_done, p) != 0) fail(p);
+    p->due = disk_clock();
+    return 0;
+}
+
+// RC cyl sec n：和 RN 一样，数据后面再跟上每个扇区的 CRC32C（各 4 字节，网络字节序），供客户端核对
+int handle_rc(tcp_buffer *wb, char *args, int len) {
+    int cyl, sec, n;
+
+    if (sscanf(args, "%d %d %d", &cyl, &sec, &n) != 3) {
+        Log("Invalid command format for READ RUN: %s", args);
+        return reject(wb);
+    }
+    if (n <= 0 || n > MAXRUN) {
+        Log("Invalid sector count for READ RUN: %d", n);
+        return reject(wb);
+    }
+    struct pending *p = new_pending(wb, n * (BLOCKSIZE + 4), 4 + n * (BLOCKSIZE + 4));
+    p->crc = n;
+    if (cmd_rn_async(cyl, sec, n, p->buf + 4, io_done, p) != 0) fail(p);
+    p->due = disk_clock();
+    return 0;
+}
+
+// WN cyl sec n data：连续写n个扇区，data是紧跟在第三个空格后的n * 512字节
+int handle_wn(tcp_buffer *wb, char *args, int len) {
+    int cyl, sec, n;
+    if (sscanf(args, "%d %d %d", &cyl, &sec, &n) != 3) {
+        Log("Invalid command format for WRITE RUN: %s", args);
+        return reject(wb);
+    }
+    char *data = args;
+    for (int i = 0; i < 3; i++)
+        data = strchr(data, ' ') + 1;
+    if (n <= 0 || n > MAXRUN || args + len - data < (long)n * BLOCKSIZE) {
+        Log("Invalid data length for WRITE RUN: %d sector(s)", n);
+        return reject(wb);
+    }
+
+    // 读缓冲区在这条消息之后可能被挪动，数据要拷出来
+    struct pending *p = new_pending(wb, n * BLOCKSIZE, 4);
+    memcpy(p->buf, "Yes", 4);
+    memcpy(p->buf + 4, data, n * BLOCKSIZE);
+    if (cmd_wn_async(cyl, sec, n, p->buf + 4, io_done, p) != 0) fail(p);
+    p->due = disk_clock();
+    return 0;
+}
+
+// F：屏障，之前的写都落盘后才回复
+int handle_f(tcp_buffer *wb, char *args, int len) {
+    struct pending *p = new_pending(wb, 0, 4);
+    memcpy(p->buf, "Yes", 4);
+    p->barrier = 1;
+    p->due = disk_clock();
+    nbarrier++;
+    return 0;
+}
+
+// D cyl sec n：丢弃n个扇区（不受 MAXRUN 限制），之后读出全零
+int handle_d(tcp_buffer *wb, char *args, int len) {
+    int cyl, sec;
+    long n;
+    if (sscanf(args, "%d %d %ld", &cyl, &sec, &n) != 3) {
+        Log("Invalid command format for DISCARD: %s", args);
+        return reject(wb);
+    }
+    // 排在前面的读写先完成，之后的请求看到的已经是丢弃后的内容
+    struct pending *p = new_pending(wb, 0, 4);
+    memcpy(p->buf, "Yes", 4);
+    if (cmd_d(cyl, sec, n) != 0) fail(p);
+    p->due = disk_clock();
     return 0;
 }
 
@@ -111,12 +298,18 @@ int handle_e(tcp_buffer *wb, char *args, int len) {
 static struct {
     const char *name;
     int (*handler)(tcp_buffer *wb, char *, int);
+    int queued;  // 回复先排队；其余命令直接回复，之前要先把排队的回复写出去
 } cmd_table[] = {
-    {"I", handle_i},
-    {"R", handle_r},
-    {"X", handle_rx},
-    {"W", handle_w},
-    {"E", handle_e},
+    {"I", handle_i, 0},
+    {"R", handle_r, 1},
+    {"X", handle_rx, 1},
+    {"W", handle_w, 1},
+    {"RN", handle_rn, 1},
+    {"RC", handle_rc, 1},
+    {"WN", handle_wn, 1},
+    {"F", handle_f, 1},
+    {"D", handle_d, 1},
+    {"E", handle_e, 0},
 };
 
 #define NCMD (sizeof(cmd_table) / sizeof(cmd_table[0]))
@@ -126,17 +319,50 @@ void on_connection(int id) {
     // you don't need this now
 }
 
+// 把不排队的命令写在 later 里的回复依次交给时间轮，排在这个连接推迟的回复后面
+static void hold_replies(tcp_buffer *later) {
+    while (later->write_index - later->read_index >= 4) {
+        char *s = &later->buf[later->read_index];
+        int n = ntohl(*(int *)s);
+        char *msg = malloc(n);
+        memcpy(msg, s + 4, n);
+        wheel_add(pending_id, msg, n, 0);
+        later->read_index += n + 4;
+    }
+}
+
 int on_recv(int id, tcp_buffer *wb, char *msg, int len) {
+    static tcp_buffer later;
     char *p = strtok(msg, " \r\n");
-    int ret = 1;
+    int ret = 1, queued = 0;
+    pending_id = id;
     for (int i = 0; i < NCMD; i++)
         if (p && strcmp(p, cmd_table[i].name) == 0) {
-            ret = cmd_table[i].handler(wb, p + strlen(p) + 1, len - strlen(p) - 1);
+            queued = cmd_table[i].queued;
+            break;
+        }
+    // 不排队的命令直接回复，之前要先把排队的回复写出去；还有推迟的回复时这条也推迟
+    tcp_buffer *out = wb;
+    if (!queued) {
+        flush_pending(wb);
+        if (disk_timing() == TIMING_ASYNC && wheel_held(id)) {
+            later.read_index = later.write_index = 0;
+            out = &later;
+        }
+    }
+    for (int i = 0; i < NCMD; i++)
+        if (p && strcmp(p, cmd_table[i].name) == 0) {
+            ret = cmd_table[i].handler(out, p + strlen(p) + 1, len - strlen(p) - 1);
             break;
         }
     if (ret == 1) {
         static char unk[] = "Unknown command";
-        buffer_append(wb, unk, sizeof(unk));
+        buffer_append(out, unk, sizeof(unk));
+    }
+    if (out == &later) {
+        hold_replies(&later);
+        // 连接关闭会丢掉推迟的回复，E 就留给客户端收到 Bye! 后自己关
+        if (ret < 0) ret = 0;
     }
     if (ret < 0) {
         return -1;
@@ -144,28 +370,61 @@ int on_recv(int id, tcp_buffer *wb, char *msg, int len) {
     return 0;
 }
 
+// 一批消息处理完，完成排队的请求
+void on_batch(int id, tcp_buffer *wb) {
+    pending_id = id;
+    flush_pending(wb);
+}
+
 void cleanup(int id) {
-    // some code that are executed when a client is disconnected
-    // you don't need this now
+    // 连接已经断开，推迟的回复不用再发
+    if (disk_timing() == TIMING_ASYNC) wheel_drop(id);
+    Log("Disk busy for %.1f ms of modelled time so far", disk_busy() / 1000);
 }
 
 FILE *log_file;
 
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-b mmap|pio|direct|uring|lz] [-s none|periodic|write|flush] [-p <sync period ms>] "
+            "[-t block|async|sim] [-r <rpm>] [-c] [-d] [-a normal|random|sequential|willneed|auto] [-H] [-P] <disk file name> <cylinders> <sector per cylinder> "
+            "<track-to-track delay> <port>\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 5) {
-        fprintf(stderr,
-                "Usage: %s <disk file name> <cylinders> <sector per cylinder> "
-                "<track-to-track delay> <port>\n",
-                argv[0]);
-        exit(EXIT_FAILURE);
+    int opt;
+    char *policy = NULL, *timing = "block", *advice = "normal";
+    int period = 1000, rpm = 0, huge = 0, populate = 0;
+    while ((opt = getopt(argc, argv, "b:s:p:t:r:cda:HP")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (disk_set_backend(optarg) < 0) usage(argv[0]);
+                break;
+            case 's': policy = optarg; break;
+            case 'p': period = atoi(optarg); break;
+            case 't': timing = optarg; break;
+            case 'r': rpm = atoi(optarg); break;
+            case 'c': disk_set_checksum(1); break;
+            case 'd': disk_set_dedup(1); break;
+            case 'a': advice = optarg; break;
+            case 'H': huge = 1; break;
+            case 'P': populate = 1; break;
+            default: usage(argv[0]);
+        }
     }
+    if (argc - optind < 5) usage(argv[0]);
+    if ((policy || period != 1000) && disk_set_sync(policy ? policy : disk_sync_policy(), period) < 0) usage(argv[0]);
+    if (disk_set_timing(timing, rpm) < 0) usage(argv[0]);
+    if (disk_set_mapping(advice, huge, populate) < 0) usage(argv[0]);
 
     // args
-    char *filename = argv[1];
-    int ncyl = atoi(argv[2]);
-    int nsec = atoi(argv[3]);
-    int ttd = atoi(argv[4]);  // ms
-    int port = atoi(argv[5]);
+    char *filename = argv[optind];
+    int ncyl = atoi(argv[optind + 1]);
+    int nsec = atoi(argv[optind + 2]);
+    int ttd = atoi(argv[optind + 3]);  // ms
+    int port = atoi(argv[optind + 4]);
 
     log_init("disk.log");
 
@@ -176,7 +435,9 @@ int main(int argc, char *argv[]) {
     }
 
     // command
-    tcp_server server = server_init(port, 1, on_connection, on_recv, cleanup);
+    server = server_init(port, 1, on_connection, on_recv, cleanup);
+    server_on_batch(server, on_batch);
+    if (disk_timing() == TIMING_ASYNC) wheel_start(try_send);
     server_run(server);
 
     // never reached
@@ -0,0 +1,131 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/*------------------------------------------------------------
+ *  io_uring 的最小封装
+ *    不依赖 liburing，直接用 io_uring_setup / io_uring_enter 两个系统调用，
+ *    提交队列（SQ）和完成队列（CQ）通过 mmap 与内核共享。
+ *    uring_queue 只填写 SQE，不进内核；uring_wait 用一次 io_uring_enter
+ *    提交全部请求并等它们完成，完成的顺序由内核决定。
+ *    只在一个线程里使用。
+ *-----------------------------------------------------------*/
+
+static struct {
+    int fd;
+    unsigned entries;           // SQ 的大小，也是同时在途的请求数上限
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;    // 共享一次映射时两者相同
+    size_t sq_size, cq_size;
+    unsigned tail;              // 本地的 SQ 尾，uring_wait 时才交给内核
+    unsigned queued;            // 已填写、还没提交的请求数
+    unsigned inflight;          // 已提交、还没完成的请求数
+} ring = {.fd = -1, .sq_ring = MAP_FAILED, .cq_ring = MAP_FAILED, .sqes = MAP_FAILED};
+
+int uring_init(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring.fd < 0) {
+        Warn("io_uring_setup failed: %s", strerror(errno));
+        return -1;
+    }
+    ring.entries = p.sq_entries;
+    ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) ring.sq_size = ring.cq_size = ring.sq_size > ring.cq_size ? ring.sq_size : ring.cq_size;
+
+    ring.sq_ring = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                        IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED) goto fail;
+    ring.cq_ring = single ? ring.sq_ring
+                          : mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                                 IORING_OFF_CQ_RING);
+    if (ring.cq_ring == MAP_FAILED) goto fail;
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) goto fail;
+
+    char *sq = ring.sq_ring, *cq = ring.cq_ring;
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.tail = *ring.sq_tail;
+    ring.queued = ring.inflight = 0;
+    return 0;
+
+fail:
+    Warn("Could not map the io_uring rings: %s", strerror(errno));
+    uring_exit();
+    return -1;
+}
+
+int uring_queue(int write, int fd, char *buf, unsigned len, long off, unsigned long tag) {
+    if (ring.queued + ring.inflight == ring.entries) return -1;
+    unsigned i = ring.tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = off;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->user_data = tag;
+    ring.sq_array[i] = i;
+    ring.tail++;
+    ring.queued++;
+    return 0;
+}
+
+int uring_wait(void (*done)(unsigned long tag, int res)) {
+    // SQE 写完之后才能让内核看到新的尾
+    __atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+    while (ring.queued + ring.inflight > 0) {
+        // 提交剩下的请求，同时等所有请求完成；CQ 是 SQ 的两倍大，不会溢出
+        int n = syscall(__NR_io_uring_enter, ring.fd, ring.queued, ring.queued + ring.inflight,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                Error("io_uring_enter failed: %s", strerror(errno));
+                return -1;
+            }
+            n = 0;
+        }
+        ring.queued -= n;
+        ring.inflight += n;
+
+        unsigned head = *ring.cq_head, tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            done(cqe->user_data, cqe->res);
+            ring.inflight--;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+void uring_exit() {
+    if (ring.sqes != MAP_FAILED) munmap(ring.sqes, ring.entries * sizeof(struct io_uring_sqe));
+    if (ring.cq_ring != MAP_FAILED && ring.cq_ring != ring.sq_ring) munmap(ring.cq_ring, ring.cq_size);
+    if (ring.sq_ring != MAP_FAILED) munmap(ring.sq_ring, ring.sq_size);
+    ring.sqes = MAP_FAILED;
+    ring.sq_ring = ring.cq_ring = MAP_FAILED;
+    if (ring.fd >= 0) close(ring.fd);
+    ring.fd = -1;
+}
@@ -0,0 +1,135 @@
+#include "wheel.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/select.h>
+#include <time.h>
+
+/*------------------------------------------------------------
+ *  推迟回复的时间轮
+ *    每格 1 毫秒，共 WHEEL_SLOTS 格，回复按到期的毫秒数挂在对应的格上，
+ *    超过一圈的留在格里等下一圈。后台线程每毫秒往前走一格，把到期的回复
+ *    交给 send；连接正忙时停在这一格，下一毫秒再试，所以同一个连接的
+ *    回复总是按加入的顺序发出。
+ *-----------------------------------------------------------*/
+#define WHEEL_SLOTS 512
+
+struct held {
+    struct held *next;
+    int id;
+    char *msg;
+    int len;
+    long tick;  // 到期的毫秒数
+};
+
+static struct {
+    struct held *head[WHEEL_SLOTS], *tail[WHEEL_SLOTS];
+    long cur;               // 下一个要处理的格对应的毫秒数
+    int total;              // 挂着的回复总数
+    int held[FD_SETSIZE];   // 每个连接挂着的回复数
+    long last[FD_SETSIZE];  // 每个连接最后一个回复的到期时间
+    int (*send)(int id, const char *msg, int len);
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} wheel = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static pthread_t wheel_thread;
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void wheel_add(int id, char *msg, int len, double due) {
+    struct held *h = malloc(sizeof(*h));
+    h->next = NULL;
+    h->id = id;
+    h->msg = msg;
+    h->len = len;
+    pthread_mutex_lock(&wheel.lock);
+    if (wheel.total == 0) wheel.cur = now_ms();  // 空闲之后不用补走中间的格
+    long t = (long)(due / 1000) + 1;             // 向上取整，不早于完成时间发出
+    if (t < wheel.cur) t = wheel.cur;
+    if (wheel.held[id] && t < wheel.last[id]) t = wheel.last[id];
+    h->tick = t;
+    int i = t % WHEEL_SLOTS;
+    if (wheel.tail[i]) wheel.tail[i]->next = h;
+    else wheel.head[i] = h;
+    wheel.tail[i] = h;
+    wheel.held[id]++;
+    wheel.last[id] = t;
+    wheel.total++;
+    pthread_cond_signal(&wheel.cond);
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+int wheel_held(int id) {
+    pthread_mutex_lock(&wheel.lock);
+    int n = wheel.held[id];
+    pthread_mutex_unlock(&wheel.lock);
+    return n;
+}
+
+// 从第i格里摘掉prev之后的h（prev 为 NULL 时 h 是第一个）
+static void unlink_held(int i, struct held *prev, struct held *h) {
+    if (prev) prev->next = h->next;
+    else wheel.head[i] = h->next;
+    if (wheel.tail[i] == h) wheel.tail[i] = prev;
+    wheel.held[h->id]--;
+    wheel.total--;
+    free(h->msg);
+    free(h);
+}
+
+void wheel_drop(int id) {
+    pthread_mutex_lock(&wheel.lock);
+    for (int i = 0; i < WHEEL_SLOTS && wheel.held[id]; i++) {
+        struct held *prev = NULL, *h = wheel.head[i];
+        while (h) {
+            struct held *next = h->next;
+            if (h->id == id) unlink_held(i, prev, h);
+            else prev = h;
+            h = next;
+        }
+    }
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+// 发出第i格里已经到期的回复，有连接正忙时返回 -1
+static int fire(int i) {
+    struct held *prev = NULL, *h = wheel.head[i];
+    while (h) {
+        struct held *next = h->next;
+        if (h->tick > wheel.cur) prev = h;  // 下一圈的
+        else if (wheel.send(h->id, h->msg, h->len) < 0) return -1;
+        else unlink_held(i, prev, h);
+        h = next;
+    }
+    return 0;
+}
+
+static void *wheel_loop(void *arg) {
+    pthread_mutex_lock(&wheel.lock);
+    while (1) {
+        while (wheel.total == 0) pthread_cond_wait(&wheel.cond, &wheel.lock);
+        long now = now_ms();
+        while (wheel.cur <= now && fire(wheel.cur % WHEEL_SLOTS) == 0) wheel.cur++;
+        // 睡到下一毫秒，有新回复加入时提前醒来
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 1000000;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wheel.cond, &wheel.lock, &ts);
+    }
+    return NULL;
+}
+
+void wheel_start(int (*send)(int id, const char *msg, int len)) {
+    wheel.send = send;
+    pthread_create(&wheel_thread, NULL, wheel_loop, NULL);
+    pthread_detach(wheel_thread);
+}
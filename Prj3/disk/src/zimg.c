@@ -0,0 +1,577 @@
+#include "zimg.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "log.h"
+#include "lz.h"
+
+/*------------------------------------------------------------
+ *  压缩镜像（lz 后端）
+ *    文件布局：4 KB 的头，块索引（每块 8 字节：位置和长度），然后是数据区。
+ *    数据区按 512 字节的单位分配，压缩后的块占 1 到 8 个单位；压不到省下
+ *    一个单位的块原样存放，全零的块不占空间（长度为 0）。
+ *    改写块时总是写到新的位置再改索引，旧位置先记在 pending 里，等索引
+ *    落盘（zimg_sync）之后才回到空闲表，崩溃后盘上的索引指向的块都还完好；
+ *    上次同步之后才分配的位置盘上的索引没有指向，不再用时可以马上重用。
+ *    等待的空间超过存储数据的四分之一（加 1 MB）时自己同步一次，文件不会无限增长。
+ *    空闲表按长度分开，分配时先取一样长的，再拆更长的，最后才扩展文件；
+ *    打开时从索引算出哪些单位在用，其余的空隙就是空闲的。
+ *    读写都经过解压后的块缓存（clock 置换），部分写先把块读进缓存、改好
+ *    再整块压缩写回；缓存总是和文件一致，换出时不用写。
+ *    periodic 策略的后台同步线程也会调用，所有操作都在 z.lock 下进行。
+ *
+ *  去重
+ *    几个块的索引项可以指向同一段数据，引用计数从索引数出来，不用另外保存。
+ *    打开去重时，每段数据按解压后内容的哈希放进内容表（开放寻址，线性探测），
+ *    写入时先查表，哈希相同再读出来逐字节比较，一样就只改索引、不写数据。
+ *    数据一旦写下就不再改，改写共享的块自然是写时复制：写到新位置，旧的
+ *    那段少一个引用，没有引用了才释放。
+ *-----------------------------------------------------------*/
+
+#define UNIT 512                  // 数据区的分配单位
+#define MAXUNITS (ZCHUNK / UNIT)  // 一个块最多占的单位数
+#define SECS (ZCHUNK / 512)       // 每块的扇区数
+#define HEADER 4096
+#define PAGE 4096                 // 索引按页写回
+#define NCACHE 2048               // 缓存的块数（8 MB）
+#define PENDING_SLACK (1L << 20)  // 等待索引落盘的空间在数据的四分之一之外还可以多这么多
+
+static const char MAGIC[8] = "BDSLZ1";
+
+struct header {
+    char magic[8];
+    uint64_t nsect;
+    uint32_t chunk;
+    uint32_t nchunk;
+    uint64_t data_off;
+};
+
+struct entry {
+    uint32_t unit;  // 在数据区的第几个单位
+    uint32_t len;   // 0 表示全零的块，ZCHUNK 表示没有压缩
+};
+
+struct extent {
+    uint32_t unit, n;
+};
+
+// 数据区里的一段数据，记在它的第一个单位上
+struct ext {
+    uint64_t hash;  // 解压后内容的哈希（去重时才有）
+    uint32_t ref;   // 索引里指向它的块数
+    uint32_t gen;   // 分配时的同步代数，等于 z.gen 表示上次同步之后才分配
+    uint32_t len;
+};
+
+struct slot {
+    uint64_t hash;
+    uint32_t unit;
+    uint32_t used;
+};
+
+struct cached {
+    long c;   // 缓存的是哪一块，-1 表示空
+    int ref;  // clock 算法的访问位
+    char data[ZCHUNK];
+};
+
+static struct {
+    int fd;
+    long nchunk, data_off;
+    struct entry *index;
+    unsigned char *dirty;  // 索引的每一页是否改过
+    long npage;
+    uint32_t end;          // 数据区用到的单位数
+    long stored;           // 数据区里有效数据的字节数，共享的只算一次
+    struct {
+        uint32_t *v;
+        int n, cap;
+    } free[MAXUNITS + 1];  // free[k]：长 k 个单位的空闲位置
+    struct extent *pending;
+    int npending, cappending;
+    long pending_units;
+    struct ext *ext;       // 下标是单位
+    uint32_t capext, gen;
+    int dedup;
+    struct slot *table;    // 内容表，大小是 2 的幂
+    long tsize, tcount;
+    long nref, nunique;    // 有数据的块数，不同的数据段数
+    unsigned long hits;    // 去重省下的写
+    struct cached *cache;
+    int *where;            // 每块在缓存中的下标，-1 表示不在
+    int hand;
+    pthread_mutex_t lock;
+} z = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static int units(uint32_t len) { return (len + UNIT - 1) / UNIT; }
+
+static int rw_all(int write, char *buf, size_t len, long off) {
+    while (len > 0) {
+        ssize_t n = write ? pwrite(z.fd, buf, len, off) : pread(z.fd, buf, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            Error("Compressed image %s at offset %ld failed: %s", write ? "write" : "read", off,
+                  n < 0 ? strerror(errno) : "end of file");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/*--------------- 空间分配 ---------------------*/
+static void push_free(int k, uint32_t unit) {
+    if (z.free[k].n == z.free[k].cap) {
+        z.free[k].cap = z.free[k].cap ? 2 * z.free[k].cap : 64;
+        z.free[k].v = realloc(z.free[k].v, z.free[k].cap * sizeof(uint32_t));
+    }
+    z.free[k].v[z.free[k].n++] = unit;
+}
+
+// 让 ext 至少能放下n个单位，新的部分清零
+static void grow_ext(uint32_t n) {
+    if (n <= z.capext) return;
+    uint32_t cap = z.capext ? z.capext : 1024;
+    while (cap < n) cap *= 2;
+    z.ext = realloc(z.ext, cap * sizeof(struct ext));
+    memset(z.ext + z.capext, 0, (cap - z.capext) * sizeof(struct ext));
+    z.capext = cap;
+}
+
+static uint32_t alloc_units(int k) {
+    if (z.free[k].n) return z.free[k].v[--z.free[k].n];
+    for (int j = k + 1; j <= MAXUNITS; j++)
+        if (z.free[j].n) {
+            uint32_t unit = z.free[j].v[--z.free[j].n];
+            push_free(j - k, unit + k);
+            return unit;
+        }
+    z.end += k;
+    grow_ext(z.end);
+    return z.end - k;
+}
+
+/*--------------- 内容表 ---------------------*/
+static uint64_t chunk_hash(const char *data) {
+    return (uint64_t)crc32c(0, data, ZCHUNK / 2) << 32 | crc32c(0, data + ZCHUNK / 2, ZCHUNK / 2);
+}
+
+static void table_put(uint64_t hash, uint32_t unit) {
+    long i = hash & (z.tsize - 1);
+    while (z.table[i].used) i = (i + 1) & (z.tsize - 1);
+    z.table[i] = (struct slot){hash, unit, 1};
+}
+
+static void table_insert(uint64_t hash, uint32_t unit) {
+    if (2 * (z.tcount + 1) > z.tsize) {
+        struct slot *old = z.table;
+        long n = z.tsize;
+        z.tsize = n ? 2 * n : 1024;
+        z.table = calloc(z.tsize, sizeof(struct slot));
+        for (long i = 0; i < n; i++)
+            if (old[i].used) table_put(old[i].hash, old[i].unit);
+        free(old);
+    }
+    table_put(hash, unit);
+    z.tcount++;
+}
+
+// 删掉单位 unit 开始的那段数据；后面同一串里的项往前挪，查找时不会断开
+static void table_remove(uint32_t unit) {
+    long mask = z.tsize - 1, i = z.ext[unit].hash & mask;
+    while (z.table[i].used && z.table[i].unit != unit) i = (i + 1) & mask;
+    if (!z.table[i].used) return;
+    for (long j = i;;) {
+        j = (j + 1) & mask;
+        if (!z.table[j].used) break;
+        long home = z.table[j].hash & mask;
+        // home 在 (i, j] 里的项留在原处也找得到
+        if (i < j ? home > i && home <= j : home > i || home <= j) continue;
+        z.table[i] = z.table[j];
+        i = j;
+    }
+    z.table[i].used = 0;
+    z.tcount--;
+}
+
+static int read_extent(uint32_t unit, uint32_t len, char *buf);
+
+// 找内容和 data 一样的数据段，没有时返回-1
+static long table_find(uint64_t hash, const char *data) {
+    static char buf[ZCHUNK];
+    if (!z.tsize) return -1;
+    for (long i = hash & (z.tsize - 1); z.table[i].used; i = (i + 1) & (z.tsize - 1)) {
+        uint32_t u = z.table[i].unit;
+        if (z.table[i].hash == hash && read_extent(u, z.ext[u].len, buf) == 0 && memcmp(buf, data, ZCHUNK) == 0)
+            return u;
+    }
+    return -1;
+}
+
+/*--------------- 引用计数 ---------------------*/
+static void ref_extent(struct entry e) {
+    if (!e.len) return;
+    z.nref++;
+    if (z.ext[e.unit].ref++ == 0) {
+        z.stored += e.len;
+        z.nunique++;
+    }
+}
+
+// 没有引用的数据段：盘上的索引可能还指向它，要等新索引落盘后才能再用
+static void unref_extent(struct entry e) {
+    if (!e.len) return;
+    z.nref--;
+    struct ext *x = &z.ext[e.unit];
+    if (--x->ref) return;
+    z.stored -= e.len;
+    z.nunique--;
+    if (z.dedup) table_remove(e.unit);
+    if (x->gen == z.gen) {
+        push_free(units(e.len), e.unit);
+        return;
+    }
+    z.pending_units += units(e.len);
+    if (z.npending == z.cappending) {
+        z.cappending = z.cappending ? 2 * z.cappending : 256;
+        z.pending = realloc(z.pending, z.cappending * sizeof(struct extent));
+    }
+    z.pending[z.npending++] = (struct extent){e.unit, units(e.len)};
+}
+
+/*--------------- 索引 ---------------------*/
+static int sync_locked() {
+    for (long p = 0; p < z.npage; p++) {
+        if (!z.dirty[p]) continue;
+        long lo = p * PAGE, hi = (p + 1) * PAGE < z.nchunk * (long)sizeof(struct entry) ? (p + 1) * PAGE
+                                                                                        : z.nchunk * (long)sizeof(struct entry);
+        if (rw_all(1, (char *)z.index + lo, hi - lo, HEADER + lo) < 0) return -1;
+        z.dirty[p] = 0;
+    }
+    if (fdatasync(z.fd) < 0) {
+        Error("Could not sync the compressed image: %s", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < z.npending; i++) push_free(z.pending[i].n, z.pending[i].unit);
+    z.npending = 0;
+    z.pending_units = 0;
+    z.gen++;
+    return 0;
+}
+
+// 先加新的引用再减旧的：两者可能是同一段数据
+static void set_entry(long c, struct entry e) {
+    ref_extent(e);
+    unref_extent(z.index[c]);
+    z.index[c] = e;
+    z.dirty[c * sizeof(struct entry) / PAGE] = 1;
+    if (z.pending_units * UNIT > z.stored / 4 + PENDING_SLACK) sync_locked();
+}
+
+/*--------------- 块的读写 ---------------------*/
+static int read_extent(uint32_t unit, uint32_t len, char *buf) {
+    static char packed[ZCHUNK];
+    if (len == 0) {
+        memset(buf, 0, ZCHUNK);
+        return 0;
+    }
+    if (len == ZCHUNK) return rw_all(0, buf, ZCHUNK, z.data_off + (long)unit * UNIT);
+    if (rw_all(0, packed, len, z.data_off + (long)unit * UNIT) < 0) return -1;
+    if (lz_decompress(packed, len, buf, ZCHUNK) != ZCHUNK) {
+        Error("The data at unit %u of the compressed image is corrupt", unit);
+        return -1;
+    }
+    return 0;
+}
+
+// 把块c的新内容写进数据区：有一样的数据时共用，否则压缩后写到新的位置
+static int store_chunk(long c, char *data) {
+    static char packed[ZCHUNK];
+    struct entry e = {0, 0};
+    if (data[0] || memcmp(data, data + 1, ZCHUNK - 1)) {
+        uint64_t hash = 0;
+        if (z.dedup) {
+            hash = chunk_hash(data);
+            long u = table_find(hash, data);
+            if (u >= 0) {
+                z.hits++;
+                set_entry(c, (struct entry){u, z.ext[u].len});
+                return 0;
+            }
+        }
+        char *src = packed;
+        e.len = lz_compress(data, ZCHUNK, packed, ZCHUNK - UNIT);
+        if (e.len == 0) {
+            e.len = ZCHUNK;
+            src = data;
+        }
+        e.unit = alloc_units(units(e.len));
+        if (rw_all(1, src, e.len, z.data_off + (long)e.unit * UNIT) < 0) {
+            push_free(units(e.len), e.unit);  // 索引没有指向它，可以马上再用
+            return -1;
+        }
+        z.ext[e.unit] = (struct ext){hash, 0, z.gen, e.len};
+        if (z.dedup) table_insert(hash, e.unit);
+    }
+    set_entry(c, e);
+    return 0;
+}
+
+// 把块c读进缓存，返回缓存下标
+static int load(long c) {
+    int i = z.where[c];
+    if (i >= 0) {
+        z.cache[i].ref = 1;
+        return i;
+    }
+    while (z.cache[z.hand].ref) {
+        z.cache[z.hand].ref = 0;
+        z.hand = (z.hand + 1) % NCACHE;
+    }
+    i = z.hand;
+    z.hand = (z.hand + 1) % NCACHE;
+    if (z.cache[i].c >= 0) z.where[z.cache[i].c] = -1;
+    z.cache[i].c = -1;
+    if (read_extent(z.index[c].unit, z.index[c].len, z.cache[i].data) < 0) return -1;
+    z.cache[i].c = c;
+    z.cache[i].ref = 1;
+    z.where[c] = i;
+    return i;
+}
+
+static void forget(long c) {
+    if (z.where[c] < 0) return;
+    z.cache[z.where[c]].c = -1;
+    z.where[c] = -1;
+}
+
+// 对从s开始的n个扇区逐块操作：整块写入或丢弃时不用读旧内容。
+// data 为 NULL 表示写零（丢弃）
+static int chunk_io(int write, long s, long n, char *buf) {
+    while (n > 0) {
+        long c = s / SECS;
+        int off = s % SECS, k = n < SECS - off ? n : SECS - off;
+        if (write && k == SECS) {
+            if (!buf) {
+                set_entry(c, (struct entry){0, 0});
+                if (z.where[c] >= 0) memset(z.cache[z.where[c]].data, 0, ZCHUNK);
+            } else if (store_chunk(c, buf) < 0) {
+                return -1;
+            } else if (z.where[c] >= 0) {
+                memcpy(z.cache[z.where[c]].data, buf, ZCHUNK);
+            }
+        } else {
+            int i = load(c);
+            if (i < 0) return -1;
+            char *p = z.cache[i].data + off * 512;
+            if (!write) {
+                memcpy(buf, p, k * 512);
+            } else {
+                if (buf) memcpy(p, buf, k * 512);
+                else memset(p, 0, k * 512);
+                if (store_chunk(c, z.cache[i].data) < 0) {
+                    forget(c);  // 缓存里的内容没能写进文件
+                    return -1;
+                }
+            }
+        }
+        if (buf) buf += k * 512;
+        s += k;
+        n -= k;
+    }
+    return 0;
+}
+
+int zimg_io(int write, long s, int n, char *buf) {
+    pthread_mutex_lock(&z.lock);
+    int ret = chunk_io(write, s, n, buf);
+    pthread_mutex_unlock(&z.lock);
+    return ret;
+}
+
+int zimg_discard(long s, long n) {
+    pthread_mutex_lock(&z.lock);
+    int ret = chunk_io(1, s, n, NULL);
+    pthread_mutex_unlock(&z.lock);
+    return ret;
+}
+
+int zimg_stored(long c) { return z.index[c].len != 0; }
+
+int zimg_sync() {
+    pthread_mutex_lock(&z.lock);
+    int ret = sync_locked();
+    pthread_mutex_unlock(&z.lock);
+    return ret;
+}
+
+void zimg_usage(long *stored, long *file) {
+    pthread_mutex_lock(&z.lock);
+    if (stored) *stored = z.stored;
+    if (file) *file = z.data_off + (long)z.end * UNIT;
+    pthread_mutex_unlock(&z.lock);
+}
+
+void zimg_dedup_stats(long *chunks, long *copies, unsigned long *hits) {
+    pthread_mutex_lock(&z.lock);
+    if (chunks) *chunks = z.nref;
+    if (copies) *copies = z.nunique;
+    if (hits) *hits = z.hits;
+    pthread_mutex_unlock(&z.lock);
+}
+
+/*--------------- 打开和关闭 ---------------------*/
+static int is_used(unsigned char *used, uint32_t u) { return used[u / 8] & (1 << (u % 8)); }
+
+// 从索引数出每段数据的引用，在用的单位之间的空隙放进空闲表；
+// 有越界的位置、重叠的数据段或者起点相同长度不同的项时返回-1
+static int scan_index(long size) {
+    z.end = 0;
+    for (long c = 0; c < z.nchunk; c++) {
+        struct entry e = z.index[c];
+        if (e.len > ZCHUNK || z.data_off + (long)e.unit * UNIT + e.len > size) return -1;
+        if (e.len && e.unit + units(e.len) > z.end) z.end = e.unit + units(e.len);
+    }
+    grow_ext(z.end);
+    unsigned char *used = calloc(z.end / 8 + 1, 1);
+    for (long c = 0; c < z.nchunk; c++) {
+        struct entry e = z.index[c];
+        if (!e.len) continue;
+        struct ext *x = &z.ext[e.unit];
+        if (x->ref == 0) {
+            for (uint32_t u = e.unit; u < e.unit + units(e.len); u++) {
+                if (is_used(used, u)) goto corrupt;
+                used[u / 8] |= 1 << (u % 8);
+            }
+            x->len = e.len;
+        } else if (x->len != e.len) {
+            goto corrupt;
+        }
+        ref_extent(e);
+    }
+    for (uint32_t u = 0; u < z.end;) {
+        if (is_used(used, u)) {
+            u++;
+            continue;
+        }
+        int k = 0;
+        while (u + k < z.end && k < MAXUNITS && !is_used(used, u + k)) k++;
+        push_free(k, u);
+        u += k;
+    }
+    free(used);
+    return 0;
+corrupt:
+    free(used);
+    return -1;
+}
+
+// 去重时把已有的每段数据读出来算哈希，放进内容表
+static int build_table() {
+    static char buf[ZCHUNK];
+    for (uint32_t u = 0; u < z.end; u++) {
+        if (!z.ext[u].ref) continue;
+        if (read_extent(u, z.ext[u].len, buf) < 0) return -1;
+        z.ext[u].hash = chunk_hash(buf);
+        table_insert(z.ext[u].hash, u);
+    }
+    return 0;
+}
+
+int zimg_open(int fd, long nsect, int dedup) {
+    z.fd = fd;
+    z.nchunk = (nsect * 512 + ZCHUNK - 1) / ZCHUNK;
+    long isize = z.nchunk * sizeof(struct entry);
+    z.npage = (isize + PAGE - 1) / PAGE;
+    z.data_off = HEADER + z.npage * PAGE;
+    z.index = calloc(z.nchunk, sizeof(struct entry));
+    z.dirty = calloc(z.npage, 1);
+    z.gen = 1;  // 打开时已有的数据段都是 0 代
+    z.dedup = dedup;
+
+    struct stat st;
+    struct header h;
+    if (fstat(fd, &st) < 0) goto fail;
+    if (st.st_size == 0) {
+        // 新镜像：索引全零，所有块都是零
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, MAGIC, sizeof(MAGIC));
+        h.nsect = nsect;
+        h.chunk = ZCHUNK;
+        h.nchunk = z.nchunk;
+        h.data_off = z.data_off;
+        if (rw_all(1, (char *)&h, sizeof(h), 0) < 0 || ftruncate(fd, z.data_off) < 0) goto fail;
+        st.st_size = z.data_off;
+    } else {
+        if (st.st_size < HEADER || rw_all(0, (char *)&h, sizeof(h), 0) < 0 || memcmp(h.magic, MAGIC, sizeof(MAGIC))) {
+            Error("The file is not a compressed image");
+            goto fail;
+        }
+        if (h.nsect != (uint64_t)nsect || h.chunk != ZCHUNK || h.data_off != (uint64_t)z.data_off) {
+            Error("The compressed image holds %lu sectors, not %ld", (unsigned long)h.nsect, nsect);
+            goto fail;
+        }
+        if (rw_all(0, (char *)z.index, isize, HEADER) < 0) goto fail;
+    }
+    if (scan_index(st.st_size) < 0) {
+        Error("The index of the compressed image is corrupt");
+        goto fail;
+    }
+    if (dedup && build_table() < 0) goto fail;
+
+    z.cache = malloc(NCACHE * sizeof(struct cached));
+    z.where = malloc(z.nchunk * sizeof(int));
+    for (int i = 0; i < NCACHE; i++) z.cache[i].c = -1, z.cache[i].ref = 0;
+    for (long c = 0; c < z.nchunk; c++) z.where[c] = -1;
+    z.hand = 0;
+    return 0;
+fail:
+    zimg_close();
+    return -1;
+}
+
+void zimg_close() {
+    pthread_mutex_lock(&z.lock);
+    if (z.cache) {
+        // 正常关闭时索引总要写回，none 策略下也一样
+        for (long p = 0; p < z.npage; p++)
+            if (z.dirty[p]) {
+                sync_locked();
+                break;
+            }
+    }
+    free(z.index);
+    free(z.dirty);
+    free(z.cache);
+    free(z.where);
+    free(z.pending);
+    free(z.ext);
+    free(z.table);
+    for (int k = 0; k <= MAXUNITS; k++) free(z.free[k].v);
+    memset(z.free, 0, sizeof(z.free));
+    z.index = NULL;
+    z.dirty = NULL;
+    z.cache = NULL;
+    z.where = NULL;
+    z.pending = NULL;
+    z.ext = NULL;
+    z.table = NULL;
+    z.npending = z.cappending = 0;
+    z.pending_units = 0;
+    z.capext = 0;
+    z.tsize = z.tcount = 0;
+    z.stored = z.nref = z.nunique = 0;
+    z.hits = 0;
+    z.dedup = 0;
+    z.fd = -1;
+    pthread_mutex_unlock(&z.lock);
+}
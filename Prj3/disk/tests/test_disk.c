@@ -1,8 +1,13 @@
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "crc32c.h"
 #include "disk.h"
+#include "lz.h"
 #include "mintest.h"
+#include "zimg.h"
 
 inline static void setup_disk() { init_disk("test_disk.img", 10, 10, 0); }
 
@@ -122,6 +127,425 @@ mt_test(test_out_of_bounds) {
     return 0;
 }
 
+mt_test(test_sector_run) {
+    setup_disk();
+    char write_buf[8 * 512];
+    char read_buf[8 * 512];
+    for (int i = 0; i < (int)sizeof(write_buf); i++) write_buf[i] = 'a' + (i / 512) + i % 7;
+
+    // a run that crosses from cylinder 4 into cylinder 5
+    mt_assert(cmd_wn(4, 6, 8, write_buf) == 0);
+    mt_assert(cmd_rn(4, 6, 8, read_buf) == 0);
+    mt_assert(memcmp(write_buf, read_buf, sizeof(read_buf)) == 0);
+    // the same sectors one at a time
+    for (int i = 0; i < 8; i++) {
+        mt_assert(cmd_r(4 + (6 + i) / 10, (6 + i) % 10, read_buf) == 0);
+        mt_assert(memcmp(write_buf + i * 512, read_buf, 512) == 0);
+    }
+
+    mt_assert(cmd_rn(9, 8, 3, read_buf) != 0);  // past the last sector
+    mt_assert(cmd_rn(0, 0, 0, read_buf) != 0);
+    mt_assert(cmd_wn(0, 0, MAXRUN + 1, write_buf) != 0);
+    close_disk();
+    return 0;
+}
+
+mt_test(test_backends) {
+    const char *names[] = {"mmap", "pio", "direct", "uring"};
+    char write_buf[8 * 512];
+    char read_buf[8 * 512];
+    mt_assert(disk_set_backend("tape") != 0);
+    for (int b = 0; b < 4; b++) {
+        for (int i = 0; i < (int)sizeof(write_buf); i++) write_buf[i] = 'A' + b + (i / 512) + i % 5;
+        mt_assert(disk_set_backend(names[b]) == 0);
+        setup_disk();
+        // an unaligned run, and a partial sector next to it
+        mt_assert(cmd_wn(2, 3, 8, write_buf) == 0);
+        mt_assert(cmd_w(3, 1, 100, write_buf) == 0);
+        mt_assert(cmd_rn(2, 3, 8, read_buf) == 0);
+        mt_assert(memcmp(write_buf, read_buf, sizeof(read_buf)) == 0);
+        close_disk();
+
+        // what one backend wrote, the others read back
+        mt_assert(disk_set_backend(names[(b + 1) % 4]) == 0);
+        setup_disk();
+        mt_assert(cmd_r(2, 5, read_buf) == 0);
+        mt_assert(memcmp(write_buf + 2 * 512, read_buf, 512) == 0);
+        mt_assert(cmd_r(3, 1, read_buf) == 0);
+        mt_assert(memcmp(write_buf, read_buf, 100) == 0 && read_buf[100] == 0 && read_buf[511] == 0);
+        close_disk();
+    }
+    disk_set_backend("mmap");
+    return 0;
+}
+
+static void count_done(void *arg, int status) { *(int *)arg += status ? 100 : 1; }
+
+mt_test(test_direct_tail) {
+    // 10 x 63 sectors is not a multiple of 4 KB: the last sectors sit in a partial aligned block
+    char buf[2 * 512], data[2 * 512];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = 'a' + i % 26;
+    unlink("test_tail.img");
+    disk_set_backend("direct");
+    mt_assert(init_disk("test_tail.img", 10, 63, 0) == 0);
+    mt_assert(cmd_r(9, 62, buf) == 0);
+    mt_assert(cmd_w(9, 62, 5, "hello") == 0);
+    mt_assert(cmd_r(9, 62, buf) == 0 && memcmp(buf, "hello", 5) == 0);
+    mt_assert(cmd_wn(9, 61, 2, data) == 0);
+    mt_assert(cmd_rn(9, 61, 2, buf) == 0 && memcmp(buf, data, sizeof(data)) == 0);
+    close_disk();
+    // the other backends see the same tail
+    disk_set_backend("mmap");
+    mt_assert(init_disk("test_tail.img", 10, 63, 0) == 0);
+    mt_assert(cmd_r(9, 62, buf) == 0 && memcmp(buf, data + 512, 512) == 0);
+    close_disk();
+    unlink("test_tail.img");
+    return 0;
+}
+
+mt_test(test_async) {
+    const char *names[] = {"mmap", "uring"};
+    static char write_buf[100][512];
+    static char read_buf[100][512];
+    for (int b = 0; b < 2; b++) {
+        mt_assert(disk_set_backend(names[b]) == 0);
+        setup_disk();
+        int ndone = 0;
+        for (int i = 0; i < 100; i++) {
+            memset(write_buf[i], 'a' + b + i % 20, 512);
+            mt_assert(cmd_wn_async(i / 10, i % 10, 1, write_buf[i], count_done, &ndone) == 0);
+        }
+        // an invalid run is refused at once and never completes
+        mt_assert(cmd_wn_async(9, 9, 2, write_buf[0], count_done, &ndone) != 0);
+        disk_complete();
+        mt_assert(ndone == 100);
+
+        // a read queued behind an overlapping write sees it, however the ring orders them
+        ndone = 0;
+        memset(write_buf[0], 'z', 512);
+        mt_assert(cmd_wn_async(0, 0, 1, write_buf[0], count_done, &ndone) == 0);
+        for (int i = 0; i < 100; i++) mt_assert(cmd_rn_async(i / 10, i % 10, 1, read_buf[i], count_done, &ndone) == 0);
+        disk_complete();
+        mt_assert(ndone == 101);
+        mt_assert(memcmp(read_buf, write_buf, sizeof(read_buf)) == 0);
+
+        // a synchronous request waits for the queued ones
+        mt_assert(cmd_rn_async(5, 0, 10, read_buf[0], count_done, &ndone) == 0);
+        mt_assert(cmd_w(5, 0, 3, "new") == 0);
+        mt_assert(ndone == 102 && read_buf[0][0] == write_buf[50][0]);
+        close_disk();
+    }
+    disk_set_backend("mmap");
+    return 0;
+}
+
+mt_test(test_sync) {
+    char buf[512] = "durable";
+    mt_assert(disk_set_sync("sometimes", 1000) != 0);
+    mt_assert(disk_set_sync("flush", 0) != 0);
+
+    // flush: only barriers sync, and back-to-back barriers sync once
+    mt_assert(disk_set_sync("flush", 1000) == 0);
+    setup_disk();
+    unsigned long n = disk_sync_count();
+    mt_assert(cmd_w(1, 1, 7, buf) == 0);
+    mt_assert(cmd_w(1, 2, 7, buf) == 0);
+    mt_assert(disk_sync_count() == n);
+    mt_assert(cmd_f() == 0 && cmd_f() == 0);
+    mt_assert(disk_sync_count() == n + 1);
+    close_disk();
+
+    // write: every write, but a batch of queued writes only once
+    mt_assert(disk_set_sync("write", 1000) == 0);
+    disk_set_backend("uring");
+    setup_disk();
+    n = disk_sync_count();
+    mt_assert(cmd_w(1, 1, 7, buf) == 0);
+    mt_assert(disk_sync_count() == n + 1);
+    int ndone = 0;
+    for (int i = 0; i < 10; i++) mt_assert(cmd_wn_async(2, i, 1, buf, count_done, &ndone) == 0);
+    disk_complete();
+    mt_assert(ndone == 10 && disk_sync_count() == n + 2);
+    close_disk();
+    disk_set_backend("mmap");
+
+    // periodic: a background thread picks the writes up
+    mt_assert(disk_set_sync("periodic", 10) == 0);
+    setup_disk();
+    n = disk_sync_count();
+    mt_assert(cmd_w(1, 1, 7, buf) == 0);
+    usleep(100 * 1000);
+    mt_assert(disk_sync_count() == n + 1);
+    close_disk();
+
+    // none ignores barriers
+    mt_assert(disk_set_sync("none", 1000) == 0);
+    setup_disk();
+    n = disk_sync_count();
+    mt_assert(cmd_w(1, 1, 7, buf) == 0);
+    mt_assert(cmd_f() == 0 && disk_sync_count() == n);
+    close_disk();
+    disk_set_sync("flush", 1000);
+    return 0;
+}
+
+mt_test(test_timing) {
+    char buf[2 * 512];
+    mt_assert(disk_set_timing("warp", 0) != 0);
+    // seeks only: 1 ms per cylinder, as without the model
+    mt_assert(disk_set_timing("sim", 0) == 0);
+    init_disk("test_disk.img", 10, 10, 1);
+    mt_assert(disk_clock() == 0);
+    mt_assert(cmd_r(0, 5, buf) == 0 && disk_clock() == 0);
+    mt_assert(cmd_r(4, 5, buf) == 0 && disk_clock() == 4000);
+    mt_assert(cmd_rn(4, 9, 2, buf) == 0 && disk_clock() == 5000);  // crosses onto cylinder 5
+    close_disk();
+
+    // with a spindle the seek grows with the square root of the distance: 4 cylinders cost 2 ms
+    mt_assert(disk_set_timing("sim", 6000) == 0);
+    init_disk("test_disk.img", 10, 10, 1);
+    mt_assert(cmd_r(4, 2, buf) == 0 && disk_clock() == 2000 + 1000);  // after the seek sector 2 is under the head
+    close_disk();
+
+    // 6000 rpm with 10 sectors a track: 1 ms per sector passing under the head
+    mt_assert(disk_set_timing("sim", 6000) == 0);
+    init_disk("test_disk.img", 10, 10, 0);
+    mt_assert(cmd_r(0, 0, buf) == 0 && disk_clock() == 1000);
+    mt_assert(cmd_r(0, 1, buf) == 0 && disk_clock() == 2000);
+    mt_assert(cmd_r(0, 0, buf) == 0 && disk_clock() == 11000);  // a full turn minus one sector
+    mt_assert(disk_busy() == 11000);
+    close_disk();
+    disk_set_timing("block", 0);
+    return 0;
+}
+
+mt_test(test_sparse) {
+    char buf[2 * 512], zero[2 * 512] = {0};
+    unlink("test_sparse.img");
+    init_disk("test_sparse.img", 100, 10, 0);
+    mt_assert(disk_allocated() == 0);
+    mt_assert(cmd_r(7, 7, buf) == 0 && memcmp(buf, zero, 512) == 0);
+    mt_assert(disk_allocated() == 0);  // reading a hole does not fill it
+
+    memset(buf, 'x', sizeof(buf));
+    mt_assert(cmd_wn(5, 3, 1, buf) == 0);
+    mt_assert(disk_allocated() == 8);
+    // a discard that only partly covers the 4 KB chunk zeroes the sector but keeps the chunk
+    mt_assert(cmd_d(5, 0, 5) == 0);
+    mt_assert(cmd_r(5, 3, buf) == 0 && memcmp(buf, zero, 512) == 0);
+    mt_assert(disk_allocated() == 8);
+    mt_assert(cmd_d(4, 0, 20) == 0 && disk_allocated() == 0);
+    mt_assert(cmd_d(99, 9, 2) != 0 && cmd_d(0, 0, 0) != 0);
+
+    // a run across data and holes, and the allocation rebuilt from the image on reopening
+    memset(buf, 'y', sizeof(buf));
+    mt_assert(cmd_w(0, 7, 512, buf) == 0);
+    mt_assert(cmd_rn(0, 7, 2, buf) == 0 && buf[511] == 'y' && memcmp(buf + 512, zero, 512) == 0);
+    close_disk();
+    init_disk("test_sparse.img", 100, 10, 0);
+    mt_assert(disk_allocated() == 8);
+    mt_assert(cmd_r(0, 7, buf) == 0 && buf[0] == 'y');
+    // discarding the whole disk covers the partial chunk at its end
+    mt_assert(cmd_w(99, 9, 3, "end") == 0);
+    mt_assert(cmd_d(0, 0, 1000) == 0 && disk_allocated() == 0);
+    mt_assert(cmd_r(0, 7, buf) == 0 && memcmp(buf, zero, 512) == 0);
+    close_disk();
+    unlink("test_sparse.img");
+    return 0;
+}
+
+mt_test(test_checksum) {
+    char buf[2 * 512], zero[512] = {0};
+    mt_assert(crc32c(0, "123456789", 9) == 0xe3069283);
+    mt_assert(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+
+    // data written without checksums is picked up when the table is built
+    unlink("test_crc.img");
+    unlink("test_crc.img.crc");
+    init_disk("test_crc.img", 100, 10, 0);
+    memset(buf, 'c', sizeof(buf));
+    mt_assert(cmd_wn(3, 4, 2, buf) == 0);
+    close_disk();
+    disk_set_checksum(1);
+    init_disk("test_crc.img", 100, 10, 0);
+    mt_assert(disk_checksum());
+    mt_assert(cmd_rn(3, 4, 2, buf) == 0 && buf[1023] == 'c');
+
+    // a sector changed behind the server's back fails to read, its neighbour still reads
+    unsigned long errors = disk_checksum_errors();
+    int fd = open("test_crc.img", O_WRONLY);
+    mt_assert(pwrite(fd, "!", 1, (3 * 10 + 5) * 512 + 100) == 1);
+    close(fd);
+    mt_assert(cmd_r(3, 5, buf) != 0);
+    mt_assert(cmd_rn(3, 4, 2, buf) != 0);
+    mt_assert(disk_checksum_errors() == errors + 2);
+    mt_assert(cmd_r(3, 4, buf) == 0 && buf[0] == 'c');
+    // rewriting it, discarding and holes all read back fine
+    mt_assert(cmd_w(3, 5, 3, "new") == 0 && cmd_r(3, 5, buf) == 0 && memcmp(buf, "new", 3) == 0);
+    mt_assert(cmd_d(3, 0, 10) == 0 && cmd_r(3, 4, buf) == 0 && memcmp(buf, zero, 512) == 0);
+    mt_assert(cmd_r(50, 5, buf) == 0);
+
+    // the table survives reopening; opening without checksums removes it
+    mt_assert(cmd_w(7, 7, 4, "keep") == 0);
+    close_disk();
+    init_disk("test_crc.img", 100, 10, 0);
+    mt_assert(cmd_r(7, 7, buf) == 0 && memcmp(buf, "keep", 4) == 0);
+    close_disk();
+    disk_set_checksum(0);
+    init_disk("test_crc.img", 100, 10, 0);
+    mt_assert(!disk_checksum() && access("test_crc.img.crc", F_OK) != 0);
+    close_disk();
+    unlink("test_crc.img");
+    return 0;
+}
+
+mt_test(test_compressed) {
+    static char text[ZCHUNK], noise[ZCHUNK], packed[ZCHUNK], out[ZCHUNK];
+    for (int i = 0; i < ZCHUNK; i++) text[i] = "block device, sector "[i % 21] + i / 700;
+    srand(48);
+    for (int i = 0; i < ZCHUNK; i++) noise[i] = rand();
+
+    // the codec: text shrinks and comes back, noise does not fit, damaged input is refused
+    int n = lz_compress(text, ZCHUNK, packed, ZCHUNK - 512);
+    mt_assert(n > 0 && n < ZCHUNK / 4);
+    mt_assert(lz_decompress(packed, n, out, ZCHUNK) == ZCHUNK && memcmp(out, text, ZCHUNK) == 0);
+    mt_assert(lz_compress(noise, ZCHUNK, packed, ZCHUNK - 512) == 0);
+    mt_assert(lz_compress("short", 5, packed, 16) == 6 && lz_decompress(packed, 6, out, 5) == 5);
+    n = lz_compress(text, ZCHUNK, packed, ZCHUNK);
+    mt_assert(lz_decompress(packed, n - 3, out, ZCHUNK) != ZCHUNK);
+    mt_assert(lz_decompress(packed, n, out, ZCHUNK - 1) == -1);
+    packed[n - 1] = 0x55;
+    packed[1] = (char)0xff;
+    mt_assert(lz_decompress(packed, n, out, ZCHUNK) != ZCHUNK);
+
+    // the backend: whole and partial chunks, runs across chunks, zeros take no space
+    unlink("test_lz.img");
+    disk_set_backend("lz");
+    mt_assert(init_disk("test_lz.img", 100, 10, 0) == 0);
+    mt_assert(strcmp(disk_backend(), "lz") == 0 && disk_allocated() == 0);
+    static char buf[MAXRUN * 512];
+    for (int i = 0; i < MAXRUN * 512; i++) buf[i] = text[i % ZCHUNK];
+    mt_assert(cmd_wn(0, 3, MAXRUN, buf) == 0);
+    mt_assert(cmd_wn(48, 0, 8, noise) == 0);
+    mt_assert(cmd_w(90, 1, 5, "hello") == 0);
+    memset(buf, 0, sizeof(buf));
+    mt_assert(cmd_rn(0, 3, MAXRUN, buf) == 0 && memcmp(buf + ZCHUNK, text, ZCHUNK) == 0);
+    mt_assert(cmd_rn(0, 0, 3, buf) == 0 && buf[0] == 0 && buf[3 * 512 - 1] == 0);
+    long stored, file;
+    zimg_usage(&stored, &file);
+    mt_assert(stored < ZCHUNK + MAXRUN * 512 / 4);
+
+    // reopening finds everything through the index; a discard frees whole chunks
+    close_disk();
+    mt_assert(init_disk("test_lz.img", 100, 10, 0) == 0);
+    mt_assert(cmd_rn(48, 0, 8, buf) == 0 && memcmp(buf, noise, ZCHUNK) == 0);
+    mt_assert(cmd_r(90, 1, buf) == 0 && memcmp(buf, "hello", 5) == 0);
+    mt_assert(cmd_rn(0, 3, 1, buf) == 0 && memcmp(buf, text, 512) == 0);
+    long before = disk_allocated();
+    mt_assert(cmd_d(48, 0, 8) == 0 && disk_allocated() == before - 8);
+    mt_assert(cmd_rn(48, 0, 8, buf) == 0 && buf[0] == 0 && buf[ZCHUNK - 1] == 0);
+    // once the discard is durable, the space it gave back is reused instead of growing the file
+    mt_assert(cmd_f() == 0);
+    zimg_usage(NULL, &file);
+    mt_assert(cmd_wn(60, 0, 8, noise) == 0);
+    zimg_usage(NULL, &before);
+    mt_assert(before == file);
+    close_disk();
+
+    // an image of another size or a plain image is not opened
+    mt_assert(init_disk("test_lz.img", 50, 10, 0) != 0);
+    int fd = open("test_lz.img", O_WRONLY | O_TRUNC);
+    mt_assert(write(fd, noise, ZCHUNK) == ZCHUNK);
+    close(fd);
+    mt_assert(init_disk("test_lz.img", 100, 10, 0) != 0);
+    disk_set_backend("mmap");
+    unlink("test_lz.img");
+    return 0;
+}
+
+mt_test(test_dedup) {
+    static char data[ZCHUNK], buf[ZCHUNK];
+    for (int i = 0; i < ZCHUNK; i++) data[i] = "home/user/.bashrc "[i % 18] + i / 512;
+    long chunks, copies;
+    unsigned long hits;
+    unlink("test_dedup.img");
+    disk_set_backend("lz");
+    disk_set_dedup(1);
+
+    // three chunks with the same contents share one copy
+    mt_assert(init_disk("test_dedup.img", 100, 10, 0) == 0);
+    mt_assert(cmd_wn(0, 0, 8, data) == 0);
+    mt_assert(cmd_wn(0, 8, 8, data) == 0);
+    mt_assert(cmd_wn(1, 6, 8, data) == 0);
+    zimg_dedup_stats(&chunks, &copies, &hits);
+    mt_assert(chunks == 3 && copies == 1 && hits == 2);
+
+    // changing one sector of a shared chunk copies it, the others keep the old contents
+    mt_assert(cmd_w(0, 9, 4, "edit") == 0);
+    zimg_dedup_stats(&chunks, &copies, NULL);
+    mt_assert(chunks == 3 && copies == 2);
+    mt_assert(cmd_rn(0, 8, 8, buf) == 0 && memcmp(buf + 512, "edit", 4) == 0);
+    mt_assert(cmd_rn(1, 6, 8, buf) == 0 && memcmp(buf, data, ZCHUNK) == 0);
+    mt_assert(cmd_rn(0, 0, 8, buf) == 0 && memcmp(buf, data, ZCHUNK) == 0);
+    // writing the old contents back shares again and frees the copy
+    mt_assert(cmd_wn(0, 8, 8, data) == 0);
+    zimg_dedup_stats(&chunks, &copies, NULL);
+    mt_assert(chunks == 3 && copies == 1);
+
+    // sharing comes back from the index, and the stored copy is found again after reopening
+    close_disk();
+    mt_assert(init_disk("test_dedup.img", 100, 10, 0) == 0);
+    zimg_dedup_stats(&chunks, &copies, &hits);
+    mt_assert(chunks == 3 && copies == 1 && hits == 0);
+    mt_assert(cmd_wn(4, 0, 8, data) == 0);
+    zimg_dedup_stats(&chunks, &copies, &hits);
+    mt_assert(chunks == 4 && copies == 1 && hits == 1);
+    // discarding every chunk frees the copy only with the last one
+    mt_assert(cmd_d(0, 0, 24) == 0);
+    zimg_dedup_stats(&chunks, &copies, NULL);
+    mt_assert(chunks == 1 && copies == 1);
+    mt_assert(cmd_rn(4, 0, 8, buf) == 0 && memcmp(buf, data, ZCHUNK) == 0);
+    close_disk();
+
+    // without deduplication the same image stores every write as its own copy
+    disk_set_dedup(0);
+    mt_assert(init_disk("test_dedup.img", 100, 10, 0) == 0);
+    mt_assert(cmd_wn(8, 0, 8, data) == 0);
+    zimg_dedup_stats(&chunks, &copies, NULL);
+    mt_assert(chunks == 2 && copies == 2);
+    close_disk();
+    disk_set_backend("mmap");
+    unlink("test_dedup.img");
+    return 0;
+}
+
+mt_test(test_mapping) {
+    static char buf[MAXRUN * 512];
+    mt_assert(disk_set_mapping("often", 0, 0) == -1);
+
+    // every tuning maps the same contents; auto switches advice as the pattern changes
+    const char *advice[] = {"random", "sequential", "willneed", "auto"};
+    unlink("test_map.img");
+    for (int i = 0; i < 4; i++) {
+        mt_assert(disk_set_mapping(advice[i], i == 3, i == 2) == 0);
+        mt_assert(init_disk("test_map.img", 200, 64, 0) == 0);
+        for (int cyl = 0; cyl < 200; cyl++) {
+            memset(buf, 'a' + (cyl + i) % 26, sizeof(buf));
+            mt_assert(cmd_wn(cyl, 0, MAXRUN, buf) == 0);
+        }
+        for (int k = 0; k < 300; k++) {
+            int cyl = (k * 37) % 200;
+            mt_assert(cmd_r(cyl, k % 64, buf) == 0 && buf[0] == 'a' + (cyl + i) % 26);
+        }
+        for (int cyl = 0; cyl < 200; cyl++)
+            mt_assert(cmd_rn(cyl, 0, MAXRUN, buf) == 0 && buf[MAXRUN * 512 - 1] == 'a' + (cyl + i) % 26);
+        close_disk();
+    }
+    mt_assert(disk_set_mapping("normal", 0, 0) == 0);
+    unlink("test_map.img");
+    return 0;
+}
+
 void disk_tests() {
     mt_run_test(test_cmd_i);
     mt_run_test(test_cmd_wr);
@@ -129,4 +553,15 @@ void disk_tests() {
     mt_run_test(test_w_partial);
     mt_run_test(test_non_ascii);
     mt_run_test(test_out_of_bounds);
+    mt_run_test(test_sector_run);
+    mt_run_test(test_backends);
+    mt_run_test(test_direct_tail);
+    mt_run_test(test_async);
+    mt_run_test(test_sync);
+    mt_run_test(test_timing);
+    mt_run_test(test_sparse);
+    mt_run_test(test_checksum);
+    mt_run_test(test_compressed);
+    mt_run_test(test_dedup);
+    mt_run_test(test_mapping);
 }
\ No newline at end of file
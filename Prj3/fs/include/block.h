@@ -4,9 +4,23 @@
 
 #include "common.h"      /* 提供 uint / uchar 等类型别名 */
 
-/* ------------ 与块大小相关的常量 ------------ */
-#define BSIZE 512               /* 每块字节数（模板一般已有，可留一份） */
-#define BPB (BSIZE * 8)         /* Bits‑Per‑Block：一个数据块能容纳的位数 */
+/* 已格式化磁盘的超级块魔数。磁盘格式改变（超级块、dinode、目录项布局）时换一个新值，
+ * 旧格式的磁盘不能按新布局解析，只能重新格式化 */
+#define FS_MAGIC 0x2303A515
+#define FS_MAGIC_V0 0x2303A514  /* 最初的格式：定长目录项，8 个直接块，没有日志 */
+
+/*------------------------------------------------------------
+ *  快照表项：快照时刻的超级块副本，以及该快照的写时复制映射链
+ *-----------------------------------------------------------*/
+#define NSNAP 3
+
+struct snapinfo {
+    uint id;
+    uint ctime;
+    uint sbcopy;        /* 快照时刻的超级块副本 */
+    uint maphead;       /* (原块号, 副本块号) 映射链的第一个块 */
+    uint nmap;          /* 映射条数，即复制出的块数 */
+};
 
 /*------------------------------------------------------------
  *  超级块 Superblock
@@ -16,27 +30,86 @@ struct superblock {
     uint magic;         /* 魔数，用于校验磁盘是否已格式化 */
     uint size;          /* 磁盘总块数 */
     uint bmapstart;     /* 位图起始块号（连续若干块存储位向量） */
+    uint refstart;      /* 引用计数表起始块号，紧跟在位图之后，每块一个字节 */
     /*  后续实现 inode 数据区时，可在此追加字段 */
     uint datastart;     /* 数据区（包括间接块和inode块）起始号 */
+    uint logstart;      /* 日志区起始块号（日志头），之后 nlog 块为日志块 */
+    uint nlog;          /* 日志块数，0 表示不使用日志 */
+    uint bsize;         /* 格式化时的块大小，与编译时的 BSIZE 不同则不能挂载 */
+    uint groupsize;     /* 每个柱面组的块数，0 表示不分组（全盘 first-fit） */
     uint ninodeblock;
-    uint inodeblock[123];
+    uint inodeblock[92];
+    uint norphan;       /* 孤儿列表长度：已从目录树摘下、等待后台回收的目录 */
+    uint orphan[8];     /* 孤儿列表（栈），崩溃后重启时据此继续回收 */
+    uint snapseq;       /* 最近一次创建的快照编号 */
+    uint nsnap;         /* 快照个数，snap[] 按创建时间从旧到新排列 */
+    struct snapinfo snap[NSNAP];
 };
 
+_Static_assert(sizeof(struct superblock) <= BSIZE, "superblock must fit in block 0");
+
 /* 全局唯一的超级块实例；这里只是“声明”，真正的定义放在 fs.c */
 extern struct superblock sb;
+void sbwrite();     /* 把内存中的超级块写回 block 0 */
 
 /*------------- 位图相关辅助宏 --------------*/
 /* 给定逻辑块号 b，计算它位于哪一个“位图块” */
 #define BBLOCK(b)  ((b) / BPB + sb.bmapstart)
 
+/*------------- 柱面组 --------------*/
+/* 数据区按柱面切成若干组，每组由位图中连续的一段管理，inode 块也分散在各组中。
+ * 文件的 inode 和数据放在父目录所在的组，新目录放到离父目录最近的、还比较空的组 */
+#define CG_CYLS 16   /* 格式化时每组的柱面数 */
+#define BGROUP(b)  (sb.groupsize ? (b) / sb.groupsize : 0)
+#define NINODEBLOCK (sizeof(((struct superblock *)0)->inodeblock) / sizeof(uint))
+
+/*------------- 引用计数相关辅助宏 --------------*/
+/* clone 出的文件共享数据块；表中记的是第一个拥有者之外的引用数，0 表示独占 */
+#define REFMAX 255
+#define NREFBLOCK(size) (((size) + BSIZE - 1) / BSIZE)
+#define RBLOCK(b)  ((b) / BSIZE + sb.refstart)
+
 /*--------------- 各种函数 -----------------*/
 void zero_block(uint bno);
 uint allocate_block();
+// Allocate a free block at or after goal in goal's group, then in the following groups
+uint allocate_block_near(uint goal);
+
+// Forget the per-group free block counts (mount/format)
+void group_init();
+// Number of cylinder groups, and the first data block of group g
+uint group_count();
+uint group_start(uint g);
+// Free blocks left in group g
+uint group_free(uint g);
+// The group nearest to group near with at least the average number of free blocks, for a new directory
+uint group_for_dir(uint near);
+// Free blocks; a block shared by clone only loses one reference
 void free_block(uint bno);
+void free_blocks(uint *bnos, int n);
+
+// Forget the cached reference table summary (mount/format)
+void refcnt_init();
+// Number of extra owners of bno, 0 when it is not shared
+uint block_refs(uint bno);
+// Add an owner to each block; saturated blocks are set to 0 in bnos. Returns how many were shared
+int share_blocks(uint *bnos, int n);
 
 void get_disk_info(int *ncyl, int *nsec);
 void read_block(int blockno, uchar *buf);
 void write_block(int blockno, uchar *buf);
+void read_block_raw(int blockno, uchar *buf);
+void write_block_raw(int blockno, uchar *buf);
+// Barrier: return once everything written so far is durable on the disk server
+void flush_disk();
+// Discard n blocks from start on the disk server, so that they read back as zeros and take no space in a sparse
+// image; returns -1 if the server could not (the blocks are then unchanged)
+int discard_blocks(uint start, uint n);
+// Requests sent to the disk server and cylinders the head crossed serving them, since the last reset
+void seek_stats(uint *nreq, unsigned long *ncyl);
+void reset_seek_stats();
+// The first block of the cylinder under the disk head
+uint head_block();
 void _set_disk_geometry(int ncyl, int nsec);
 
 void init_disk_client(const char*, int);
@@ -57,5 +130,8 @@ void move_to_front(CacheEntry *entry);
 CacheEntry* find_in_cache(int blockno);
 void evict_and_insert(int blockno, uchar *data);
 void clear_block_cache();
+// Keep one block resident outside the LRU list (the tail block of the file being appended to)
+void pin_block(int blockno);
+void unpin_block();
 
 #endif /* _BLOCK_H_ */
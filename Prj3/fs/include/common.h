@@ -6,8 +6,22 @@ typedef unsigned short ushort;
 typedef unsigned int uint;
 typedef unsigned int uint32_t;
 
-// block size in bytes
+// block size in bytes, a run of SPB disk sectors; chosen at build time (make BSIZE=4096)
+#ifndef BSIZE
 #define BSIZE 512
+#endif
+
+// sector size of the disk server
+#define SECTSIZE 512
+
+// sectors per block
+#define SPB (BSIZE / SECTSIZE)
+
+// 32KB is the largest block size supported, not 64KB:
+//  - a directory record's reclen is a ushort, and one record can cover a whole empty block
+//  - the WN request and the RC reply for a block must fit in TCP_BUF_SIZE (33KB)
+// A 64KB block needs a wider reclen (a new FS_MAGIC), a larger TCP_BUF_SIZE, and MAXRUN >= 128 in the disk server.
+_Static_assert(BSIZE % SECTSIZE == 0 && BSIZE <= 32768, "BSIZE must be a multiple of the sector size, at most 32KB");
 
 // bits per block
 #define BPB (BSIZE * 8)
@@ -18,6 +32,9 @@ typedef unsigned int uint32_t;
 // block of free map containing bit for block b
 #define BBLOCK(b) ((b) / BPB + sb.bmapstart)
 
+// pread/pwrite 每条消息最多携带的数据量，几个请求流水线传输时回复也不会占满 TCP 缓冲区
+#define IO_CHUNK 3072
+
 #define max(a, b) ((a) > (b) ? (a) : (b))
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
@@ -2,12 +2,32 @@
 #define __FS_H__
 
 #include "common.h"
+#include "block.h"
 #include "inode.h"
 #include "stdlib.h"
+#include <pthread.h>
+#include <time.h>
 
-// used for cmd_ls
+// 磁盘上的目录项：变长记录，按 4 字节对齐，不跨块；一个块中各记录的 reclen 之和恰好是 BSIZE。
+// 删除时并入前一条记录，块首的记录则标记为空闲（namelen 为 0）
 typedef struct {
-    char name[MAXNAME];  // 目录项名称
+    uint inum;
+    ushort reclen;  // 到下一条记录的距离，包括本记录之后的空闲空间
+    uchar namelen;  // 0 表示空闲记录
+    uchar type;
+    char name[];    // 不以 '\0' 结尾
+} dirent;
+
+#define DIRENT_LEN(namelen) ((sizeof(dirent) + (namelen) + 3) & ~3u)  // 一条记录至少占用的长度
+
+_Static_assert(DIRENT_LEN(MAXNAME) <= BSIZE, "a directory record must fit in one block");
+
+// Longest path accepted by cd and path resolution, without the terminating '\0'; longer ones are rejected
+#define MAXPATH 1024  // the cd handlers scan it with "%1025s", keep them in step
+
+// used for cmd_ls, only in memory
+typedef struct {
+    char name[MAXNAME + 1];  // 目录项名称
     short type;          // 目录项类型
     uint inum;           // inode号
     uint size;
@@ -18,7 +38,23 @@ typedef struct {
 } entry;
 
 void sbinit();
+// Reload the superblock and the working directory after an operation was rolled back (see end_op)
+void fs_rollback();
+
+// Serialize FS commands against the background reclaimer
+void fs_lock();
+void fs_unlock();
+// Wait on cond with the FS lock held; returns nonzero if deadline (CLOCK_REALTIME) passed first
+int fs_wait(pthread_cond_t *cond, const struct timespec *deadline);
 
+// Background reclamation of directories removed by rmdir/logout
+void reclaim_start();
+void reclaim_stop();
+void reclaim_kick();
+void reclaim_wait();
+
+// Cylinders per group used by the next cmd_f; 0 formats without groups (first-fit allocation)
+extern uint cg_cyls;
 int cmd_f(int ncyl, int nsec);
 
 int cmd_mk(char *name, short mode);
@@ -31,13 +67,27 @@ int cmd_ls(entry **entries, int *n);
 
 int cmd_cat(char *name, uchar **buf, uint *len);
 int cmd_w(char *name, uint len, const char *data);
+// Append len bytes at the end of the file
+int cmd_a(char *name, uint len, const char *data);
+// Range I/O: read up to len bytes at off, or overwrite/extend from off (off <= file size)
+int cmd_pread(char *name, uint off, uint len, uchar *buf, uint *n);
+int cmd_pwrite(char *name, uint off, uint len, const char *data);
 int cmd_i(char *name, uint pos, uint len, const char *data);
 int cmd_d(char *name, uint pos, uint len);
+// Copy file src to dst by sharing its data blocks; either side copies a block when writing it
+int cmd_clone(char *src, char *dst);
 
 int cmd_login(int auid);
 int cmd_chmod(char *name, int perm, int kernel);
 int cmd_logout();
 
+// Snapshots (superuser only); a mounted snapshot is read-only until cmd_umount
+int cmd_snap(uint *id);
+int cmd_snaprm(uint id);
+int cmd_lssnap(struct snapinfo **snaps, int *n);
+int cmd_mount(uint id);
+int cmd_umount();
+
 char* get_path();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef __FSCK_H__
+#define __FSCK_H__
+
+#include "common.h"
+
+/*------------------------------------------------------------
+ *  离线一致性检查 fsck
+ *    直接读取 BDS 的磁盘镜像文件（块 b 位于偏移 b * BSIZE），
+ *    检查位图与 inode 的块引用、孤儿 inode、目录的 "." / ".." 以及
+ *    parent / tsize / tfiles / blocks 等字段，快照占用的块也算作在用；
+ *    被几个文件共享的数据块与引用计数表对照。
+ *    日志中已提交但还没写回的块会先叠加到读到的内容上（修复模式下直接写回）。
+ *    镜像必须没有被正在运行的 FS 使用。
+ *-----------------------------------------------------------*/
+
+typedef struct {
+    uint ninode;    // 已分配的 inode 数
+    uint nblock;    // 被引用的块数（含超级块、位图、日志区和 inode 块）
+    uint nerror;    // 发现的问题数
+    uint nfixed;    // 已修复的问题数
+} fsck_result;
+
+// Check (and with repair != 0, fix) the image at path using nthread threads.
+// Returns the number of problems left unfixed, or -1 if the image cannot be checked.
+int fsck_image(const char *path, int repair, int nthread, fsck_result *res);
+
+#endif
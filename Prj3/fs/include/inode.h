@@ -3,7 +3,7 @@
 
 #include "common.h"
 
-#define NDIRECT 8  // Direct blocks, you can change this value
+#define NDIRECT 5  // Direct blocks, you can change this value
 
 #define MAXFILEB (NDIRECT + APB + APB * APB)
 
@@ -25,6 +25,9 @@ typedef struct {
     uint mtime;               // 最后修改时间
     uint ctime;               // 创建时间
     uint owner;               // 所有者
+    uint parent;              // 父目录的inode号（根目录指向自己）
+    uint tsize;               // 目录专用：子树中所有文件大小之和
+    uint tfiles;              // 目录专用：子树中的文件数
 } dinode;
 
 // inode in memory
@@ -39,10 +42,13 @@ typedef struct {
     uint mtime;
     uint ctime;
     uint owner;
+    uint parent;
+    uint tsize;   // 只读快照，由 iaccount() 直接在磁盘上维护，iupdate() 不会写回
+    uint tfiles;
 } inode;
 
-// You can change the size of MAXNAME
-#define MAXNAME 12
+// Longest file name, without the terminating '\0' (directory records store the length in a byte)
+#define MAXNAME 255
 
 // Get an inode by number (returns allocated inode or NULL)
 // Don't forget to use iput()
@@ -52,8 +58,9 @@ inode *iget(uint inum);
 void iput(inode *ip);
 
 // Allocate a new inode of specified type (returns allocated inode or NULL)
+// A file goes in the cylinder group of its parent directory, a directory in the nearest group that is not too full
 // Don't forget to use iput()
-inode *ialloc(short type);
+inode *ialloc(short type, uint parent);
 
 // Update disk inode with memory inode contents
 void iupdate(inode *ip);
@@ -64,7 +71,25 @@ int readi(inode *ip, uchar *dst, uint off, uint n);
 // Write to an inode (returns bytes written or -1 on error)
 int writei(inode *ip, uchar *src, uint off, uint n);
 
-// 清空磁盘中的dinode
+// Insert n bytes at off, shifting the rest of the file (returns bytes inserted or -1)
+int inserti(inode *ip, uchar *src, uint off, uint n);
+
+// Append n bytes at the end of the file, touching only the tail block and new blocks (returns bytes appended)
+int appendi(inode *ip, uchar *src, uint n);
+
+// Delete n bytes at off, shifting the rest of the file back (returns bytes deleted)
+int deletei(inode *ip, uint off, uint n);
+
+// Make the empty file dst a copy of src that shares its data blocks (returns -1 when out of space)
+int iclone(inode *dst, inode *src);
+
+// Free all data and indirect blocks of an inode and clear its dinode
 void ifree(inode *ip);
 
+// Add size/file-count deltas to directory inum and all of its ancestors
+void iaccount(uint inum, int dsize, int dfiles);
+
+// Truncate an inode to size bytes, freeing the blocks past the new end
+void itrunc(inode *ip, uint size);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,61 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include "common.h"
+
+/*------------------------------------------------------------
+ *  元数据日志 Journal
+ *    cmd_f 在位图之后预留日志区：1 个日志头块 + LOGSIZE 个日志块。
+ *    一个 FS 操作（begin_op ~ end_op）修改的元数据块作为一个事务写入日志，
+ *    多个事务合并成一次顺序写提交（group commit），之后再由后台线程
+ *    按块号顺序写回原位置（checkpoint）。
+ *    操作进行中日志满了时只写回之前已经结束的操作；一个操作本身就超过
+ *    LOGSIZE 个块时整个撤销，end_op 返回失败，它的改动一个也不会生效。
+ *    服务器在 journal_wait 返回、包含该操作的提交落盘之后才回复客户端。
+ *-----------------------------------------------------------*/
+#define LOGSIZE 126     // 日志块数，日志头需要能放下 LOGSIZE 个块号
+#define MAXOPBLOCKS 32  // 操作开始时为它预留的日志块数，分批进行的操作每批不超过这个数
+
+// 日志头，存放在 sb.logstart，n 为 0 表示日志中没有已提交的事务
+typedef struct {
+    uint n;
+    uint block[LOGSIZE];
+} logheader;
+
+_Static_assert(sizeof(logheader) <= BSIZE, "log header must fit in one block");
+
+// Reset the in-memory journal and replay committed transactions from disk
+void journal_init();
+// Forget the journal of the previous file system (used by cmd_f)
+void journal_reset();
+
+// Start/end an FS operation; ops may nest, the outermost end_op ends the transaction.
+// end_op returns -1 if the operation did not fit in the log and was rolled back
+void begin_op();
+int end_op();
+// Log blocks the current operation can still add; work done in steps stops below MAXOPBLOCKS
+uint journal_room();
+
+// Write a metadata block as part of the current transaction
+void log_write(uint bno, uchar *buf);
+
+// Block layer hooks: serve/absorb blocks that have a newer copy in the journal
+int journal_read(uint bno, uchar *buf);
+int journal_absorb(uint bno, uchar *buf);
+// Block layer hook: hold back the new contents of a block that was just copied for a
+// snapshot (copied != 0), or that is already held back, until the next commit
+int journal_defer(uint bno, uchar *buf, int copied);
+
+// Commit all finished transactions, and additionally write them home
+void journal_commit();
+void journal_checkpoint();
+// Checkpoint from inside an op that has not written anything yet
+void journal_sync();
+
+// Background group commit/checkpoint thread
+void journal_start();
+void journal_stop();
+// With the FS lock held, block until every finished op is committed to disk
+void journal_wait();
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef __SNAP_H__
+#define __SNAP_H__
+
+#include "block.h"
+#include "common.h"
+
+/*------------------------------------------------------------
+ *  写时复制快照 Snapshot
+ *    创建快照只在超级块中登记一项并保存超级块副本，与文件系统大小无关。
+ *    之后第一次改写快照时刻正在使用的块 b 时，先把旧内容复制到新块 c，
+ *    并把 (b, c) 记入该快照的映射（内存中是哈希表，磁盘上是 snapmap 链）。
+ *    读快照时 b 若有映射则读 c，否则 b 自创建以来没有被改写过，直接读 b；
+ *    比它新的快照的映射同样适用，因为两次快照之间没有改写过的块内容相同。
+ *    活动文件系统的读取不经过映射。
+ *-----------------------------------------------------------*/
+#define SNAPMAP_PAIRS ((BSIZE / sizeof(uint) - 2) / 2)
+
+typedef struct {
+    uint next;  // 下一个映射块，0 表示链尾
+    uint n;
+    uint pair[SNAPMAP_PAIRS][2];
+} snapmap;
+
+_Static_assert(sizeof(snapmap) <= BSIZE, "snapmap must fit in one block");
+
+// Rebuild the in-memory maps from the superblock's snapshot table (mount/format)
+void snap_init();
+
+// Block layer hook: preserve block bno for the snapshots before it is overwritten;
+// returns 1 if a copy was made just now
+int snap_cow(uint bno);
+
+// Block layer hook: serve reads from the mounted snapshot, returns 0 when none is mounted
+int snap_read(uint bno, uchar *buf);
+
+// Take a snapshot of the current state, must run before the current op writes anything
+int snap_take(uint *id);
+// Delete a snapshot and free the blocks only it was using
+int snap_delete(uint id);
+// List the snapshots (points into the live superblock)
+int snap_list(struct snapinfo **snaps);
+
+// Switch all reads to snapshot id (the superblock is swapped) and back
+int snap_mount(uint id);
+void snap_umount();
+int snap_mounted();
+
+#endif
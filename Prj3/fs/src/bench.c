@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "common.h"
+#include "fs.h"
+#include "journal.h"
+#include "log.h"
+
+/*------------------------------------------------------------
+ *  块布局的寻道基准测试
+ *    同一组操作分别在 first-fit 布局（不分组）和柱面组布局上运行，
+ *    按 block.c 推算的磁头移动统计每个阶段的柱面数，乘以 BDS 的
+ *    ttd（每跨一个柱面的毫秒数）得到模拟的寻道时间。
+ *    会格式化所连接的磁盘。
+ *-----------------------------------------------------------*/
+
+FILE *log_file;
+
+static int ndir = 8;     // 目录数
+static int nfile = 12;   // 每个目录的文件数
+static int nround = 8;   // 每个文件追加的块数
+static int ttd = 10;     // 与 BDS 启动参数一致，只用来换算时间
+
+static uchar *data;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d <dirs>] [-f <files per dir>] [-b <blocks per file>] [-t <ttd>] <DiskServerAddr> <Port>\n", prog);
+    fprintf(stderr, "  Formats the disk, so do not point it at a disk in use\n");
+    exit(EXIT_FAILURE);
+}
+
+// 和 server 一样，操作在 fs 锁内进行，由后台线程做组提交
+static void op_begin() {
+    fs_lock();
+    begin_op();
+}
+
+static void op_end() {
+    end_op();
+    fs_unlock();
+}
+
+// 进入第d个目录，name为其中第f个文件的文件名
+static void enter(int d, int f, char *name) {
+    char dir[16];
+    sprintf(dir, "/d%d", d);
+    cmd_cd(dir);
+    sprintf(name, "f%d", f);
+}
+
+// 每个文件轮流追加一块，文件交错地增长
+static void grow(int nblock) {
+    char name[16];
+    for (int r = 0; r < nblock; r++)
+        for (int d = 0; d < ndir; d++)
+            for (int f = 0; f < nfile; f++) {
+                op_begin();
+                enter(d, f, name);
+                cmd_a(name, BSIZE, (char *)data);
+                op_end();
+            }
+}
+
+// 把文件依次读一遍
+static void read_all() {
+    char name[16];
+    for (int d = 0; d < ndir; d++)
+        for (int f = 0; f < nfile; f++) {
+            uchar *buf;
+            uint len;
+            op_begin();
+            enter(d, f, name);
+            if (cmd_cat(name, &buf, &len) == E_SUCCESS) free(buf);
+            op_end();
+        }
+}
+
+// 结束一个阶段：写回日志，打印这一阶段的磁头移动
+static void phase(const char *name, unsigned long *total) {
+    fs_lock();
+    journal_checkpoint();
+    fs_unlock();
+    uint nreq;
+    unsigned long ncyl;
+    seek_stats(&nreq, &ncyl);
+    printf("  %-10s %8u requests %10lu cylinders %10.1f s\n", name, nreq, ncyl, ncyl * ttd / 1000.0);
+    *total += ncyl;
+    reset_seek_stats();
+}
+
+static unsigned long run(int ncyl, int nsec, uint cyls) {
+    char name[16];
+    unsigned long total = 0;
+    cg_cyls = cyls;
+    op_begin();
+    cmd_f(ncyl, nsec);
+    op_end();
+    clear_block_cache();
+    reset_seek_stats();
+    journal_start();
+
+    // 建目录和文件，交错写入
+    for (int d = 0; d < ndir; d++) {
+        sprintf(name, "d%d", d);
+        op_begin();
+        cmd_cd("/");
+        cmd_mkdir(name, 0b1111);
+        op_end();
+        for (int f = 0; f < nfile; f++) {
+            op_begin();
+            enter(d, f, name);
+            cmd_mk(name, 0b1111);
+            op_end();
+        }
+    }
+    grow(nround);
+    phase("create", &total);
+
+    // 删掉一半的文件留下空洞，重新建出来再写，模拟用旧了的磁盘
+    for (int d = 0; d < ndir; d++)
+        for (int f = 0; f < nfile; f += 2) {
+            op_begin();
+            enter(d, f, name);
+            cmd_rm(name);
+            cmd_mk(name, 0b1111);
+            op_end();
+        }
+    grow(nround);
+    phase("age", &total);
+
+    clear_block_cache();
+    read_all();
+    journal_stop();
+    phase("read", &total);
+    return total;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:f:b:t:")) != -1) {
+        switch (opt) {
+            case 'd': ndir = atoi(optarg); break;
+            case 'f': nfile = atoi(optarg); break;
+            case 'b': nround = atoi(optarg); break;
+            case 't': ttd = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2 || ndir <= 0 || nfile <= 0 || nround <= 0) usage(argv[0]);
+    log_init("bench.log");
+
+    init_disk_client(argv[optind], atoi(argv[optind + 1]));
+    int ncyl, nsec;
+    get_disk_info(&ncyl, &nsec);
+    sbinit();
+    cmd_login(1);
+
+    data = malloc(BSIZE);
+    memset(data, 'b', BSIZE);
+    printf("%d dirs x %d files, %d block(s) per file per round, %d x %d disk, ttd %d ms\n", ndir, nfile, nround, ncyl,
+           nsec, ttd);
+    printf("first-fit:\n");
+    unsigned long base = run(ncyl, nsec, 0);
+    printf("cylinder groups (%d cylinders each):\n", CG_CYLS);
+    unsigned long cg = run(ncyl, nsec, CG_CYLS);
+    printf("simulated seek time: %.1f s -> %.1f s (%.0f%%)\n", base * ttd / 1000.0, cg * ttd / 1000.0,
+           base ? 100.0 * cg / base : 100.0);
+    free(data);
+    return 0;
+}
@@ -7,17 +7,43 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include "common.h"
+#include "crc32c.h"
+#include "journal.h"
 #include "log.h"
+#include "snap.h"
 #include "tcp_utils.h"
 
 static tcp_client disk_client;
 static CacheEntry cache[CACHE_CAPACITY];
 static CacheEntry *head = NULL, *tail = NULL;
+static CacheEntry pinned = {.blockno = -1};  // 钉住的块，不参与 LRU 淘汰
 static int cache_hits = 0;      // 命中次数
 static int cache_accesses = 0;  // 总访问次数
 // static int g_port = 0;
 static int g_ncyl = 0;
 static int g_nsec = 0;
+static int head_cyl = 0;        // 磁头所在的柱面（按发出的请求推算）
+static uint seek_reqs = 0;      // 发出的磁盘请求数
+static unsigned long seek_cyls = 0;  // 磁头累计移动的柱面数
+static int use_rc = 0;          // BDS 支持 RC：读块时连同每个扇区的 CRC32C 一起读回，收到后核对
+
+// 记录一次从扇区s开始、共SPB个扇区的请求带来的磁头移动
+static void track_seek(long s) {
+    int cyl = s / g_nsec, end = (s + SPB - 1) / g_nsec;
+    seek_cyls += abs(cyl - head_cyl) + (end - cyl);
+    seek_reqs++;
+    head_cyl = end;
+}
+
+void seek_stats(uint *nreq, unsigned long *ncyl) {
+    if (nreq) *nreq = seek_reqs;
+    if (ncyl) *ncyl = seek_cyls;
+}
+
+void reset_seek_stats() {
+    seek_reqs = 0;
+    seek_cyls = 0;
+}
 
 // 初始化 disk server 连接
 void init_disk_client(const char *addr, int port) {
@@ -38,11 +64,53 @@ void init_disk_client(const char *addr, int port) {
         g_ncyl = g_nsec = 0;
         exit(EXIT_FAILURE);
     }
+
+    // 试探 BDS 是否支持带校验和的读，不认识 RC 的服务器（如 BDA）回复 Unknown command
+    client_send(disk_client, "RC 0 0 1", 9);
+    char probe[4 + SECTSIZE + 4];
+    n = client_recv(disk_client, probe, sizeof(probe));
+    use_rc = n == sizeof(probe) && strncmp(probe, "Yes ", 4) == 0;
+    Log("Block checksums from the disk server: %s", use_rc ? "on" : "off");
+}
+
+// 屏障：BDS 把之前写入的数据都落盘后才回复
+void flush_disk() {
+    client_send(disk_client, "F", 2);
+    char response[64];
+    int n = client_recv(disk_client, response, sizeof(response));
+    response[n > 0 ? n : 0] = 0;
+    if (strcmp(response, "Yes") != 0) Warn("flush_disk: the disk server could not sync");
+}
+
+// 丢弃从start开始的n个块：BDS 在镜像里打洞，之后读出全零。返回-1表示 BDS 不支持或失败
+int discard_blocks(uint start, uint n) {
+    long s = (long)start * SPB;
+    char cmd[64];
+    sprintf(cmd, "D %ld %ld %ld", s / g_nsec, s % g_nsec, (long)n * SPB);
+    client_send(disk_client, cmd, strlen(cmd) + 1);
+    char response[64];
+    int len = client_recv(disk_client, response, sizeof(response));
+    response[len > 0 ? len : 0] = 0;
+    // 缓存里的旧内容作废；丢弃很少发生，整个缓存清掉即可
+    init_block_cache();
+    unpin_block();
+    if (strcmp(response, "Yes") != 0) {
+        Warn("discard_blocks: the disk server could not discard blocks %u-%u", start, start + n - 1);
+        return -1;
+    }
+    return 0;
 }
 
 /*--------------- 基本块 I/O 接口 ----------------*/
-// 将号码为blockno的块的数据（512bits）读入buf中
+// 将号码为blockno的块的数据（BSIZE字节）读入buf中，日志中有更新的版本时以日志为准；挂载了快照时读快照
 void read_block(int blockno, uchar *buf) {
+    if (snap_read(blockno, buf)) return;
+    if (journal_read(blockno, buf)) return;
+    read_block_raw(blockno, buf);
+}
+
+// 绕过日志，直接从缓存或磁盘读取
+void read_block_raw(int blockno, uchar *buf) {
     // 先在缓存中查找
     cache_accesses++;
     CacheEntry *entry = find_in_cache(blockno);
@@ -55,19 +123,38 @@ void read_block(int blockno, uchar *buf) {
     }
 
     // 若未命中，则从磁盘读取
-    // 通过block号确定柱面号和扇区号    
-    int cyl = blockno / g_nsec;
-    int sec = blockno % g_nsec;
+    // 一个块占 SPB 个连续扇区，通过第一个扇区的编号确定柱面号和扇区号
+    long s = (long)blockno * SPB;
+    int cyl = s / g_nsec;
+    int sec = s % g_nsec;
 
-    // 向磁盘服务器发送请求
+    // 向磁盘服务器发送请求，多扇区的块用 RN 一次读出；支持时用 RC 带回校验和，
+    // 对不上（传输途中损坏）时再读一次
     char cmd[64];
-    sprintf(cmd, "R %d %d", cyl, sec);
-    client_send(disk_client, cmd, strlen(cmd) + 1);
+    if (use_rc) sprintf(cmd, "RC %d %d %d", cyl, sec, SPB);
+    else if (SPB == 1) sprintf(cmd, "R %d %d", cyl, sec);
+    else sprintf(cmd, "RN %d %d %d", cyl, sec, SPB);
+    static char response[4 + BSIZE + SPB * 4 + 8];
+    int ok = 0;
+    for (int attempt = 0; attempt < 2 && !ok; attempt++) {
+        client_send(disk_client, cmd, strlen(cmd) + 1);
+        track_seek(s);
 
-    // 获取磁盘服务器的回复
-    char response[BSIZE + 10];
-    client_recv(disk_client, response, sizeof(response));
-    if (strncmp(response, "Yes ", 4) == 0) {
+        // 获取磁盘服务器的回复
+        int n = client_recv(disk_client, response, sizeof(response));
+        if (n < 4 + BSIZE || strncmp(response, "Yes ", 4) != 0) break;
+        ok = 1;
+        for (int i = 0; use_rc && i < SPB; i++) {
+            uint32_t crc;
+            memcpy(&crc, response + 4 + BSIZE + i * 4, 4);
+            if (crc32c(0, response + 4 + i * SECTSIZE, SECTSIZE) != ntohl(crc)) {
+                Warn("read_block: checksum mismatch in block %d, sector %d", blockno, i);
+                ok = 0;
+                break;
+            }
+        }
+    }
+    if (ok) {
         Log("read_block: succeeded to read block %d", blockno);
         memcpy(buf, response + 4, BSIZE);
         evict_and_insert(blockno, buf);  // 加入缓存
@@ -78,16 +165,26 @@ void read_block(int blockno, uchar *buf) {
     Log("Cache miss for block %d (Block search: %d, Hit rate: %.2f%%)", blockno, cache_accesses, 100.0 * cache_hits / cache_accesses);
 }
 
-// 将buf中的数据写入号码为blockno的块中
+// 将buf中的数据写入号码为blockno的块中；该块在日志中时改写日志中的副本
+// 改写快照仍在使用的块之前先为快照复制一份，复制的映射提交之后才写原位置
 void write_block(int blockno, uchar *buf) {
-    // 通过block号确定柱面号和扇区号
-    int cyl = blockno / g_nsec;
-    int sec = blockno % g_nsec;
+    int copied = snap_cow(blockno);
+    if (journal_absorb(blockno, buf)) return;
+    if (journal_defer(blockno, buf, copied)) return;
+    write_block_raw(blockno, buf);
+}
+
+// 绕过日志，直接写入磁盘
+void write_block_raw(int blockno, uchar *buf) {
+    // 通过第一个扇区的编号确定柱面号和扇区号
+    long s = (long)blockno * SPB;
+    int cyl = s / g_nsec;
+    int sec = s % g_nsec;
 
-    // 向磁盘服务器发送请求
+    // 向磁盘服务器发送请求，多扇区的块用 WN 一次写入
     char header[64];
-    int len = BSIZE;
-    sprintf(header, "W %d %d %d ", cyl, sec, len);
+    if (SPB == 1) sprintf(header, "W %d %d %d ", cyl, sec, BSIZE);
+    else sprintf(header, "WN %d %d %d ", cyl, sec, SPB);
     int hlen = strlen(header);
 
     // 构造完整消息
@@ -96,6 +193,7 @@ void write_block(int blockno, uchar *buf) {
     memcpy(msg + hlen, buf, BSIZE);
     client_send(disk_client, msg, hlen + BSIZE);
     free(msg);
+    track_seek(s);
 
     // 获取磁盘服务器的回复
     char response[64];
@@ -121,46 +219,237 @@ void zero_block(uint bno) {
     write_block(bno, zero);
 }
 
-/*--------------- 位图分配器 ---------------------*/
-// 返回空闲的块号码
-uint allocate_block() {
+/*--------------- 柱面组 ---------------------*/
+static uint *gfree;  // 每组的空闲块数，第一次用到时扫描位图得到，之后随分配和释放更新
+static uint ngfree;
+
+void group_init() {
+    free(gfree);
+    gfree = NULL;
+    ngfree = 0;
+}
+
+uint group_count() { return sb.groupsize ? (sb.size + sb.groupsize - 1) / sb.groupsize : 1; }
+
+uint group_start(uint g) { return max(g * sb.groupsize, sb.datastart); }
+
+static uint group_end(uint g) { return sb.groupsize ? min((g + 1) * sb.groupsize, sb.size) : sb.size; }
+
+static uint *group_summary() {
+    if (gfree) return gfree;
+    ngfree = group_count();
+    gfree = calloc(ngfree, sizeof(uint));
     uchar buf[BSIZE];
     for (uint b = sb.datastart; b < sb.size; b++) {
+        if (b == sb.datastart || b % BPB == 0) read_block(BBLOCK(b), buf);
+        if (!(buf[(b % BPB) / 8] & (1 << (b % 8)))) gfree[BGROUP(b)]++;
+    }
+    return gfree;
+}
+
+uint group_free(uint g) { return g < group_count() ? group_summary()[g] : 0; }
+
+static uint group_size(uint g) { return group_end(g) - group_start(g); }
+
+uint group_for_dir(uint near) {
+    // 父目录所在的组还有四分之一以上空闲就留在那里，离得近的目录和文件都在附近的柱面上
+    if (group_free(near) >= group_size(near) / 4) return near;
+    // 否则找离它最近、空闲块不少于平均值的组
+    uint ng = group_count();
+    unsigned long avg = 0;
+    for (uint g = 0; g < ng; g++) avg += group_free(g);
+    avg /= ng;
+    for (uint d = 1; d < ng; d++) {
+        if (near + d < ng && group_free(near + d) && group_free(near + d) >= avg) return near + d;
+        if (d <= near && group_free(near - d) && group_free(near - d) >= avg) return near - d;
+    }
+    return near;
+}
+
+/*--------------- 位图分配器 ---------------------*/
+// 在[start, end)中找第一个空闲块并占用它，没有则返回 0
+static uint take_free(uint start, uint end) {
+    uchar buf[BSIZE];
+    for (uint b = start; b < end;) {
         uint bmap_blk = BBLOCK(b); // 计算b块的位向量信息储存在哪个位图块中
+        snap_cow(bmap_blk);        // 复制位图块时还要分配块，必须在读之前，否则两边会分到同一块
         read_block(bmap_blk, buf); // 读取相应位图块
-        // 计算相应字节在位图块中的偏移
-        int byte = (b % BPB) / 8;
-        int bit  = (b % BPB) % 8;
-        
-        if (!(buf[byte] & (1 << bit))) {         // 找到空闲位
+        // 同一个位图块只读一次
+        for (; b < end && BBLOCK(b) == bmap_blk; b++) {
+            // 计算相应字节在位图块中的偏移
+            int byte = (b % BPB) / 8;
+            int bit  = (b % BPB) % 8;
+            if (buf[byte] & (1 << bit)) continue;
             buf[byte] |= 1 << bit;               // 占用
-            write_block(bmap_blk, buf);          // 写回修改后的位图块 
+            log_write(bmap_blk, buf);            // 写回修改后的位图块
+            if (gfree) gfree[BGROUP(b)]--;
             zero_block(b);                       // 清零后返回
             return b;
         }
     }
+    return 0;
+}
+
+// 在组g中找空闲块，g是goal所在的组时从goal开始找到组尾，再从组头找到goal
+static uint take_in_group(uint g, uint goal) {
+    if (sb.groupsize && group_free(g) == 0) return 0;
+    if (g != BGROUP(goal)) return take_free(group_start(g), group_end(g));
+    uint b = take_free(goal, group_end(g));
+    return b ? b : take_free(group_start(g), goal);
+}
+
+// 返回空闲的块号码：先找goal所在的组，再按离它的远近依次找其他组，磁头移动最少；不分组时就是 first-fit
+uint allocate_block_near(uint goal) {
+    if (!sb.groupsize || goal < sb.datastart || goal >= sb.size) goal = sb.datastart;
+    uint ng = group_count(), g0 = BGROUP(goal);
+    for (uint d = 0; d < ng; d++) {
+        uint b = 0;
+        if (g0 + d < ng) b = take_in_group(g0 + d, goal);
+        if (!b && d && d <= g0) b = take_in_group(g0 - d, goal);
+        if (b) return b;
+    }
     Warn("allocate_block: disk used up");
     return 0;   // 约定 0 代表失败
 }
 
-void free_block(uint bno) {
-    // 合法性检查
-    if (bno == 0 || bno >= sb.size) {
-        Warn("free_block: 非法块号 %u", bno);
-        return;
+// 没有位置要求的块（快照副本等）：分组的布局下放在磁头所在的柱面附近
+uint allocate_block() { return allocate_block_near(sb.groupsize ? head_block() : sb.datastart); }
+
+// 磁头所在柱面的第一个块
+uint head_block() { return g_nsec ? (uint)((long)head_cyl * g_nsec / SPB) : 0; }
+
+static int cmp_uint(const void *a, const void *b) {
+    uint x = *(const uint *)a, y = *(const uint *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*--------------- 引用计数 -----------------------*/
+// 每个引用计数块是否可能有非零项：大多数文件系统从不 clone，
+// 这样改写数据块时就不必每次都去读引用计数表
+enum { REF_UNKNOWN = 0, REF_ZERO, REF_SOME };
+static uchar *refsum;
+static uint nrefsum;
+
+void refcnt_init() {
+    free(refsum);
+    refsum = NULL;
+    nrefsum = 0;
+}
+
+static uchar *ref_summary(uint rb) {
+    if (!refsum) {
+        nrefsum = NREFBLOCK(sb.size);
+        refsum = calloc(nrefsum, 1);
+    }
+    return &refsum[rb - sb.refstart];
+}
+
+static void ref_read(uint rb, uchar *buf) {
+    read_block(rb, buf);
+    uchar *sum = ref_summary(rb);
+    if (*sum == REF_UNKNOWN && !snap_mounted()) {  // 挂载快照时读到的是快照里的表，不能缓存
+        *sum = REF_ZERO;
+        for (uint i = 0; i < BSIZE; i++)
+            if (buf[i]) *sum = REF_SOME;
+    }
+}
+
+uint block_refs(uint bno) {
+    if (!sb.refstart || bno < sb.datastart || bno >= sb.size) return 0;
+    if (*ref_summary(RBLOCK(bno)) == REF_ZERO) return 0;
+    uchar buf[BSIZE];
+    ref_read(RBLOCK(bno), buf);
+    return buf[bno % BSIZE];
+}
+
+int share_blocks(uint *bnos, int n) {
+    uchar buf[BSIZE];
+    uint cur = 0;  // 当前读入的引用计数块，0 表示还没有读
+    int shared = 0;
+    for (int i = 0; i < n; i++) {
+        uint b = bnos[i];
+        if (!b) continue;
+        if (!sb.refstart || b < sb.datastart || b >= sb.size) {
+            bnos[i] = 0;
+            continue;
+        }
+        if (RBLOCK(b) != cur) {  // 同一个文件的块通常相邻，连续的块共用一次读写
+            if (cur) log_write(cur, buf);
+            cur = RBLOCK(b);
+            ref_read(cur, buf);
+            *ref_summary(cur) = REF_SOME;
+        }
+        if (buf[b % BSIZE] == REFMAX) {
+            bnos[i] = 0;
+            continue;
+        }
+        buf[b % BSIZE]++;
+        shared++;
     }
-    // 清除块数据
-    zero_block(bno);
-    // 修改位向量
+    if (cur) log_write(cur, buf);
+    return shared;
+}
+
+// 从已排序的bnos中去掉仍被其他文件共享的块（只减少引用计数），返回剩下的需要释放的块数
+static int drop_shared(uint *bnos, int n) {
+    if (!sb.refstart) return n;
     uchar buf[BSIZE];
-    uint bmap_blk = BBLOCK(bno);
-    read_block(bmap_blk, buf);
+    uint cur = 0;
+    int dirty = 0, m = 0;
+    for (int i = 0; i < n; i++) {
+        uint b = bnos[i];
+        if (b < sb.datastart || b >= sb.size || *ref_summary(RBLOCK(b)) == REF_ZERO) {
+            bnos[m++] = b;
+            continue;
+        }
+        if (RBLOCK(b) != cur) {
+            if (dirty) log_write(cur, buf);
+            cur = RBLOCK(b);
+            ref_read(cur, buf);
+            dirty = 0;
+        }
+        if (buf[b % BSIZE]) {
+            buf[b % BSIZE]--;
+            dirty = 1;
+        } else {
+            bnos[m++] = b;
+        }
+    }
+    if (dirty) log_write(cur, buf);
+    return m;
+}
 
-    int byte = (bno % BPB) / 8;
-    int bit  = (bno % BPB) % 8;
-    buf[byte] &= ~(1 << bit); // 清空该位
-    Log("Free block: %d\n", bno);
-    write_block(bmap_blk, buf);
+// 批量释放n个块：按块号排序后，同一个位图块只读写一次
+// 被释放的块不再清零，allocate_block() 分配时会清零；共享的块只减少一个引用
+void free_blocks(uint *bnos, int n) {
+    uchar buf[BSIZE];
+    qsort(bnos, n, sizeof(uint), cmp_uint);
+    n = drop_shared(bnos, n);
+    int i = 0;
+    while (i < n) {
+        // 合法性检查
+        if (bnos[i] == 0 || bnos[i] >= sb.size) {
+            Warn("free_block: 非法块号 %u", bnos[i]);
+            i++;
+            continue;
+        }
+        uint bmap_blk = BBLOCK(bnos[i]);
+        snap_cow(bmap_blk);
+        read_block(bmap_blk, buf);
+        // 修改位向量，直到遇到属于下一个位图块的块号
+        for (; i < n && bnos[i] < sb.size && BBLOCK(bnos[i]) == bmap_blk; i++) {
+            int byte = (bnos[i] % BPB) / 8;
+            int bit  = (bnos[i] % BPB) % 8;
+            if (gfree && (buf[byte] & (1 << bit)) && bnos[i] >= sb.datastart) gfree[BGROUP(bnos[i])]++;
+            buf[byte] &= ~(1 << bit); // 清空该位
+        }
+        log_write(bmap_blk, buf);
+    }
+    Log("Free %d blocks", n);
+}
+
+void free_block(uint bno) {
+    free_blocks(&bno, 1);
 }
 
 /*--------------- 几何信息 -----------------------*/
@@ -190,6 +479,7 @@ void init_block_cache() {
 
 // 查找缓存
 CacheEntry* find_in_cache(int blockno) {
+    if (pinned.valid && pinned.blockno == blockno) return &pinned;
     for (int i = 0; i < CACHE_CAPACITY; ++i) {
         if (cache[i].valid && cache[i].blockno == blockno) {
             return &cache[i];
@@ -200,7 +490,7 @@ CacheEntry* find_in_cache(int blockno) {
 
 // 移动到缓存头
 void move_to_front(CacheEntry *entry) {
-    if (entry == head) return;
+    if (entry == head || entry == &pinned) return;
 
     // 从链表中移除
     if (entry->prev) entry->prev->next = entry->next;
@@ -243,7 +533,37 @@ void evict_and_insert(int blockno, uchar *data) {
     move_to_front(entry);
 }
 
+// 把块钉在缓存里（同时只钉一个块，钉新块时放开旧的），追加写时文件的尾块总是命中
+void pin_block(int blockno) {
+    if (pinned.valid && pinned.blockno == blockno) return;
+    uchar buf[BSIZE];
+    read_block_raw(blockno, buf);
+    // 从 LRU 链表中摘下，避免同一个块有两份
+    CacheEntry *entry = NULL;
+    for (int i = 0; i < CACHE_CAPACITY; ++i)
+        if (cache[i].valid && cache[i].blockno == blockno) entry = &cache[i];
+    if (entry) {
+        if (entry->prev) entry->prev->next = entry->next;
+        else head = entry->next;
+        if (entry->next) entry->next->prev = entry->prev;
+        else tail = entry->prev;
+        entry->prev = entry->next = NULL;
+        entry->valid = 0;
+        entry->blockno = -1;
+    }
+    pinned.blockno = blockno;
+    pinned.valid = 1;
+    memcpy(pinned.data, buf, BSIZE);
+    Log("Cache for block %d pinned", blockno);
+}
+
+void unpin_block() {
+    pinned.valid = 0;
+    pinned.blockno = -1;
+}
+
 void clear_block_cache() {
+    unpin_block();
     for (int i = 0; i < CACHE_CAPACITY; ++i) {
         cache[i].blockno = -1;
         cache[i].valid = 0;
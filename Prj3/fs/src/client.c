@@ -5,8 +5,109 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "common.h"
 #include "tcp_utils.h"
 
+#define WINDOW 4   // 流式传输时最多有几个没有收到回复的请求
+#define MAXARG 256 // 命令参数（本地路径）的最大长度
+
+static char buf[TCP_BUF_SIZE];
+
+// 发送一条 pread 请求
+static void send_pread(tcp_client client, const char *name, uint off) {
+    char req[MAXARG + 32];
+    sprintf(req, "pread %s %u %u", name, off, IO_CHUNK);
+    client_send(client, req, strlen(req) + 1);
+}
+
+// get remote local：流水线地按块读取远程文件，不需要把整个文件放进缓冲区
+static void get_file(tcp_client client, const char *remote, const char *local) {
+    FILE *fp = fopen(local, "wb");
+    if (!fp) {
+        perror(local);
+        return;
+    }
+    uint sent = 0, total = 0;
+    int inflight = 0, done = 0;
+    while (inflight < WINDOW) {
+        send_pread(client, remote, sent);
+        sent += IO_CHUNK;
+        inflight++;
+    }
+    // 回复按请求的顺序到达；读到短块后不再发新请求，但已发出的回复都要收完
+    while (inflight > 0) {
+        int n = client_recv(client, buf, sizeof(buf));
+        inflight--;
+        if (n >= 4 && memcmp(buf, "Yes ", 4) == 0) {
+            if (!done) {
+                fwrite(buf + 4, 1, n - 4, fp);
+                total += n - 4;
+                if (n - 4 < IO_CHUNK) done = 1;
+            }
+        } else if (!done) {
+            buf[n] = 0;
+            printf("get: %s\n", n > 3 ? buf + 3 : "Connection closed");
+            done = 1;
+        }
+        if (!done) {
+            send_pread(client, remote, sent);
+            sent += IO_CHUNK;
+            inflight++;
+        }
+    }
+    fclose(fp);
+    printf("Received %u bytes\n", total);
+}
+
+// 检查一条普通回复，失败时打印并返回 0
+static int expect(tcp_client client, const char *ok) {
+    int n = client_recv(client, buf, sizeof(buf));
+    buf[n] = 0;
+    if (strcmp(buf, ok) == 0) return 1;
+    printf("put: %s\n", buf);
+    return 0;
+}
+
+// put local remote：创建（或截断）远程文件，再流水线地按块写入
+static void put_file(tcp_client client, const char *local, const char *remote) {
+    FILE *fp = fopen(local, "rb");
+    if (!fp) {
+        perror(local);
+        return;
+    }
+    static char req[MAXARG + 32 + IO_CHUNK];
+    sprintf(req, "mk %s", remote);
+    client_send(client, req, strlen(req) + 1);
+    client_recv(client, buf, sizeof(buf));  // 文件已存在时也继续
+    sprintf(req, "w %s 0 ", remote);
+    client_send(client, req, strlen(req) + 1);
+    if (!expect(client, "Write file successfully")) {
+        fclose(fp);
+        return;
+    }
+
+    uint off = 0;
+    int inflight = 0, ok = 1;
+    while (ok) {
+        int h = sprintf(req, "pwrite %s %u ", remote, off);
+        size_t n = fread(req + h + 16, 1, IO_CHUNK, fp);
+        if (n == 0) break;
+        // 长度写在数据前面，先读数据再把它挪到位
+        int m = sprintf(req + h, "%zu ", n);
+        memmove(req + h + m, req + h + 16, n);
+        req[h + m + n] = 0;
+        client_send(client, req, h + m + n + 1);
+        off += n;
+        if (++inflight == WINDOW) {
+            ok = expect(client, "Write file successfully");
+            inflight--;
+        }
+    }
+    for (; inflight > 0; inflight--) ok = expect(client, "Write file successfully") && ok;
+    fclose(fp);
+    if (ok) printf("Sent %u bytes\n", off);
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         fprintf(stderr, "Usage: %s <Port>\n", argv[0]);
@@ -14,7 +115,6 @@ int main(int argc, char *argv[]) {
     }
     int port = atoi(argv[2]);
     tcp_client client = client_init("localhost", port);
-    static char buf[4096];
     while (1) {
         // 获取工作路径并打印
         client_send(client, "p\n", 3);
@@ -26,6 +126,18 @@ int main(int argc, char *argv[]) {
         // 发送指令，获取回复
         fgets(buf, sizeof(buf), stdin);
         if (feof(stdin)) break;
+        // get/put 在客户端拆成一串 pread/pwrite
+        char op[8], a[MAXARG], b[MAXARG];
+        if (sscanf(buf, "%7s %255s %255s", op, a, b) == 3) {
+            if (strcmp(op, "get") == 0) {
+                get_file(client, a, b);
+                continue;
+            }
+            if (strcmp(op, "put") == 0) {
+                put_file(client, a, b);
+                continue;
+            }
+        }
         client_send(client, buf, strlen(buf) + 1);
         n = client_recv(client, buf, sizeof(buf));
         buf[n] = 0;
@@ -4,33 +4,126 @@
 #include "block.h"
 #include "inode.h"
 #include "common.h"
+#include "journal.h"
 #include "log.h"
+#include "snap.h"
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sched.h>
 
-#define FS_MAGIC 0x2303A514
+#define NORPHAN (sizeof(sb.orphan) / sizeof(uint))
+#define RECLAIM_BATCH 32  // 后台回收线程每次持锁最多释放的inode数
+#define COMPACT_BLOCKS 16 // 一次目录压缩最多改写的目录块数
 
 int current_uid = 0;
 struct superblock sb;
 inode *cwd = NULL;  // 当前工作目录
-static char current_path[256] = "/"; // 当前工作目录的绝对路径
+uint cg_cyls = CG_CYLS;  // 下次格式化时每个柱面组的柱面数
+static char current_path[MAXPATH + 1] = "/"; // 当前工作目录的绝对路径
 
 // 加载超级块，初始化在cmd_f中实现
 void sbinit() {
     uchar buf[BSIZE];
-    read_block(0, buf);
+    read_block_raw(0, buf);
     memcpy(&sb, buf, sizeof(sb));
+    if (sb.magic == FS_MAGIC && sb.bsize != BSIZE) {
+        // 块大小不同，布局和块号都对不上，只能当作未格式化
+        Warn("sbinit: 磁盘的块大小为 %u，本程序编译时为 %d", sb.bsize, BSIZE);
+        sb.magic = 0;
+    }
+    if (sb.magic == FS_MAGIC_V0) Warn("sbinit: 磁盘是旧版本的格式，需要重新格式化");
+    if (sb.magic != FS_MAGIC) {
+        sb.nlog = sb.nsnap = sb.refstart = 0;
+        snap_init();
+        refcnt_init();
+        group_init();
+        Warn("sbinit: 发现未知或未格式化的磁盘");
+        return;
+    }
+    // 重放日志中已提交的事务，超级块本身也可能在其中，需要重新读一次
+    journal_init();
+    read_block_raw(0, buf);
+    memcpy(&sb, buf, sizeof(sb));
+    snap_init();
+    refcnt_init();
+    group_init();
     if (sb.magic != FS_MAGIC) Warn("sbinit: 发现未知或未格式化的磁盘");
+    else if (sb.norphan) {
+        Log("sbinit: %d orphan(s) left from last run", sb.norphan);
+        reclaim_kick();  // 继续回收上次没删完的目录
+    }
+}
+
+// 把内存中的超级块写回磁盘
+void sbwrite() {
+    uchar buf[BSIZE] = {0};
+    memcpy(buf, &sb, sizeof(sb));
+    log_write(0, buf);
+}
+
+// 操作被撤销后，内存中的超级块、各种摘要和 cwd 里可能还有没生效的改动，按磁盘内容重新加载
+void fs_rollback() {
+    uchar buf[BSIZE];
+    read_block(0, buf);
+    memcpy(&sb, buf, sizeof(sb));
+    if (!snap_mounted()) snap_init();
+    refcnt_init();
+    group_init();
+    unpin_block();
+    if (cwd) {
+        inode *ip = iget(cwd->inum);
+        if (ip) {
+            ip->perm = cwd->perm;  // 登录时设置的权限只在内存中
+            iput(cwd);
+            cwd = ip;
+        }
+    }
+    Log("fs_rollback: in-memory state reloaded");
+}
+
+/*------------------ 目录 --------------------
+ * 目录文件由若干个块组成，每个块里是首尾相接的变长记录 dirent，最后一条记录的
+ * reclen 延伸到块尾。新记录放进第一个空闲空间足够的记录之后（或空闲记录本身），
+ * 都放不下才追加一个块。块 0 的前两条记录总是 "." 和 ".."。
+ */
+#define DE(buf, off) ((dirent *)((buf) + (off)))
+
+static void dir_read(inode *dp, uint i, uchar *buf) { readi(dp, buf, i * BSIZE, BSIZE); }
+static void dir_write(inode *dp, uint i, uchar *buf) { writei(dp, buf, i * BSIZE, BSIZE); }
+
+static int name_eq(dirent *d, const char *name, uint len) {
+    return d->namelen == len && memcmp(d->name, name, len) == 0;
+}
+
+// 下一条记录的偏移；reclen 损坏时直接跳到块尾，避免死循环
+static uint de_next(uchar *buf, uint off) {
+    uint r = DE(buf, off)->reclen;
+    return r < sizeof(dirent) || off + r > BSIZE ? BSIZE : off + r;
+}
+
+// 把(name, type, inum)填进off处的记录，reclen由调用者设置
+static void de_fill(uchar *buf, uint off, const char *name, uint len, short type, uint inum) {
+    dirent *d = DE(buf, off);
+    d->inum = inum;
+    d->namelen = len;
+    d->type = type;
+    memcpy(d->name, name, len);
 }
 
 // 辅助函数：目录查找项
 int dir_lookup(inode *dp, const char *name, uint *inum_out) {
-    entry e;
-    for (uint off = 0; off + sizeof(e) <= dp->size; off += sizeof(e)) {
-        readi(dp, (uchar *)&e, off, sizeof(e));
-        if (strncmp(e.name, name, MAXNAME) == 0) {
-            if (inum_out) *inum_out = e.inum;
-            return e.type;
+    uchar buf[BSIZE];
+    uint len = strlen(name);
+    for (uint i = 0; i < dp->size / BSIZE; i++) {
+        dir_read(dp, i, buf);
+        for (uint off = 0; off < BSIZE; off = de_next(buf, off)) {
+            dirent *d = DE(buf, off);
+            if (name_eq(d, name, len)) {
+                if (inum_out) *inum_out = d->inum;
+                return d->type;
+            }
         }
     }
     return 0;
@@ -38,44 +131,176 @@ int dir_lookup(inode *dp, const char *name, uint *inum_out) {
 
 // 辅助函数：添加目录项
 int dir_add(inode *dp, const char *name, short type, uint inum) {
-    // 若重名则直接返回错误
-    if (dir_lookup(dp, name, NULL)) return 1;
-
-    // 组织目录项内容
-    entry e;
-    memset(&e, 0, sizeof(e));
-    strncpy(e.name, name, MAXNAME);
-    e.type = type;
-    e.inum = inum;
+    uint len = strlen(name);
+    if (len == 0 || len > MAXNAME) return 1;
+    uint need = DIRENT_LEN(len);
+
+    // 查重的同时记住第一个放得下新记录的位置，都放不下才追加一个块
+    uchar buf[BSIZE], slot[BSIZE];
+    uint nb = dp->size / BSIZE, at = nb, at_off = 0;
+    for (uint i = 0; i < nb; i++) {
+        dir_read(dp, i, buf);
+        for (uint off = 0; off < BSIZE; off = de_next(buf, off)) {
+            dirent *d = DE(buf, off);
+            if (name_eq(d, name, len)) return 1; // 若重名则直接返回错误
+            uint used = d->namelen ? DIRENT_LEN(d->namelen) : 0;
+            if (at == nb && d->reclen >= used + need) {
+                at = i;
+                at_off = off;
+                memcpy(slot, buf, BSIZE);
+            }
+        }
+    }
 
-    // 以当前文件大小作为写入偏移
-    uint offset = dp->size;
+    if (at == nb) {  // 新块只有一条记录
+        memset(slot, 0, BSIZE);
+        DE(slot, 0)->reclen = BSIZE;
+    } else if (DE(slot, at_off)->namelen) {  // 从已有记录后面的空闲空间里切出一条
+        dirent *d = DE(slot, at_off);
+        uint used = DIRENT_LEN(d->namelen);
+        DE(slot, at_off + used)->reclen = d->reclen - used;
+        d->reclen = used;
+        at_off += used;
+    }
+    de_fill(slot, at_off, name, len, type, inum);
 
-    // 把目录项写入目录文件
-    int written = writei(dp, (uchar *)&e, offset, sizeof(e));
-    if (written != sizeof(e)) return 1;  // 写失败
+    // 把记录所在的块写回目录文件，追加新块时writei会更新dp->size并写回inode
+    uint old_size = dp->size;
+    dir_write(dp, at, slot);
+    return at == nb && dp->size != old_size + BSIZE;  // 写失败
+}
 
-    /* writei() 已经把 dp->size 更新为 offset + written
-       这里**千万不要**再自增，否则会多算一次！ */
+// 把块内存活的记录依次紧密排列，空闲空间都并入最后一条记录；返回已用的字节数，*last 为最后一条记录的偏移
+static uint de_pack(uchar *buf, uint *last) {
+    uchar out[BSIZE] = {0};
+    uint off = 0;
+    *last = 0;
+    for (uint o = 0; o < BSIZE; o = de_next(buf, o)) {
+        dirent *d = DE(buf, o);
+        if (!d->namelen) continue;
+        uint len = DIRENT_LEN(d->namelen);
+        memcpy(out + off, d, len);
+        DE(out, off)->reclen = len;
+        *last = off;
+        off += len;
+    }
+    DE(out, *last)->reclen = BSIZE - *last;
+    memcpy(buf, out, BSIZE);
+    return off;
+}
 
-    // 把内存中的inode刷回磁盘，保证size等元数据持久化
-    iupdate(dp);
-    return 0;
+// 辅助函数：压缩目录，把末尾块里的记录搬进前面块的空闲空间，搬空的块截掉。
+// 一次最多改写 COMPACT_BLOCKS 个目录块，让删除操作的日志事务有上界；没压缩完的目录下次删除时继续
+static void dir_compact(inode *dp) {
+    uchar buf[BSIZE], tail[BSIZE];
+    uint nb = dp->size / BSIZE, old_nb = nb;
+    uint dst = 0, last, used, budget = COMPACT_BLOCKS - 1;  // 留一次给没搬空的末尾块
+    int dirty = 0, stop = 0;
+    dir_read(dp, 0, buf);
+    used = de_pack(buf, &last);
+    while (dst < nb - 1 && !stop) {
+        dir_read(dp, nb - 1, tail);
+        int moved = 0, left = 0;
+        for (uint o = 0; o < BSIZE; o = de_next(tail, o)) {
+            dirent *d = DE(tail, o);
+            if (!d->namelen) continue;
+            uint len = DIRENT_LEN(d->namelen);
+            // 当前块放不下就写回它，换下一个块
+            while (!stop && used + len > BSIZE) {
+                if (dirty) {
+                    dir_write(dp, dst, buf);
+                    budget--;
+                    dirty = 0;
+                }
+                if (++dst >= nb - 1 || budget == 0) {
+                    stop = 1;
+                    break;
+                }
+                dir_read(dp, dst, buf);
+                used = de_pack(buf, &last);
+            }
+            if (stop) {
+                left = 1;
+                continue;
+            }
+            if (used) DE(buf, last)->reclen = used - last;
+            memcpy(buf + used, d, len);
+            DE(buf, used)->reclen = BSIZE - used;
+            last = used;
+            used += len;
+            d->namelen = 0;
+            dirty = moved = 1;
+        }
+        if (!left) {
+            nb--;
+        } else if (moved) {
+            uint tail_last;
+            de_pack(tail, &tail_last);
+            dir_write(dp, nb - 1, tail);
+        }
+    }
+    if (dirty) dir_write(dp, dst, buf);
+    if (nb < old_nb) itrunc(dp, nb * BSIZE);
+    Log("dir_compact: directory #%d compacted from %d to %d block(s)", dp->inum, old_nb, nb);
 }
 
 // 辅助函数：删除目录项
 int dir_remove(inode *dp, const char *name) {
-    entry e;
-    for (uint off = 0; off + sizeof(e) <= dp->size; off += sizeof(e)) {
-        readi(dp, (uchar *)&e, off, sizeof(e));
-        if (strncmp(e.name, name, MAXNAME) == 0) {
-            memset(&e, 0, sizeof(e));
-            writei(dp, (uchar *)&e, off, sizeof(e));
-            return 0;
+    uchar buf[BSIZE];
+    uint len = strlen(name), nb = dp->size / BSIZE;
+    int found = 0;
+    uint live = 0;  // 存活记录占用的字节数
+    uint tail = 0;  // 最后一个有存活记录的块之后的偏移
+    for (uint i = 0; i < nb; i++) {
+        dir_read(dp, i, buf);
+        int prev = -1, any = 0;
+        for (uint off = 0, next; off < BSIZE; off = next) {
+            dirent *d = DE(buf, off);
+            next = de_next(buf, off);
+            if (!found && name_eq(d, name, len)) {
+                // 并入前一条记录；块首的记录没有前一条，标记为空闲
+                if (prev >= 0) {
+                    DE(buf, prev)->reclen += d->reclen;
+                } else {
+                    d->namelen = 0;
+                    d->inum = 0;
+                    prev = off;
+                }
+                dir_write(dp, i, buf);
+                found = 1;
+                continue;
+            }
+            if (d->namelen) {
+                live += DIRENT_LEN(d->namelen);
+                any = 1;
+            }
+            prev = off;
         }
+        if (any) tail = (i + 1) * BSIZE;
     }
     // 目录文件大小没有改变，不用iupdate更新
-    return -1;
+    if (!found) return -1;
+
+    // 空闲空间比存活项还多、并且压缩后至少能省下一个块时压缩目录，保证查找开销与存活项数成正比；
+    // 否则只把末尾全空的块截掉
+    uint free = nb * BSIZE - live;
+    if (free > live && free >= 2 * BSIZE)
+        dir_compact(dp);
+    else if (tail < dp->size)
+        itrunc(dp, tail);
+    return 0;
+}
+
+// 目录中除了 "." 和 ".." 之外是否还有项
+static int dir_empty(inode *dp) {
+    if (dp->size > BSIZE) return 0;
+    if (dp->size == 0) return 1;
+    uchar buf[BSIZE];
+    dir_read(dp, 0, buf);
+    uint k = 0;
+    for (uint off = 0; off < BSIZE; off = de_next(buf, off))
+        if (DE(buf, off)->namelen && k++ >= 2) return 0;
+    return 1;
 }
 
 // rmdir的辅助函数：递归删除目录或文件
@@ -87,15 +312,18 @@ static void recursive_delete(inode *ip) {
     }
 
     // 是目录，遍历子项
-    entry e;
-    for (uint off = 0; off + sizeof(e) <= ip->size; off += sizeof(e)) {
-        readi(ip, (uchar *)&e, off, sizeof(e));
-        if (strcmp(e.name, ".") == 0 || strcmp(e.name, "..") == 0 || e.name[0] == '\0')
-            continue;
-
-        inode *child = iget(e.inum);
-        if (child) {
-            recursive_delete(child);
+    uchar buf[BSIZE];
+    for (uint i = 0; i < ip->size / BSIZE; i++) {
+        dir_read(ip, i, buf);
+        for (uint off = 0; off < BSIZE; off = de_next(buf, off)) {
+            dirent *d = DE(buf, off);
+            if (!d->namelen || name_eq(d, ".", 1) || name_eq(d, "..", 2))
+                continue;
+
+            inode *child = iget(d->inum);
+            if (child) {
+                recursive_delete(child);
+            }
         }
     }
 
@@ -104,25 +332,161 @@ static void recursive_delete(inode *ip) {
     iput(ip);
 }
 
-// ls的辅助函数：递归统计某目录下所有文件（包括子目录内）的大小之和
-uint calc_total_file_size(inode *dir) {
-    uint total = 0;
-    entry e;
-    for (uint off = 0; off + sizeof(e) <= dir->size; off += sizeof(e)) {
-        readi(dir, (uchar *)&e, off, sizeof(e));
-        if (strcmp(e.name, ".") == 0 || strcmp(e.name, "..") == 0 || e.name[0] == '\0')
+/*------------------ 后台回收 --------------------
+ * rmdir/logout 只把目录从父目录摘下并压入超级块中的孤儿列表，立即返回。
+ * 回收线程每次处理栈顶目录的最后一个目录项：文件和空目录直接释放并截短
+ * 父目录；非空子目录先从父目录摘下再压栈。孤儿列表持久化在超级块中，
+ * 重启后 sbinit() 会继续回收。
+ */
+static pthread_mutex_t fs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;  // 有新的孤儿
+static pthread_cond_t reclaim_idle = PTHREAD_COND_INITIALIZER;  // 孤儿列表已清空
+static pthread_t reclaimer;
+static int reclaimer_running = 0;
+
+void fs_lock() { pthread_mutex_lock(&fs_mutex); }
+void fs_unlock() { pthread_mutex_unlock(&fs_mutex); }
+
+int fs_wait(pthread_cond_t *cond, const struct timespec *deadline) {
+    if (!deadline) return pthread_cond_wait(cond, &fs_mutex);
+    return pthread_cond_timedwait(cond, &fs_mutex, deadline) == ETIMEDOUT;
+}
+
+// 把已经从目录树上摘下的inode交给回收线程
+static void orphan_add(inode *ip) {
+    if (sb.norphan == NORPHAN) {  // 列表已满，退回同步删除
+        Warn("orphan_add: orphan list full, deleting #%d synchronously", ip->inum);
+        recursive_delete(ip);
+        return;
+    }
+    sb.orphan[sb.norphan++] = ip->inum;
+    sbwrite();
+    iput(ip);
+}
+
+// 回收一步，返回0表示孤儿列表已空
+static int reclaim_step() {
+    if (sb.magic != FS_MAGIC || sb.norphan == 0) return 0;
+    inode *dp = iget(sb.orphan[sb.norphan - 1]);
+    if (!dp || dp->type == T_FILE) {
+        if (dp) ifree(dp);
+        goto pop;
+    }
+
+    // 在最后一个块里找最后一个有效目录项（块 0 的前两项是 "." 和 ".."）
+    uchar buf[BSIZE];
+    uint i = dp->size / BSIZE;
+    if (i == 0) {
+        ifree(dp);
+        goto pop;
+    }
+    dir_read(dp, --i, buf);
+    int last = -1, prev = -1, others = 0;  // others: 块中除它以外还有没有存活的记录
+    uint k = 0;
+    for (uint off = 0, p = 0; off < BSIZE; p = off, off = de_next(buf, off)) {
+        if (!DE(buf, off)->namelen || (i == 0 && k++ < 2)) {
+            if (DE(buf, off)->namelen) others = 1;
             continue;
-        inode *child = iget(e.inum);
-        if (!child) continue;
+        }
+        if (last >= 0) others = 1;
+        last = off;
+        prev = off ? (int)p : -1;
+    }
+    if (last < 0) {
+        if (i == 0) {  // 目录已经空了，释放它本身
+            ifree(dp);
+            goto pop;
+        }
+        itrunc(dp, i * BSIZE);  // 末尾的空块
+        iput(dp);
+        return 1;
+    }
 
-        if (child->type == T_FILE) {
-            total += child->size;
-        } else if (child->type == T_DIR) {
-            total += calc_total_file_size(child);  // 递归统计子目录
+    dirent *d = DE(buf, last);
+    inode *child = iget(d->inum);
+    // 先改写父目录再处理子项：崩溃时最多泄漏，不会误删重用了该inode号的新文件
+    if (!others && i > 0) {
+        itrunc(dp, i * BSIZE);
+    } else {
+        if (prev >= 0) {
+            DE(buf, prev)->reclen += d->reclen;
+        } else {
+            d->namelen = 0;
+            d->inum = 0;
         }
+        dir_write(dp, i, buf);
+    }
+    iput(dp);
+    if (!child) return 1;
+    if (child->type == T_DIR && !dir_empty(child)) {
+        orphan_add(child);
+    } else {
+        ifree(child);
         iput(child);
     }
-    return total;
+    return 1;
+
+pop:
+    if (dp) iput(dp);
+    sb.norphan--;
+    sbwrite();
+    return 1;
+}
+
+static void *reclaim_thread(void *arg) {
+    fs_lock();
+    while (reclaimer_running) {
+        if (sb.magic != FS_MAGIC || sb.norphan == 0) {
+            pthread_cond_broadcast(&reclaim_idle);
+            pthread_cond_wait(&reclaim_cond, &fs_mutex);
+            continue;
+        }
+        begin_op();  // 每一批作为一个事务，日志剩余的空间不够再回收一步时提前结束
+        for (int i = 0; i < RECLAIM_BATCH && journal_room() >= MAXOPBLOCKS && reclaim_step(); i++);
+        if (end_op() < 0) {  // 一步就超出了日志容量，重试也是一样，等下一次通知
+            Error("reclaim: orphan #%d cannot be reclaimed in one transaction", sb.orphan[sb.norphan - 1]);
+            pthread_cond_broadcast(&reclaim_idle);
+            pthread_cond_wait(&reclaim_cond, &fs_mutex);
+        }
+        // 每批之间让出锁，让前台请求插进来
+        fs_unlock();
+        sched_yield();
+        fs_lock();
+    }
+    fs_unlock();
+    return NULL;
+}
+
+// 启动后台回收线程
+void reclaim_start() {
+    reclaimer_running = 1;
+    pthread_create(&reclaimer, NULL, reclaim_thread, NULL);
+}
+
+// 停止后台回收线程，未回收完的孤儿留在超级块中
+void reclaim_stop() {
+    fs_lock();
+    reclaimer_running = 0;
+    pthread_cond_signal(&reclaim_cond);
+    fs_unlock();
+    pthread_join(reclaimer, NULL);
+}
+
+// 通知有新的孤儿；没有后台线程时（本地模式、测试）在当前操作里同步回收，
+// 日志剩余的空间不够时剩下的孤儿留到下一次
+void reclaim_kick() {
+    if (reclaimer_running)
+        pthread_cond_signal(&reclaim_cond);
+    else
+        while (journal_room() >= MAXOPBLOCKS && reclaim_step());
+}
+
+// 等待孤儿列表被回收完
+void reclaim_wait() {
+    fs_lock();
+    while (reclaimer_running && sb.magic == FS_MAGIC && sb.norphan)
+        pthread_cond_wait(&reclaim_idle, &fs_mutex);
+    fs_unlock();
 }
 
 /* 辅助函数：路径解析
@@ -131,15 +495,15 @@ uint calc_total_file_size(inode *dir) {
 inode *resolve_path(const char *path, char *name_out) {
     inode *ip = NULL;
 
-    // 如果路径为空，返回 NULL
-    if (!path || !*path) return NULL;
+    // 如果路径为空或过长，返回 NULL
+    if (!path || !*path || strlen(path) > MAXPATH) return NULL;
 
     // 如果路径是绝对路径，从根目录 inode 开始；否则从当前目录 cwd 开始
     ip = (*path == '/') ? iget(0) : iget(cwd->inum);
 
     // 为了不破坏原始字符串，先拷贝一份路径
-    char path_copy[256];
-    strncpy(path_copy, path, sizeof(path_copy));
+    char path_copy[MAXPATH + 1];
+    strcpy(path_copy, path);
 
     // 使用 strtok 将路径按 '/' 分割，获取第一个路径分量
     char *p = strtok(path_copy, "/");
@@ -174,7 +538,13 @@ inode *resolve_path(const char *path, char *name_out) {
     }
 
     // 如果需要获取路径最后一级的名字（比如用在创建文件时）
-    if (name_out) strncpy(name_out, p ? p : "", MAXNAME);
+    if (name_out) {
+        if (p && strlen(p) > MAXNAME) {
+            if (ip) iput(ip);
+            return NULL;
+        }
+        strcpy(name_out, p ? p : "");
+    }
 
     // 返回路径解析到的 inode 指针
     return ip;
@@ -188,46 +558,61 @@ int has_permission(inode *ip, int required) {
 }
 
 int cmd_f(int ncyl, int nsec) {
+    if (snap_mounted()) return E_PERMISSION_DENIED;  // 挂载的快照只读
     // 只有 uid 为 1 的用户（超级用户）才允许执行格式化操作
     if (!current_uid) return E_NOT_LOGGED_IN;
     if (current_uid != 1) return E_PERMISSION_DENIED;
 
-    // 计算总块数（每个 cylinder 有 nsec 个 sector，每个 sector 就是一个 block）
-    uint nblocks = (uint)ncyl * (uint)nsec;
+    // 计算总块数（每个 cylinder 有 nsec 个 sector，每 SPB 个 sector 组成一个 block）
+    uint nblocks = (uint)ncyl * (uint)nsec / SPB;
     if (nblocks == 0) return E_ERROR;
 
     // 设置磁盘几何信息（保存到全局变量）
     _set_disk_geometry(ncyl, nsec);
 
 
-    // 清空 superblock，并设置必要字段
+    // 旧文件系统的日志作废
+    journal_reset();
+
+    // 清空 superblock，并设置必要字段，旧的快照一并作废
     memset(&sb, 0, sizeof(sb));
+    snap_init();
+    refcnt_init();
+    group_init();
     uint nbitmap = (nblocks + BPB - 1) / BPB; // 向上取整
     sb.magic = FS_MAGIC;          // 魔数，用于判断是否格式化
     sb.size = nblocks;            // 总块数
+    sb.bsize = BSIZE;             // 块大小
+    sb.groupsize = min(BPB, cg_cyls * nsec / SPB);  // 每组的块数，一组最多由一个位图块管理
     sb.bmapstart = 1;             // 位图起始块（superblock 是 block 0）
-    sb.datastart = sb.bmapstart + nbitmap; // 数据起始快
+    sb.refstart = sb.bmapstart + nbitmap;            // 引用计数表紧跟在位图之后
+    sb.logstart = sb.refstart + NREFBLOCK(nblocks);  // 然后是日志区
+    sb.nlog = LOGSIZE;
+    sb.datastart = sb.logstart + 1 + sb.nlog; // 数据起始快
     sb.ninodeblock = 0;
+    if (sb.datastart >= nblocks) return E_ERROR;
 
-    // 清空位图所在的所有块（从 block 1 开始）
+    // 先丢弃整个磁盘：稀疏镜像里旧的内容不再占空间，之后没写过的块都读出全零，
+    // 位图、引用计数表和日志头只需写非零的部分。BDS 不支持丢弃时退回到逐块清零
     uchar buf[BSIZE] = {0};
-    memset(buf, 0, BSIZE);
-    for (uint i = 0; i < nbitmap; i++) write_block(sb.bmapstart + i, buf);
-
-    // 把 bitmap 本身对应的块标记为“已使用”（避免被当作数据块分配）
-    for (uint b = 0; b <= nbitmap; b++) {
-        uint map_blk = BBLOCK(b);     // 找到 bitmap 的块
-        read_block(map_blk, buf);     // 读出这个 bitmap 块
-
-        int byte = (b % BPB) / 8;      // 计算 bitmap 中字节索引
-        int bit  = (b % BPB) % 8;      // 计算该字节中的位索引
-        buf[byte] |= 1 << bit;         // 设置该位为 1，表示已使用
+    if (discard_blocks(0, nblocks) < 0) {
+        for (uint b = sb.bmapstart; b < sb.logstart; b++) write_block_raw(b, buf);
+        write_block_raw(sb.logstart, buf);
+    }
 
-        write_block(map_blk, buf);    // 写回修改后的 bitmap 块
+    // 把超级块、bitmap、引用计数表和日志区对应的块标记为“已使用”（避免被当作数据块分配），
+    // 每个位图块在内存里置好位后只写一次
+    for (uint m = 0; m * BPB < sb.datastart; m++) {
+        memset(buf, 0, BSIZE);
+        for (uint b = m * BPB; b < sb.datastart && b < (m + 1) * BPB; b++) buf[(b % BPB) / 8] |= 1 << (b % 8);
+        write_block_raw(sb.bmapstart + m, buf);
     }
+    // 在日志生效前先落盘超级块，之后的修改都经过日志
+    memcpy(buf, &sb, sizeof(sb));
+    write_block_raw(0, buf);
 
     // 创建根目录 inode，类型为 T_DIR
-    inode *root = ialloc(T_DIR);
+    inode *root = ialloc(T_DIR, 0);
 
     // 给根目录添加 "." 和 ".." 两个特殊目录项（都指向自己）
     dir_add(root, ".", T_DIR, root->inum);
@@ -242,8 +627,7 @@ int cmd_f(int ncyl, int nsec) {
     iput(root);                 // 释放刚刚分配的 root inode
 
     // 写入 superblock（block 0）
-    memcpy(buf, &sb, sizeof(sb));
-    write_block(0, buf);
+    sbwrite();
 
     // 工作目录回到根目录
     memcpy(current_path, "/", 2);
@@ -277,6 +661,7 @@ int cmd_login(int auid) {
 }
 
 int cmd_mk(char *name, short mode) {
+    if (snap_mounted()) return E_PERMISSION_DENIED;  // 挂载的快照只读
     if (!cwd) return E_NOT_LOGGED_IN;
     if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
     if (!has_permission(cwd, 2)) return E_PERMISSION_DENIED; // 检查权限
@@ -284,19 +669,27 @@ int cmd_mk(char *name, short mode) {
         Warn("cmd_mk: name already exists");
         return E_ERROR;
     }
+    if (strlen(name) > MAXNAME) {
+        Warn("cmd_mk: name too long");
+        return E_ERROR;
+    }
 
-    inode *ip = ialloc(T_FILE);
+    inode *ip = ialloc(T_FILE, cwd->inum);
     if (!ip) return E_ERROR;
     Log("New file inode #%d for '%s'\n", ip->inum, name);
+    ip->parent = cwd->inum;
+    iupdate(ip);
 
     if (dir_add(cwd, name, T_FILE, ip->inum))
         Warn("cmd_mk: failed to add file entry");
     iupdate(cwd);
+    iaccount(cwd->inum, 0, 1);
     iput(ip);
     return E_SUCCESS;
 }
 
 int cmd_mkdir(char *name, short mode) {
+    if (snap_mounted()) return E_PERMISSION_DENIED;  // 挂载的快照只读
     if (!cwd) return E_NOT_LOGGED_IN;
     if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
     if (!has_permission(cwd, 2)) return E_PERMISSION_DENIED; // 检查权限
@@ -305,14 +698,19 @@ int cmd_mkdir(char *name, short mode) {
         Warn("cmd_mkdir: name already exists");
         return E_ERROR;
     }
+    if (strlen(name) > MAXNAME) {
+        Warn("cmd_mkdir: name too long");
+        return E_ERROR;
+    }
 
-    inode *ip = ialloc(T_DIR);
+    inode *ip = ialloc(T_DIR, cwd->inum);
     if (!ip) return E_ERROR;
     Log("New dir inode #%d for '%s'\n", ip->inum, name);
 
     // 初始化 "." 和 ".." 目录项
     dir_add(ip, ".", T_DIR, ip->inum);
     dir_add(ip, "..", T_DIR, cwd->inum);
+    ip->parent = cwd->inum;
     iupdate(ip);
 
     // 将新目录添加到当前工作目录
@@ -327,35 +725,46 @@ int cmd_mkdir(char *name, short mode) {
 int cmd_cd(char *name) {
     if (!cwd) return E_NOT_LOGGED_IN;
     if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
-    inode *ip = resolve_path(name, NULL);
-    if (!ip || ip->type != T_DIR) return E_ERROR;
-    if (!has_permission(ip, 1)) return E_PERMISSION_DENIED; // 检查权限
-
-    // 修改cwd指针
-    iput(cwd);
-    cwd = ip;
 
-    // 更新路径字符串
+    // 先算出新的路径字符串，超过 MAXPATH 时不切换目录
+    char path[MAXPATH + 1];
     if (name[0] == '/') {
         // 绝对路径
-        strncpy(current_path, name, sizeof(current_path));
+        if (strlen(name) > MAXPATH) return E_ERROR;
+        strcpy(path, name);
     } else {
-        // 相对路径：拼接
+        strcpy(path, current_path);
         if (strcmp(name, "..") == 0) {
             // 删除末尾一层
-            char *last = strrchr(current_path, '/');
-            if (last != NULL && last != current_path) {
+            char *last = strrchr(path, '/');
+            if (last != NULL && last != path) {
                 *last = '\0';
             } else {
-                strcpy(current_path, "/");
+                strcpy(path, "/");
             }
         } else if (strcmp(name, ".") != 0) {
-            // 追加子目录
-            if (strcmp(current_path, "/") != 0)
-                strncat(current_path, "/", sizeof(current_path) - strlen(current_path) - 1);
-            strncat(current_path, name, sizeof(current_path) - strlen(current_path) - 1);
+            // 相对路径：拼接子目录
+            size_t len = strlen(path), sep = strcmp(path, "/") != 0;
+            if (len + sep + strlen(name) > MAXPATH) return E_ERROR;
+            if (sep) strcat(path, "/");
+            strcat(path, name);
         }
     }
+
+    inode *ip = resolve_path(name, NULL);
+    if (!ip || ip->type != T_DIR) {
+        if (ip) iput(ip);
+        return E_ERROR;
+    }
+    if (!has_permission(ip, 1)) {
+        iput(ip);
+        return E_PERMISSION_DENIED; // 检查权限
+    }
+
+    // 修改cwd指针和路径字符串
+    iput(cwd);
+    cwd = ip;
+    strcpy(current_path, path);
     return E_SUCCESS;
 }
 
@@ -371,30 +780,37 @@ int cmd_ls(entry **e, int *n) {
     if (!cwd) return E_NOT_LOGGED_IN;
     if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
 
-    int raw_cnt = cwd->size / sizeof(entry);
-    entry *all = malloc(raw_cnt * sizeof(entry));
+    // 每条记录至少占 DIRENT_LEN(1) 字节，据此估计项数的上限
+    int max_cnt = cwd->size / DIRENT_LEN(1);
+    entry *all = malloc((max_cnt + 1) * sizeof(entry));
     int cnt = 0;
 
-    for (int i = 0; i < raw_cnt; i++) {
-        entry tmp;
-        readi(cwd, (uchar *)&tmp, i * sizeof(entry), sizeof(entry));
-        if (tmp.name[0] == '\0' || strcmp(tmp.name, ".") == 0 || strcmp(tmp.name, "..") == 0)
-            continue;
-        inode *ip = iget(tmp.inum);
-        if (ip) {
-            all[cnt] = tmp;
-            if (ip->type == T_DIR) {
-                // 使用递归计算该目录下所有文件大小之和
-                all[cnt].size = calc_total_file_size(ip);
-            } else {
-                all[cnt].size = ip->size;
+    uchar buf[BSIZE];
+    for (uint i = 0; i < cwd->size / BSIZE; i++) {
+        dir_read(cwd, i, buf);
+        for (uint off = 0; off < BSIZE && cnt < max_cnt; off = de_next(buf, off)) {
+            dirent *d = DE(buf, off);
+            if (!d->namelen || name_eq(d, ".", 1) || name_eq(d, "..", 2))
+                continue;
+            inode *ip = iget(d->inum);
+            if (ip) {
+                memcpy(all[cnt].name, d->name, d->namelen);
+                all[cnt].name[d->namelen] = '\0';
+                all[cnt].type = d->type;
+                all[cnt].inum = d->inum;
+                if (ip->type == T_DIR) {
+                    // 目录大小取 inode 中增量维护的子树大小，无需递归
+                    all[cnt].size = ip->tsize;
+                } else {
+                    all[cnt].size = ip->size;
+                }
+                all[cnt].mtime = ip->mtime;
+                all[cnt].ctime = ip->ctime;
+                all[cnt].owner = ip->owner;
+                all[cnt].perm = ip->perm;
+                iput(ip);
+                cnt++;
             }
-            all[cnt].mtime = ip->mtime;
-            all[cnt].ctime = ip->ctime;
-            all[cnt].owner = ip->owner;
-            all[cnt].perm = ip->perm;
-            iput(ip);
-            cnt++;
         }
     }
 
@@ -407,6 +823,7 @@ int cmd_ls(entry **e, int *n) {
 }
 
 int cmd_rm(char *name) {
+    if (snap_mounted()) return E_PERMISSION_DENIED;  // 挂载的快照只读
     uint inum;
     if (!dir_lookup(cwd, name, &inum)) return E_ERROR;
     inode *ip = iget(inum);
@@ -419,12 +836,14 @@ int cmd_rm(char *name) {
     }
     dir_remove(cwd, name);
     iupdate(cwd);
+    iaccount(cwd->inum, -(int)ip->size, -1);
     ifree(ip);
     iput(ip);
     return E_SUCCESS;
 }
 
 int cmd_rmdir(char *name) {
+    if (snap_mounted()) return E_PERMISSION_DENIED;  // 挂载的快照只读
     uint inum;
     if (!dir_lookup(cwd, name, &inum)) return E_ERROR;
 
@@ -436,12 +855,14 @@ int cmd_rmdir(char *name) {
         return E_ERROR;
     }
 
-    // 调用递归删除
-    recursive_delete(ip);
-
-    // 从父目录移除项
+    // 从父目录移除项，从祖先目录的统计中扣除整棵子树
     dir_remove(cwd, name);
     iupdate(cwd);
+    iaccount(cwd->inum, -(int)ip->tsize, -(int)ip->tfiles);
+
+    // 子树交给后台回收
+    orphan_add(ip);
+    reclaim_kick();
     return E_SUCCESS;
 }
 
@@ -465,6 +886,7 @@ int cmd_cat(char *name, uchar **buf, uint *len) {
 }
 
 int cmd_w(char *name, uint l, const char *data) {
+    if (snap_mounted()) return E_PERMISSION_DENIED;  // 挂载的快照只读
     if (!cwd) return E_NOT_LOGGED_IN;
     if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
     uint inum;
@@ -477,11 +899,78 @@ int cmd_w(char *name, uint l, const char *data) {
         return E_ERROR;
     }
     writei(ip, (uchar *)data, 0, l);
+    itrunc(ip, l);  // 新内容更短时释放旧的尾部块
     iput(ip);
     return E_SUCCESS;
 }
 
+// 追加写：只改动尾块和新块，不需要先知道文件大小
+int cmd_a(char *name, uint l, const char *data) {
+    if (snap_mounted()) return E_PERMISSION_DENIED;  // 挂载的快照只读
+    if (!cwd) return E_NOT_LOGGED_IN;
+    if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
+    uint inum;
+    if (!dir_lookup(cwd, name, &inum)) return E_ERROR;
+    inode *ip = iget(inum);
+    if (!has_permission(ip, 2) || !has_permission(cwd, 2)) { // 检查权限
+        iput(ip);
+        return E_PERMISSION_DENIED;
+    }
+
+    if (ip->type != T_FILE) {
+        iput(ip);
+        return E_ERROR;
+    }
+    uint n = appendi(ip, (uchar *)data, l);
+    iput(ip);
+    return n == l ? E_SUCCESS : E_ERROR;
+}
+
+// 读出[off, off + l)范围内的数据，文件末尾之后的部分不返回；buf至少要有l字节
+int cmd_pread(char *name, uint off, uint l, uchar *buf, uint *len) {
+    if (!cwd) return E_NOT_LOGGED_IN;
+    if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
+    uint inum;
+    if (!dir_lookup(cwd, name, &inum)) return E_ERROR;
+    inode *ip = iget(inum);
+    if (!has_permission(ip, 1)) { // 检查权限
+        iput(ip);
+        return E_PERMISSION_DENIED;
+    }
+
+    if (ip->type != T_FILE) {
+        iput(ip);
+        return E_ERROR;
+    }
+    *len = readi(ip, buf, off, l);
+    iput(ip);
+    return E_SUCCESS;
+}
+
+// 从off开始覆盖写入l字节，写过文件末尾时文件变长；off不能超过文件末尾，避免留下空洞
+int cmd_pwrite(char *name, uint off, uint l, const char *data) {
+    if (snap_mounted()) return E_PERMISSION_DENIED;  // 挂载的快照只读
+    if (!cwd) return E_NOT_LOGGED_IN;
+    if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
+    uint inum;
+    if (!dir_lookup(cwd, name, &inum)) return E_ERROR;
+    inode *ip = iget(inum);
+    if (!has_permission(ip, 2) || !has_permission(cwd, 2)) { // 检查权限
+        iput(ip);
+        return E_PERMISSION_DENIED;
+    }
+
+    if (ip->type != T_FILE || off > ip->size) {
+        iput(ip);
+        return E_ERROR;
+    }
+    uint n = writei(ip, (uchar *)data, off, l);
+    iput(ip);
+    return n == l ? E_SUCCESS : E_ERROR;
+}
+
 int cmd_i(char *name, uint p, uint l, const char *data) {
+    if (snap_mounted()) return E_PERMISSION_DENIED;  // 挂载的快照只读
     if (!cwd) return E_NOT_LOGGED_IN;
     if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
     uint inum;
@@ -493,20 +982,16 @@ int cmd_i(char *name, uint p, uint l, const char *data) {
         iput(ip);
         return E_ERROR;
     }
-    // 如果pos比文件还大，直接加在文件末尾
+    // 如果pos比文件还大，直接加在文件末尾；只平移pos之后的数据
     if (p > ip->size)
         p = ip->size;
-    uchar *tmp = malloc(ip->size + l);
-    readi(ip, tmp, 0, p);
-    memcpy(tmp + p, data, l);
-    readi(ip, tmp + p + l, p, ip->size - p);
-    writei(ip, tmp, 0, ip->size + l);
-    free(tmp);
+    int ret = inserti(ip, (uchar *)data, p, l);
     iput(ip);
-    return E_SUCCESS;
+    return ret < 0 ? E_ERROR : E_SUCCESS;
 }
 
 int cmd_d(char *name, uint p, uint l) {
+    if (snap_mounted()) return E_PERMISSION_DENIED;  // 挂载的快照只读
     if (!cwd) return E_NOT_LOGGED_IN;
     if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
     uint inum;
@@ -525,31 +1010,63 @@ int cmd_d(char *name, uint p, uint l) {
         return E_SUCCESS;  // 删除范围超出文件末尾，直接返回成功
     }
 
-    uint old_size = ip->size;  // 保存原始大小
-    uint actual_del = min(l, old_size - p);  // 实际删除字节数
-    uint new_len = old_size - actual_del;
-
-    uchar *tmp = malloc(new_len);
-
-    // 拷贝删除前的前半段数据
-    readi(ip, tmp, 0, p);
+    // 只平移删除范围之后的数据，并释放多出来的块
+    deletei(ip, p, l);
+    iput(ip);
+    return E_SUCCESS;
+}
 
-    // 拷贝删除后的后半段数据
-    readi(ip, tmp + p, p + actual_del, old_size - p - actual_del);
+// 克隆文件：dst与src共享所有数据块，只复制块映射，之后哪一方改写哪个块时才复制那一块
+int cmd_clone(char *src, char *dst) {
+    if (snap_mounted()) return E_PERMISSION_DENIED;  // 挂载的快照只读
+    if (!cwd) return E_NOT_LOGGED_IN;
+    if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
+    uint inum;
+    if (!dir_lookup(cwd, src, &inum)) return E_ERROR;
+    if (dir_lookup(cwd, dst, NULL)) {
+        Warn("cmd_clone: name already exists");
+        return E_ERROR;
+    }
+    if (strlen(dst) > MAXNAME) {
+        Warn("cmd_clone: name too long");
+        return E_ERROR;
+    }
 
-    // 写回数据
-    writei(ip, tmp, 0, new_len);
+    inode *sp = iget(inum);
+    if (!has_permission(sp, 1) || !has_permission(cwd, 2)) { // 检查权限
+        iput(sp);
+        return E_PERMISSION_DENIED;
+    }
+    if (sp->type != T_FILE) {
+        iput(sp);
+        return E_ERROR;
+    }
 
-    // 修改文件大小
-    ip->size = new_len;
-    iupdate(ip);
+    inode *ip = ialloc(T_FILE, cwd->inum);
+    if (!ip) {
+        iput(sp);
+        return E_ERROR;
+    }
+    ip->parent = cwd->inum;
+    if (iclone(ip, sp) < 0) {
+        ifree(ip);  // 还回已经共享的块的引用
+        iput(ip);
+        iput(sp);
+        return E_ERROR;
+    }
+    Log("Cloned '%s' (inode #%d) to '%s' (inode #%d), %d block(s) shared", src, sp->inum, dst, ip->inum, ip->blocks);
 
-    free(tmp);
+    if (dir_add(cwd, dst, T_FILE, ip->inum))
+        Warn("cmd_clone: failed to add file entry");
+    iupdate(cwd);
+    iaccount(cwd->inum, ip->size, 1);
     iput(ip);
+    iput(sp);
     return E_SUCCESS;
 }
 
 int cmd_chmod(char *name, int perm, int kernel) {
+    if (snap_mounted()) return E_PERMISSION_DENIED;  // 挂载的快照只读
     if (!cwd) return E_NOT_LOGGED_IN;
     if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
     if (!cwd || perm < 0 || perm > 2) return E_ERROR;
@@ -599,12 +1116,12 @@ int cmd_logout() {
         return E_ERROR;
     }
 
-    // 删除整个目录树
-    recursive_delete(user_dir);
-
-    // 从根目录中移除此用户目录项
+    // 从根目录中移除此用户目录项，整个目录树交给后台回收
     dir_remove(root, username);
     iupdate(root);
+    iaccount(root->inum, -(int)user_dir->tsize, -(int)user_dir->tfiles);
+    orphan_add(user_dir);
+    reclaim_kick();
 
     // 清理工作目录与UID
     iput(cwd);
@@ -614,4 +1131,49 @@ int cmd_logout() {
 
     iput(root);
     return E_SUCCESS;
-}
\ No newline at end of file
+}
+// 创建快照，只有超级用户可以操作
+int cmd_snap(uint *id) {
+    if (!cwd) return E_NOT_LOGGED_IN;
+    if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
+    if (current_uid != 1 || snap_mounted()) return E_PERMISSION_DENIED;
+    return snap_take(id) == 0 ? E_SUCCESS : E_ERROR;
+}
+
+int cmd_snaprm(uint id) {
+    if (!cwd) return E_NOT_LOGGED_IN;
+    if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
+    if (current_uid != 1 || snap_mounted()) return E_PERMISSION_DENIED;
+    return snap_delete(id) == 0 ? E_SUCCESS : E_ERROR;
+}
+
+int cmd_lssnap(struct snapinfo **snaps, int *n) {
+    if (!cwd) return E_NOT_LOGGED_IN;
+    if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
+    *n = snap_list(snaps);
+    return E_SUCCESS;
+}
+
+// 挂载快照：之后所有读取都来自快照，修改类命令一律拒绝，直到 umount
+int cmd_mount(uint id) {
+    if (!cwd) return E_NOT_LOGGED_IN;
+    if (sb.magic != FS_MAGIC) return E_NOT_FORMATTED;
+    if (current_uid != 1 || snap_mounted()) return E_PERMISSION_DENIED;
+    if (snap_mount(id)) return E_ERROR;
+    iput(cwd);
+    cwd = iget(0);
+    strcpy(current_path, "/");
+    return E_SUCCESS;
+}
+
+int cmd_umount() {
+    if (!cwd) return E_NOT_LOGGED_IN;
+    if (!snap_mounted()) return E_ERROR;
+    snap_umount();
+    iput(cwd);
+    cwd = iget(0);
+    strcpy(current_path, "/");
+    // 快照的超级块副本没有孤儿列表，挂载期间回收线程一直空闲
+    if (sb.norphan) reclaim_kick();
+    return E_SUCCESS;
+}
@@ -0,0 +1,664 @@
+/* fsck.c - 离线一致性检查：多线程扫描 inode 与位图，发现问题并可选地修复 */
+
+#include "fsck.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "block.h"
+#include "fs.h"
+#include "inode.h"
+#include "journal.h"
+#include "log.h"
+#include "snap.h"
+
+#define IPB (BSIZE / sizeof(dinode))  // 每个 inode 块中的 inode 数
+#define NORPHAN (sizeof(((struct superblock *)0)->orphan) / sizeof(uint))
+#define NMAP (NDIRECT + APB)  // 块映射长度：直接块 + 一级间接块
+#define MAXREPORT 20          // 位图不一致时最多逐条报告多少个块
+#define CHUNK 64              // 并行扫描时每个线程一次领取的 inode 数
+
+// inode 的检查状态
+enum {
+    S_FREE = 0,  // 未分配
+    S_LOST,      // 已分配，但还没有从根目录或孤儿列表找到它
+    S_LIVE,      // 从根目录可达
+    S_PENDING,   // 在孤儿列表的子树里，等待后台回收
+};
+
+typedef struct {
+    dinode d;
+    int state;
+    uint map[NMAP];  // 逻辑块号 -> 物理块号，0 表示空洞
+    uchar *data;     // 目录的内容
+    int dirty;       // dinode 需要写回
+    int mapdirty;    // 间接块需要写回
+    int datadirty;   // 目录内容需要写回
+} fnode;
+
+static struct {
+    int fd;
+    int repair;
+    int nthread;
+    struct superblock sb;
+    int sbdirty;
+    uint nbitmap;
+    uint ninode;
+    fnode *nodes;
+    uchar *ref;     // 根据引用关系算出的位图
+    uchar *bitmap;  // 磁盘上的位图
+    ushort *nowner; // 每个数据块被多少个 inode 引用
+    uchar *refcnt;  // 磁盘上的引用计数表
+    int refdirty;
+    logheader lh;   // 检查模式下，日志中已提交的块叠加在读到的内容上
+    uchar (*logdata)[BSIZE];
+    uint nerror, nfixed, nmismatch;
+    uint next;      // 并行任务的下一个编号
+    pthread_mutex_t mu;
+} ck;
+
+// 报告一个问题；fixable 的问题在修复模式下由调用者负责修好
+static void problem(int fixable, const char *format, ...) {
+    char msg[256];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(msg, sizeof(msg), format, ap);
+    va_end(ap);
+    int fixed = ck.repair && fixable;
+    pthread_mutex_lock(&ck.mu);
+    ck.nerror++;
+    if (fixed) ck.nfixed++;
+    Warn("fsck: %s%s", msg, fixed ? " (fixed)" : "");
+    pthread_mutex_unlock(&ck.mu);
+}
+
+static void bread(uint bno, uchar *buf) {
+    for (int i = (int)ck.lh.n - 1; i >= 0; i--) {  // 日志中最新的版本优先
+        if (ck.lh.block[i] == bno) {
+            memcpy(buf, ck.logdata[i], BSIZE);
+            return;
+        }
+    }
+    if (pread(ck.fd, buf, BSIZE, (off_t)bno * BSIZE) != BSIZE) memset(buf, 0, BSIZE);
+}
+
+static void bwrite(uint bno, uchar *buf) {
+    if (pwrite(ck.fd, buf, BSIZE, (off_t)bno * BSIZE) != BSIZE) Error("fsck: write block %u failed", bno);
+}
+
+static int valid_block(uint b) { return b >= ck.sb.datastart && b < ck.sb.size; }
+
+// 用 nthread 个线程运行 fn，fn 通过 ck.next 领取任务
+static void parallel(void *(*fn)(void *)) {
+    pthread_t *tids = malloc(ck.nthread * sizeof(pthread_t));
+    ck.next = 0;
+    for (int i = 0; i < ck.nthread; i++) pthread_create(&tids[i], NULL, fn, NULL);
+    for (int i = 0; i < ck.nthread; i++) pthread_join(tids[i], NULL);
+    free(tids);
+}
+
+// 读出日志头；修复模式下把已提交的事务写回原位置，检查模式下只在内存中叠加
+static int load_journal() {
+    if (ck.sb.nlog == 0) return 0;
+    if (ck.sb.logstart + 1 + ck.sb.nlog > ck.sb.datastart) {
+        problem(0, "journal region [%u, %u) overlaps the data area", ck.sb.logstart,
+                ck.sb.logstart + 1 + ck.sb.nlog);
+        return -1;
+    }
+    uchar buf[BSIZE];
+    bread(ck.sb.logstart, buf);
+    memcpy(&ck.lh, buf, sizeof(ck.lh));
+    if (ck.lh.n > ck.sb.nlog || ck.lh.n > LOGSIZE) {
+        problem(1, "journal header claims %u blocks", ck.lh.n);
+        ck.lh.n = 0;
+        if (ck.repair) {
+            memset(buf, 0, BSIZE);
+            bwrite(ck.sb.logstart, buf);
+        }
+        return 0;
+    }
+    if (ck.lh.n == 0) return 0;
+
+    uint n = ck.lh.n;
+    ck.logdata = malloc(n * BSIZE);
+    ck.lh.n = 0;  // 读日志块本身时不要叠加
+    for (uint i = 0; i < n; i++) bread(ck.sb.logstart + 1 + i, ck.logdata[i]);
+    ck.lh.n = n;
+    Log("fsck: journal holds %u committed block(s)", n);
+    if (!ck.repair) return 0;
+
+    // 与挂载时的恢复相同：按顺序写回，同一个块后面的版本覆盖前面的
+    for (uint i = 0; i < n; i++) bwrite(ck.lh.block[i], ck.logdata[i]);
+    memset(buf, 0, BSIZE);
+    bwrite(ck.sb.logstart, buf);
+    ck.lh.n = 0;
+    Log("fsck: replayed journal");
+    return 0;
+}
+
+static int load_superblock() {
+    uchar buf[BSIZE];
+    bread(0, buf);
+    memcpy(&ck.sb, buf, sizeof(ck.sb));
+    if (ck.sb.magic == FS_MAGIC_V0) {
+        Error("fsck: image uses the old on-disk format, reformat it");
+        return -1;
+    }
+    if (ck.sb.magic != FS_MAGIC) {
+        Error("fsck: bad magic %#x, image is not formatted", ck.sb.magic);
+        return -1;
+    }
+    if (ck.sb.bsize != BSIZE) {
+        Error("fsck: image uses %u byte blocks, fsck is built for %d", ck.sb.bsize, BSIZE);
+        return -1;
+    }
+    if (load_journal() < 0) return -1;
+    bread(0, buf);  // 超级块本身也可能在日志里
+    memcpy(&ck.sb, buf, sizeof(ck.sb));
+
+    struct stat st;
+    fstat(ck.fd, &st);
+    ck.nbitmap = (ck.sb.size + BPB - 1) / BPB;
+    if ((off_t)ck.sb.size * BSIZE > st.st_size || ck.sb.bmapstart != 1 ||
+        ck.sb.bmapstart + ck.nbitmap > ck.sb.datastart || ck.sb.datastart > ck.sb.size ||
+        (ck.sb.refstart && (ck.sb.refstart != ck.sb.bmapstart + ck.nbitmap ||
+                            ck.sb.refstart + NREFBLOCK(ck.sb.size) > ck.sb.logstart)) ||
+        ck.sb.ninodeblock > NINODEBLOCK || ck.sb.ninodeblock == 0 || ck.sb.groupsize > BPB) {
+        Error("fsck: superblock is inconsistent with a %ld byte image", (long)st.st_size);
+        return -1;
+    }
+    for (uint i = 0; i < ck.sb.ninodeblock; i++) {
+        if (!valid_block(ck.sb.inodeblock[i])) {
+            Error("fsck: inode block %u is out of range (%u)", i, ck.sb.inodeblock[i]);
+            return -1;
+        }
+    }
+    if (ck.sb.norphan > NORPHAN) {
+        problem(1, "orphan list length %u is too large", ck.sb.norphan);
+        ck.sb.norphan = NORPHAN;
+        ck.sbdirty = 1;
+    }
+    return 0;
+}
+
+// 读出一个已分配 inode 的块映射（和目录内容），顺带检查块号是否越界
+static void load_inode(fnode *n, uint inum) {
+    dinode *d = &n->d;
+    for (uint i = 0; i < NDIRECT; i++) {
+        if (d->addrs[i] && !valid_block(d->addrs[i])) {
+            problem(1, "inode #%u: direct block %u out of range", inum, d->addrs[i]);
+            d->addrs[i] = 0;
+            n->dirty = 1;
+        }
+        n->map[i] = d->addrs[i];
+    }
+    if (d->addrs[NDIRECT + 1]) {
+        problem(1, "inode #%u: unsupported double indirect block %u", inum, d->addrs[NDIRECT + 1]);
+        d->addrs[NDIRECT + 1] = 0;
+        n->dirty = 1;
+    }
+    if (d->addrs[NDIRECT] && !valid_block(d->addrs[NDIRECT])) {
+        problem(1, "inode #%u: indirect block %u out of range", inum, d->addrs[NDIRECT]);
+        d->addrs[NDIRECT] = 0;
+        n->dirty = 1;
+    }
+    if (d->addrs[NDIRECT]) {
+        bread(d->addrs[NDIRECT], (uchar *)(n->map + NDIRECT));
+        for (uint i = NDIRECT; i < NMAP; i++) {
+            if (n->map[i] && !valid_block(n->map[i])) {
+                problem(1, "inode #%u: block %u out of range", inum, n->map[i]);
+                n->map[i] = 0;
+                n->mapdirty = 1;
+            }
+        }
+    }
+
+    // 文件末尾之后不应该还挂着块
+    uint nlbn = (d->size + BSIZE - 1) / BSIZE;
+    if (nlbn > NMAP) {
+        problem(1, "inode #%u: size %u exceeds the maximum file size", inum, d->size);
+        nlbn = NMAP;
+        d->size = NMAP * BSIZE;
+        n->dirty = 1;
+    }
+    for (uint i = nlbn; i < NMAP; i++) {
+        if (n->map[i]) {
+            problem(1, "inode #%u: block %u mapped past end of file", inum, n->map[i]);
+            if (!ck.repair) continue;  // 检查模式下仍算作引用，避免再报一次位图不一致
+            n->map[i] = 0;
+            if (i < NDIRECT) {
+                d->addrs[i] = 0;
+                n->dirty = 1;
+            } else {
+                n->mapdirty = 1;
+            }
+        }
+    }
+    if (d->addrs[NDIRECT] && nlbn <= NDIRECT) {
+        problem(1, "inode #%u: indirect block %u past end of file", inum, d->addrs[NDIRECT]);
+        if (ck.repair) {
+            d->addrs[NDIRECT] = 0;
+            n->dirty = 1;
+            n->mapdirty = 0;
+        }
+    }
+
+    uint blocks = d->addrs[NDIRECT] ? 1 : 0;
+    for (uint i = 0; i < NMAP; i++) blocks += n->map[i] != 0;
+    if (d->blocks != blocks) {
+        problem(1, "inode #%u: block count %u, should be %u", inum, d->blocks, blocks);
+        d->blocks = blocks;
+        n->dirty = 1;
+    }
+
+    if (d->type != T_DIR) return;
+    if (d->size % BSIZE) {
+        problem(1, "directory #%u: size %u is not a multiple of the block size", inum, d->size);
+        d->size -= d->size % BSIZE;
+        n->dirty = 1;
+    }
+    n->data = calloc(1, nlbn * BSIZE + 1);
+    for (uint i = 0; i < nlbn; i++)
+        if (n->map[i]) bread(n->map[i], n->data + i * BSIZE);
+}
+
+// 第一遍（并行）：按 inode 块读出所有 inode
+static void *scan_inodes(void *arg) {
+    uchar buf[BSIZE];
+    uint i;
+    while ((i = __atomic_fetch_add(&ck.next, 1, __ATOMIC_RELAXED)) < ck.sb.ninodeblock) {
+        bread(ck.sb.inodeblock[i], buf);
+        for (uint j = 0; j < IPB; j++) {
+            uint inum = i * IPB + j;
+            fnode *n = &ck.nodes[inum];
+            memcpy(&n->d, (dinode *)buf + j, sizeof(dinode));
+            if (n->d.type == 0) continue;
+            if (n->d.type != T_DIR && n->d.type != T_FILE) {
+                problem(1, "inode #%u: bad type %u", inum, n->d.type);
+                memset(&n->d, 0, sizeof(dinode));
+                n->dirty = 1;
+                continue;
+            }
+            n->state = S_LOST;
+            load_inode(n, inum);
+        }
+    }
+    return NULL;
+}
+
+// 目录块中off处的记录是否完整：不越过块尾，reclen 对齐并且放得下名字
+static int rec_ok(uchar *b, uint off) {
+    if (off + sizeof(dirent) > BSIZE) return 0;
+    dirent *d = (dirent *)(b + off);
+    return d->reclen % 4 == 0 && d->reclen >= DIRENT_LEN(d->namelen) && off + d->reclen <= BSIZE;
+}
+
+// 改写一条记录，返回 0 表示记录太短放不下新名字
+static int set_entry(fnode *dp, dirent *d, const char *name, short type, uint inum) {
+    uint len = strlen(name);
+    if (d->reclen < DIRENT_LEN(len)) return 0;
+    if (ck.repair) {
+        d->namelen = len;
+        memcpy(d->name, name, len);
+        d->type = type;
+        d->inum = inum;
+        dp->datadirty = 1;
+    }
+    return 1;
+}
+
+// 记录变成空闲，长度不变
+static void clear_entry(fnode *dp, dirent *d) {
+    if (!ck.repair) return;
+    d->namelen = 0;
+    d->inum = 0;
+    dp->datadirty = 1;
+}
+
+// 第二遍（串行）：从根目录遍历目录树，检查目录项和父指针，并重新计算子树大小
+static void walk(uint inum, uint parent, uint *tsize, uint *tfiles) {
+    fnode *n = &ck.nodes[inum];
+    n->state = S_LIVE;
+    if (n->d.parent != parent) {
+        problem(1, "inode #%u: parent is #%u, should be #%u", inum, n->d.parent, parent);
+        n->d.parent = parent;
+        n->dirty = 1;
+    }
+    if (n->d.type == T_FILE) {
+        *tsize += n->d.size;
+        *tfiles += 1;
+        return;
+    }
+
+    uint ts = 0, tf = 0, k = 0;  // k: 已经检查过的记录数，前两条应是 "." 和 ".."
+    for (uint i = 0; i < n->d.size / BSIZE; i++) {
+        uchar *b = n->data + i * BSIZE;
+        for (uint off = 0, prev = 0; off < BSIZE; prev = off, off += ((dirent *)(b + off))->reclen) {
+            dirent *e = (dirent *)(b + off);
+            if (!rec_ok(b, off)) {
+                // 坏记录及其后的部分并入前一条记录（块首则整块成为一条空闲记录）
+                problem(1, "directory #%u: bad record at offset %u", inum, i * BSIZE + off);
+                if (ck.repair) {
+                    if (off) {
+                        ((dirent *)(b + prev))->reclen = BSIZE - prev;
+                    } else {
+                        e->reclen = BSIZE;
+                        e->namelen = 0;
+                    }
+                    n->datadirty = 1;
+                }
+                break;
+            }
+            if (k < 2) {
+                const char *name = k ? ".." : ".";
+                uint want = k ? parent : inum;
+                k++;
+                if (e->namelen != strlen(name) || memcmp(e->name, name, e->namelen) || e->inum != want ||
+                    e->type != T_DIR)
+                    problem(set_entry(n, e, name, T_DIR, want), "directory #%u: bad \"%s\" entry, should point to #%u",
+                            inum, name, want);
+                continue;
+            }
+            if (!e->namelen) continue;  // 空闲记录
+            uint c = e->inum;
+            if (c >= ck.ninode || ck.nodes[c].state == S_FREE) {
+                problem(1, "directory #%u: entry \"%.*s\" points to free inode #%u", inum, e->namelen, e->name, c);
+                clear_entry(n, e);
+                continue;
+            }
+            if (ck.nodes[c].state != S_LOST) {
+                problem(1, "directory #%u: entry \"%.*s\" links inode #%u a second time", inum, e->namelen, e->name,
+                        c);
+                clear_entry(n, e);
+                continue;
+            }
+            if (e->type != ck.nodes[c].d.type) {
+                problem(1, "directory #%u: entry \"%.*s\" has type %d, inode #%u is %d", inum, e->namelen, e->name,
+                        e->type, c, ck.nodes[c].d.type);
+                if (ck.repair) {
+                    e->type = ck.nodes[c].d.type;
+                    n->datadirty = 1;
+                }
+            }
+            walk(c, inum, &ts, &tf);
+        }
+    }
+    if (k < 2) problem(0, "directory #%u: missing \".\" and \"..\"", inum);
+    if (n->d.tsize != ts || n->d.tfiles != tf) {
+        problem(1, "directory #%u: subtree size %u/%u files, should be %u/%u", inum, n->d.tsize,
+                n->d.tfiles, ts, tf);
+        n->d.tsize = ts;
+        n->d.tfiles = tf;
+        n->dirty = 1;
+    }
+    *tsize += ts;
+    *tfiles += tf;
+}
+
+// 孤儿列表中的子树由后台线程回收，只标记为可达，不检查统计信息
+static void mark_pending(uint inum) {
+    fnode *n = &ck.nodes[inum];
+    if (n->state != S_LOST) return;
+    n->state = S_PENDING;
+    if (n->d.type != T_DIR) return;
+    uint k = 0;
+    for (uint i = 0; i < n->d.size / BSIZE; i++) {
+        uchar *b = n->data + i * BSIZE;
+        for (uint off = 0; off < BSIZE && rec_ok(b, off); off += ((dirent *)(b + off))->reclen) {
+            dirent *e = (dirent *)(b + off);
+            if (k++ >= 2 && e->namelen && e->inum < ck.ninode) mark_pending(e->inum);
+        }
+    }
+}
+
+static void check_tree() {
+    uint ts = 0, tf = 0;
+    walk(0, 0, &ts, &tf);
+
+    uint norphan = 0;
+    for (uint i = 0; i < ck.sb.norphan; i++) {
+        uint inum = ck.sb.orphan[i];
+        if (inum >= ck.ninode || ck.nodes[inum].state == S_FREE) {
+            problem(1, "orphan list: inode #%u is not allocated", inum);
+            continue;
+        }
+        if (ck.nodes[inum].state == S_LIVE) {  // 否则回收线程会删掉仍在使用的目录
+            problem(1, "orphan list: inode #%u is still linked", inum);
+            continue;
+        }
+        mark_pending(inum);
+        ck.sb.orphan[norphan++] = inum;
+    }
+    if (norphan != ck.sb.norphan && ck.repair) {
+        ck.sb.norphan = norphan;
+        ck.sbdirty = 1;
+    }
+
+    for (uint inum = 0; inum < ck.ninode; inum++) {
+        fnode *n = &ck.nodes[inum];
+        if (n->state != S_LOST) continue;
+        problem(1, "inode #%u (%s, %u bytes) is not linked anywhere", inum,
+                n->d.type == T_DIR ? "dir" : "file", n->d.size);
+        if (!ck.repair) continue;
+        memset(&n->d, 0, sizeof(dinode));
+        memset(n->map, 0, sizeof(n->map));
+        n->state = S_FREE;
+        n->dirty = 1;
+        n->mapdirty = n->datadirty = 0;
+    }
+}
+
+static void mark(uint b, const char *owner, uint id) {
+    uchar bit = 1 << (b % 8);
+    if (__atomic_fetch_or(&ck.ref[b / 8], bit, __ATOMIC_RELAXED) & bit)
+        problem(0, "block %u is referenced more than once (%s %u)", b, owner, id);
+}
+
+// 数据块可以被 clone 出的几个文件共享，这里只计数，由 check_refs() 对照引用计数表
+static void mark_data(uint b, uint inum) {
+    if (__atomic_fetch_add(&ck.nowner[b], 1, __ATOMIC_RELAXED) == 0) mark(b, "inode", inum);
+}
+
+// 快照的超级块副本、映射链和复制出的块
+static void mark_snapshots() {
+    uchar buf[BSIZE];
+    snapmap *m = (snapmap *)buf;
+    for (uint k = 0; k < ck.sb.nsnap && k < NSNAP; k++) {
+        struct snapinfo *s = &ck.sb.snap[k];
+        if (valid_block(s->sbcopy)) mark(s->sbcopy, "snapshot", s->id);
+        else problem(0, "snapshot %u: superblock copy %u out of range", s->id, s->sbcopy);
+        uint nmap = 0;
+        for (uint bno = s->maphead; bno; bno = m->next) {
+            if (!valid_block(bno)) {
+                problem(0, "snapshot %u: map block %u out of range", s->id, bno);
+                break;
+            }
+            mark(bno, "snapshot", s->id);
+            bread(bno, buf);
+            for (uint i = 0; i < m->n && i < SNAPMAP_PAIRS; i++, nmap++) {
+                if (valid_block(m->pair[i][1])) mark(m->pair[i][1], "snapshot", s->id);
+                else problem(0, "snapshot %u: copy %u out of range", s->id, m->pair[i][1]);
+            }
+        }
+        if (nmap != s->nmap) {
+            problem(1, "snapshot %u: map holds %u blocks, superblock says %u", s->id, nmap, s->nmap);
+            s->nmap = nmap;
+            ck.sbdirty = 1;
+        }
+    }
+}
+
+// 第三遍（并行）：把所有仍在使用的 inode 引用的块记入 ck.ref
+static void *mark_blocks(void *arg) {
+    uint first;
+    while ((first = __atomic_fetch_add(&ck.next, CHUNK, __ATOMIC_RELAXED)) < ck.ninode) {
+        for (uint inum = first; inum < first + CHUNK && inum < ck.ninode; inum++) {
+            fnode *n = &ck.nodes[inum];
+            if (n->state == S_FREE) continue;
+            if (n->d.addrs[NDIRECT]) mark(n->d.addrs[NDIRECT], "inode", inum);
+            for (uint i = 0; i < NMAP; i++)
+                if (n->map[i]) mark_data(n->map[i], inum);
+        }
+    }
+    return NULL;
+}
+
+// 第四遍（并行）：逐个位图块比较，修复模式下直接写回。不一致的块可能很多，只逐条报告前 MAXREPORT 个
+static void *check_bitmap(void *arg) {
+    uint i;
+    while ((i = __atomic_fetch_add(&ck.next, 1, __ATOMIC_RELAXED)) < ck.nbitmap) {
+        uchar *have = ck.bitmap + i * BSIZE, *want = ck.ref + i * BSIZE;
+        if (memcmp(have, want, BSIZE) == 0) continue;  // 常见情况：整块一致
+        uint end = min((i + 1) * BPB, ck.sb.size);
+        uint nbad = 0;
+        for (uint b = i * BPB; b < end; b++) {
+            uint k = (b % BPB) / 8, bit = 1 << (b % 8);
+            if ((have[k] & bit) == (want[k] & bit)) continue;
+            if (__atomic_fetch_add(&ck.nmismatch, 1, __ATOMIC_RELAXED) < MAXREPORT)
+                problem(1, "block %u is %s in the bitmap", b, (want[k] & bit) ? "in use but free" : "free but in use");
+            else
+                nbad++;
+            have[k] ^= bit;
+        }
+        pthread_mutex_lock(&ck.mu);
+        ck.nerror += nbad;
+        if (ck.repair) ck.nfixed += nbad;
+        pthread_mutex_unlock(&ck.mu);
+        if (ck.repair) bwrite(ck.sb.bmapstart + i, have);
+    }
+    return NULL;
+}
+
+// 共享的数据块：引用计数表里记的是第一个拥有者之外的引用数
+static void check_refs() {
+    uint nbad = 0;
+    for (uint b = ck.sb.datastart; b < ck.sb.size; b++) {
+        uint want = ck.nowner[b] ? min(ck.nowner[b] - 1, REFMAX) : 0;
+        if (ck.refcnt[b] == want) continue;
+        if (nbad++ < MAXREPORT)
+            problem(1, "block %u has reference count %u, should be %u", b, ck.refcnt[b], want);
+        ck.refcnt[b] = want;
+        ck.refdirty = 1;
+    }
+    if (nbad <= MAXREPORT) return;
+    Warn("fsck: %u reference count mismatches in total", nbad);
+    ck.nerror += nbad - MAXREPORT;
+    if (ck.repair) ck.nfixed += nbad - MAXREPORT;
+}
+
+// 一次读出连续的n个块，已提交但还没写回的日志块叠加在上面
+static uchar *load_region(uint start, uint n) {
+    uchar *buf = malloc(n * BSIZE);
+    if (pread(ck.fd, buf, n * BSIZE, (off_t)start * BSIZE) != (ssize_t)(n * BSIZE)) memset(buf, 0, n * BSIZE);
+    for (uint i = 0; i < ck.lh.n; i++) {
+        uint b = ck.lh.block[i];
+        if (b >= start && b < start + n) memcpy(buf + (b - start) * BSIZE, ck.logdata[i], BSIZE);
+    }
+    return buf;
+}
+
+static void check_blocks() {
+    ck.ref = calloc(1, ck.nbitmap * BSIZE);
+    ck.bitmap = load_region(ck.sb.bmapstart, ck.nbitmap);
+    ck.nowner = calloc(ck.sb.size, sizeof(ushort));
+
+    // 超级块、位图、日志区和 inode 块总是在用的
+    for (uint b = 0; b < ck.sb.datastart; b++) ck.ref[b / 8] |= 1 << (b % 8);
+    for (uint i = 0; i < ck.sb.ninodeblock; i++) mark(ck.sb.inodeblock[i], "inode block", i);
+    mark_snapshots();
+    parallel(mark_blocks);
+    if (ck.sb.refstart) {
+        ck.refcnt = load_region(ck.sb.refstart, NREFBLOCK(ck.sb.size));
+        check_refs();
+    }
+    parallel(check_bitmap);
+    if (ck.nmismatch > MAXREPORT)
+        Warn("fsck: %u bitmap mismatches in total", ck.nmismatch);
+}
+
+// 把修改过的 inode、间接块、目录内容和超级块写回
+static void write_back() {
+    uchar buf[BSIZE];
+    for (uint i = 0; i < ck.sb.ninodeblock; i++) {
+        int dirty = 0;
+        for (uint j = 0; j < IPB; j++) {
+            fnode *n = &ck.nodes[i * IPB + j];
+            dirty |= n->dirty;
+            memcpy((dinode *)buf + j, &n->d, sizeof(dinode));
+        }
+        if (dirty) bwrite(ck.sb.inodeblock[i], buf);
+    }
+    for (uint inum = 0; inum < ck.ninode; inum++) {
+        fnode *n = &ck.nodes[inum];
+        if (n->mapdirty && n->d.addrs[NDIRECT]) bwrite(n->d.addrs[NDIRECT], (uchar *)(n->map + NDIRECT));
+        if (!n->datadirty) continue;
+        for (uint i = 0; i * BSIZE < n->d.size; i++)
+            if (n->map[i]) bwrite(n->map[i], n->data + i * BSIZE);
+    }
+    if (ck.refdirty)  // 引用计数表很小，整张写回
+        for (uint i = 0; i < NREFBLOCK(ck.sb.size); i++) bwrite(ck.sb.refstart + i, ck.refcnt + i * BSIZE);
+    if (ck.sbdirty) {
+        memset(buf, 0, BSIZE);
+        memcpy(buf, &ck.sb, sizeof(ck.sb));
+        bwrite(0, buf);
+    }
+    fsync(ck.fd);
+}
+
+static void cleanup() {
+    if (ck.nodes)
+        for (uint i = 0; i < ck.ninode; i++) free(ck.nodes[i].data);
+    free(ck.nodes);
+    free(ck.ref);
+    free(ck.bitmap);
+    free(ck.nowner);
+    free(ck.refcnt);
+    free(ck.logdata);
+    close(ck.fd);
+    pthread_mutex_destroy(&ck.mu);
+}
+
+int fsck_image(const char *path, int repair, int nthread, fsck_result *res) {
+    memset(&ck, 0, sizeof(ck));
+    pthread_mutex_init(&ck.mu, NULL);
+    ck.repair = repair;
+    ck.nthread = nthread > 0 ? nthread : 1;
+    ck.fd = open(path, repair ? O_RDWR : O_RDONLY);
+    if (ck.fd < 0) {
+        Error("fsck: cannot open %s", path);
+        pthread_mutex_destroy(&ck.mu);
+        return -1;
+    }
+    if (load_superblock() < 0) {
+        cleanup();
+        return -1;
+    }
+
+    ck.ninode = ck.sb.ninodeblock * IPB;
+    ck.nodes = calloc(ck.ninode, sizeof(fnode));
+    parallel(scan_inodes);
+    if (ck.nodes[0].d.type != T_DIR) {
+        Error("fsck: root inode #0 is not a directory");
+        cleanup();
+        return -1;
+    }
+    check_tree();
+    check_blocks();
+    if (repair) write_back();
+
+    if (res) {
+        memset(res, 0, sizeof(*res));
+        for (uint i = 0; i < ck.ninode; i++) res->ninode += ck.nodes[i].state != S_FREE;
+        for (uint i = 0; i < ck.nbitmap * BSIZE; i++) res->nblock += __builtin_popcount(ck.ref[i]);
+        res->nerror = ck.nerror;
+        res->nfixed = ck.nfixed;
+    }
+    Log("fsck: %u problem(s), %u fixed", ck.nerror, ck.nfixed);
+    int left = ck.nerror - ck.nfixed;
+    cleanup();
+    return left;
+}
@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fsck.h"
+#include "log.h"
+
+FILE *log_file;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-y] [-j <threads>] <disk image>\n", prog);
+    fprintf(stderr, "  -y  repair the problems found (the FS must not be running)\n");
+    fprintf(stderr, "  -j  number of scanning threads (default: number of CPUs)\n");
+    exit(EXIT_FAILURE);
+}
+
+// 退出码与常见的 fsck 一致：0 没有问题，1 问题已全部修复，4 还有问题没有修复，8 无法检查
+int main(int argc, char *argv[]) {
+    int repair = 0;
+    int nthread = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "yj:")) != -1) {
+        switch (opt) {
+            case 'y': repair = 1; break;
+            case 'j': nthread = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || nthread <= 0) usage(argv[0]);
+    log_file = stdout;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    fsck_result res;
+    int left = fsck_image(argv[optind], repair, nthread, &res);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (left < 0) return 8;
+
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("%s: %u inodes, %u blocks in use, %u problem(s), %u fixed (%d threads, %.1f ms)\n",
+           argv[optind], res.ninode, res.nblock, res.nerror, res.nfixed, nthread, ms);
+    if (left) return 4;
+    return res.nerror ? 1 : 0;
+}
@@ -5,6 +5,7 @@
 #include <time.h>
 #include "common.h"
 #include "block.h"
+#include "journal.h"
 #include "log.h"
 
 extern uint current_uid;
@@ -12,6 +13,7 @@ extern struct superblock sb;
 #define INODES_PER_BLOCK (BSIZE / sizeof(dinode))
 #define IBLOCK(i) (sb.inodeblock[(i) / INODES_PER_BLOCK])  // inode 所在 block
 #define IOFFSET(i) ((i) % INODES_PER_BLOCK)               // inode 在 block 中的偏移
+#define MAXFILEBLK (NDIRECT + APB)                         // 目前只支持一级间接块
 
 // 获取编号为inum的inode
 inode *iget(uint inum) {
@@ -35,6 +37,9 @@ inode *iget(uint inum) {
     ip->ctime = dip->ctime;
     ip->owner = dip->owner;
     ip->perm = dip->perm;
+    ip->parent = dip->parent;
+    ip->tsize = dip->tsize;
+    ip->tfiles = dip->tfiles;
 
     memcpy(ip->addrs, dip->addrs, sizeof(ip->addrs)); // 对于数组要单独用复制操作，否则只会复制指针
     return ip;
@@ -43,52 +48,78 @@ inode *iget(uint inum) {
 // 释放 inode（当前直接释放内存）
 void iput(inode *ip) { free(ip); }
 
-// 清空inode，以再之后重用
+static void trunc_blocks(inode *ip, uint size);
+
+// 释放inode占用的全部数据块和间接块，并清空dinode，以在之后重用
 void ifree(inode *ip) {
+    trunc_blocks(ip, 0);
     uchar buf[BSIZE];
     read_block(IBLOCK(ip->inum), buf);
     dinode *dip = (dinode *)buf + IOFFSET(ip->inum);
     memset(dip, 0, sizeof(dinode));
-    write_block(IBLOCK(ip->inum), buf);
+    log_write(IBLOCK(ip->inum), buf);
 }
 
-// 分配一个新的 inode，设置类型，初始化其内容
-inode *ialloc(short type) {
-    uchar buf[BSIZE];
-    uint current_block = -1;
-
-    uint max_inodes = sizeof(sb.inodeblock) / sizeof(uint) * INODES_PER_BLOCK; // 最大 inode 数
-    for (uint inum = 0; inum < max_inodes; inum++) {
-        // 如果检索的inode号超过已分配的inode块，则要新分配一个inode块
-        if (inum / INODES_PER_BLOCK == sb.ninodeblock) {
-            sb.inodeblock[sb.ninodeblock] = allocate_block();
-            sb.ninodeblock++;
-        }
-        uint blkno = IBLOCK(inum);          // inode 所在 block
-        if (blkno != current_block) {       // 如果这次检索的块与上一次的不同则重新读取，否则沿用上一次的
-            read_block(blkno, buf);
-            current_block = blkno;
-        }
-        dinode *dip = ((dinode *)buf) + IOFFSET(inum);  // inode 在块中的位置
+// 新 inode 所在的柱面组：根目录放在第一组，文件跟父目录在同一组，目录放到离父目录最近的不太满的组
+static uint pick_group(short type, uint parent) {
+    if (sb.ninodeblock == 0 || parent / INODES_PER_BLOCK >= sb.ninodeblock) return BGROUP(sb.datastart);
+    uint g = BGROUP(IBLOCK(parent));
+    return type == T_DIR ? group_for_dir(g) : g;
+}
 
-        if (dip->type == 0) { // 如果这个编号（位置）的inode没有被占用，则用它
-            dip->type = type;
-            dip->size = 0;
-            dip->blocks = 0;
-            dip->ctime = dip->mtime = (uint)time(NULL);
-            dip->owner = current_uid;
-            dip->perm = 1;
+// 在第i个 inode 块中找空闲的 dinode，块内容读入buf，返回它的 inode 号，没有则返回 -1
+static int free_slot(uint i, uchar *buf) {
+    read_block(sb.inodeblock[i], buf);
+    for (uint k = 0; k < INODES_PER_BLOCK; k++)
+        if (((dinode *)buf)[k].type == 0) return i * INODES_PER_BLOCK + k;
+    return -1;
+}
 
-            memset(dip->addrs, 0, sizeof(dip->addrs));
+// 分配一个新的 inode，设置类型，初始化其内容
+inode *ialloc(short type, uint parent) {
+    uchar buf[BSIZE];
+    uint g = pick_group(type, parent);
+    int inum = -1;
 
-            write_block(blkno, buf);
-            Log("[ialloc] Allocated inode #%d for type %d\n", inum, type);
-            return iget(inum); // 返回储存在内存里的inode信息
+    // 先用组内已有 inode 块的空位
+    for (uint i = 0; i < sb.ninodeblock && inum < 0; i++)
+        if (BGROUP(sb.inodeblock[i]) == g) inum = free_slot(i, buf);
+    // 再在组内新分配一个 inode 块
+    if (inum < 0 && sb.ninodeblock < NINODEBLOCK) {
+        uint b = allocate_block_near(group_start(g));
+        if (b) {
+            sb.inodeblock[sb.ninodeblock++] = b;
+            sbwrite();
+            inum = free_slot(sb.ninodeblock - 1, buf);
         }
     }
+    // inode 块用完了，只能用其他组的空位
+    for (uint i = 0; i < sb.ninodeblock && inum < 0; i++)
+        if (BGROUP(sb.inodeblock[i]) != g) inum = free_slot(i, buf);
+    if (inum < 0) {
+        Error("ialloc: no free inode available");
+        return NULL;
+    }
+
+    dinode *dip = ((dinode *)buf) + IOFFSET(inum);  // inode 在块中的位置
+    dip->type = type;
+    dip->size = 0;
+    dip->blocks = 0;
+    dip->ctime = dip->mtime = (uint)time(NULL);
+    dip->owner = current_uid;
+    dip->perm = 1;
+    dip->parent = 0;
+    dip->tsize = dip->tfiles = 0;
+    memset(dip->addrs, 0, sizeof(dip->addrs));
 
-    Error("ialloc: no free inode available");
-    return NULL;
+    log_write(IBLOCK(inum), buf);
+    Log("[ialloc] Allocated inode #%d for type %d in group %u\n", inum, type, g);
+    return iget(inum); // 返回储存在内存里的inode信息
+}
+
+// 为ip分配一个数据块或间接块：紧跟在前一个块prev之后，没有前一个块时靠近 inode 所在的块
+static uint balloc(inode *ip, uint prev) {
+    return allocate_block_near(prev ? prev + 1 : IBLOCK(ip->inum));
 }
 
 // 将内存中的 inode 内容写回磁盘
@@ -106,10 +137,28 @@ void iupdate(inode *ip) {
     dip->ctime = ip->ctime;
     dip->owner = ip->owner;
     dip->perm = ip->perm;
+    dip->parent = ip->parent;
     memcpy(dip->addrs, ip->addrs, sizeof(dip->addrs));
+    // tsize/tfiles 只由 iaccount() 修改，内存中的副本可能已过期，不能写回
 
     // 将修改的数据写回磁盘中
-    write_block(IBLOCK(ip->inum), buf);
+    log_write(IBLOCK(ip->inum), buf);
+}
+
+// 把子树大小和文件数的增量累加到目录inum及其所有祖先目录上
+void iaccount(uint inum, int dsize, int dfiles) {
+    uchar buf[BSIZE];
+    while (1) {
+        if (inum / INODES_PER_BLOCK >= sb.ninodeblock) return;
+        read_block(IBLOCK(inum), buf);
+        dinode *dip = ((dinode *)buf) + IOFFSET(inum);
+        if (dip->type != T_DIR) return;
+        dip->tsize += dsize;
+        dip->tfiles += dfiles;
+        log_write(IBLOCK(inum), buf);
+        if (dip->parent == inum) return;  // 已到达根目录
+        inum = dip->parent;
+    }
 }
 
 // 获取逻辑块号对应的物理块地址，必要时分配
@@ -117,8 +166,7 @@ static uint get_data_block(inode *ip, uint lbn, int alloc) {
     // 在直接块里放得下
     if (lbn < NDIRECT) {
         if (ip->addrs[lbn] == 0 && alloc) {
-            ip->addrs[lbn] = allocate_block();
-            zero_block(ip->addrs[lbn]);
+            ip->addrs[lbn] = balloc(ip, lbn ? ip->addrs[lbn - 1] : 0);
             ip->blocks++;
         }
         return ip->addrs[lbn];
@@ -128,8 +176,7 @@ static uint get_data_block(inode *ip, uint lbn, int alloc) {
     lbn -= NDIRECT;
     if (lbn < APB) {
         if (ip->addrs[NDIRECT] == 0 && alloc) { // 如果没有一级间接块且允许分配则先分配一级间接块
-            ip->addrs[NDIRECT] = allocate_block();
-            zero_block(ip->addrs[NDIRECT]);
+            ip->addrs[NDIRECT] = balloc(ip, ip->addrs[NDIRECT - 1]);
             ip->blocks++;
         }
         else if (ip->addrs[NDIRECT] == 0 && !alloc) return 0; // 如果没有一级间接块且不允许分配，则直接退出
@@ -139,9 +186,8 @@ static uint get_data_block(inode *ip, uint lbn, int alloc) {
         read_block(ip->addrs[NDIRECT], indirect); // 读入一级间接块
         uint *table = (uint *)indirect;
         if (table[lbn] == 0 && alloc) { // 如果间接块中对应的逻辑块未分配且允许分配则分配
-            table[lbn] = allocate_block();
-            zero_block(table[lbn]); // 对新分配的块置零
-            write_block(ip->addrs[NDIRECT], indirect); // 将更新后的间接块写回
+            table[lbn] = balloc(ip, lbn ? table[lbn - 1] : ip->addrs[NDIRECT]);
+            log_write(ip->addrs[NDIRECT], indirect); // 将更新后的间接块写回
             ip->blocks++;
         }
         return table[lbn];
@@ -151,6 +197,33 @@ static uint get_data_block(inode *ip, uint lbn, int alloc) {
     return 0;
 }
 
+// 数据块被 clone 共享时，改写前换成一个私有的副本（copy 为 0 表示调用者会整块覆盖，不必复制），
+// 返回改写时应当使用的块号，调用者负责更新块映射
+static uint unshare_block(uint bno, int copy) {
+    if (block_refs(bno) == 0) return bno;
+    uint c = allocate_block_near(bno);
+    if (c == 0) return 0;
+    if (copy) {
+        uchar buf[BSIZE];
+        read_block(bno, buf);
+        write_block(c, buf);
+    }
+    free_block(bno);  // 只减少一个引用
+    return c;
+}
+
+// 把逻辑块lbn映射到物理块bno（lbn必须已经分配）
+static void set_data_block(inode *ip, uint lbn, uint bno) {
+    if (lbn < NDIRECT) {
+        ip->addrs[lbn] = bno;
+        return;
+    }
+    uchar indirect[BSIZE];
+    read_block(ip->addrs[NDIRECT], indirect);
+    ((uint *)indirect)[lbn - NDIRECT] = bno;
+    log_write(ip->addrs[NDIRECT], indirect);
+}
+
 // 从inode索引的文件中读取数据到dst中，起始偏移量为off，读取字节数为n
 int readi(inode *ip, uchar *dst, uint off, uint n) {
     if (off >= ip->size) return 0; // 如果偏移量超过文件大小，则直接返回0
@@ -174,8 +247,8 @@ int readi(inode *ip, uchar *dst, uint off, uint n) {
     return total;
 }
 
-// 向inode索引的文件写入数据，起始偏移量为off，写入字节数为n
-int writei(inode *ip, uchar *src, uint off, uint n) {
+// 把数据写入inode索引的数据块，只负责块的分配与写入，不修改size、不写回inode
+static uint write_data(inode *ip, uchar *src, uint off, uint n) {
     uint total = 0; // 已写入的字节数
     while (total < n) {
         uint lbn = (off + total) / BSIZE; // 计算要写的数据所在的逻辑块
@@ -184,17 +257,298 @@ int writei(inode *ip, uchar *src, uint off, uint n) {
         // 获取逻辑块号对应的物理块号
         uint bno = get_data_block(ip, lbn, 1); // 允许新分配
         if (bno == 0) break;
-        // 将块读入内存，修改后写入内存
+        uint own = unshare_block(bno, to_write < BSIZE);  // 与其他文件共享的块先复制
+        if (own == 0) break;
+        if (own != bno) set_data_block(ip, lbn, bno = own);
+        // 将块读入内存，修改后写入内存（整块覆盖时不必先读）
         uchar buf[BSIZE];
-        read_block(bno, buf);
+        if (to_write < BSIZE) read_block(bno, buf);
         memcpy(buf + blockoff, src + total, to_write);
-        write_block(bno, buf);
+        if (ip->type == T_DIR)
+            log_write(bno, buf);   // 目录内容属于元数据，记入日志
+        else
+            write_block(bno, buf);
 
         total += to_write;
     }
+    return total;
+}
+
+// 向inode索引的文件写入数据，起始偏移量为off，写入字节数为n
+int writei(inode *ip, uchar *src, uint off, uint n) {
+    uint old_size = ip->size;
+    uint total = write_data(ip, src, off, n);
     // 如果写入后文件大小增加，则更新dinode
     if (off + total > ip->size) ip->size = off + total;
     ip->mtime = (uint)time(NULL);  // 更新时间
     iupdate(ip);
+    if (ip->type == T_FILE && ip->size != old_size)
+        iaccount(ip->parent, ip->size - old_size, 0);
+    return total;
+}
+
+// 在文件末尾追加n字节：只写最后一个不满的块和新分配的块，代价与文件大小无关。
+// 追加后把尾块钉在缓存中，下一次追加读尾块时不必访问磁盘
+int appendi(inode *ip, uchar *src, uint n) {
+    int total = writei(ip, src, ip->size, n);
+    if (ip->size % BSIZE) pin_block(get_data_block(ip, ip->size / BSIZE, 0));
     return total;
 }
+
+/*--------------- 插入与删除 ---------------------
+ * 插入/删除只移动编辑点之后的数据。长度是 BSIZE 整数倍时直接在块映射表中
+ * 插入/摘除块指针，最多只需拷贝编辑点所在块的半块数据；否则逐块平移尾部。
+ */
+// 把文件的块映射表（直接块 + 一级间接块）读到map中，返回文件占用的逻辑块数
+static uint load_map(inode *ip, uint *map) {
+    uint nb = (ip->size + BSIZE - 1) / BSIZE;
+    memset(map, 0, MAXFILEBLK * sizeof(uint));
+    memcpy(map, ip->addrs, NDIRECT * sizeof(uint));
+    if (ip->addrs[NDIRECT]) {
+        uchar indirect[BSIZE];
+        read_block(ip->addrs[NDIRECT], indirect);
+        memcpy(map + NDIRECT, indirect, APB * sizeof(uint));
+    }
+    return nb;
+}
+
+// 把修改后的块映射表写回inode，按需分配或释放一级间接块
+static void store_map(inode *ip, uint *map, uint nb) {
+    memcpy(ip->addrs, map, NDIRECT * sizeof(uint));
+    if (nb > NDIRECT) {
+        if (ip->addrs[NDIRECT] == 0) {
+            ip->addrs[NDIRECT] = balloc(ip, map[NDIRECT - 1]);
+            ip->blocks++;
+        }
+        log_write(ip->addrs[NDIRECT], (uchar *)(map + NDIRECT));
+    } else if (ip->addrs[NDIRECT]) {
+        free_block(ip->addrs[NDIRECT]);
+        ip->addrs[NDIRECT] = 0;
+        ip->blocks--;
+    }
+}
+
+// 在off处插入整数个块（n为BSIZE的整数倍），只拼接块指针
+static int splice_insert(inode *ip, uchar *src, uint off, uint n) {
+    uint map[MAXFILEBLK];
+    uint nb = load_map(ip, map);
+    uint k = n / BSIZE, P = off / BSIZE, o = off % BSIZE;
+    uint at = o ? P + 1 : P;  // 新块插入的位置
+
+    // 腾出k个位置并分配新块
+    memmove(map + at + k, map + at, (nb - at) * sizeof(uint));
+    uint got = 0;  // 已经分配的新块数，失败时全部释放
+    for (; got < k; got++) {
+        map[at + got] = balloc(ip, at + got ? map[at + got - 1] : 0);
+        if (map[at + got] == 0) goto fail;
+        ip->blocks++;
+    }
+
+    uchar buf[BSIZE];
+    if (o == 0) {
+        for (uint j = 0; j < k; j++)
+            write_block(map[at + j], src + j * BSIZE);
+    } else {
+        // 原P块的后半段挪到P+k块的同一偏移处，src的最后o字节补在P+k块前半段
+        uchar old[BSIZE];
+        read_block(map[P], old);
+        memcpy(buf, src + n - o, o);
+        memcpy(buf + o, old + o, BSIZE - o);
+        write_block(map[P + k], buf);
+        // P块的后半段由src开头填充，中间的新块整块写入
+        memcpy(old + o, src, BSIZE - o);
+        if ((map[P] = unshare_block(map[P], 0)) == 0) goto fail;
+        write_block(map[P], old);
+        for (uint j = 1; j < k; j++)
+            write_block(map[P + j], src + BSIZE - o + (j - 1) * BSIZE);
+    }
+    store_map(ip, map, nb + k);
+    return n;
+
+fail:
+    // 块映射表还没有写回，释放新块即可恢复原状
+    free_blocks(map + at, got);
+    ip->blocks -= got;
+    return -1;
+}
+
+// 删除off处整数个块长度的数据（n为BSIZE的整数倍且不超过文件末尾），只摘除块指针
+static void splice_delete(inode *ip, uint off, uint n) {
+    uint map[MAXFILEBLK];
+    uint nb = load_map(ip, map);
+    uint k = n / BSIZE, P = off / BSIZE, o = off % BSIZE;
+    uint at = o ? P + 1 : P;  // 被摘除的第一个块
+
+    if (o) {
+        // P+k块的后半段接到P块的前半段之后
+        uchar head[BSIZE], tail[BSIZE];
+        read_block(map[P], head);
+        read_block(map[P + k], tail);
+        memcpy(head + o, tail + o, BSIZE - o);
+        uint own = unshare_block(map[P], 0);
+        if (own) {
+            map[P] = own;
+            write_block(map[P], head);
+        } else {
+            Error("splice_delete: no space to unshare block %u", map[P]);  // 不能改写别的文件还在用的块
+        }
+    }
+    for (uint j = 0; j < k; j++) {
+        if (map[at + j]) {
+            free_block(map[at + j]);
+            ip->blocks--;
+        }
+    }
+    memmove(map + at, map + at + k, (nb - at - k) * sizeof(uint));
+    memset(map + nb - k, 0, k * sizeof(uint));
+    store_map(ip, map, nb - k);
+}
+
+// 在off处插入n字节数据，原有数据向后平移
+int inserti(inode *ip, uchar *src, uint off, uint n) {
+    if (off > ip->size) off = ip->size;
+    if ((ip->size + n + BSIZE - 1) / BSIZE > MAXFILEBLK) return -1;
+    if (n == 0) return 0;
+
+    if (n % BSIZE == 0) {
+        if (splice_insert(ip, src, off, n) < 0) return -1;
+    } else {
+        // 从尾部开始，每次处理一个目标块，把[off, size)平移到off + n之后
+        uchar buf[BSIZE];
+        uint end = ip->size;
+        while (end > off) {
+            uint dst_end = end + n;
+            uint dst_start = max(off + n, (dst_end - 1) / BSIZE * BSIZE);
+            uint len = dst_end - dst_start;
+            readi(ip, buf, dst_start - n, len);
+            write_data(ip, buf, dst_start, len);
+            end -= len;
+        }
+        write_data(ip, src, off, n);
+    }
+
+    ip->size += n;
+    ip->mtime = (uint)time(NULL);
+    iupdate(ip);
+    if (ip->type == T_FILE) iaccount(ip->parent, n, 0);
+    return n;
+}
+
+// 删除从off开始的n字节数据，之后的数据向前平移并释放多余的块
+int deletei(inode *ip, uint off, uint n) {
+    if (off >= ip->size) return 0;
+    if (n > ip->size - off) n = ip->size - off;
+    if (off + n == ip->size) { // 删到文件末尾，直接截断
+        itrunc(ip, off);
+        return n;
+    }
+
+    uint old_size = ip->size;
+    if (n % BSIZE == 0) {
+        splice_delete(ip, off, n);
+    } else {
+        // 从编辑点开始，每次处理一个目标块，把[off + n, size)平移到off处
+        uchar buf[BSIZE];
+        uint new_size = ip->size - n;
+        uint dst = off;
+        while (dst < new_size) {
+            uint len = min(new_size, (dst / BSIZE + 1) * BSIZE) - dst;
+            readi(ip, buf, dst + n, len);
+            write_data(ip, buf, dst, len);
+            dst += len;
+        }
+        itrunc(ip, new_size);  // 释放尾部多余的块，同时更新size
+        return n;
+    }
+
+    ip->size = old_size - n;
+    ip->mtime = (uint)time(NULL);
+    iupdate(ip);
+    if (ip->type == T_FILE) iaccount(ip->parent, -(int)n, 0);
+    return n;
+}
+
+// 让dst成为src的一份拷贝：数据块只增加引用计数，间接块各用各的
+int iclone(inode *dst, inode *src) {
+    uint map[MAXFILEBLK], shared[MAXFILEBLK];
+    uint nb = load_map(src, map);
+    memcpy(shared, map, sizeof(map));
+    share_blocks(shared, nb);
+    uint blocks = 0;
+    int ret = 0;
+    for (uint i = 0; i < nb; i++) {
+        if (map[i] == 0) continue;
+        if (shared[i] == 0) {  // 引用计数已满，只能真的复制一份
+            uint c = balloc(dst, i ? map[i - 1] : 0);
+            if (c == 0) {  // 空间不足：已共享的块仍然挂上，调用者释放dst时才能还回引用
+                map[i] = 0;
+                ret = -1;
+                continue;
+            }
+            uchar buf[BSIZE];
+            read_block(map[i], buf);
+            write_block(c, buf);
+            map[i] = c;
+        }
+        blocks++;
+    }
+    dst->blocks = blocks;
+    store_map(dst, map, nb);
+    dst->size = src->size;
+    dst->mtime = (uint)time(NULL);
+    iupdate(dst);
+    return ret;
+}
+
+// 释放逻辑块号不小于 ceil(size / BSIZE) 的数据块（必要时连同一级间接块），
+// 收集起来一次性交给 free_blocks()，每个位图块只需读写一次
+static void trunc_blocks(inode *ip, uint size) {
+    uint keep = (size + BSIZE - 1) / BSIZE; // 需要保留的逻辑块数
+    uint freed[MAXFILEBLK + 1];
+    int n = 0;
+
+    // 直接块
+    for (uint lbn = keep; lbn < NDIRECT; lbn++) {
+        if (ip->addrs[lbn]) {
+            freed[n++] = ip->addrs[lbn];
+            ip->addrs[lbn] = 0;
+        }
+    }
+
+    // 一级间接块
+    if (ip->addrs[NDIRECT]) {
+        uchar indirect[BSIZE];
+        read_block(ip->addrs[NDIRECT], indirect);
+        uint *table = (uint *)indirect;
+        uint first = keep > NDIRECT ? keep - NDIRECT : 0; // 间接块中第一个要释放的下标
+        int changed = 0;
+        for (uint i = first; i < APB; i++) {
+            if (table[i]) {
+                freed[n++] = table[i];
+                table[i] = 0;
+                changed = 1;
+            }
+        }
+        if (first == 0) { // 间接块已经没有用处，一并释放
+            freed[n++] = ip->addrs[NDIRECT];
+            ip->addrs[NDIRECT] = 0;
+        } else if (changed) {
+            log_write(ip->addrs[NDIRECT], indirect);
+        }
+    }
+
+    if (n) free_blocks(freed, n);
+    ip->blocks -= n;
+}
+
+// 将文件截断为size字节，释放新末尾之后的块
+void itrunc(inode *ip, uint size) {
+    if (size >= ip->size) return;
+    uint old_size = ip->size;
+    trunc_blocks(ip, size);
+    ip->size = size;
+    ip->mtime = (uint)time(NULL);
+    iupdate(ip);
+    if (ip->type == T_FILE)
+        iaccount(ip->parent, (int)size - (int)old_size, 0);
+}
@@ -0,0 +1,420 @@
+/* journal.c - 元数据预写日志（write-ahead log）与组提交 */
+
+#include "journal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "block.h"
+#include "common.h"
+#include "fs.h"
+#include "log.h"
+#include "snap.h"
+
+#define COMMIT_INTERVAL_MS 50  // 后台线程的组提交间隔
+#define CHECKPOINT_TICKS 20    // 每隔多少个提交间隔至少做一次 checkpoint
+
+// 内存中的日志：slot[0, ncommit) 已经写入磁盘日志区，[ncommit, n) 属于尚未提交的事务。
+// 同一个块可能有多个版本，总是以下标最大的为准；已提交的 slot 不会被原地覆盖，
+// 否则提交到一半崩溃会让恢复程序装回未提交的内容。
+// 当前操作从 slot start 开始追加；它原地改写之前已结束的操作的 slot 时先保存旧内容，
+// 这样日志满了可以只写回已结束的操作，操作太大时也能整个撤销。
+static struct {
+    int outstanding;  // 正在进行的操作数（支持嵌套）
+    int running;      // 后台线程是否在运行
+    int failed;       // 当前操作超出日志容量，已被撤销
+    unsigned long ended;    // 结束了的、写过日志的操作数
+    unsigned long durable;  // 其中已经提交落盘的个数
+    uint n;
+    uint ncommit;
+    uint start;
+    uint nundo;
+    uint block[LOGSIZE];
+    uchar data[LOGSIZE][BSIZE];
+    uint undo_slot[LOGSIZE];
+    uchar undo[LOGSIZE][BSIZE];
+} jr;
+
+// 为快照复制过的块：副本的映射记在日志里，原位置要等它提交之后才能改写，
+// 否则提交之前崩溃，快照会读到新内容。新内容先留在这里，提交之后再写回。
+// 当前操作从 start 开始追加，同一个块以下标最大的为准
+static struct {
+    uint *block;
+    uchar (*data)[BSIZE];
+    uint n, cap, start;
+} dw;
+
+static pthread_t journal_thread;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;   // 有操作在等提交
+static pthread_cond_t durable_cond = PTHREAD_COND_INITIALIZER;  // 完成了一次提交
+
+static int journal_enabled() { return sb.nlog > 0; }
+
+static int find_deferred(uint bno) {
+    for (int i = (int)dw.n - 1; i >= 0; i--)
+        if (dw.block[i] == bno) return i;
+    return -1;
+}
+
+// 把 [0, m) 的延迟写入写到原位置，后面的前移
+static void flush_deferred(uint m) {
+    for (uint i = 0; i < m; i++) {
+        int newest = 1;
+        for (uint j = i + 1; j < m; j++)
+            if (dw.block[j] == dw.block[i]) newest = 0;
+        if (newest) write_block_raw(dw.block[i], dw.data[i]);
+    }
+    if (m) Log("journal: wrote %u deferred block(s) home", m);
+    memmove(dw.block, dw.block + m, (dw.n - m) * sizeof(uint));
+    memmove(dw.data, dw.data + m, (dw.n - m) * BSIZE);
+    dw.n -= m;
+    dw.start -= m;
+}
+
+// 从后往前找bno最新的版本
+static int find_slot(uint bno) {
+    for (int i = (int)jr.n - 1; i >= 0; i--)
+        if (jr.block[i] == bno) return i;
+    return -1;
+}
+
+static void write_head(uint n) {
+    uchar buf[BSIZE] = {0};
+    logheader *lh = (logheader *)buf;
+    lh->n = n;
+    memcpy(lh->block, jr.block, n * sizeof(uint));
+    write_block_raw(sb.logstart, buf);
+}
+
+// 把日志块按块号顺序写回原位置，同一个块只写最新的版本
+static void install(uint n, uchar (*data)[BSIZE], uint *block) {
+    uint *order = malloc(n * sizeof(uint));
+    uint m = 0;
+    for (uint i = 0; i < n; i++) {
+        int newest = 1;
+        for (uint j = i + 1; j < n; j++)
+            if (block[j] == block[i]) newest = 0;
+        if (newest) order[m++] = i;
+    }
+    // 按块号排序，也就是按柱面排序（插入排序，m 不超过 LOGSIZE）
+    for (uint i = 1; i < m; i++) {
+        uint x = order[i], j = i;
+        while (j > 0 && block[order[j - 1]] > block[x]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = x;
+    }
+    // 电梯算法：从磁头所在位置先扫向较近的一端，再折返扫完另一侧
+    uint head = head_block(), k = 0;
+    while (k < m && block[order[k]] < head) k++;
+    int up_first = k == 0 || (k < m && block[order[m - 1]] - head <= head - block[order[0]]);
+    if (up_first) {
+        for (uint i = k; i < m; i++) write_block_raw(block[order[i]], data[order[i]]);
+        for (uint i = k; i > 0; i--) write_block_raw(block[order[i - 1]], data[order[i - 1]]);
+    } else {
+        for (uint i = k; i > 0; i--) write_block_raw(block[order[i - 1]], data[order[i - 1]]);
+        for (uint i = k; i < m; i++) write_block_raw(block[order[i]], data[order[i]]);
+    }
+    free(order);
+}
+
+// 组提交：把所有未提交的 slot 顺序写入日志区，再写日志头（提交点）。
+// 日志块落盘之后才写日志头，日志头落盘之后提交才算完成
+// 只在没有进行中的操作时调用，所以之后已结束的操作都已落盘
+void journal_commit() {
+    if (!journal_enabled() || jr.ncommit == jr.n) {
+        flush_deferred(dw.n);
+        jr.durable = jr.ended;
+        return;
+    }
+    for (uint i = jr.ncommit; i < jr.n; i++) write_block_raw(sb.logstart + 1 + i, jr.data[i]);
+    flush_disk();
+    write_head(jr.n);
+    flush_disk();
+    Log("journal: committed %d block(s), %d in log", jr.n - jr.ncommit, jr.n);
+    jr.ncommit = jr.n;
+    flush_deferred(dw.n);
+    jr.durable = jr.ended;
+}
+
+static void checkpoint() {
+    journal_commit();
+    if (jr.n == 0) return;
+    install(jr.n, jr.data, jr.block);
+    flush_disk();  // 写回的块落盘之前日志不能清空
+    write_head(0);
+    Log("journal: checkpointed %d block(s)", jr.n);
+    jr.n = jr.ncommit = jr.start = 0;
+}
+
+static void swap_undo() {
+    uchar tmp[BSIZE];
+    for (uint k = 0; k < jr.nundo; k++) {
+        uchar *cur = jr.data[jr.undo_slot[k]];
+        memcpy(tmp, cur, BSIZE);
+        memcpy(cur, jr.undo[k], BSIZE);
+        memcpy(jr.undo[k], tmp, BSIZE);
+    }
+}
+
+// 操作进行中日志满了：只提交并写回之前已经结束的操作（被当前操作改写过的 slot 用保存的旧内容），
+// 当前操作的 slot 留在日志里移到最前面，它的改动不会在结束之前到达原位置
+static void spill() {
+    uint m = jr.start;
+    if (m == 0) return;
+    swap_undo();
+    for (uint i = jr.ncommit; i < m; i++) write_block_raw(sb.logstart + 1 + i, jr.data[i]);
+    flush_disk();
+    write_head(m);
+    flush_disk();
+    flush_deferred(dw.start);  // 在写回日志块之前，同一个块以日志为准
+    install(m, jr.data, jr.block);
+    flush_disk();
+    write_head(0);
+    swap_undo();
+    jr.durable = jr.ended;
+    Log("journal: wrote back %d block(s) of finished operations to make room", m);
+
+    // 被改写过的 slot 按下标排好序再前移，目标位置不会超过来源
+    for (uint a = 1; a < jr.nundo; a++)
+        for (uint b = a; b > 0 && jr.undo_slot[b - 1] > jr.undo_slot[b]; b--) {
+            uint t = jr.undo_slot[b];
+            jr.undo_slot[b] = jr.undo_slot[b - 1];
+            jr.undo_slot[b - 1] = t;
+        }
+    uint n = 0;
+    for (uint k = 0; k < jr.nundo; k++, n++) {
+        jr.block[n] = jr.block[jr.undo_slot[k]];
+        memcpy(jr.data[n], jr.data[jr.undo_slot[k]], BSIZE);
+    }
+    for (uint i = m; i < jr.n; i++, n++) {
+        jr.block[n] = jr.block[i];
+        memcpy(jr.data[n], jr.data[i], BSIZE);
+    }
+    jr.n = n;
+    jr.ncommit = jr.start = jr.nundo = 0;
+}
+
+// 当前操作要改写属于已结束的操作的 slot i：第一次改写时保存旧内容
+static void save_undo(uint i) {
+    for (uint k = 0; k < jr.nundo; k++)
+        if (jr.undo_slot[k] == i) return;
+    jr.undo_slot[jr.nundo] = i;
+    memcpy(jr.undo[jr.nundo++], jr.data[i], BSIZE);
+}
+
+// 撤销当前操作在日志中的全部改动，之后它的写入都被丢弃，由 end_op 报告失败
+static void abort_op() {
+    for (uint k = 0; k < jr.nundo; k++) memcpy(jr.data[jr.undo_slot[k]], jr.undo[k], BSIZE);
+    jr.n = jr.start;
+    jr.nundo = 0;
+    dw.n = dw.start;
+    jr.failed = 1;
+}
+
+// 把已提交的事务写回原位置并清空日志；必须在没有未完成操作时调用
+void journal_checkpoint() {
+    if (!journal_enabled() || jr.outstanding) return;
+    checkpoint();
+}
+
+// 在操作内部调用的 checkpoint：只写回之前已经结束的操作
+void journal_sync() {
+    if (!journal_enabled()) return;
+    if (jr.outstanding == 0) checkpoint();
+    else spill();
+}
+
+void journal_reset() {
+    jr.n = jr.ncommit = jr.start = jr.nundo = 0;
+    dw.n = dw.start = 0;
+    if (journal_enabled()) write_head(0);
+}
+
+// 启动时调用：丢弃内存中的状态，重放磁盘上已提交的日志
+void journal_init() {
+    jr.n = jr.ncommit = jr.start = jr.nundo = 0;
+    jr.outstanding = jr.failed = 0;
+    dw.n = dw.start = 0;
+    if (!journal_enabled()) return;
+
+    uchar buf[BSIZE];
+    read_block_raw(sb.logstart, buf);
+    logheader lh;
+    memcpy(&lh, buf, sizeof(lh));
+    if (lh.n == 0 || lh.n > LOGSIZE) return;
+
+    uchar (*data)[BSIZE] = malloc(lh.n * BSIZE);
+    for (uint i = 0; i < lh.n; i++) read_block_raw(sb.logstart + 1 + i, data[i]);
+    install(lh.n, data, lh.block);
+    free(data);
+    flush_disk();
+    write_head(0);
+    Log("journal: recovered %d block(s)", lh.n);
+}
+
+void begin_op() {
+    // 最外层操作开始前保证日志里有足够的空间
+    if (jr.outstanding == 0 && journal_enabled() && jr.n + MAXOPBLOCKS > LOGSIZE)
+        journal_checkpoint();
+    if (jr.outstanding++ == 0) {
+        jr.start = jr.n;
+        jr.nundo = 0;
+        jr.failed = 0;
+        dw.start = dw.n;
+    }
+}
+
+int end_op() {
+    if (jr.outstanding == 0) {
+        Warn("end_op: no outstanding operation");
+        return 0;
+    }
+    if (--jr.outstanding) return jr.failed ? -1 : 0;
+    if (!jr.failed && (jr.n > jr.start || jr.nundo || dw.n > dw.start)) jr.ended++;
+    jr.nundo = 0;
+    if (jr.failed) {
+        // 日志里已经没有它的改动，内存中的超级块等还要按磁盘内容恢复
+        jr.failed = 0;
+        fs_rollback();
+        return -1;
+    }
+    // 有后台线程时由它定期做组提交，否则立即提交
+    if (!jr.running) journal_commit();
+    return 0;
+}
+
+uint journal_room() {
+    if (!journal_enabled() || jr.outstanding == 0) return LOGSIZE;
+    return LOGSIZE - (jr.n - jr.start) - jr.nundo;
+}
+
+void log_write(uint bno, uchar *buf) {
+    if (!journal_enabled() || jr.outstanding == 0) { // 不在事务中，直接写
+        write_block(bno, buf);
+        return;
+    }
+    if (jr.failed) return;
+    snap_cow(bno);  // 可能递归地写位图和映射块，要在找 slot 之前
+    if (jr.failed) return;
+    int i = find_slot(bno);
+    if (i < 0 || (uint)i < jr.ncommit) {  // 新块，或最新版本已提交：追加一个 slot
+        if (jr.n == LOGSIZE) spill();
+        if (jr.n == LOGSIZE) {
+            // 单个操作就超出了日志容量：整个撤销，不能把一部分写回原位置
+            Error("log_write: operation needs more than %d log blocks, rolled back", LOGSIZE);
+            abort_op();
+            return;
+        }
+        i = jr.n++;
+        jr.block[i] = bno;
+    } else if ((uint)i < jr.start) {
+        save_undo(i);
+    }
+    memcpy(jr.data[i], buf, BSIZE);
+}
+
+// 块先写成了数据块又作为元数据写进日志时，日志中的版本更新
+int journal_read(uint bno, uchar *buf) {
+    int i = jr.n ? find_slot(bno) : -1;
+    if (i >= 0) {
+        memcpy(buf, jr.data[i], BSIZE);
+        return 1;
+    }
+    i = dw.n ? find_deferred(bno) : -1;
+    if (i < 0) return 0;
+    memcpy(buf, dw.data[i], BSIZE);
+    return 1;
+}
+
+// 块层的普通写入命中日志中的块时，写入日志而不是原位置，否则之后 checkpoint 会用旧内容覆盖它
+// 被撤销的操作剩下的写入也一并丢弃
+int journal_absorb(uint bno, uchar *buf) {
+    if (jr.failed && jr.outstanding) return 1;
+    if (jr.n == 0 || find_slot(bno) < 0) return 0;
+    if (jr.outstanding) {
+        log_write(bno, buf);
+        return 1;
+    }
+    begin_op();
+    log_write(bno, buf);
+    end_op();
+    return 1;
+}
+
+int journal_defer(uint bno, uchar *buf, int copied) {
+    int i = dw.n ? find_deferred(bno) : -1;
+    if (i < 0 && !copied) return 0;
+    if (!journal_enabled()) return 0;
+    if (jr.outstanding == 0) {  // 不在事务中：先把映射提交，再直接写
+        journal_commit();
+        return 0;
+    }
+    if (jr.failed) return 1;
+    if (i < 0 || (uint)i < dw.start) {  // 不改写已结束的操作的版本，撤销时还要用
+        if (dw.n == dw.cap) {
+            dw.cap = dw.cap ? dw.cap * 2 : 16;
+            dw.block = realloc(dw.block, dw.cap * sizeof(uint));
+            dw.data = realloc(dw.data, (size_t)dw.cap * BSIZE);
+        }
+        i = dw.n++;
+        dw.block[i] = bno;
+    }
+    memcpy(dw.data[i], buf, BSIZE);
+    return 1;
+}
+
+void journal_wait() {
+    if (!jr.running) return;  // 没有后台线程时 end_op 已经提交
+    unsigned long seq = jr.ended;
+    while (jr.running && jr.durable < seq) {
+        pthread_cond_signal(&commit_cond);
+        fs_wait(&durable_cond, NULL);
+    }
+}
+
+// 每个提交间隔提交一次；有操作在 journal_wait 中等待时立即提交，
+// 等待期间结束的其他操作也在同一次提交里
+static void *journal_loop(void *arg) {
+    int ticks = 0;
+    fs_lock();
+    while (jr.running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += COMMIT_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        if (jr.durable == jr.ended && fs_wait(&commit_cond, &deadline)) ticks++;
+        if (!jr.running) break;
+        if (jr.outstanding == 0) {
+            // 日志过半或者距离上次 checkpoint 足够久时写回原位置，否则只提交
+            if (jr.n > LOGSIZE / 2 || (ticks >= CHECKPOINT_TICKS && jr.n)) {
+                journal_checkpoint();
+                ticks = 0;
+            } else {
+                journal_commit();
+            }
+            pthread_cond_broadcast(&durable_cond);
+        }
+    }
+    fs_unlock();
+    return NULL;
+}
+
+// 启动后台组提交线程（调用者需持有 fs 锁或尚未开始服务）
+void journal_start() {
+    jr.running = 1;
+    pthread_create(&journal_thread, NULL, journal_loop, NULL);
+}
+
+void journal_stop() {
+    fs_lock();
+    jr.running = 0;
+    journal_checkpoint();
+    pthread_cond_signal(&commit_cond);
+    pthread_cond_broadcast(&durable_cond);
+    fs_unlock();
+    pthread_join(journal_thread, NULL);
+}
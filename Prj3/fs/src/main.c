@@ -7,6 +7,7 @@
 #include "block.h"
 #include "common.h"
 #include "fs.h"
+#include "journal.h"
 #include "log.h"
 
 // global variables
@@ -34,7 +35,7 @@ int handle_f(char *args) {
 }
 
 int handle_mk(char *args) {
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     short mode = 0b1111; // 默认权限
     if (sscanf(args, "%s", name) == 1 && cmd_mk(name, mode) == E_SUCCESS) {
         ReplyYes();
@@ -45,7 +46,7 @@ int handle_mk(char *args) {
 }
 
 int handle_mkdir(char *args) {
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     short mode = 0b1111;
     if (sscanf(args, "%s", name) == 1 && cmd_mkdir(name, mode) == E_SUCCESS) {
         ReplyYes();
@@ -56,7 +57,7 @@ int handle_mkdir(char *args) {
 }
 
 int handle_rm(char *args) {
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     if (sscanf(args, "%s", name) == 1 && cmd_rm(name) == E_SUCCESS) {
         ReplyYes();
     } else {
@@ -66,8 +67,8 @@ int handle_rm(char *args) {
 }
 
 int handle_cd(char *args) {
-    char name[256];
-    if (sscanf(args, "%s", name) == 1 && cmd_cd(name) == E_SUCCESS) {
+    char name[MAXPATH + 2];  // 多读一个字节，超长的路径由 cmd_cd 拒绝
+    if (sscanf(args, "%1025s", name) == 1 && cmd_cd(name) == E_SUCCESS) {
         ReplyYes();
     } else {
         ReplyNo("Failed to change directory");
@@ -76,7 +77,7 @@ int handle_cd(char *args) {
 }
 
 int handle_rmdir(char *args) {
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     if (sscanf(args, "%s", name) == 1 && cmd_rmdir(name) == E_SUCCESS) {
         ReplyYes();
     } else {
@@ -99,7 +100,7 @@ int handle_ls(char *args) {
 }
 
 int handle_cat(char *args) {
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     uchar *buf = NULL;
     uint len;
 
@@ -115,7 +116,7 @@ int handle_cat(char *args) {
 }
 
 int handle_w(char *args) {
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     uint len;
     char *data;
 
@@ -131,8 +132,25 @@ int handle_w(char *args) {
     return 0;
 }
 
+int handle_a(char *args) {
+    char name[MAXNAME + 1];
+    uint len;
+    char *data;
+
+    if (sscanf(args, "%s %u", name, &len) == 2) {
+        data = strchr(args, ' ');
+        data = strchr(data + 1, ' ');
+        if (data && strlen(data + 1) >= len && cmd_a(name, len, data + 1) == E_SUCCESS) {
+            ReplyYes();
+            return 0;
+        }
+    }
+    ReplyNo("Failed to append file");
+    return 0;
+}
+
 int handle_i(char *args) {
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     uint pos, len;
     char *data;
 
@@ -150,7 +168,7 @@ int handle_i(char *args) {
 }
 
 int handle_d(char *args) {
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     uint pos, len;
     if (sscanf(args, "%s %u %u", name, &pos, &len) == 3 && cmd_d(name, pos, len) == E_SUCCESS) {
         ReplyYes();
@@ -160,6 +178,16 @@ int handle_d(char *args) {
     return 0;
 }
 
+int handle_clone(char *args) {
+    char src[256], dst[256];
+    if (sscanf(args, "%255s %255s", src, dst) == 2 && cmd_clone(src, dst) == E_SUCCESS) {
+        ReplyYes();
+    } else {
+        ReplyNo("Failed to clone file");
+    }
+    return 0;
+}
+
 int handle_e(char *args) {
     printf("Bye!\n");
     Log("Exit");
@@ -183,7 +211,7 @@ static struct {
 } cmd_table[] = {{"f", handle_f},        {"mk", handle_mk},       {"mkdir", handle_mkdir}, {"rm", handle_rm},
                  {"cd", handle_cd},      {"rmdir", handle_rmdir}, {"ls", handle_ls},       {"cat", handle_cat},
                  {"w", handle_w},        {"i", handle_i},         {"d", handle_d},         {"e", handle_e},
-                 {"login", handle_login}};
+                 {"login", handle_login}, {"clone", handle_clone}, {"a", handle_a}};
 
 #define NCMD (sizeof(cmd_table) / sizeof(cmd_table[0]))
 
@@ -219,9 +247,17 @@ int main(int argc, char *argv[]) {
         int ret = 1;
         for (int i = 0; i < NCMD; i++)
             if (p && strcmp(p, cmd_table[i].name) == 0) {
+                begin_op();
                 ret = cmd_table[i].handler(p + strlen(p) + 1);
+                if (end_op() < 0) ReplyNo("The operation does not fit in the journal and was rolled back");
                 break;
             }
+        // 没有后台回收线程，一个操作里回收不完的孤儿分成几个事务继续回收
+        while (ret >= 0 && sb.magic == FS_MAGIC && sb.norphan) {
+            begin_op();
+            reclaim_kick();
+            if (end_op() < 0) break;
+        }
         if (ret == 1) {
             Log("No such command");
             printf("No\n");
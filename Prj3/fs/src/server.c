@@ -7,6 +7,7 @@
 #include "block.h"
 #include "common.h"
 #include "fs.h"
+#include "journal.h"
 #include "log.h"
 #include "tcp_utils.h"
 
@@ -46,7 +47,7 @@ int handle_mk(tcp_buffer *wb, char *args) {
         server_reply(wb, "mk: Invalid arguments");
         return 0;
     }
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     if (sscanf(args, "%s", name) != 1)
         server_reply(wb, "Invalid arguments");
     else {
@@ -80,7 +81,7 @@ int handle_mkdir(tcp_buffer *wb, char *args) {
         server_reply(wb, "mkdir: Invalid arguments");
         return 0;
     }
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     if (sscanf(args, "%s", name) != 1)
         server_reply(wb, "mkdir: Invalid arguments");
     else {
@@ -115,7 +116,7 @@ int handle_rm(tcp_buffer *wb, char *args) {
         reply_with_no(wb, rep, strlen(rep) + 1);
         return 0;
     }
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     if (sscanf(args, "%s", name) != 1)
         server_reply(wb, "rm: Invalid arguments");
     else {
@@ -149,8 +150,8 @@ int handle_cd(tcp_buffer *wb, char *args) {
         reply_with_no(wb, rep, strlen(rep) + 1);
         return 0;
     }
-    char name[256];
-    if (sscanf(args, "%s", name) != 1)
+    char name[MAXPATH + 2];  // 多读一个字节，超长的路径由 cmd_cd 拒绝
+    if (sscanf(args, "%1025s", name) != 1)
         server_reply(wb, "cd: Invalid arguments");
     else {
         int ret = cmd_cd(name);
@@ -183,7 +184,7 @@ int handle_rmdir(tcp_buffer *wb, char *args) {
         reply_with_no(wb, rep, strlen(rep) + 1);
         return 0;
     }
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     if (sscanf(args, "%s", name) != 1)
         server_reply(wb, "rmdir: Invalid arguments");
     else {
@@ -240,7 +241,7 @@ int handle_ls(tcp_buffer *wb, char *args) {
         }
         return 0;
     }
-    size_t rep_size = 100 * (n + 1);
+    size_t rep_size = (MAXNAME + 100) * (n + 1);  // 每行最长是名字加上其余各列
     char *rep = malloc(rep_size);
     rep[0] = 0;
     int len = snprintf(rep, rep_size, "%-12s %-6s %-6s %-6s %s  %s          %s\n", "name", "type", "owner", "perm", "size(B)", "last modify", "create time");
@@ -257,11 +258,11 @@ int handle_ls(tcp_buffer *wb, char *args) {
         strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", localtime(&mtime));
         strftime(ctimebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", localtime(&ctime));
 
-        char add[100] = {0};
+        char add[MAXNAME + 100] = {0};
         int len = snprintf(add, sizeof(add), "%-12s %-6s %-6u %-4s   %-6u   %s  %s\n", entries[i].name, type_str, entries[i].owner, perm_str(entries[i].perm), entries[i].size, timebuf, ctimebuf);
         if (len > sizeof(add)) {
             Warn("Output out of bound");
-            add[99] = '\0';
+            add[sizeof(add) - 1] = '\0';
         }
         strcat(rep, add);
     }
@@ -277,7 +278,7 @@ int handle_cat(tcp_buffer *wb, char *args) {
         server_reply(wb, "cat: Invalid arguments");
         return 0;
     }
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     uchar *buf = NULL;
     uint len;
 
@@ -315,7 +316,7 @@ int handle_w(tcp_buffer *wb, char *args) {
         server_reply(wb, "w: Invalid arguments");
         return 0;
     }
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     uint len;
     char *data;
 
@@ -350,12 +351,52 @@ int handle_w(tcp_buffer *wb, char *args) {
     return 0;
 }
 
+int handle_a(tcp_buffer *wb, char *args) {
+    if (!args) {
+        server_reply(wb, "a: Invalid arguments");
+        return 0;
+    }
+    char name[MAXNAME + 1];
+    uint len;
+    char *data;
+
+    if (sscanf(args, "%s %u", name, &len) == 2) {
+        data = strchr(args, ' ');
+        data = strchr(data + 1, ' ');
+        if (data && strlen(data + 1) >= len) {
+            int ret = cmd_a(name, len, data + 1);
+            switch (ret) {
+                case E_SUCCESS:
+                    server_reply(wb, "Append file successfully");
+                    break;
+                case E_ERROR:
+                    server_reply(wb, "Failed to append file");
+                    break;
+                case E_NOT_LOGGED_IN:
+                    server_reply(wb, "Please login first");
+                    break;
+                case E_PERMISSION_DENIED:
+                    server_reply(wb, "Permission denied");
+                    break;
+                case E_NOT_FORMATTED:
+                    server_reply(wb, "Not formatted");
+                    break;
+                default:
+                    server_reply(wb, "Unexpected reply");
+            }
+            return 0;
+        }
+    }
+    server_reply(wb, "a: Invalid arguments");
+    return 0;
+}
+
 int handle_i(tcp_buffer *wb, char *args) {
     if (!args) {
         server_reply(wb, "i: Invalid arguments");
         return 0;
     }
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     uint pos, len;
     char *data;
 
@@ -391,12 +432,83 @@ int handle_i(tcp_buffer *wb, char *args) {
     return 0;
 }
 
+// pread name off len：回复 "Yes " 加读到的数据（可能比 len 短，到达文件末尾时为空），出错时回复 "No " 加原因
+int handle_pread(tcp_buffer *wb, char *args) {
+    char name[MAXNAME + 1];
+    uint off, len;
+    if (!args || sscanf(args, "%s %u %u", name, &off, &len) != 3 || len > IO_CHUNK) {
+        server_reply(wb, "pread: Invalid arguments");
+        return 0;
+    }
+    static uchar buf[IO_CHUNK];
+    uint n;
+    int ret = cmd_pread(name, off, len, buf, &n);
+    const char *rep;
+    switch (ret) {
+        case E_SUCCESS:
+            reply_with_yes(wb, (char *)buf, n);
+            return 0;
+        case E_ERROR:
+            rep = "Failed to read file";
+            break;
+        case E_NOT_LOGGED_IN:
+            rep = "Please login first";
+            break;
+        case E_PERMISSION_DENIED:
+            rep = "Permission denied";
+            break;
+        case E_NOT_FORMATTED:
+            rep = "Not formatted";
+            break;
+        default:
+            rep = "Unexpected reply";
+    }
+    reply_with_no(wb, rep, strlen(rep) + 1);
+    return 0;
+}
+
+static char *msg_end;  // 当前消息的结尾，pwrite 的数据是二进制的，不能用 strlen
+
+// pwrite name off len data：data 是紧跟在第三个空格后的 len 字节，和其他消息一样以 '\0' 结尾
+int handle_pwrite(tcp_buffer *wb, char *args) {
+    char name[MAXNAME + 1];
+    uint off, len;
+    char *data = args;
+    for (int i = 0; data && i < 3; i++) data = strchr(data + 1, ' ');
+    if (!args || !data || sscanf(args, "%s %u %u", name, &off, &len) != 3 || len > IO_CHUNK ||
+        msg_end - (data + 1) < len) {
+        server_reply(wb, "pwrite: Invalid arguments");
+        return 0;
+    }
+    int ret = cmd_pwrite(name, off, len, data + 1);
+    switch (ret) {
+        case E_SUCCESS:
+            server_reply(wb, "Write file successfully");
+            break;
+        case E_ERROR:
+            server_reply(wb, "Failed to write file");
+            break;
+        case E_NOT_LOGGED_IN:
+            server_reply(wb, "Please login first");
+            break;
+        case E_PERMISSION_DENIED:
+            server_reply(wb, "Permission denied");
+            break;
+        case E_NOT_FORMATTED:
+            server_reply(wb, "Not formatted");
+            break;
+        default:
+            server_reply(wb, "Unexpected reply");
+    }
+    return 0;
+}
+
 int handle_d(tcp_buffer *wb, char *args) {
     if (!args) {
         server_reply(wb, "d: Invalid arguments");
         return 0;
     }
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     uint pos, len;
     if (sscanf(args, "%s %u %u", name, &pos, &len) == 3) {
         int ret = cmd_d(name, pos, len);
@@ -424,6 +536,35 @@ int handle_d(tcp_buffer *wb, char *args) {
     return 0;
 }
 
+int handle_clone(tcp_buffer *wb, char *args) {
+    char src[256], dst[256];
+    if (!args || sscanf(args, "%255s %255s", src, dst) != 2) {
+        server_reply(wb, "clone: Invalid arguments");
+        return 0;
+    }
+    int ret = cmd_clone(src, dst);
+    switch (ret) {
+        case E_SUCCESS:
+            server_reply(wb, "File cloned successfully");
+            break;
+        case E_ERROR:
+            server_reply(wb, "Failed to clone file");
+            break;
+        case E_NOT_LOGGED_IN:
+            server_reply(wb, "Please login first");
+            break;
+        case E_PERMISSION_DENIED:
+            server_reply(wb, "Permission denied");
+            break;
+        case E_NOT_FORMATTED:
+            server_reply(wb, "Not formatted");
+            break;
+        default:
+            server_reply(wb, "Unexpected reply");
+    }
+    return 0;
+}
+
 int handle_e(tcp_buffer *wb, char *args) {
     reply(wb, "Bye!", 5);
     Log("Exit");
@@ -491,7 +632,7 @@ int handle_logout(tcp_buffer *wb, char *args) {
 }
 
 int handle_chmod(tcp_buffer *wb, char *args) {
-    char name[MAXNAME];
+    char name[MAXNAME + 1];
     int perm;
     if (sscanf(args, "%s %d", name, &perm) == 2) {
         int ret = cmd_chmod(name, perm, 0);
@@ -525,6 +666,80 @@ int handle_clearcache(tcp_buffer *wb, char *args) {
     return 0;
 }
 
+static void snap_reply(tcp_buffer *wb, int ret, const char *ok, const char *fail) {
+    switch (ret) {
+        case E_SUCCESS:
+            server_reply(wb, ok);
+            break;
+        case E_ERROR:
+            server_reply(wb, fail);
+            break;
+        case E_NOT_LOGGED_IN:
+            server_reply(wb, "Please login first");
+            break;
+        case E_PERMISSION_DENIED:
+            server_reply(wb, "Permission denied");
+            break;
+        case E_NOT_FORMATTED:
+            server_reply(wb, "Not formatted");
+            break;
+        default:
+            server_reply(wb, "Unexpected reply");
+    }
+}
+
+int handle_snap(tcp_buffer *wb, char *args) {
+    uint id = 0;
+    int ret = cmd_snap(&id);
+    char ok[64];
+    snprintf(ok, sizeof(ok), "Snapshot %u created", id);
+    snap_reply(wb, ret, ok, "Failed to create snapshot");
+    return 0;
+}
+
+int handle_snaprm(tcp_buffer *wb, char *args) {
+    uint id;
+    if (args && sscanf(args, "%u", &id) == 1)
+        snap_reply(wb, cmd_snaprm(id), "Snapshot deleted", "No such snapshot");
+    else
+        server_reply(wb, "snaprm: Invalid arguments");
+    return 0;
+}
+
+int handle_lssnap(tcp_buffer *wb, char *args) {
+    struct snapinfo *snaps;
+    int n;
+    int ret = cmd_lssnap(&snaps, &n);
+    if (ret != E_SUCCESS) {
+        snap_reply(wb, ret, "", "Failed to list snapshots");
+        return 0;
+    }
+    char rep[64 * (NSNAP + 1)];
+    int len = snprintf(rep, sizeof(rep), "%-6s %-20s %s", "id", "create time", "copied blocks");
+    for (int i = 0; i < n; i++) {
+        char timebuf[32];
+        time_t ctime = snaps[i].ctime;
+        strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", localtime(&ctime));
+        len += snprintf(rep + len, sizeof(rep) - len, "\n%-6u %-20s %u", snaps[i].id, timebuf, snaps[i].nmap);
+    }
+    reply(wb, rep, strlen(rep) + 1);
+    return 0;
+}
+
+int handle_mount(tcp_buffer *wb, char *args) {
+    uint id;
+    if (args && sscanf(args, "%u", &id) == 1)
+        snap_reply(wb, cmd_mount(id), "Snapshot mounted read-only", "No such snapshot");
+    else
+        server_reply(wb, "mount: Invalid arguments");
+    return 0;
+}
+
+int handle_umount(tcp_buffer *wb, char *args) {
+    snap_reply(wb, cmd_umount(), "Snapshot unmounted", "No snapshot mounted");
+    return 0;
+}
+
 #define NCMD (sizeof(cmd_table) / sizeof(cmd_table[0]))
 
 static struct {
@@ -534,7 +749,10 @@ static struct {
                  {"cd", handle_cd},       {"rmdir", handle_rmdir}, {"ls", handle_ls},       {"cat", handle_cat},
                  {"w", handle_w},         {"i", handle_i},         {"d", handle_d},         {"e", handle_e},
                  {"login", handle_login}, {"p", handle_path},      {"chmod", handle_chmod}, {"logout", handle_logout},
-                 {"clearcache", handle_clearcache}};
+                 {"clearcache", handle_clearcache}, {"snap", handle_snap}, {"snaprm", handle_snaprm},
+                 {"lssnap", handle_lssnap}, {"mount", handle_mount},   {"umount", handle_umount},
+                 {"clone", handle_clone}, {"pread", handle_pread}, {"pwrite", handle_pwrite},
+                 {"a", handle_a}};
 
 void on_connection(int id) {
     Log("client connecting");
@@ -554,7 +772,18 @@ int on_recv(int id, tcp_buffer *wb, char *msg, int len) {
             char *inp = strchr(msg, ' ');
             if (!inp && (strcmp(msg, "ls") == 0 || strcmp(msg, "logout") || strcmp(msg, "clearcache"))) inp = msg;
             else if (inp) inp = inp + 1;
+            fs_lock();
+            msg_end = msg + len;
+            int mark = wb->write_index - wb->read_index;
+            begin_op();  // 每条命令是一个日志事务
             ret = cmd_table[i].handler(wb, inp);
+            if (end_op() < 0) {  // 命令被整个撤销，换掉它已经生成的回复
+                wb->write_index = wb->read_index + mark;
+                server_reply(wb, "Operation too big for the journal, nothing was changed");
+            } else {
+                journal_wait();  // 提交落盘之后才能告诉客户端成功了
+            }
+            fs_unlock();
             break;
         }
     if (ret == 1) {
@@ -587,10 +816,14 @@ int main(int argc, char *argv[]) {
     // get disk info and store in global variables
     get_disk_info(&ncyl, &nsec);
 
-    // read the superblock
-    sbinit();
-
     init_block_cache(); // 初始化缓存
+    reclaim_start();    // 启动后台回收线程
+
+    // read the superblock, leftover orphans are handed to the reclaimer
+    fs_lock();
+    sbinit();
+    fs_unlock();
+    journal_start();    // 启动后台组提交线程
     tcp_server server = server_init(fs_port, 1, on_connection, on_recv, clean_up);
     server_run(server);
 
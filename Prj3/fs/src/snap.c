@@ -0,0 +1,297 @@
+/* snap.c - 块层的写时复制快照 */
+
+#include "snap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "block.h"
+#include "common.h"
+#include "journal.h"
+#include "log.h"
+
+#define PENDING ((uint)-1)  // 正在复制：原位置还没有被改写
+
+// 原块号 -> 副本块号的开放寻址哈希表，块号 0 不会出现，用作空槽
+typedef struct {
+    uint *key;
+    uint *val;
+    uint cap;
+    uint n;
+} cowmap;
+
+// 与 sb.snap[k] 一一对应的内存状态
+typedef struct {
+    cowmap map;
+    uchar **bitmap;  // 快照时刻的位图，按位图块懒加载；快照只读，缓存永不过期
+    uint nbitmap;
+} snapstate;
+
+static struct {
+    snapstate st[NSNAP];
+    int mounted;                // 挂载的快照下标，-1 表示活动文件系统
+    struct superblock live;     // 挂载期间保存的活动超级块
+} sn = {.mounted = -1};
+
+// 快照表总是在活动超级块里
+static struct superblock *live() { return sn.mounted >= 0 ? &sn.live : &sb; }
+
+static uint hash(uint b) { return b * 2654435761u; }
+
+static uint map_get(cowmap *m, uint b) {
+    if (m->cap == 0) return 0;
+    for (uint i = hash(b) & (m->cap - 1);; i = (i + 1) & (m->cap - 1)) {
+        if (m->key[i] == b) return m->val[i];
+        if (m->key[i] == 0) return 0;
+    }
+}
+
+static void map_put(cowmap *m, uint b, uint c) {
+    if (2 * (m->n + 1) > m->cap) {  // 装载因子不超过 1/2
+        cowmap old = *m;
+        m->cap = old.cap ? old.cap * 2 : 64;
+        m->key = calloc(m->cap, sizeof(uint));
+        m->val = calloc(m->cap, sizeof(uint));
+        m->n = 0;
+        for (uint i = 0; i < old.cap; i++)
+            if (old.key[i]) map_put(m, old.key[i], old.val[i]);
+        free(old.key);
+        free(old.val);
+    }
+    uint i = hash(b) & (m->cap - 1);
+    while (m->key[i] && m->key[i] != b) i = (i + 1) & (m->cap - 1);
+    if (m->key[i] == 0) m->n++;
+    m->key[i] = b;
+    m->val[i] = c;
+}
+
+static void state_free(snapstate *st) {
+    free(st->map.key);
+    free(st->map.val);
+    for (uint i = 0; st->bitmap && i < st->nbitmap; i++) free(st->bitmap[i]);
+    free(st->bitmap);
+    memset(st, 0, sizeof(*st));
+}
+
+// 快照 k 看到的块 b：依次查 k 及更新的快照的映射，都没有则 b 自快照以来没有被改写
+static void view_read(int k, uint b, uchar *buf) {
+    struct superblock *s = live();
+    if (b == 0) {
+        read_block_raw(s->snap[k].sbcopy, buf);
+        return;
+    }
+    for (int i = k; i < (int)s->nsnap; i++) {
+        uint c = map_get(&sn.st[i].map, b);
+        if (c && c != PENDING) {
+            read_block_raw(c, buf);
+            return;
+        }
+        if (c == PENDING) break;
+    }
+    // 原位置上的内容：改写在日志中的话也还没有写回，所以绕过日志
+    read_block_raw(b, buf);
+}
+
+// 块 b 在快照 k 创建时是否在使用
+static int used_at(int k, uint b) {
+    if (b < sb.datastart) return 1;  // 超级块、位图等元数据
+    snapstate *st = &sn.st[k];
+    uint i = b / BPB;
+    if (!st->bitmap) {
+        st->nbitmap = (sb.size + BPB - 1) / BPB;
+        st->bitmap = calloc(st->nbitmap, sizeof(uchar *));
+    }
+    if (!st->bitmap[i]) {
+        st->bitmap[i] = malloc(BSIZE);
+        view_read(k, sb.bmapstart + i, st->bitmap[i]);
+    }
+    return st->bitmap[i][(b % BPB) / 8] >> (b % 8) & 1;
+}
+
+// 把 (b, c) 追加到快照 k 的映射链上，头块满了就在链头新加一个块
+static void chain_append(int k, uint b, uint c) {
+    uchar buf[BSIZE];
+    snapmap *m = (snapmap *)buf;
+    struct snapinfo *s = &sb.snap[k];
+    if (s->maphead) read_block(s->maphead, buf);
+    if (!s->maphead || m->n == SNAPMAP_PAIRS) {
+        // 分配时可能递归地复制位图块并改动映射链，所以分配完再读链头
+        uint nb = allocate_block();
+        if (!nb) {
+            Error("snap: no space for the map of snapshot %u", s->id);
+            return;
+        }
+        memset(buf, 0, BSIZE);
+        m->next = s->maphead;
+        s->maphead = nb;
+    }
+    m->pair[m->n][0] = b;
+    m->pair[m->n][1] = c;
+    m->n++;
+    log_write(s->maphead, buf);
+    s->nmap++;
+    sbwrite();
+}
+
+// 为快照 k 保存块 b 当前的内容，成功时返回 1
+static int cow(int k, uint b) {
+    uchar old[BSIZE];
+    read_block(b, old);
+    // 先登记，分配副本时改写同一个位图块就不会再复制一次
+    map_put(&sn.st[k].map, b, PENDING);
+    uint c = allocate_block();
+    if (!c) {
+        Error("snap: disk full, snapshot %u loses block %u", sb.snap[k].id, b);
+        map_put(&sn.st[k].map, b, 0);
+        return 0;
+    }
+    write_block_raw(c, old);
+    map_put(&sn.st[k].map, b, c);
+    chain_append(k, b, c);
+    Log("snap: block %u copied to %u for snapshot %u", b, c, sb.snap[k].id);
+    return 1;
+}
+
+int snap_cow(uint bno) {
+    if (sb.nsnap == 0 || sn.mounted >= 0) return 0;
+    if (bno == 0 || bno >= sb.size || (bno >= sb.logstart && bno < sb.datastart)) return 0;
+    // 从最新的快照往旧找：已经有副本就不用再复制；最新的在使用 b 的快照负责保存它，
+    // 更旧的快照没有自己的副本时会读到这一份
+    for (int k = sb.nsnap - 1; k >= 0; k--) {
+        if (map_get(&sn.st[k].map, bno)) return 0;
+        if (used_at(k, bno)) return cow(k, bno);
+    }
+    return 0;
+}
+
+int snap_read(uint bno, uchar *buf) {
+    if (sn.mounted < 0) return 0;
+    view_read(sn.mounted, bno, buf);
+    return 1;
+}
+
+void snap_init() {
+    for (int k = 0; k < NSNAP; k++) state_free(&sn.st[k]);
+    sn.mounted = -1;
+    uchar buf[BSIZE];
+    snapmap *m = (snapmap *)buf;
+    for (int k = 0; k < (int)sb.nsnap; k++) {
+        for (uint bno = sb.snap[k].maphead; bno; bno = m->next) {
+            read_block(bno, buf);
+            for (uint i = 0; i < m->n; i++) map_put(&sn.st[k].map, m->pair[i][0], m->pair[i][1]);
+        }
+        Log("snap: snapshot %u has %u copied block(s)", sb.snap[k].id, sn.st[k].map.n);
+    }
+}
+
+int snap_take(uint *id) {
+    if (sn.mounted >= 0 || sb.nsnap == NSNAP) return -1;
+    // 快照读的是原位置，先让日志中已完成的操作全部写回
+    journal_sync();
+
+    uchar buf[BSIZE] = {0};
+    struct superblock *copy = (struct superblock *)buf;
+    memcpy(copy, &sb, sizeof(sb));
+    copy->nsnap = 0;    // 快照只读，不需要快照表和孤儿列表
+    copy->norphan = 0;
+
+    int k = sb.nsnap++;
+    struct snapinfo *s = &sb.snap[k];
+    memset(s, 0, sizeof(*s));
+    s->id = ++sb.snapseq;
+    s->ctime = (uint)time(NULL);
+    // 登记之后再分配副本块，它在快照时刻是空闲的，以后改写它不会触发复制
+    s->sbcopy = allocate_block();
+    if (!s->sbcopy) {
+        sb.nsnap--;
+        return -1;
+    }
+    write_block_raw(s->sbcopy, buf);
+    sbwrite();
+    if (id) *id = s->id;
+    Log("snap: took snapshot %u", s->id);
+    return 0;
+}
+
+int snap_delete(uint id) {
+    if (sn.mounted >= 0) return -1;
+    int k = 0;
+    while (k < (int)sb.nsnap && sb.snap[k].id != id) k++;
+    if (k == (int)sb.nsnap) return -1;
+
+    struct snapinfo s = sb.snap[k];
+    snapstate st = sn.st[k];
+    uchar buf[BSIZE];
+    snapmap *sm = (snapmap *)buf;
+    uint nchain = 0;
+    for (uint bno = s.maphead; bno; bno = sm->next, nchain++) read_block(bno, buf);
+
+    uint nfree = 0, nmove = 0;
+    uint *freed = malloc((st.map.n + nchain + 1) * sizeof(uint));
+    uint(*moved)[2] = malloc((st.map.n + 1) * sizeof(uint[2]));
+    // 更旧的快照会读到 k 的副本：它自己没有副本的块把映射转给它，其余副本释放
+    for (uint i = 0; i < st.map.cap; i++) {
+        uint b = st.map.key[i], c = st.map.val[i];
+        if (!b || !c) continue;
+        if (k > 0 && !map_get(&sn.st[k - 1].map, b)) {
+            map_put(&sn.st[k - 1].map, b, c);
+            moved[nmove][0] = b;
+            moved[nmove++][1] = c;
+        } else {
+            freed[nfree++] = c;
+        }
+    }
+    freed[nfree++] = s.sbcopy;
+    for (uint bno = s.maphead; bno; bno = sm->next) {
+        read_block(bno, buf);
+        freed[nfree++] = bno;
+    }
+
+    // 先把快照从表中摘掉，之后的分配和释放就不会再为它复制
+    for (int i = k; i + 1 < (int)sb.nsnap; i++) {
+        sb.snap[i] = sb.snap[i + 1];
+        sn.st[i] = sn.st[i + 1];
+    }
+    sb.nsnap--;
+    memset(&sb.snap[sb.nsnap], 0, sizeof(struct snapinfo));
+    memset(&sn.st[sb.nsnap], 0, sizeof(snapstate));
+    state_free(&st);
+
+    for (uint i = 0; i < nmove; i++) chain_append(k - 1, moved[i][0], moved[i][1]);
+    free_blocks(freed, nfree);
+    sbwrite();
+    Log("snap: deleted snapshot %u, %u block(s) freed, %u handed over", id, nfree, nmove);
+    free(freed);
+    free(moved);
+    return 0;
+}
+
+int snap_list(struct snapinfo **snaps) {
+    *snaps = live()->snap;
+    return live()->nsnap;
+}
+
+int snap_mount(uint id) {
+    if (sn.mounted >= 0) return -1;
+    int k = 0;
+    while (k < (int)sb.nsnap && sb.snap[k].id != id) k++;
+    if (k == (int)sb.nsnap) return -1;
+
+    // 快照的超级块替换内存中的超级块，之后所有读取都经过 snap_read()
+    sn.live = sb;
+    sn.mounted = k;
+    uchar buf[BSIZE];
+    view_read(k, 0, buf);
+    memcpy(&sb, buf, sizeof(sb));
+    Log("snap: mounted snapshot %u", id);
+    return 0;
+}
+
+void snap_umount() {
+    if (sn.mounted < 0) return;
+    sb = sn.live;
+    sn.mounted = -1;
+    Log("snap: unmounted");
+}
+
+int snap_mounted() { return sn.mounted >= 0; }
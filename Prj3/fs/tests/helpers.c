@@ -0,0 +1,33 @@
+#include "helpers.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "common.h"
+#include "fs.h"
+
+void format() {
+    cmd_login(1);
+    cmd_f(1024, 63);
+}
+
+int exist(char *name, int type) {
+    entry *entries;
+    int n;
+    cmd_ls(&entries, &n);
+    int found = 0;
+    for (int i = 0; i < n; i++)
+        if (strcmp(entries[i].name, name) == 0 && entries[i].type == type) {
+            found = 1;
+            break;
+        }
+    free(entries);
+    return found;
+}
+
+void remount() {
+    clear_block_cache();
+    sbinit();
+    cmd_cd("/");
+}
@@ -0,0 +1,16 @@
+#ifndef __TEST_HELPERS_H__
+#define __TEST_HELPERS_H__
+
+#include "inode.h"
+
+extern inode *cwd;
+int dir_lookup(inode *dp, const char *name, uint *inum_out);
+
+// Log in as user 1 and format a 1024x63 disk
+void format();
+// Whether the current directory has an entry called name of the given type
+int exist(char *name, int type);
+// Simulate a restart: drop all in-memory state, mount again and go back to /
+void remount();
+
+#endif
@@ -11,11 +11,17 @@ int mt_fail_count = 0;
 void block_tests();
 void inode_tests();
 void fs_tests();
+void journal_tests();
+void fsck_tests();
+void snap_tests();
 
 void all_tests() {
     mt_run_suite(block_tests);
     mt_run_suite(inode_tests);
     mt_run_suite(fs_tests);
+    mt_run_suite(journal_tests);
+    mt_run_suite(fsck_tests);
+    mt_run_suite(snap_tests);
 }
 
 FILE *log_file;
@@ -30,6 +36,12 @@ int main(int argc, char **argv) {
             test = inode_tests;
         } else if (strcmp(argv[1], "fs") == 0) {
             test = fs_tests;
+        } else if (strcmp(argv[1], "journal") == 0) {
+            test = journal_tests;
+        } else if (strcmp(argv[1], "fsck") == 0) {
+            test = fsck_tests;
+        } else if (strcmp(argv[1], "snap") == 0) {
+            test = snap_tests;
         }
     }
     mt_main(test);
@@ -12,6 +12,8 @@ void mock_format() {
     nmeta = nbitmap + 7;  // some first blocks for metadata
 
     sb.bmapstart = 1;
+    sb.groupsize = 0;  // no cylinder groups: plain first-fit
+    group_init();
     uchar buf[BSIZE];
     memset(buf, 0, BSIZE);
     for (int i = 0; i < sb.size; i += BPB) write_block(BBLOCK(i), buf);  // initialize bitmap blocks
@@ -100,10 +102,29 @@ mt_test(test_free_block) {
     return 0;
 }
 
+mt_test(test_free_blocks) {
+    mock_format();
+    uint bnos[512];
+    int n = sizeof(bnos) / sizeof(bnos[0]);
+    for (int i = 0; i < n; i++) {
+        bnos[n - 1 - i] = allocate_block();  // reversed, free_blocks sorts them
+        mt_assert(bnos[n - 1 - i] != 0);
+    }
+    free_blocks(bnos, n);
+
+    uchar buf[BSIZE];
+    read_block(BBLOCK(nmeta), buf);
+    for (uint b = nmeta; b < nmeta + n; b++)
+        mt_assert((buf[(b % BPB) / 8] & (1 << (b % 8))) == 0);
+    mt_assert(allocate_block() == nmeta);
+    return 0;
+}
+
 void block_tests() {
     mt_run_test(test_read_write_block);
     mt_run_test(test_zero_block);
     mt_run_test(test_allocate_block);
     mt_run_test(test_allocate_block_all);
     mt_run_test(test_free_block);
+    mt_run_test(test_free_blocks);
 }
@@ -5,28 +5,11 @@
 #include "block.h"
 #include "common.h"
 #include "fs.h"
+#include "helpers.h"
 #include "inode.h"
+#include "journal.h"
 #include "mintest.h"
 
-static void format() {
-    cmd_login(1);
-    cmd_f(1024, 63);
-}
-
-static int exist(char *name, int type) {
-    entry *entries;
-    int n;
-    cmd_ls(&entries, &n);
-    int found = 0;
-    for (int i = 0; i < n; i++)
-        if (strcmp(entries[i].name, name) == 0 && entries[i].type == type) {
-            found = 1;
-            break;
-        }
-    free(entries);
-    return found;
-}
-
 mt_test(test_cmd_ls) {
     format();
     entry *entries;
@@ -165,6 +148,489 @@ mt_test(test_small_file_ops) {
     return 0;
 }
 
+mt_test(test_dir_slot_reuse) {
+    format();
+    cmd_mk("a", 0b1111);
+    cmd_mk("b", 0b1111);
+    uint size = cwd->size;
+    mt_assert(cmd_rm("a") == E_SUCCESS);
+    mt_assert(cmd_mk("c", 0b1111) == E_SUCCESS);
+    mt_assert(cwd->size == size);  // "c" should reuse the slot of "a"
+    mt_assert(exist("b", T_FILE));
+    mt_assert(exist("c", T_FILE));
+    return 0;
+}
+
+// enough 7-character names to fill five directory blocks
+#define NCOMPACT (5 * BSIZE / DIRENT_LEN(7))
+
+mt_test(test_dir_compaction) {
+    format();
+    char name[16];
+    for (int i = 0; i < NCOMPACT; i++) {
+        snprintf(name, sizeof(name), "file%03d", i);
+        mt_assert(cmd_mk(name, 0b1111) == E_SUCCESS);
+    }
+    uint size = cwd->size;
+    uint blocks = cwd->blocks;
+    for (int i = 0; i < NCOMPACT; i += 4) {
+        for (int j = 1; j < 4; j++) {
+            snprintf(name, sizeof(name), "file%03d", i + j);
+            mt_assert(cmd_rm(name) == E_SUCCESS);
+        }
+    }
+    mt_assert(cwd->size < size);
+    mt_assert(cwd->blocks < blocks);
+    for (int i = 0; i < NCOMPACT; i++) {
+        snprintf(name, sizeof(name), "file%03d", i);
+        mt_assert(exist(name, T_FILE) == (i % 4 == 0));
+    }
+    return 0;
+}
+
+// 80 directory blocks of 100-character names
+#define NAMELEN_BIG 100
+#define NBIG (80 * (BSIZE / DIRENT_LEN(NAMELEN_BIG)))
+
+static void big_name(char *name, int i) {
+    memset(name, 'n', NAMELEN_BIG);
+    name[NAMELEN_BIG] = '\0';
+    char num[8];
+    int len = snprintf(num, sizeof(num), "%d", i);
+    memcpy(name, num, len);
+}
+
+// compacting a large sparse directory must stay within what one operation reserves in the log
+mt_test(test_dir_compaction_bounded) {
+    format();
+    char name[NAMELEN_BIG + 1];
+    for (int i = 0; i < NBIG; i++) {
+        big_name(name, i);
+        mt_assert(cmd_mk(name, 0b1111) == E_SUCCESS);
+    }
+    uint size = cwd->size;
+    for (int i = 0; i < NBIG; i++) {
+        if (i % 4 == 0) continue;
+        big_name(name, i);
+        begin_op();
+        mt_assert(cmd_rm(name) == E_SUCCESS);
+        mt_assert(LOGSIZE - journal_room() <= MAXOPBLOCKS);
+        mt_assert(end_op() == 0);
+    }
+    mt_assert(cwd->size <= size / 2);
+    for (int i = 0; i < NBIG; i++) {
+        big_name(name, i);
+        mt_assert((dir_lookup(cwd, name, NULL) == T_FILE) == (i % 4 == 0));
+    }
+    return 0;
+}
+
+// paths made of long names can outgrow MAXPATH: cd refuses them instead of truncating
+mt_test(test_long_paths) {
+    format();
+    char name[MAXNAME + 1];
+    memset(name, 'p', MAXNAME);
+    name[MAXNAME] = '\0';
+    uint inum = 0;
+    for (int i = 0; i < 5; i++) {
+        mt_assert(cmd_mkdir(name, 0b1111) == E_SUCCESS);
+        int rc = cmd_cd(name);
+        if (i < MAXPATH / (MAXNAME + 1)) {
+            mt_assert(rc == E_SUCCESS);
+        } else {
+            mt_assert(rc == E_ERROR);  // cwd stays where it was
+            mt_assert(cwd->inum == inum);
+        }
+        inum = cwd->inum;
+    }
+    char *path = get_path();
+    mt_assert(strlen(path) < MAXPATH + 20);
+    free(path);
+
+    char abs[MAXPATH + 3];
+    memset(abs, 'a', sizeof(abs) - 1);
+    abs[0] = '/';
+    abs[sizeof(abs) - 1] = '\0';
+    mt_assert(cmd_cd(abs) == E_ERROR);
+    mt_assert(cmd_cd("/") == E_SUCCESS);
+    return 0;
+}
+
+mt_test(test_dir_long_names) {
+    format();
+    char name[MAXNAME + 2];
+    memset(name, 'x', sizeof(name));
+    name[MAXNAME + 1] = '\0';
+    mt_assert(cmd_mk(name, 0b1111) != E_SUCCESS);  // one byte too long
+    name[MAXNAME] = '\0';
+    mt_assert(cmd_mk(name, 0b1111) == E_SUCCESS);
+    mt_assert(exist(name, T_FILE));
+    name[MAXNAME - 1] = 'y';  // same length, different last byte
+    mt_assert(!exist(name, T_FILE));
+    mt_assert(cmd_mkdir(name, 0b1111) == E_SUCCESS);
+    mt_assert(cmd_cd(name) == E_SUCCESS);
+    cmd_cd("..");
+    name[MAXNAME - 1] = 'x';
+    mt_assert(cmd_rm(name) == E_SUCCESS);
+    mt_assert(!exist(name, T_FILE));
+
+    // short names are packed: ".", ".." and 40 two-letter names share one block
+    format();
+    for (int i = 0; i < 40; i++) {
+        snprintf(name, sizeof(name), "%c%c", 'a' + i / 26, 'a' + i % 26);
+        mt_assert(cmd_mk(name, 0b1111) == E_SUCCESS);
+    }
+    mt_assert(cwd->size == BSIZE);
+    return 0;
+}
+
+static uint ls_size(char *name) {
+    entry *entries;
+    int n;
+    uint size = (uint)-1;
+    cmd_ls(&entries, &n);
+    for (int i = 0; i < n; i++)
+        if (strcmp(entries[i].name, name) == 0) size = entries[i].size;
+    free(entries);
+    return size;
+}
+
+mt_test(test_dir_subtree_size) {
+    format();
+    cmd_mkdir("d", 0b1111);
+    cmd_cd("d");
+    cmd_mk("f", 0b1111);
+    cmd_w("f", 11, "hello world");
+    cmd_mkdir("e", 0b1111);
+    cmd_cd("e");
+    cmd_mk("g", 0b1111);
+    cmd_w("g", 5, "hello");
+    cmd_cd("/");
+    mt_assert(ls_size("d") == 16);
+
+    cmd_cd("d");
+    mt_assert(ls_size("e") == 5);
+    cmd_d("f", 0, 3);
+    cmd_i("f", 0, 2, "ab");
+    cmd_cd("/");
+    mt_assert(ls_size("d") == 15);
+
+    cmd_cd("d");
+    mt_assert(cmd_rmdir("e") == E_SUCCESS);
+    cmd_cd("/");
+    mt_assert(ls_size("d") == 10);
+
+    uint inum;
+    cmd_cd("d");
+    cmd_rm("f");
+    cmd_cd("..");
+    mt_assert(ls_size("d") == 0);
+    mt_assert(dir_lookup(cwd, "d", &inum) == T_DIR);
+    inode *ip = iget(inum);
+    mt_assert(ip->tfiles == 0);
+    iput(ip);
+    return 0;
+}
+
+// blocks in use, not counting inode blocks: a group keeps its inode blocks once it has had inodes
+static uint used_blocks() {
+    uchar buf[BSIZE];
+    uint used = 0;
+    for (uint b = 0; b < sb.size; b++) {
+        if (b % BPB == 0) read_block(BBLOCK(b), buf);
+        if (buf[(b % BPB) / 8] & (1 << (b % 8))) used++;
+    }
+    return used - sb.ninodeblock;
+}
+
+mt_test(test_space_reclaimed) {
+    format();
+    uint used = used_blocks();
+    char *data = malloc(20 * BSIZE);
+    memset(data, 'x', 20 * BSIZE);
+
+    cmd_mkdir("d", 0b1111);
+    uint used_dir = used_blocks();
+    cmd_cd("d");
+    cmd_mk("f", 0b1111);
+    cmd_w("f", 20 * BSIZE, data);
+    cmd_w("f", 3, "abc");
+    cmd_d("f", 1, 1);
+    cmd_cd("..");
+    mt_assert(used_blocks() == used_dir + 1);  // one data block left
+
+    cmd_cd("d");
+    cmd_w("f", 20 * BSIZE, data);
+    mt_assert(cmd_rm("f") == E_SUCCESS);
+    cmd_cd("..");
+    mt_assert(used_blocks() == used_dir);
+
+    cmd_cd("d");
+    cmd_mk("g", 0b1111);
+    cmd_w("g", 20 * BSIZE, data);
+    cmd_cd("..");
+    mt_assert(cmd_rmdir("d") == E_SUCCESS);
+    mt_assert(used_blocks() == used);
+    free(data);
+    return 0;
+}
+
+static int same_content(char *name, char *data, uint len) {
+    uchar *buf;
+    uint n;
+    if (cmd_cat(name, &buf, &n) != E_SUCCESS) return 0;
+    int same = n == len && memcmp(buf, data, len) == 0;
+    free(buf);
+    return same;
+}
+
+mt_test(test_clone_shares_blocks) {
+    format();
+    char *data = malloc(20 * BSIZE);
+    for (int i = 0; i < 20 * BSIZE; i++) data[i] = 'a' + i % 26;
+    cmd_mk("f", 0b1111);
+    cmd_w("f", 20 * BSIZE, data);
+    uint used = used_blocks();
+
+    mt_assert(cmd_clone("f", "g") == E_SUCCESS);
+    mt_assert(cmd_clone("f", "g") == E_ERROR);
+    mt_assert(cmd_clone("nope", "h") == E_ERROR);
+    mt_assert(used_blocks() <= used + 2);  // a new indirect block, maybe an inode block
+    mt_assert(same_content("g", data, 20 * BSIZE));
+    mt_assert(ls_size("g") == 20 * BSIZE);
+
+    // writing either side copies only the blocks it touches
+    used = used_blocks();
+    cmd_i("g", 3 * BSIZE, BSIZE, data);
+    mt_assert(used_blocks() == used + 1);
+    cmd_d("g", 3 * BSIZE + 7, BSIZE);  // rewrites the block at the edit point
+    mt_assert(used_blocks() == used + 1);
+    cmd_w("f", 5, "hello");
+    mt_assert(same_content("f", "hello", 5));
+    char *expect = malloc(20 * BSIZE);
+    memcpy(expect, data, 3 * BSIZE);
+    memcpy(expect + 3 * BSIZE, data, 7);
+    memcpy(expect + 3 * BSIZE + 7, data + 3 * BSIZE + 7, 17 * BSIZE - 7);
+    mt_assert(same_content("g", expect, 20 * BSIZE));
+    free(expect);
+    free(data);
+    return 0;
+}
+
+mt_test(test_clone_space_reclaimed) {
+    format();
+    char *data = malloc(10 * BSIZE);
+    memset(data, 'c', 10 * BSIZE);
+    uint used = used_blocks();
+    cmd_mk("f", 0b1111);
+    cmd_w("f", 10 * BSIZE, data);
+    cmd_clone("f", "g");
+    cmd_clone("g", "h");
+    mt_assert(cmd_rm("f") == E_SUCCESS);
+    mt_assert(same_content("h", data, 10 * BSIZE));
+    mt_assert(cmd_rm("h") == E_SUCCESS);
+    mt_assert(same_content("g", data, 10 * BSIZE));
+    mt_assert(cmd_rm("g") == E_SUCCESS);
+    mt_assert(used_blocks() == used);
+    free(data);
+    return 0;
+}
+
+mt_test(test_range_io) {
+    format();
+    char *data = malloc(3 * BSIZE);
+    for (int i = 0; i < 3 * BSIZE; i++) data[i] = 'a' + i % 26;
+    cmd_mk("f", 0b1111);
+    // streamed in pieces that straddle block boundaries
+    for (uint off = 0; off < 3 * BSIZE; off += 300)
+        mt_assert(cmd_pwrite("f", off, min(300, 3 * BSIZE - off), data + off) == E_SUCCESS);
+    mt_assert(same_content("f", data, 3 * BSIZE));
+
+    uchar buf[BSIZE];
+    uint n;
+    mt_assert(cmd_pread("f", BSIZE - 10, 20, buf, &n) == E_SUCCESS && n == 20);
+    mt_assert(memcmp(buf, data + BSIZE - 10, 20) == 0);
+    mt_assert(cmd_pread("f", 3 * BSIZE - 5, 20, buf, &n) == E_SUCCESS && n == 5);
+    mt_assert(cmd_pread("f", 3 * BSIZE + 5, 20, buf, &n) == E_SUCCESS && n == 0);
+
+    // overwrite in the middle, append at the end, no holes past the end
+    mt_assert(cmd_pwrite("f", 100, 3, "XYZ") == E_SUCCESS);
+    memcpy(data + 100, "XYZ", 3);
+    mt_assert(cmd_pwrite("f", 3 * BSIZE + 1, 1, "!") == E_ERROR);
+    mt_assert(cmd_pwrite("f", 3 * BSIZE, 1, "!") == E_SUCCESS);
+    data = realloc(data, 3 * BSIZE + 1);
+    data[3 * BSIZE] = '!';
+    mt_assert(same_content("f", data, 3 * BSIZE + 1));
+
+    cmd_mkdir("d", 0b1111);
+    mt_assert(cmd_pread("d", 0, 10, buf, &n) == E_ERROR);
+    mt_assert(cmd_pwrite("nosuch", 0, 1, "x") == E_ERROR);
+    free(data);
+    return 0;
+}
+
+mt_test(test_append) {
+    format();
+    char *data = malloc(20 * BSIZE);
+    for (int i = 0; i < 20 * BSIZE; i++) data[i] = 'a' + i % 23;
+    cmd_mk("log", 0b1111);
+    // record sizes that keep crossing block boundaries, into the indirect block
+    uint off = 0;
+    for (uint n = 1; off + n <= 20 * BSIZE; off += n, n = n * 7 % 601 + 1)
+        mt_assert(cmd_a("log", n, data + off) == E_SUCCESS);
+    mt_assert(same_content("log", data, off));
+    // the partial tail block stays cached for the next append
+    uint inum, lbn = off / BSIZE, bno;
+    mt_assert(off % BSIZE && dir_lookup(cwd, "log", &inum));
+    inode *ip = iget(inum);
+    if (lbn < NDIRECT) {
+        bno = ip->addrs[lbn];
+    } else {
+        uint indirect[APB];
+        read_block(ip->addrs[NDIRECT], (uchar *)indirect);
+        bno = indirect[lbn - NDIRECT];
+    }
+    iput(ip);
+    mt_assert(find_in_cache(bno) != NULL);
+    cmd_mkdir("d", 0b1111);
+    mt_assert(cmd_a("d", 1, "x") == E_ERROR);
+    mt_assert(cmd_a("nosuch", 1, "x") == E_ERROR);
+    free(data);
+    return 0;
+}
+
+mt_test(test_block_size_recorded) {
+    format();
+    mt_assert(sb.bsize == BSIZE && sb.size == 1024 * 63 / SPB);
+    cmd_mk("f", 0b1111);
+    // a disk formatted with another block size is not mounted
+    uchar buf[BSIZE];
+    read_block_raw(0, buf);
+    ((struct superblock *)buf)->bsize = BSIZE * 2;
+    write_block_raw(0, buf);
+    clear_block_cache();
+    sbinit();
+    entry *entries;
+    int n;
+    mt_assert(cmd_ls(&entries, &n) == E_NOT_FORMATTED);
+    ((struct superblock *)buf)->bsize = BSIZE;
+    write_block_raw(0, buf);
+    sbinit();
+    cmd_cd("/");
+    mt_assert(exist("f", T_FILE));
+    return 0;
+}
+
+// an image in the old on-disk format is not mounted until it is reformatted
+mt_test(test_old_format_rejected) {
+    format();
+    uchar buf[BSIZE];
+    read_block_raw(0, buf);
+    ((struct superblock *)buf)->magic = FS_MAGIC_V0;
+    write_block_raw(0, buf);
+    remount();
+    entry *entries;
+    int n;
+    mt_assert(cmd_ls(&entries, &n) == E_NOT_FORMATTED);
+    mt_assert(cmd_mk("f", 0b1111) == E_NOT_FORMATTED);
+    format();
+    mt_assert(sb.magic == FS_MAGIC);
+    mt_assert(cmd_mk("f", 0b1111) == E_SUCCESS);
+    return 0;
+}
+
+mt_test(test_cylinder_groups) {
+    format();
+    mt_assert(sb.groupsize > 0 && group_count() > 1);
+    // a new directory stays near its parent while the parent's group has room
+    cmd_mkdir("a", 0b1111);
+    cmd_mkdir("b", 0b1111);
+    uint ia, ib, inum;
+    mt_assert(dir_lookup(cwd, "a", &ia) && dir_lookup(cwd, "b", &ib));
+    inode *a = iget(ia), *b = iget(ib);
+    uint g = BGROUP(a->addrs[0]);
+    mt_assert(g == BGROUP(cwd->addrs[0]) && g == BGROUP(b->addrs[0]));
+    iput(a);
+    iput(b);
+    // and moves to the nearest group with average free space once that fills up
+    uint n = 0, *taken = malloc(sb.groupsize * sizeof(uint));
+    while (group_for_dir(g) == g && n < sb.groupsize) taken[n++] = allocate_block_near(group_start(g));
+    uint h = group_for_dir(g);
+    mt_assert(h == g + 1 || h + 1 == g);
+    free_blocks(taken, n);
+    mt_assert(group_for_dir(g) == g);
+    free(taken);
+
+    // a file's inode and data stay in its directory's group
+    cmd_cd("a");
+    char *data = malloc(8 * BSIZE);
+    memset(data, 'x', 8 * BSIZE);
+    cmd_mk("f", 0b1111);
+    cmd_w("f", 8 * BSIZE, data);
+    mt_assert(dir_lookup(cwd, "f", &inum));
+    inode *ip = iget(inum);
+    for (int i = 0; i < NDIRECT; i++) mt_assert(BGROUP(ip->addrs[i]) == g);
+    uint first = ip->addrs[0];
+    iput(ip);
+
+    // so reading it back never leaves the group
+    int ncyl, nsec;
+    get_disk_info(&ncyl, &nsec);
+    clear_block_cache();
+    uchar buf[BSIZE];
+    read_block_raw(first, buf);
+    reset_seek_stats();
+    uchar *out;
+    uint len, nreq;
+    unsigned long dist;
+    mt_assert(cmd_cat("f", &out, &len) == E_SUCCESS && len == 8 * BSIZE);
+    seek_stats(&nreq, &dist);
+    mt_assert(nreq > 0 && dist <= sb.groupsize * SPB / nsec + 1);
+    free(out);
+    free(data);
+    cmd_cd("/");
+    return 0;
+}
+
+mt_test(test_rmdir_background) {
+    format();
+    uint used = used_blocks();
+    char name[8];
+    char *data = malloc(10 * BSIZE);
+    memset(data, 'y', 10 * BSIZE);
+
+    // a tree deeper and wider than a single reclaim batch
+    cmd_mkdir("top", 0b1111);
+    cmd_cd("top");
+    for (int i = 0; i < 12; i++) {
+        snprintf(name, sizeof(name), "d%d", i);
+        cmd_mkdir(name, 0b1111);
+        cmd_cd(name);
+        cmd_mk("f", 0b1111);
+        cmd_w("f", 10 * BSIZE, data);
+        cmd_mkdir("sub", 0b1111);
+        cmd_cd("sub");
+        cmd_mk("g", 0b1111);
+        cmd_w("g", 100, data);
+        cmd_cd("../..");
+    }
+    cmd_cd("/");
+    free(data);
+
+    // commands take the fs lock, as the server does, while the reclaimer runs
+    reclaim_start();
+    fs_lock();
+    int rc = cmd_rmdir("top");
+    int gone = !exist("top", T_DIR);  // unlinked before being reclaimed
+    fs_unlock();
+    mt_assert(rc == E_SUCCESS && gone);
+    reclaim_wait();
+    reclaim_stop();
+    mt_assert(sb.norphan == 0);
+    mt_assert(used_blocks() == used);
+    return 0;
+}
+
 static void generate_random_name(char *name, int length) {
     const char charset[] = "abcdefghijklmnopqrstuvwxyz";
     for (int i = 0; i < length; i++) {
@@ -255,6 +721,21 @@ void fs_tests() {
     mt_run_test(test_cmd_rmdir_with_files);
     mt_run_test(test_file_lifecycle);
     mt_run_test(test_small_file_ops);
+    mt_run_test(test_dir_slot_reuse);
+    mt_run_test(test_dir_compaction);
+    mt_run_test(test_dir_compaction_bounded);
+    mt_run_test(test_dir_long_names);
+    mt_run_test(test_long_paths);
+    mt_run_test(test_dir_subtree_size);
+    mt_run_test(test_space_reclaimed);
+    mt_run_test(test_clone_shares_blocks);
+    mt_run_test(test_clone_space_reclaimed);
+    mt_run_test(test_range_io);
+    mt_run_test(test_append);
+    mt_run_test(test_block_size_recorded);
+    mt_run_test(test_old_format_rejected);
+    mt_run_test(test_cylinder_groups);
+    mt_run_test(test_rmdir_background);
     mt_run_test(test_folder_tree_operations);
     mt_run_test(test_folder_tree_with_rm);
 }
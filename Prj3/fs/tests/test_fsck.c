@@ -0,0 +1,255 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "common.h"
+#include "fs.h"
+#include "fsck.h"
+#include "inode.h"
+#include "journal.h"
+#include "mintest.h"
+#include "snap.h"
+
+#define IMG "fsck_test.img"
+
+extern inode *cwd;
+int dir_lookup(inode *dp, const char *name, uint *inum_out);
+int dir_remove(inode *dp, const char *name);
+
+// a small file system keeps the image dump fast
+static void format() {
+    cmd_login(1);
+    cmd_f(32, 63);
+}
+
+// copy the whole file system out of the disk server into an image file
+static void dump() {
+    FILE *f = fopen(IMG, "w");
+    uchar buf[BSIZE];
+    for (uint b = 0; b < sb.size; b++) {
+        read_block_raw(b, buf);
+        fwrite(buf, BSIZE, 1, f);
+    }
+    fclose(f);
+}
+
+static void patch(uint bno, uint off, void *src, uint n) {
+    FILE *f = fopen(IMG, "r+");
+    fseek(f, (long)bno * BSIZE + off, SEEK_SET);
+    fwrite(src, n, 1, f);
+    fclose(f);
+}
+
+static void build_tree() {
+    char *data = malloc(20 * BSIZE);
+    memset(data, 'z', 20 * BSIZE);
+    cmd_mkdir("a", 0b1111);
+    cmd_mkdir("b", 0b1111);
+    cmd_cd("a");
+    cmd_mk("small", 0b1111);
+    cmd_w("small", 700, data);
+    cmd_mk("big", 0b1111);
+    cmd_w("big", 20 * BSIZE, data);  // uses the indirect block
+    cmd_i("big", 10, 5, "hello");
+    cmd_d("big", BSIZE, 3 * BSIZE);
+    cmd_mkdir("c", 0b1111);
+    cmd_cd("c");
+    cmd_mk("deep", 0b1111);
+    cmd_w("deep", 3, "abc");
+    cmd_cd("/");
+    cmd_cd("b");
+    cmd_mk("gone", 0b1111);
+    cmd_w("gone", 8 * BSIZE, data);
+    cmd_rm("gone");
+    cmd_cd("/");
+    free(data);
+}
+
+mt_test(test_fsck_clean) {
+    format();
+    build_tree();
+    cmd_rmdir("b");
+    journal_checkpoint();
+    dump();
+
+    fsck_result res;
+    mt_assert(fsck_image(IMG, 0, 4, &res) == 0);
+    mt_assert(res.nerror == 0);
+    mt_assert(res.ninode == 6);  // root, a, small, big, c, deep
+    unlink(IMG);
+    return 0;
+}
+
+mt_test(test_fsck_journal) {
+    format();
+    begin_op();
+    build_tree();
+    end_op();  // committed to the log but not written home
+    dump();
+
+    fsck_result res;
+    mt_assert(fsck_image(IMG, 0, 2, &res) == 0);
+    mt_assert(res.nerror == 0);
+    // repair mode replays the log first, which leaves nothing to fix
+    mt_assert(fsck_image(IMG, 1, 2, &res) == 0);
+    mt_assert(res.nerror == 0);
+    logheader lh;
+    FILE *f = fopen(IMG, "r");
+    fseek(f, (long)sb.logstart * BSIZE, SEEK_SET);
+    mt_assert(fread(&lh, sizeof(lh), 1, f) == 1);
+    fclose(f);
+    mt_assert(lh.n == 0);
+    unlink(IMG);
+    return 0;
+}
+
+mt_test(test_fsck_repair) {
+    format();
+    build_tree();
+    journal_checkpoint();
+    uint a, small, c;
+    mt_assert(dir_lookup(cwd, "a", &a) == T_DIR);
+    inode *ap = iget(a);
+    mt_assert(dir_lookup(ap, "small", &small) == T_FILE);
+    mt_assert(dir_lookup(ap, "c", &c) == T_DIR);
+    inode *sp = iget(small), *cp = iget(c);
+    dump();
+
+    // 1. a block of "small" marked free in the bitmap
+    uint b = sp->addrs[1];
+    uchar byte;
+    FILE *f = fopen(IMG, "r");
+    fseek(f, (long)BBLOCK(b) * BSIZE + (b % BPB) / 8, SEEK_SET);
+    mt_assert(fread(&byte, 1, 1, f) == 1);
+    fclose(f);
+    byte &= ~(1 << (b % 8));
+    patch(BBLOCK(b), (b % BPB) / 8, &byte, 1);
+    // 2. ".." of c pointing to the root instead of a
+    uint root = 0;
+    patch(cp->addrs[0], DIRENT_LEN(1) + offsetof(dirent, inum), &root, sizeof(uint));
+    // 3. an allocated inode that no directory links to
+    uint lost;
+    for (lost = 0; lost < sb.ninodeblock * (BSIZE / sizeof(dinode)); lost++) {
+        inode *ip = iget(lost);
+        if (!ip) break;
+        iput(ip);
+    }
+    dinode d;
+    memset(&d, 0, sizeof(d));
+    d.type = T_FILE;
+    patch(sb.inodeblock[lost / (BSIZE / sizeof(dinode))], lost % (BSIZE / sizeof(dinode)) * sizeof(dinode),
+          &d, sizeof(d));
+    // 4. a wrong subtree size on a
+    uint tsize = ap->tsize + 1;
+    patch(sb.inodeblock[a / (BSIZE / sizeof(dinode))],
+          a % (BSIZE / sizeof(dinode)) * sizeof(dinode) + offsetof(dinode, tsize), &tsize, sizeof(uint));
+    iput(ap);
+    iput(sp);
+    iput(cp);
+
+    fsck_result res;
+    mt_assert(fsck_image(IMG, 0, 4, &res) == 4);
+    mt_assert(res.nerror == 4 && res.nfixed == 0);
+    mt_assert(fsck_image(IMG, 1, 4, &res) == 0);
+    mt_assert(res.nerror == 4 && res.nfixed == 4);
+    mt_assert(fsck_image(IMG, 0, 1, &res) == 0);
+    mt_assert(res.nerror == 0);
+    unlink(IMG);
+    return 0;
+}
+
+mt_test(test_fsck_orphans) {
+    format();
+    build_tree();
+    // a directory waiting for the background reclaimer is not a leak; do what
+    // cmd_rmdir does but stop before the reclaimer runs
+    uint a;
+    mt_assert(dir_lookup(cwd, "a", &a) == T_DIR);
+    inode *ap = iget(a);
+    dir_remove(cwd, "a");
+    iaccount(cwd->inum, -(int)ap->tsize, -(int)ap->tfiles);
+    iput(ap);
+    sb.orphan[sb.norphan++] = a;
+    sbwrite();
+    journal_checkpoint();
+    dump();
+
+    fsck_result res;
+    mt_assert(fsck_image(IMG, 0, 3, &res) == 0);
+    mt_assert(res.nerror == 0);
+    mt_assert(res.ninode == 7);
+    reclaim_kick();
+    unlink(IMG);
+    return 0;
+}
+
+mt_test(test_fsck_snapshots) {
+    format();
+    build_tree();
+    uint id;
+    mt_assert(snap_take(&id) == 0);
+    // copies, the map chain and the superblock copy are all in use
+    cmd_cd("a");
+    cmd_w("small", 5, "fresh");
+    cmd_rm("big");
+    cmd_cd("/");
+    cmd_rmdir("b");
+    journal_checkpoint();
+    dump();
+
+    fsck_result res;
+    mt_assert(fsck_image(IMG, 0, 2, &res) == 0);
+    mt_assert(res.nerror == 0);
+
+    // after deleting the snapshot every block it held is free again
+    mt_assert(snap_delete(id) == 0);
+    journal_checkpoint();
+    dump();
+    mt_assert(fsck_image(IMG, 0, 2, &res) == 0);
+    mt_assert(res.nerror == 0);
+    unlink(IMG);
+    return 0;
+}
+
+mt_test(test_fsck_clones) {
+    format();
+    build_tree();
+    cmd_cd("a");
+    mt_assert(cmd_clone("big", "big2") == E_SUCCESS);
+    mt_assert(cmd_clone("big", "big3") == E_SUCCESS);
+    cmd_w("big3", 3, "new");  // drops its references again
+    uint big;
+    mt_assert(dir_lookup(cwd, "big", &big) == T_FILE);
+    inode *ip = iget(big);
+    uint b = ip->addrs[0];
+    iput(ip);
+    cmd_cd("/");
+    journal_checkpoint();
+    dump();
+
+    fsck_result res;
+    mt_assert(fsck_image(IMG, 0, 2, &res) == 0);
+    mt_assert(res.nerror == 0);
+
+    // a shared block whose count says it is not shared
+    uchar zero = 0;
+    patch(RBLOCK(b), b % BSIZE, &zero, 1);
+    mt_assert(fsck_image(IMG, 0, 2, &res) == 1);
+    mt_assert(fsck_image(IMG, 1, 2, &res) == 0);
+    mt_assert(res.nfixed == 1);
+    mt_assert(fsck_image(IMG, 0, 2, &res) == 0);
+    unlink(IMG);
+    return 0;
+}
+
+void fsck_tests() {
+    mt_run_test(test_fsck_clean);
+    mt_run_test(test_fsck_journal);
+    mt_run_test(test_fsck_repair);
+    mt_run_test(test_fsck_orphans);
+    mt_run_test(test_fsck_snapshots);
+    mt_run_test(test_fsck_clones);
+}
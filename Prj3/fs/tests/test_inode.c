@@ -14,14 +14,14 @@ inline static void format() {
 
 mt_test(test_ialloc) {
     format();
-    inode *ip = ialloc(T_FILE);
+    inode *ip = ialloc(T_FILE, 0);
     mt_assert(ip != NULL);
     mt_assert(ip->type == T_FILE);
     mt_assert(ip->size == 0);
     mt_assert(ip->blocks == 0);
     iput(ip);
 
-    ip = ialloc(T_DIR);
+    ip = ialloc(T_DIR, 0);
     mt_assert(ip != NULL);
     mt_assert(ip->type == T_DIR);
     iput(ip);
@@ -30,7 +30,7 @@ mt_test(test_ialloc) {
 
 mt_test(test_iget) {
     format();
-    inode *ip = ialloc(T_FILE);
+    inode *ip = ialloc(T_FILE, 0);
     mt_assert(ip != NULL);
     uint inum = ip->inum;
     iput(ip);
@@ -45,7 +45,7 @@ mt_test(test_iget) {
 
 mt_test(test_iupdate) {
     format();
-    inode *ip = ialloc(T_FILE);
+    inode *ip = ialloc(T_FILE, 0);
     mt_assert(ip != NULL);
     uint inum = ip->inum;
     ip->size = 1024;
@@ -67,7 +67,7 @@ mt_test(test_iupdate) {
 
 mt_test(test_writei) {
     format();
-    inode *ip = ialloc(T_FILE);
+    inode *ip = ialloc(T_FILE, 0);
     mt_assert(ip != NULL);
 
     // Write data to the inode
@@ -89,7 +89,7 @@ mt_test(test_writei) {
 
 mt_test(test_readi) {
     format();
-    inode *ip = ialloc(T_FILE);
+    inode *ip = ialloc(T_FILE, 0);
     mt_assert(ip != NULL);
 
     // Write data to the inode
@@ -113,7 +113,7 @@ mt_test(test_readi) {
 
 mt_test(test_read_write_mixed) {
     format();
-    inode *ip = ialloc(T_FILE);
+    inode *ip = ialloc(T_FILE, 0);
     mt_assert(ip != NULL);
 
     // Write initial data to the inode
@@ -149,7 +149,7 @@ mt_test(test_read_write_mixed) {
 
 mt_test(test_random_binary_read_write) {
     format();
-    inode *ip = ialloc(T_FILE);
+    inode *ip = ialloc(T_FILE, 0);
     mt_assert(ip != NULL);
 
     // Generate random binary data larger than direct blocks
@@ -194,6 +194,87 @@ mt_test(test_random_binary_read_write) {
     return 0;
 }
 
+mt_test(test_insert_delete) {
+    format();
+    inode *ip = ialloc(T_FILE, 0);
+    mt_assert(ip != NULL);
+
+    // model of the file content, kept in memory
+    const uint cap = (NDIRECT + 12) * BSIZE;
+    uchar *model = malloc(cap), *data = malloc(cap), *buf = malloc(cap);
+    uint size = (NDIRECT + 3) * BSIZE + 100;
+    srand(time(NULL));
+    for (uint i = 0; i < cap; i++) data[i] = rand() % 256;
+    memcpy(model, data, size);
+    mt_assert(writei(ip, model, 0, size) == size);
+
+    // {pos, len, insert?}: block-aligned splices, unaligned splices and byte shifts
+    uint ops[][3] = {{0, BSIZE, 1}, {BSIZE * 2, BSIZE * 3, 1}, {100, BSIZE * 2, 1}, {37, 5, 1},
+                     {BSIZE, BSIZE, 0}, {300, BSIZE * 2, 0},  {11, 700, 0},       {5, 9, 1},
+                     {0, 3, 0}};
+    for (int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        uint pos = ops[i][0], len = ops[i][1];
+        if (ops[i][2]) {
+            mt_assert(inserti(ip, data, pos, len) == len);
+            memmove(model + pos + len, model + pos, size - pos);
+            memcpy(model + pos, data, len);
+            size += len;
+        } else {
+            mt_assert(deletei(ip, pos, len) == len);
+            memmove(model + pos, model + pos + len, size - pos - len);
+            size -= len;
+        }
+        mt_assert(ip->size == size);
+        mt_assert(readi(ip, buf, 0, size) == size);
+        mt_assert(memcmp(model, buf, size) == 0);
+    }
+
+    // deleting everything past a point frees the blocks behind it
+    deletei(ip, BSIZE, size);
+    mt_assert(ip->size == BSIZE);
+    mt_assert(ip->blocks == 1);
+
+    free(model);
+    free(data);
+    free(buf);
+    iput(ip);
+    return 0;
+}
+
+// a block-aligned insert that runs out of space gives back the blocks it got
+mt_test(test_insert_no_space) {
+    cmd_login(1);
+    cmd_f(32, 63);  // a small disk that is quick to fill
+    inode *ip = ialloc(T_FILE, 0);
+    mt_assert(ip != NULL);
+    uchar *data = calloc(4, BSIZE);
+    mt_assert(writei(ip, data, 0, BSIZE) == BSIZE);
+    uint blocks = ip->blocks;
+
+    // use up the disk except for two blocks
+    uint *hoard = malloc(sb.size * sizeof(uint)), n = 0;
+    while ((hoard[n] = allocate_block())) n++;
+    mt_assert(n > 2);
+    free_block(hoard[--n]);
+    free_block(hoard[--n]);
+
+    mt_assert(inserti(ip, data, 0, 4 * BSIZE) < 0);
+    mt_assert(ip->blocks == blocks);
+    mt_assert(ip->size == BSIZE);
+    // both blocks are free again
+    uint a = allocate_block(), b = allocate_block();
+    mt_assert(a && b);
+    mt_assert(allocate_block() == 0);
+
+    free_block(a);
+    free_block(b);
+    free_blocks(hoard, n);
+    free(hoard);
+    free(data);
+    iput(ip);
+    return 0;
+}
+
 void inode_tests() {
     mt_run_test(test_iget);
     mt_run_test(test_ialloc);
@@ -202,4 +283,6 @@ void inode_tests() {
     mt_run_test(test_readi);
     mt_run_test(test_read_write_mixed);
     mt_run_test(test_random_binary_read_write);
+    mt_run_test(test_insert_delete);
+    mt_run_test(test_insert_no_space);
 }
\ No newline at end of file
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "common.h"
+#include "fs.h"
+#include "helpers.h"
+#include "inode.h"
+#include "journal.h"
+#include "mintest.h"
+
+mt_test(test_journal_layout) {
+    format();
+    mt_assert(sb.nlog == LOGSIZE);
+    mt_assert(sb.logstart > sb.bmapstart);
+    mt_assert(sb.datastart == sb.logstart + 1 + LOGSIZE);
+
+    // the journal region must never be handed out
+    uint bno = allocate_block();
+    mt_assert(bno >= sb.datastart);
+    free_block(bno);
+    return 0;
+}
+
+mt_test(test_journal_commit_recover) {
+    format();
+    begin_op();
+    mt_assert(cmd_mkdir("jdir", 0b1111) == E_SUCCESS);
+    mt_assert(cmd_mk("jfile", 0b1111) == E_SUCCESS);
+    mt_assert(cmd_w("jfile", 5, "hello") == E_SUCCESS);
+    end_op();  // committed to the log, not yet written home
+
+    remount();
+    mt_assert(exist("jdir", T_DIR));
+    mt_assert(exist("jfile", T_FILE));
+    uchar *buf;
+    uint len;
+    mt_assert(cmd_cat("jfile", &buf, &len) == E_SUCCESS);
+    mt_assert(len == 5 && memcmp(buf, "hello", 5) == 0);
+    free(buf);
+    return 0;
+}
+
+mt_test(test_journal_uncommitted_lost) {
+    format();
+    begin_op();
+    cmd_mkdir("keep", 0b1111);
+    end_op();
+
+    begin_op();
+    cmd_mkdir("lost", 0b1111);
+    cmd_mk("lost2", 0b1111);
+    // crash before end_op: the whole transaction disappears
+    remount();
+    mt_assert(exist("keep", T_DIR));
+    mt_assert(!exist("lost", T_DIR));
+    mt_assert(!exist("lost2", T_FILE));
+    return 0;
+}
+
+mt_test(test_journal_checkpoint) {
+    format();
+    begin_op();
+    cmd_mk("cp", 0b1111);
+    end_op();
+    journal_checkpoint();
+
+    // after a checkpoint the home locations alone describe the file system
+    uint inum;
+    mt_assert(dir_lookup(cwd, "cp", &inum) == T_FILE);
+    uchar buf[BSIZE];
+    read_block_raw(sb.logstart, buf);
+    mt_assert(*(uint *)buf == 0);
+    remount();
+    mt_assert(exist("cp", T_FILE));
+    return 0;
+}
+
+mt_test(test_journal_many_ops) {
+    format();
+    char name[8];
+    // more transactions than fit in the log at once
+    for (int i = 0; i < 60; i++) {
+        snprintf(name, sizeof(name), "m%d", i);
+        begin_op();
+        mt_assert(cmd_mk(name, 0b1111) == E_SUCCESS);
+        end_op();
+    }
+    remount();
+    for (int i = 0; i < 60; i++) {
+        snprintf(name, sizeof(name), "m%d", i);
+        mt_assert(exist(name, T_FILE));
+    }
+    return 0;
+}
+
+// an operation that outgrows the free log space writes back the finished ones, never itself
+mt_test(test_journal_big_op) {
+    format();
+    char name[8];
+    for (int i = 0; i < 12; i++) {
+        snprintf(name, sizeof(name), "k%d", i);
+        begin_op();
+        mt_assert(cmd_mk(name, 0b1111) == E_SUCCESS);
+        end_op();
+    }
+    begin_op();
+    for (int i = 0; i < 90; i++) {
+        snprintf(name, sizeof(name), "d%d", i);
+        mt_assert(cmd_mkdir(name, 0b1111) == E_SUCCESS);
+    }
+    // crash before end_op: none of the big operation may be home yet
+    remount();
+    for (int i = 0; i < 12; i++) {
+        snprintf(name, sizeof(name), "k%d", i);
+        mt_assert(exist(name, T_FILE));
+    }
+    mt_assert(!exist("d0", T_DIR));
+    mt_assert(!exist("d89", T_DIR));
+
+    begin_op();
+    for (int i = 0; i < 90; i++) {
+        snprintf(name, sizeof(name), "d%d", i);
+        mt_assert(cmd_mkdir(name, 0b1111) == E_SUCCESS);
+    }
+    mt_assert(end_op() == 0);
+    remount();
+    mt_assert(exist("d0", T_DIR));
+    mt_assert(exist("d89", T_DIR));
+    return 0;
+}
+
+// an operation larger than the whole log fails as a unit
+mt_test(test_journal_too_big) {
+    format();
+    begin_op();
+    mt_assert(cmd_mkdir("keep", 0b1111) == E_SUCCESS);
+    end_op();
+    uint size = cwd->size;
+
+    char name[8];
+    begin_op();
+    for (int i = 0; i < 200; i++) {
+        snprintf(name, sizeof(name), "d%d", i);
+        cmd_mkdir(name, 0b1111);
+    }
+    mt_assert(end_op() < 0);
+    mt_assert(cwd->size == size);
+    mt_assert(exist("keep", T_DIR));
+    mt_assert(!exist("d0", T_DIR));
+
+    // the rolled back blocks are free again and the file system keeps working
+    begin_op();
+    mt_assert(cmd_mkdir("after", 0b1111) == E_SUCCESS);
+    mt_assert(end_op() == 0);
+    remount();
+    mt_assert(exist("keep", T_DIR));
+    mt_assert(exist("after", T_DIR));
+    mt_assert(!exist("d0", T_DIR));
+    mt_assert(!exist("d199", T_DIR));
+    return 0;
+}
+
+// with the background committer running, journal_wait returns only once the op is in the on-disk log
+mt_test(test_journal_wait_durable) {
+    format();
+    journal_start();
+    fs_lock();
+    begin_op();
+    mt_assert(cmd_mk("sync", 0b1111) == E_SUCCESS);
+    mt_assert(end_op() == 0);
+    journal_wait();
+    uchar buf[BSIZE];
+    read_block_raw(sb.logstart, buf);
+    mt_assert(*(uint *)buf > 0);
+    fs_unlock();
+    journal_stop();
+    remount();
+    mt_assert(exist("sync", T_FILE));
+    return 0;
+}
+
+void journal_tests() {
+    mt_run_test(test_journal_layout);
+    mt_run_test(test_journal_commit_recover);
+    mt_run_test(test_journal_uncommitted_lost);
+    mt_run_test(test_journal_checkpoint);
+    mt_run_test(test_journal_many_ops);
+    mt_run_test(test_journal_big_op);
+    mt_run_test(test_journal_too_big);
+    mt_run_test(test_journal_wait_durable);
+}
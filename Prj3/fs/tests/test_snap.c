@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "common.h"
+#include "fs.h"
+#include "helpers.h"
+#include "inode.h"
+#include "journal.h"
+#include "mintest.h"
+#include "snap.h"
+
+static int content(char *name, char *expect) {
+    uchar *buf;
+    uint len;
+    if (cmd_cat(name, &buf, &len) != E_SUCCESS) return 0;
+    int same = len == strlen(expect) && memcmp(buf, expect, len) == 0;
+    free(buf);
+    return same;
+}
+
+static uint nfree() {
+    uchar buf[BSIZE];
+    uint n = 0;
+    for (uint b = sb.datastart; b < sb.size; b++) {
+        if (b % BPB == 0 || b == sb.datastart) read_block(BBLOCK(b), buf);
+        if (!(buf[(b % BPB) / 8] >> (b % 8) & 1)) n++;
+    }
+    return n;
+}
+
+mt_test(test_snap_mount_old_state) {
+    format();
+    cmd_mk("f", 0b1111);
+    cmd_w("f", 5, "hello");
+    cmd_mkdir("d", 0b1111);
+    uint id;
+    mt_assert(cmd_snap(&id) == E_SUCCESS);
+
+    cmd_w("f", 5, "world");
+    cmd_rmdir("d");
+    cmd_mk("g", 0b1111);
+
+    mt_assert(cmd_mount(id) == E_SUCCESS);
+    mt_assert(content("f", "hello"));
+    mt_assert(exist("d", T_DIR));
+    mt_assert(!exist("g", T_FILE));
+    // a mounted snapshot is read-only
+    mt_assert(cmd_w("f", 3, "abc") == E_PERMISSION_DENIED);
+    mt_assert(cmd_mk("h", 0b1111) == E_PERMISSION_DENIED);
+    mt_assert(cmd_snap(NULL) == E_PERMISSION_DENIED);
+    mt_assert(cmd_umount() == E_SUCCESS);
+
+    mt_assert(content("f", "world"));
+    mt_assert(!exist("d", T_DIR));
+    mt_assert(exist("g", T_FILE));
+    return 0;
+}
+
+mt_test(test_snap_multiple_delete) {
+    format();
+    cmd_mk("f", 0b1111);
+    cmd_w("f", 2, "v1");
+    uint free0 = nfree();
+    uint s1, s2;
+    mt_assert(cmd_snap(&s1) == E_SUCCESS);
+    cmd_w("f", 2, "v2");
+    mt_assert(cmd_snap(&s2) == E_SUCCESS);
+    cmd_w("f", 2, "v3");
+    mt_assert(nfree() < free0);
+
+    struct snapinfo *snaps;
+    int n;
+    mt_assert(cmd_lssnap(&snaps, &n) == E_SUCCESS);
+    mt_assert(n == 2 && snaps[0].id == s1 && snaps[1].id == s2);
+
+    mt_assert(cmd_mount(s1) == E_SUCCESS);
+    mt_assert(content("f", "v1"));
+    cmd_umount();
+    mt_assert(cmd_mount(s2) == E_SUCCESS);
+    mt_assert(content("f", "v2"));
+    cmd_umount();
+
+    // deleting the newer snapshot must not lose what the older one sees
+    mt_assert(cmd_snaprm(s2) == E_SUCCESS);
+    mt_assert(cmd_mount(s2) == E_ERROR);
+    mt_assert(cmd_mount(s1) == E_SUCCESS);
+    mt_assert(content("f", "v1"));
+    cmd_umount();
+
+    mt_assert(cmd_snaprm(s1) == E_SUCCESS);
+    mt_assert(cmd_lssnap(&snaps, &n) == E_SUCCESS && n == 0);
+    mt_assert(nfree() == free0);
+    mt_assert(content("f", "v3"));
+    return 0;
+}
+
+mt_test(test_snap_persist) {
+    format();
+    cmd_mk("f", 0b1111);
+    cmd_w("f", 3, "old");
+    uint id;
+    mt_assert(cmd_snap(&id) == E_SUCCESS);
+    begin_op();
+    cmd_w("f", 3, "new");
+    cmd_mk("g", 0b1111);
+    end_op();
+
+    // the snapshot table and the copy maps are rebuilt on mount
+    remount();
+    mt_assert(content("f", "new"));
+    mt_assert(cmd_mount(id) == E_SUCCESS);
+    mt_assert(content("f", "old"));
+    mt_assert(!exist("g", T_FILE));
+    cmd_umount();
+    mt_assert(exist("g", T_FILE));
+    mt_assert(cmd_snaprm(id) == E_SUCCESS);
+    return 0;
+}
+
+mt_test(test_snap_limits) {
+    format();
+    uint id;
+    for (int i = 0; i < NSNAP; i++) mt_assert(cmd_snap(&id) == E_SUCCESS);
+    mt_assert(cmd_snap(&id) == E_ERROR);
+    mt_assert(cmd_snaprm(12345) == E_ERROR);
+    // formatting drops every snapshot
+    format();
+    struct snapinfo *snaps;
+    int n;
+    mt_assert(cmd_lssnap(&snaps, &n) == E_SUCCESS && n == 0);
+    return 0;
+}
+
+// a crash after a block is copied but before the copy's map entry is committed
+// must not leave the snapshot reading the new contents
+mt_test(test_snap_cow_crash) {
+    format();
+    cmd_mk("f", 0b1111);
+    cmd_w("f", 5, "hello");
+    uint id;
+    mt_assert(cmd_snap(&id) == E_SUCCESS);
+
+    begin_op();
+    mt_assert(cmd_w("f", 5, "world") == E_SUCCESS);
+    mt_assert(content("f", "world"));
+    remount();  // crash before end_op
+    mt_assert(content("f", "hello"));
+    mt_assert(cmd_mount(id) == E_SUCCESS);
+    mt_assert(content("f", "hello"));
+    mt_assert(cmd_umount() == E_SUCCESS);
+
+    begin_op();
+    mt_assert(cmd_w("f", 5, "world") == E_SUCCESS);
+    mt_assert(end_op() == 0);
+    remount();
+    mt_assert(content("f", "world"));
+    mt_assert(cmd_mount(id) == E_SUCCESS);
+    mt_assert(content("f", "hello"));
+    mt_assert(cmd_umount() == E_SUCCESS);
+    return 0;
+}
+
+void snap_tests() {
+    mt_run_test(test_snap_mount_old_state);
+    mt_run_test(test_snap_multiple_delete);
+    mt_run_test(test_snap_persist);
+    mt_run_test(test_snap_limits);
+    mt_run_test(test_snap_cow_crash);
+}
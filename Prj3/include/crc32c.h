@@ -0,0 +1,28 @@
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Compute a CRC32C (Castagnoli) checksum
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, else a table-driven
+ * (slicing-by-8) implementation; both give the same result.
+ * Pass 0 as crc to start, or the result of a previous call to continue over more data.
+ *
+ * @param  crc   checksum of the data before buf
+ * @param  buf   data
+ * @param  len   length of the data
+ * @return uint32_t  checksum of all the data so far
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * @brief Whether crc32c uses the SSE4.2 instruction
+ *
+ * @return int   1 if it does, 0 for the table-driven fallback
+ */
+int crc32c_hw();
+
+#endif
@@ -1,7 +1,8 @@
 #ifndef _TCP_BUFFER_
 #define _TCP_BUFFER_
 
-#define TCP_BUF_SIZE 4096
+#define TCP_BUF_SIZE (33 * 1024)  // a 32KB run of sectors plus its header
+#define SEND_TIMEOUT_MS 5000      // how long send_buffer waits for a peer that does not read
 
 typedef struct tcp_buffer {
     int read_index;
@@ -46,12 +47,15 @@ int read_to_buffer(tcp_buffer *buf, int sockfd);
 /**
  * @brief  Send buffer
  *
- * Write all the data in the buffer to the socket.
+ * Write all the data in the buffer to the socket. A non-blocking socket
+ * whose peer does not read for SEND_TIMEOUT_MS is given up on.
  *
  * @param  buf     buffer to be read
  * @param  sockfd  socket to be written
+ *
+ * @return int     0 if everything was sent, -1 on error or timeout
  */
-void send_buffer(tcp_buffer *buf, int sockfd);
+int send_buffer(tcp_buffer *buf, int sockfd);
 
 /**
  * @brief  Adjust buffer
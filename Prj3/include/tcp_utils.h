@@ -27,6 +27,36 @@ typedef struct tcp_client_ *tcp_client;
 tcp_server server_init(int port, int num_threads, void (*on_connection)(int id),
                        int (*on_recv)(int id, tcp_buffer *write_buf, char *msg, int len), void (*cleanup)(int id));
 
+/**
+ * @brief  Set the batch callback
+ *
+ * on_batch is called after on_recv has handled every complete message read
+ * from a client in one go, before the remaining replies are sent. A server
+ * that queues work in on_recv finishes it here and appends the replies, in
+ * the order of the requests.
+ *
+ * @param  server    server to be configured
+ * @param  on_batch  function to be called at the end of each batch, can be NULL
+ */
+void server_on_batch(tcp_server server, void (*on_batch)(int id, tcp_buffer *write_buf));
+
+/**
+ * @brief  Try to send a message to a client from another thread
+ *
+ * Appends a message to the write buffer of client id and sends it. Gives up
+ * without blocking while the client is being handled, since on_recv may be
+ * appending replies of its own; the caller tries again later. A message for
+ * a client that has gone is dropped.
+ *
+ * @param  server  server the client is connected to
+ * @param  id      client id as passed to on_recv
+ * @param  msg     message to be sent
+ * @param  len     length of the message
+ *
+ * @return int     0 if the message was sent (or dropped), -1 if the client is busy
+ */
+int server_try_send(tcp_server server, int id, const char *msg, int len);
+
 /**
  * @brief  Start the server loop
  *
@@ -0,0 +1,101 @@
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define POLY 0x82f63b78  // CRC32C polynomial, bit-reversed
+
+#define LANE 168  // the hardware version runs three streams of LANE bytes at once, a 512-byte sector is 3 x 168 + 8
+
+static uint32_t table[8][256];
+static uint32_t shift1[4][256], shift2[4][256];  // register after LANE / 2 * LANE zero bytes, by byte of the register
+static uint32_t (*impl)(uint32_t crc, const unsigned char *p, size_t len);
+
+// slicing-by-8: eight bytes per step, table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t crc_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w ^= crc;  // little endian: the low 4 bytes meet the current CRC
+        crc = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^ table[5][(w >> 16) & 0xff] ^
+              table[4][(w >> 24) & 0xff] ^ table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^
+              table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+// the register is linear in its starting value: advancing it over n zero bytes is a table lookup per byte
+static uint32_t shift(uint32_t (*t)[256], uint32_t c) {
+    return t[0][c & 0xff] ^ t[1][(c >> 8) & 0xff] ^ t[2][(c >> 16) & 0xff] ^ t[3][c >> 24];
+}
+
+// one crc32 instruction takes 3 cycles but a new one can start every cycle: three independent streams keep
+// it busy, and the streams are joined by advancing the first two over the bytes that follow them
+__attribute__((target("sse4.2"))) static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    while (len && ((uintptr_t)p & 7)) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    while (len >= 3 * LANE) {
+        uint64_t c1 = 0, c2 = 0, w0, w1, w2;
+        for (int i = 0; i < LANE; i += 8) {
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + LANE + i, 8);
+            memcpy(&w2, p + 2 * LANE + i, 8);
+            c = _mm_crc32_u64(c, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        c = shift(shift2, c) ^ shift(shift1, c1) ^ c2;
+        p += 3 * LANE;
+        len -= 3 * LANE;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#endif
+
+// runs before main, so the first crc32c calls from several threads need no locking
+__attribute__((constructor)) static void crc32c_init() {
+    for (int b = 0; b < 256; b++) {
+        uint32_t c = b;
+        for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+        table[0][b] = c;
+    }
+    for (int b = 0; b < 256; b++)
+        for (int k = 1; k < 8; k++) table[k][b] = table[0][table[k - 1][b] & 0xff] ^ (table[k - 1][b] >> 8);
+    static const unsigned char zero[2 * LANE];
+    for (int k = 0; k < 4; k++)
+        for (int b = 0; b < 256; b++) {
+            shift1[k][b] = crc_sw((uint32_t)b << (8 * k), zero, LANE);
+            shift2[k][b] = crc_sw((uint32_t)b << (8 * k), zero, 2 * LANE);
+        }
+    impl = crc_sw;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) impl = crc_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) { return ~impl(~crc, buf, len); }
+
+int crc32c_hw() { return impl != crc_sw; }
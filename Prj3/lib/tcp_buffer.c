@@ -2,6 +2,7 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +20,10 @@ tcp_buffer *init_buffer() {
 }
 
 void adjust_buffer(tcp_buffer *buf) {
+    if (buf->read_index == buf->write_index) {  // empty: start over at the front
+        buf->read_index = buf->write_index = 0;
+        return;
+    }
     if (buf->read_index > TCP_BUF_SIZE / 2) {
         int len = buf->write_index - buf->read_index;
         if (buf->read_index >= 0 && buf->read_index <= buf->write_index && buf->write_index <= TCP_BUF_SIZE) {
@@ -72,18 +77,29 @@ int read_to_buffer(tcp_buffer *buf, int sockfd) {
     int read_all = 0;
     int close_flag = 0;
     int count = 0;
+    if (buf->read_index > 0) {
+        // a partial message may sit at the tail of the buffer: move it to the front to make room
+        int len = buf->write_index - buf->read_index;
+        memmove(buf->buf, &buf->buf[buf->read_index], len);
+        buf->read_index = 0;
+        buf->write_index = len;
+    }
     while (!read_all) {
         int writeable = TCP_BUF_SIZE - buf->write_index;
         if (writeable == 0) {
-            fprintf(stderr, "read buffer full\n");
+            // the rest stays in the socket until the buffered messages are consumed
+            if (count == 0) fprintf(stderr, "read buffer full\n");
             break;
         }
         int ret = recv(sockfd, &buf->buf[buf->write_index], writeable, 0);
         if (ret > 0) {
             recycle_write(buf, ret);
-        } else if (ret < 0 && (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN)) {
-            // non-blocking recv, continue
+        } else if (ret < 0 && errno == EINTR) {
             continue;
+        } else if (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+            // nothing (more) to read: a task queued after an earlier one had already drained the socket
+            // must not spin here while holding the client, or replies sent from other threads wait on it
+            break;
         } else {  // ret <= 0, close
             close_flag = 1;
             break;
@@ -103,16 +119,30 @@ int read_to_buffer(tcp_buffer *buf, int sockfd) {
     return count;
 }
 
-void send_buffer(tcp_buffer *buf, int sockfd) {
+int send_buffer(tcp_buffer *buf, int sockfd) {
     while (buf->write_index > buf->read_index) {
         int readable = buf->write_index - buf->read_index;
         int ret = send(sockfd, &buf->buf[buf->read_index], readable, 0);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+            // non-blocking socket whose send buffer is full: wait a bounded time for the peer to read,
+            // the caller holds the connection and a peer that never reads must not keep it forever
+            struct pollfd pfd = {.fd = sockfd, .events = POLLOUT};
+            int n;
+            while ((n = poll(&pfd, 1, SEND_TIMEOUT_MS)) < 0 && errno == EINTR);
+            if (n == 0) {
+                fprintf(stderr, "send(): peer on fd %d stopped reading, dropping it\n", sockfd);
+                return -1;
+            }
+            continue;
+        }
         if (ret <= 0) {
             perror("send()");
-            break;
+            return -1;
         }
         recycle_read(buf, ret);
     }
+    return 0;
 }
 
 inline void reply(tcp_buffer *buf, const char *s, int len) { buffer_append(buf, s, len); }
@@ -4,7 +4,10 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,6 +34,7 @@ struct tcp_server_pool {     // Represents a pool of connected descriptors
 typedef struct tcp_server_ {
     void (*on_connection)(int id);
     int (*on_recv)(int id, tcp_buffer *write_buf, char *msg, int len);
+    void (*on_batch)(int id, tcp_buffer *write_buf);
     void (*cleanup)(int id);
     int port;
     int listenfd;
@@ -113,13 +117,19 @@ void handle_read(void *arg_p) {
             if (readable >= len + 4) {
                 if (server->on_recv(i, write_buf, s + 4, len) < 0) close_flag = 1;
                 recycle_read(read_buf, len + 4);
+                // send each reply at once, so pipelined requests cannot overflow the write buffer
+                if (send_buffer(write_buf, connfd) < 0) {
+                    close_flag = 1;
+                    break;
+                }
             } else
                 break;
         }
+        if (server->on_batch) server->on_batch(i, write_buf);
     }
 
     // write
-    send_buffer(write_buf, connfd);
+    if (!close_flag && send_buffer(write_buf, connfd) < 0) close_flag = 1;
 
     if (count < 0 || close_flag) {
         printf("client %d exited\n", connfd);
@@ -143,6 +153,7 @@ tcp_server_ *server_init(int port, int num_threads, void (*on_connection)(int id
     server->port = port;
     server->on_connection = on_connection;
     server->on_recv = on_recv;
+    server->on_batch = NULL;
     server->cleanup = cleanup;
 
     if (!on_recv) {
@@ -190,6 +201,24 @@ tcp_server_ *server_init(int port, int num_threads, void (*on_connection)(int id
     return server;
 }
 
+/* Set the function called after each batch of messages */
+void server_on_batch(tcp_server_ *server, void (*on_batch)(int id, tcp_buffer *write_buf)) {
+    server->on_batch = on_batch;
+}
+
+/* Send a message to a client outside handle_read, unless the client is being handled */
+int server_try_send(tcp_server_ *server, int id, const char *msg, int len) {
+    struct tcp_server_pool *p = &server->pool;
+    if (pthread_mutex_trylock(&p->mutex[id]) != 0) return -1;
+    if (p->connfd[id] >= 0) {
+        buffer_append(p->write_buf[id], msg, len);
+        // the client is closed by handle_read: shutting the socket down makes select report it
+        if (send_buffer(p->write_buf[id], p->connfd[id]) < 0) shutdown(p->connfd[id], SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&p->mutex[id]);
+    return 0;
+}
+
 /* Start the server loop, never returns */
 int server_run(tcp_server_ *server) {
     while (1) {
@@ -228,6 +257,10 @@ int server_run(tcp_server_ *server) {
                     arg->i = i;
                     // add the task to the threadpool
                     thpool_add_work(server->thpool, handle_read, (void *)arg);
+                } else {
+                    // still being handled and select will keep reporting it: let the worker run
+                    // instead of spinning here (on a single CPU it would wait for our time slice)
+                    sched_yield();
                 }
             }
         }
@@ -259,6 +292,9 @@ tcp_client_ *client_init(const char *hostname, int port) {
         perror("connect()");
         exit(EXIT_FAILURE);
     }
+    // requests are small and often pipelined: don't let Nagle hold one back until the last is acked
+    int val = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
 
     tcp_client_ *client = malloc(sizeof(tcp_client_));
     client->sockfd = sockfd;
@@ -276,31 +312,29 @@ void client_send(tcp_client_ *client, const char *msg, int len) {
 /* Receive a message from the server */
 int client_recv(tcp_client_ *client, char *buf, int max_len) {
     tcp_buffer *read_buf = client->read_buf;
-    // read all data from the socket
     while (1) {
-        int count = read_to_buffer(read_buf, client->sockfd);
-        if (count <= 0) {
-            printf("Connection closed\n");
-            return 0;
-        }
         int readable = read_buf->write_index - read_buf->read_index;
         char *s = &read_buf->buf[read_buf->read_index];
-        // the first 4 bytes is the length of the message
-        if (readable < 4) continue;
-        // network long to host long
-        int len = ntohl(*(int *)s);
-        // if the message is complete
-        if (readable >= len + 4) {
-            if (len > max_len) {
-                fprintf(stderr, "client_recv: buffer too small\n");
-                exit(EXIT_FAILURE);
+        // the first 4 bytes is the length of the message, network long to host long
+        int len = readable < 4 ? 0 : ntohl(*(int *)s);
+        // a pipelined reply may already be buffered: only block on the socket when none is complete
+        if (readable < 4 || readable < len + 4) {
+            int count = read_to_buffer(read_buf, client->sockfd);
+            if (count <= 0) {
+                printf("Connection closed\n");
+                return 0;
             }
-            // copy the message to buf
-            memcpy(buf, s + 4, len);
-            recycle_read(read_buf, len + 4);
-            return len;
-        } else
             continue;
+        }
+        // the message is complete
+        if (len > max_len) {
+            fprintf(stderr, "client_recv: buffer too small\n");
+            exit(EXIT_FAILURE);
+        }
+        // copy the message to buf
+        memcpy(buf, s + 4, len);
+        recycle_read(read_buf, len + 4);
+        return len;
     }
 }
 